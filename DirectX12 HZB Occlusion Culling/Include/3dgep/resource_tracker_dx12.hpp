@@ -149,11 +149,11 @@ public:
      */
     static void AddGlobalResourceState(ID3D12Resource* resource, D3D12_RESOURCE_STATES state);
 
-    ///**
-    // * Remove a resource from the global resource state array (map).
-    // * This should only be done when the resource is destroyed.
-    // */
-    // static void RemoveGlobalResourceState( ID3D12Resource* resource, bool immediate = false );
+    /**
+     * Remove a resource from the global resource state array (map).
+     * This should only be done when the resource is destroyed, and the GPU is done with it.
+     */
+    static void RemoveGlobalResourceState(ID3D12Resource* resource);
 
     ///**
     // * Remove garbage resources.
@@ -4,6 +4,7 @@
 
 #include <vector>
 #include <algorithm>
+#include <atomic>
 
 struct VertexData
 {
@@ -16,11 +17,15 @@ struct AABB
     DirectX::XMFLOAT3 max;
 
     void Expand(const AABB& other);
+
+    float SurfaceArea() const;
+    DirectX::XMFLOAT3 Center() const;
 };
 
 struct IndexedAABB
 {
     IndexedAABB(const AABB& aabb) : aabb(aabb) {}
+    IndexedAABB(const AABB& aabb, int index) : aabb(aabb), index(index) {}
 
     AABB aabb;
     int index = -1;
@@ -31,11 +36,50 @@ struct BVHNode
     AABB bounds;
     std::shared_ptr<BVHNode> left = nullptr; 
     std::shared_ptr<BVHNode> right = nullptr; 
+
+    // The build sorts the objects so every node covers the contiguous range [objectIndex, objectIndex + objectCount).
     int objectIndex = -1;
+    int objectCount = 0;
+
+    // Frustum plane that culled this node the last time it was outside, tested first on the next traversal. Relaxed,
+    // traversals running at the same time can only overwrite each other's hint, never change a result.
+    std::atomic<uint8_t> lastRejectingPlane{0};
 
     bool IsLeaf() const { return left == nullptr && right == nullptr; }
 };
 
+// A BVHNode without the pointers, to store a tree in a file. The nodes are in breadth-first order and the two
+// children of a node are next to each other, so one index links them.
+struct FlatBVHNode
+{
+    AABB bounds;
+    int firstChild;  // Index of the left child, the right one follows it. -1 for leaves.
+    int objectIndex;
+    int objectCount;
+};
+
+// Tree-quality metrics, filled in by BuildBVH or GetBVHStats.
+struct BVHStats
+{
+    double buildTimeMs = 0.0;
+    float sahCost = 0.f;  // Expected traversal cost relative to the root surface area
+    int nodeCount = 0;
+    int leafCount = 0;
+    int maxDepth = 0;
+    int minLeafSize = 0;
+    int maxLeafSize = 0;
+    float averageLeafSize = 0.f;
+};
+
+// Transforms the center and the extent instead of the 8 corners (Arvo), with the same result
 AABB TransformAABB(const AABB& aabb, const DirectX::XMMATRIX& worldMatrix);
 
-std::shared_ptr<BVHNode> BuildBVH(std::vector<IndexedAABB>& objects, int start, int end);
\ No newline at end of file
+// out[i] = TransformAABB(aabbs[i], worldMatrices[i]) over the worker threads
+void TransformAABBs(const AABB* aabbs, const DirectX::XMMATRIX* worldMatrices, AABB* out, size_t count);
+// Same local bounds for every instance, e.g. all instances of one mesh
+void TransformAABBs(const AABB& aabb, const DirectX::XMMATRIX* worldMatrices, AABB* out, size_t count);
+
+// Binned Surface Area Heuristic build over objects[start, end). Leaves hold up to a few objects.
+std::shared_ptr<BVHNode> BuildBVH(std::vector<IndexedAABB>& objects, int start, int end, BVHStats* stats = nullptr);
+
+BVHStats GetBVHStats(const std::shared_ptr<BVHNode>& root);
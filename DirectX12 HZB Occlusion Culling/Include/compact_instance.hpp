@@ -0,0 +1,37 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "occlusion_helpers_dx12.hpp"
+
+struct AABB;
+
+// How the instance buffer stores the world transforms
+enum class InstanceFormat
+{
+    Matrix,   // InstanceData, a full matrix per instance
+    Compact   // CompactInstance, position, rotation and uniform scale
+};
+
+// 24 byte instance transform: world = scale, then rotate, then translate. The rotation is a unit quaternion in
+// smallest-three form: the index of the largest component in 2 bits, the other three in 20 bits each. The largest
+// one is made positive and rebuilt from the unit length. compact_instance.hlsli decodes the same layout.
+struct CompactInstance
+{
+    DirectX::XMFLOAT3 position;
+    float scale;
+    uint32_t rotation[2];
+};
+
+static_assert(sizeof(CompactInstance) == 24, "CompactInstance has to match the structured buffer stride");
+
+// The world matrix can't have shear or non-uniform scale. Rotation error is below 1e-5 per component.
+CompactInstance EncodeInstance(const DirectX::XMMATRIX& worldMatrix);
+DirectX::XMMATRIX DecodeInstance(const CompactInstance& instance);
+
+// Batch versions over the worker threads. Decoding runs four instances at a time with SSE.
+void EncodeInstances(const InstanceData* instances, CompactInstance* outCompact, size_t count);
+void DecodeInstances(const CompactInstance* compact, InstanceData* outInstances, size_t count);
+
+// World space bounds straight from the compact form, without building the matrix
+AABB TransformAABB(const AABB& aabb, const CompactInstance& instance);
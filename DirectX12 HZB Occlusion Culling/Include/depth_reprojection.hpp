@@ -0,0 +1,56 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "hzb_pyramid.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+struct DepthReprojectionStats
+{
+    int numSourcePixels = 0;
+    int numReprojected = 0;  // Landed on the screen of the current camera
+    int numHoles = 0;        // Target pixels nothing landed on that weren't a crack, set to far
+    double timeMs = 0.0;
+};
+
+// Warps last frame's depth buffer into the current camera, so the HZB can be built and culled against before any
+// geometry of the new frame is drawn. Runs on the CPU, for checks and benchmarks of culling without a depth prepass.
+// The result has to stay at or behind the real depth, or culling loses visible objects:
+// - Several pixels landing on one texel keep the farthest
+// - Cracks one texel wide, also diagonal ones, take the farther side. Larger disocclusion holes are far.
+// - Every texel takes the max of its 3x3 neighbourhood, so sub-pixel shifts at silhouettes err towards far
+// Depth is NDC (0 near, 1 far), the depth buffer before the (z - 0.9) * 10 remap of the culling shader.
+class DepthReprojector
+{
+public:
+    // rowPitch is in floats, 0 means tightly packed. The reprojected depth has the same size.
+    DepthReprojectionStats Reproject(const float* previousDepth,
+                                     int width,
+                                     int height,
+                                     int rowPitch,
+                                     const XMMATRIX& previousVP,
+                                     const XMMATRIX& currentVP);
+
+    void BuildHzb(HzbPyramid& hzb, SimdLevel maxLevel = SimdLevel::AVX512) const
+    {
+        hzb.Build(m_depth.data(), m_width, m_height, 0, 0, maxLevel);
+    }
+
+    const float* GetDepth() const { return m_depth.data(); }
+    int GetWidth() const { return m_width; }
+    int GetHeight() const { return m_height; }
+
+private:
+    void Resize(int width, int height);
+    float GetSplatDepth(int x, int y) const;
+
+    // The bits of the farthest depth that landed on every texel, 0 for none. Positive floats order like their bits.
+    std::unique_ptr<std::atomic<uint32_t>[]> m_splat;
+    std::vector<float> m_depth;
+    std::vector<float> m_scratch;
+    int m_width = 0;
+    int m_height = 0;
+};
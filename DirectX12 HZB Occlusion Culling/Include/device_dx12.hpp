@@ -60,6 +60,7 @@ class Scene;
 class SwapChain;
 class DX12Texture;
 class Renderer;
+class TransientResourcePool;
 
 class Device
 {
@@ -147,6 +148,11 @@ public:
 
     CommandQueue& GetCommandQueue(D3D12_COMMAND_LIST_TYPE type = D3D12_COMMAND_LIST_TYPE_DIRECT);
 
+    /**
+     * Pool for textures and views that are only needed for a frame.
+     */
+    TransientResourcePool& GetTransientResourcePool() { return *m_TransientResourcePool; }
+
     Microsoft::WRL::ComPtr<ID3D12Device2> GetD3D12Device() const { return m_d3d12Device; }
 
     D3D_ROOT_SIGNATURE_VERSION GetHighestRootSignatureVersion() const { return m_HighestRootSignatureVersion; }
@@ -189,5 +195,8 @@ private:
 
     std::unique_ptr<DescriptorAllocator> m_DescriptorAllocators[D3D12_DESCRIPTOR_HEAP_TYPE_NUM_TYPES];
 
+    // After the descriptor allocators, the pooled views have to be freed first
+    std::unique_ptr<TransientResourcePool> m_TransientResourcePool;
+
     D3D_ROOT_SIGNATURE_VERSION m_HighestRootSignatureVersion;
 };
\ No newline at end of file
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <future>
+#include <vector>
+
+// BVH over moving instances. Refit only touches the leaves of the moved instances and their ancestors. Once
+// the SAH cost has degraded past the rebuild threshold, a new tree is built on a background thread and swapped
+// in by a later Refit call.
+class DynamicBVH
+{
+public:
+    DynamicBVH() = default;
+    ~DynamicBVH();
+
+    DynamicBVH(const DynamicBVH&) = delete;
+    DynamicBVH& operator=(const DynamicBVH&) = delete;
+
+    // objects[i].index is the instance index. All instances share meshBounds, transformed by their world matrix.
+    void Build(std::vector<IndexedAABB> objects, const AABB& meshBounds);
+
+    // The tree for a SceneCache. objectInstances gets the instance index of every object position.
+    void Flatten(std::vector<FlatBVHNode>& nodes, std::vector<int>& objectInstances) const;
+
+    // Takes over a tree from Flatten instead of building one, bounds is indexed by instance. Returns false and
+    // leaves the BVH as it was when the nodes aren't a tree over exactly numInstances instances.
+    bool Restore(const FlatBVHNode* nodes,
+                 size_t numNodes,
+                 const int* objectInstances,
+                 const AABB* bounds,
+                 size_t numInstances,
+                 const AABB& meshBounds);
+
+    // bounds[i] are the new world bounds of changedInstances[i]
+    void Refit(const std::vector<int>& changedInstances, const std::vector<AABB>& bounds);
+
+    // Same, with the bounds transformed from the mesh bounds and the instances' world matrices
+    void Refit(const std::vector<int>& changedInstances, const std::vector<InstanceData>& instanceData);
+
+    // Reports instance indices, not positions in the sorted objects array
+    void FrustumIntersect(std::vector<int>& instances, FrustumPlanes& frustum);
+
+    bool IsBuilt() const { return m_hierarchy != nullptr; }
+    bool IsRebuilding() const { return m_rebuild.valid(); }
+
+    float GetSAHCost() const;
+    float GetBuildSAHCost() const { return m_hierarchy->buildSahCost; }
+
+    // Rebuild once the SAH cost is this many times the cost right after the build
+    void SetRebuildThreshold(float threshold) { m_rebuildThreshold = threshold; }
+
+    const std::shared_ptr<BVHNode>& GetRoot() const { return m_hierarchy->root; }
+    const std::vector<IndexedAABB>& GetObjects() const { return m_hierarchy->objects; }
+    const AABB& GetInstanceBounds(int instance) const
+    {
+        return m_hierarchy->objects[m_hierarchy->objectPosition[instance]].aabb;
+    }
+
+private:
+    // Everything a (re)build produces, so a background build can be swapped in at once
+    struct Hierarchy
+    {
+        std::vector<IndexedAABB> objects;
+        std::shared_ptr<BVHNode> root = nullptr;
+
+        std::vector<int> objectPosition;  // Instance index -> position in objects
+        std::vector<int> objectLeaf;      // Position in objects -> leaf node
+
+        // Nodes in breadth-first order, with parent and depth links for the bottom-up refit
+        std::vector<BVHNode*> nodes;
+        std::vector<int> parent;
+        std::vector<int> depth;
+        int maxDepth = 0;
+
+        double weightedArea = 0.0;  // SAH cost before dividing by the root area
+        float buildSahCost = 0.f;
+    };
+
+    static std::unique_ptr<Hierarchy> MakeHierarchy(std::vector<IndexedAABB> objects);
+    static void LinkHierarchy(Hierarchy& hierarchy, size_t nodeCount);
+    static bool IsValidFlatTree(const FlatBVHNode* nodes, size_t numNodes, const int* objectInstances, size_t numInstances);
+
+    void SetHierarchy(std::unique_ptr<Hierarchy> hierarchy, const AABB& meshBounds);
+
+    void RefitPositions(const std::vector<int>& positions);
+    void StartRebuild();
+    void FinishRebuild();
+
+    std::unique_ptr<Hierarchy> m_hierarchy = nullptr;
+    AABB m_meshBounds;
+
+    std::future<std::unique_ptr<Hierarchy>> m_rebuild;
+    std::vector<int> m_movedDuringRebuild;
+
+    std::vector<unsigned int> m_refitStamp;
+    unsigned int m_refitCounter = 0;
+
+    float m_rebuildThreshold = 1.5f;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include <utility>
+#include <vector>
+
+// What the scheduler needs from a queue. The direct queue backs it on the device, CpuFenceEmulator without one.
+class FrameFence
+{
+public:
+    virtual ~FrameFence() = default;
+
+    virtual uint64_t Signal() = 0;
+    virtual bool IsFenceComplete(uint64_t fenceValue) = 0;
+    virtual void WaitForFenceValue(uint64_t fenceValue) = 0;
+};
+
+struct FrameSchedulerStats
+{
+    uint64_t numFrames = 0;
+    uint64_t numCpuWaits = 0;  // Frames that had to wait for the GPU before they could start
+};
+
+// Ring of per-frame slots. Frame n is recorded into slot n % numFramesInFlight, and BeginFrame only blocks when
+// the GPU hasn't finished the frame that used the slot before, numFramesInFlight frames ago. The fence signalled
+// at the end of a frame has to come after all of its work, on any queue, for the slot to be safe to reuse.
+class FrameScheduler
+{
+public:
+    explicit FrameScheduler(int numFramesInFlight);
+
+    // Returns the slot to record into
+    int BeginFrame(FrameFence& fence);
+    void EndFrame(FrameFence& fence);
+
+    // Blocks until every frame handed to the GPU is done
+    void WaitForIdle(FrameFence& fence);
+
+    int GetNumFramesInFlight() const { return static_cast<int>(m_fenceValues.size()); }
+    int GetFrameIndex() const { return m_frameIndex; }
+    int GetPreviousFrameIndex() const;
+    bool IsFrameRecording() const { return m_recording; }
+
+    const FrameSchedulerStats& GetStats() const { return m_stats; }
+
+private:
+    std::vector<uint64_t> m_fenceValues;  // Per slot, 0 when the slot hasn't been used yet
+    int m_frameIndex = 0;
+    bool m_recording = false;
+
+    FrameSchedulerStats m_stats;
+};
+
+// Stand-in for a command queue and its fence, so the scheduling can be tested without a device. Signals queue up
+// like submitted work and only complete when the emulated GPU gets to them, through Step or a CPU wait.
+class CpuFenceEmulator : public FrameFence
+{
+public:
+    uint64_t Signal() override;
+    bool IsFenceComplete(uint64_t fenceValue) override { return fenceValue <= m_completedValue; }
+
+    // Runs the emulated GPU up to fenceValue, including the other queues it waits on
+    void WaitForFenceValue(uint64_t fenceValue) override;
+
+    // Like CommandQueue::Wait, work submitted from now on only starts once other reached its last signal
+    void Wait(CpuFenceEmulator& other);
+
+    // Completes up to numSignals queued signals, without running other queues. Stops at one that is still waiting
+    // on another queue. Returns how many completed.
+    int Step(int numSignals = 1);
+
+    uint64_t GetCompletedValue() const { return m_completedValue; }
+    uint64_t GetLastSignaledValue() const { return m_fenceValue; }
+    int GetNumPendingSignals() const { return static_cast<int>(m_pending.size()); }
+    int GetNumCpuWaits() const { return m_numCpuWaits; }
+
+private:
+    struct PendingSignal
+    {
+        uint64_t value;
+        std::vector<std::pair<CpuFenceEmulator*, uint64_t>> waits;
+    };
+
+    bool CanComplete(const PendingSignal& signal) const;
+    void RunUntil(uint64_t fenceValue);
+
+    std::vector<PendingSignal> m_pending;
+    std::vector<std::pair<CpuFenceEmulator*, uint64_t>> m_waits;  // For the next signal
+
+    uint64_t m_fenceValue = 0;
+    uint64_t m_completedValue = 0;
+    int m_numCpuWaits = 0;
+};
@@ -29,6 +29,41 @@ struct FrustumPlanes
     Plane planes[6];
 };
 
+// Boxes as a structure of arrays, for the batch frustum test
+struct AABBSoA
+{
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+
+    void Resize(size_t count);
+    void Set(size_t index, const AABB& aabb);
+    size_t Size() const { return minX.size(); }
+};
+
+// Work counters of a BVH traversal, accumulated over every call that gets the same instance
+struct FrustumCullStats
+{
+    uint64_t nodesVisited = 0;
+    uint64_t planeTests = 0;  // Box against plane tests
+
+    void Reset() { *this = FrustumCullStats(); }
+};
+
+// A run of consecutive object positions in the build-sorted objects array
+struct ObjectRange
+{
+    int objectIndex;
+    int objectCount;
+};
+
+enum class SimdLevel
+{
+    Scalar,
+    SSE,
+    AVX2,
+    AVX512
+};
+
 void NormalizePlane(Plane& plane);
 
 void ExtractPlanes(Plane* p_planes, const XMMATRIX& comboMatrix, bool normalize);
@@ -37,9 +72,40 @@ IntersectionType PlaneAABBIntersect(AABB& B, Plane& plane);
 
 IntersectionType FrustumAABBIntersect(AABB& B, Plane* planes);
 
+SimdLevel GetSupportedSimdLevel();
+
+// Sets bit i of visibilityMask when box i is not OUTSIDE, with the same result as FrustumAABBIntersect. Tests
+// 4, 8 or 16 boxes at a time with the widest instruction set the CPU supports, capped at maxLevel.
+// visibilityMask needs (boxes.Size() + 31) / 32 words.
+void FrustumAABBIntersectBatch(const AABBSoA& boxes,
+                               const FrustumPlanes& frustum,
+                               uint32_t* visibilityMask,
+                               SimdLevel maxLevel = SimdLevel::AVX512);
+
 void AddAllChildren(std::vector<int>& array, std::shared_ptr<BVHNode>& node);
 
-void FrustumBVHIntersect(std::vector<int>& array, std::shared_ptr<BVHNode>& bvh, FrustumPlanes& frustum);
+// Children skip the planes their parent was fully inside, and every node first tries the plane that rejected it
+// last time, so coherent camera movement mostly costs one plane test per culled node. That hint is the only thing
+// written to the tree, several traversals can still run on it at the same time.
+void FrustumBVHIntersect(std::vector<int>& array,
+                         std::shared_ptr<BVHNode>& bvh,
+                         FrustumPlanes& frustum,
+                         FrustumCullStats* stats = nullptr);
+
+// Multithreaded FrustumBVHIntersect. The tree above cutoffDepth is culled on the calling thread, every subtree
+// below it is a task for the worker threads. The result has the same order as the serial traversal.
+void FrustumBVHIntersectParallel(std::vector<int>& array,
+                                 std::shared_ptr<BVHNode>& bvh,
+                                 FrustumPlanes& frustum,
+                                 FrustumCullStats* stats = nullptr,
+                                 int cutoffDepth = 8);
+
+// Same as FrustumBVHIntersectParallel, but leaves the visible objects as ranges instead of expanding them
+void FrustumBVHIntersectRanges(std::vector<ObjectRange>& ranges,
+                               std::shared_ptr<BVHNode>& bvh,
+                               FrustumPlanes& frustum,
+                               FrustumCullStats* stats = nullptr,
+                               int cutoffDepth = 8);
 
 XMFLOAT3 IntersectionPoint(const Plane& a, const Plane& b, const Plane& c);
 
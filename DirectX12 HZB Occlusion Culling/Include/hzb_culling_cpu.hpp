@@ -0,0 +1,118 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+#include "hzb_pyramid.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <climits>
+#include <vector>
+
+enum class HzbCullMode
+{
+    // Exactly what hzbCulling_cs.hlsl does: the (z - 0.9) * 10 depth remap, mip floor(log2(size in texels)) and
+    // four point samples at the corners of the screen rectangle. The shader's screen-size test is SelectLods.
+    Shader,
+    // Plain NDC depth, a mip where the rectangle covers at most 2x2 texels, all of which are read, and boxes
+    // that cross the near plane count as visible
+    Fixed
+};
+
+struct HzbCullSettings
+{
+    HzbCullMode mode = HzbCullMode::Shader;
+    float depthBias = 0.001f;           // Visible when min z <= max depth + bias, like the shader
+    unsigned int maxHzbMip = UINT_MAX;  // What the shader gets as maxHzbMip, clamped to the pyramid either way
+};
+
+struct HzbCullReport
+{
+    int numObjects = 0;
+    int numVisible = 0;
+    int numReferenceVisible = 0;
+    int numFalsePositives = 0;  // Kept, while no pixel under the box is behind it. Only less culling.
+    int numFalseNegatives = 0;  // Culled, while a pixel under the box is behind it. Objects pop.
+    double cullTimeMs = 0.0;
+    double referenceTimeMs = 0.0;
+
+    // Of the objects that could have been culled, the share that wasn't
+    float FalsePositiveRate() const
+    {
+        const int numHidden = numObjects - numReferenceVisible;
+        return numHidden > 0 ? static_cast<float>(numFalsePositives) / numHidden : 0.f;
+    }
+};
+
+// CPU version of the HZB culling pass, over the worker threads. Writes OC_VISIBLE or OC_HIDDEN per box. In Shader
+// mode the pyramid should hold what the depth prepass writes, in Fixed mode NDC depth (0 near, 1 far).
+void HzbCullAABBs(std::vector<unsigned int>& visibility,
+                  const std::vector<AABB>& aabbs,
+                  const HzbPyramid& hzb,
+                  const XMMATRIX& vpMatrix,
+                  FrustumPlanes& frustum,
+                  const HzbCullSettings& settings = HzbCullSettings());
+
+// The per-object test of HzbCullAABBs for the objects set in testBits only, bit-packed like visibility_bits.hpp.
+// visibilityBits gets a bit per object, objects that weren't tested come out hidden.
+void HzbCullAABBBits(std::vector<uint32_t>& visibilityBits,
+                     const uint32_t* testBits,
+                     const std::vector<AABB>& aabbs,
+                     const HzbPyramid& hzb,
+                     const XMMATRIX& vpMatrix,
+                     FrustumPlanes& frustum,
+                     const HzbCullSettings& settings = HzbCullSettings());
+
+// Ground truth for the same depth convention: every full resolution pixel under the screen rectangle of the box
+// is compared with its closest depth. Nothing rectangle based can cull more than this without being wrong.
+void HzbCullReference(std::vector<unsigned int>& visibility,
+                      const std::vector<AABB>& aabbs,
+                      const HzbPyramid& hzb,
+                      const XMMATRIX& vpMatrix,
+                      FrustumPlanes& frustum,
+                      const HzbCullSettings& settings = HzbCullSettings());
+
+struct HzbBVHCullStats
+{
+    uint64_t nodesVisited = 0;
+    uint64_t nodesOutside = 0;    // Culled by the frustum
+    uint64_t nodesOccluded = 0;   // Culled by the HZB, with everything below them
+    uint64_t leavesEmitted = 0;
+    uint64_t objectsEmitted = 0;
+    uint64_t objectsSkipped = 0;  // Below culled nodes, so never tested one by one
+
+    void Reset() { *this = HzbBVHCullStats(); }
+};
+
+// Tests the bounds of every BVH node against the frustum and the HZB, so a region hidden behind a wall is culled
+// by the node covering it and costs O(nodes) instead of O(objects). The leaves that pass are the candidates, as
+// ranges of BVH object positions in traversal order.
+// Fixed mode is conservative for nodes too, the rectangle of a child lies within its parent's and is no closer.
+// In Shader mode the four samples can miss for nodes like they do for objects. Nodes crossing the near plane are
+// visible in both modes. Subtrees below cutoffDepth are culled over the worker threads.
+void HzbCullBVH(std::vector<ObjectRange>& candidates,
+                std::shared_ptr<BVHNode>& bvh,
+                const HzbPyramid& hzb,
+                const XMMATRIX& vpMatrix,
+                FrustumPlanes& frustum,
+                const HzbCullSettings& settings = HzbCullSettings(),
+                HzbBVHCullStats* stats = nullptr,
+                int cutoffDepth = 8);
+
+// The per-object test of HzbCullAABBs for the candidates only. objects is the array the BVH was built from,
+// visibility gets one OC_VISIBLE/OC_HIDDEN per objects[i].index and everything that isn't a candidate is hidden.
+void HzbCullCandidates(std::vector<unsigned int>& visibility,
+                       const std::vector<ObjectRange>& candidates,
+                       const std::vector<IndexedAABB>& objects,
+                       const HzbPyramid& hzb,
+                       const XMMATRIX& vpMatrix,
+                       FrustumPlanes& frustum,
+                       const HzbCullSettings& settings = HzbCullSettings());
+
+// Runs both and counts where they disagree, with timings
+HzbCullReport ValidateHzbCulling(const std::vector<AABB>& aabbs,
+                                 const HzbPyramid& hzb,
+                                 const XMMATRIX& vpMatrix,
+                                 FrustumPlanes& frustum,
+                                 const HzbCullSettings& settings = HzbCullSettings());
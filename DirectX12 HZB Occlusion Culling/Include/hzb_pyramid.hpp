@@ -0,0 +1,67 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "frustum.hpp"
+
+#include <vector>
+
+// Result of comparing a mip read back from the GPU with the CPU pyramid
+struct HzbCompareResult
+{
+    int numTexels = 0;
+    int numBelow = 0;  // GPU texels closer than the CPU ones, these can cull visible objects
+    int numAbove = 0;  // GPU texels farther away, only less culling
+    float maxError = 0.f;
+
+    bool IsConservative() const { return numBelow == 0; }
+};
+
+// CPU reference of the depth pyramid GenerateHzbMips builds. Every texel holds the max (farthest) depth of all
+// the source texels it covers. Mip sizes follow D3D12 (max(1, size >> mip)), so on odd sizes the last row and
+// column of a mip also take the extra source row and column, which keeps every mip conservative.
+// All mips live in one allocation, every row starts 64-byte aligned and is padded to whole SIMD vectors.
+class HzbPyramid
+{
+public:
+    HzbPyramid() = default;
+
+    // rowPitch is in floats, 0 means tightly packed. numMips = 0 builds the full chain down to 1x1.
+    void Build(const float* depth,
+               int width,
+               int height,
+               int rowPitch = 0,
+               int numMips = 0,
+               SimdLevel maxLevel = SimdLevel::AVX512);
+
+    int GetNumMips() const { return static_cast<int>(m_mips.size()); }
+    int GetMipWidth(int mip) const { return m_mips[mip].width; }
+    int GetMipHeight(int mip) const { return m_mips[mip].height; }
+    int GetRowPitch(int mip) const { return m_mips[mip].rowPitch; }
+
+    const float* GetRow(int mip, int y) const { return m_data + m_mips[mip].offset + static_cast<size_t>(y) * m_mips[mip].rowPitch; }
+
+    // Coordinates are clamped to the mip, like the point-clamp sampler in the shaders
+    float GetTexel(int mip, int x, int y) const;
+
+    // Max depth over a texel rectangle of a mip, bounds included
+    float GetMaxDepth(int mip, int minX, int minY, int maxX, int maxY) const;
+
+    // gpuTexels is one mip as read back from the GPU, rowPitch in floats
+    HzbCompareResult CompareMip(int mip, const float* gpuTexels, int rowPitch, float tolerance = 0.f) const;
+
+private:
+    struct Mip
+    {
+        int width = 0;
+        int height = 0;
+        int rowPitch = 0;
+        size_t offset = 0;
+    };
+
+    void ReduceRows(int dstMip, int firstRow, int lastRow, SimdLevel level);
+
+    std::vector<Mip> m_mips;
+    std::vector<float> m_storage;
+    float* m_data = nullptr;  // m_storage, aligned
+};
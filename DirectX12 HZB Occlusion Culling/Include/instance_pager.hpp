@@ -0,0 +1,137 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A cell of the file written by InstancePager::WriteCells. On disk a cell is its instances, then their bounds,
+// then their ids in the full scene.
+struct PagedCellInfo
+{
+    AABB bounds;  // Of the instance bounds in the cell, so it can stick out of its grid cell
+    uint32_t numInstances;
+    uint64_t offset;
+};
+
+struct InstancePagerSettings
+{
+    // Cells closer than loadDistance to the frustum get loaded, and evicted again once they are further away than
+    // evictDistance. The gap keeps cells on the edge from being loaded and evicted every other frame.
+    float loadDistance = 100.f;
+    float evictDistance = 150.f;
+
+    size_t budgetBytes = size_t(1) << 30;  // Resident and loading cells together
+    int maxLoadsInFlight = 8;
+};
+
+struct InstancePagerStats
+{
+    int numCells = 0;
+    int numResidentCells = 0;
+    int numLoadingCells = 0;
+    size_t numResidentInstances = 0;
+    size_t residentBytes = 0;
+    uint64_t numLoads = 0;
+    uint64_t numEvictions = 0;
+    uint64_t numOverBudget = 0;  // Cells in load range that didn't fit in the budget, summed over the updates
+};
+
+// Out-of-core instances. The scene is bucketed into grid cells on disk, and cells are loaded on a background
+// thread and evicted by their distance to the camera frustum. Only the resident cells are handed to the culler,
+// so the scene can be larger than memory.
+// Everything except the file reads happens on the thread calling Update, so the resident set only changes there.
+class InstancePager
+{
+public:
+    InstancePager() = default;
+    ~InstancePager() { Close(); }
+
+    InstancePager(const InstancePager&) = delete;
+    InstancePager& operator=(const InstancePager&) = delete;
+
+    // Buckets the instances by the center of their bounds into cubes of cellSize, empty cells are left out
+    static bool WriteCells(const std::string& path,
+                           const InstanceData* instances,
+                           const AABB* bounds,
+                           size_t count,
+                           float cellSize);
+
+    bool Open(const std::string& path, const InstancePagerSettings& settings = InstancePagerSettings());
+    void Close();
+
+    // Takes in the finished loads, evicts the cells that are too far away and queues loads for the nearest missing
+    // ones that fit in the budget. The frustum planes have to be normalized, so distances are in world units.
+    void Update(const FrustumPlanes& frustum);
+
+    // Blocks until every queued load has finished and is resident
+    void WaitForLoads();
+
+    // Resident instances, their bounds and their ids in the full scene, cell by cell. Only changes when
+    // GetResidencyVersion does.
+    size_t GatherResident(std::vector<InstanceData>& instances,
+                          std::vector<AABB>& bounds,
+                          std::vector<uint32_t>& instanceIds) const;
+
+    uint64_t GetResidencyVersion() const { return m_residencyVersion; }
+    bool IsResident(int cell) const { return m_cellStates[cell] == CellState::Resident; }
+
+    const std::vector<PagedCellInfo>& GetCells() const { return m_cells; }
+    const InstancePagerStats& GetStats() const { return m_stats; }
+    void SetSettings(const InstancePagerSettings& settings) { m_settings = settings; }
+
+private:
+    enum class CellState
+    {
+        Unloaded,
+        Loading,
+        Resident
+    };
+
+    struct CellData
+    {
+        std::vector<InstanceData> instances;
+        std::vector<AABB> bounds;
+        std::vector<uint32_t> instanceIds;
+    };
+
+    struct FinishedLoad
+    {
+        int cell;
+        std::unique_ptr<CellData> data;  // Null when the read failed
+    };
+
+    void LoaderThread();
+    void TakeFinishedLoads();
+    void Evict(int cell);
+    size_t GetCellBytes(int cell) const;
+
+    std::string m_path;
+    InstancePagerSettings m_settings;
+
+    std::vector<PagedCellInfo> m_cells;
+    std::vector<CellState> m_cellStates;
+    std::vector<std::unique_ptr<CellData>> m_cellData;
+    std::vector<float> m_cellDistances;  // From the last Update
+    size_t m_loadingBytes = 0;
+
+    // Shared with the loader thread
+    std::mutex m_mutex;
+    std::condition_variable m_loadRequested;
+    std::condition_variable m_loadFinished;
+    std::deque<int> m_loadQueue;
+    std::vector<FinishedLoad> m_finishedLoads;
+    bool m_stopLoader = false;
+    std::thread m_loader;
+
+    uint64_t m_residencyVersion = 0;
+    InstancePagerStats m_stats;
+};
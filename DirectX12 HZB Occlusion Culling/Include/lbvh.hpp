@@ -0,0 +1,20 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+
+#include <vector>
+
+struct LBVHSettings
+{
+    bool use63BitCodes = false;     // 21 bits per axis instead of 10, for very large or very dense scenes
+    bool optimizeTreelets = false;  // SAH treelet restructuring after the Morton build, slower but a better tree
+    int maxLeafSize = 4;
+};
+
+// Linear BVH build: Morton-sorts the objects on all cores and emits the hierarchy with Karras' split finding.
+// Reorders the objects like BuildBVH does, so the result works with FrustumBVHIntersect and WideBVH.
+std::shared_ptr<BVHNode> BuildLBVH(std::vector<IndexedAABB>& objects,
+                                   const LBVHSettings& settings = LBVHSettings(),
+                                   BVHStats* stats = nullptr);
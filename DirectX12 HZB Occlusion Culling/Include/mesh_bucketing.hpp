@@ -0,0 +1,49 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include <vector>
+
+// Where a mesh lives in the shared vertex and index buffers
+struct MeshDrawInfo
+{
+    unsigned int indexCount;
+    unsigned int startIndexLocation;
+    int baseVertexLocation;
+};
+
+// One element of the indirect argument buffer. SV_InstanceID starts at 0 for every draw, so the first slot of the
+// draw in the matrix index buffer is set as a root constant before the indexed draw arguments.
+struct IndirectCommand
+{
+    unsigned int InstanceOffset;
+    unsigned int IndexCountPerInstance;
+    unsigned int InstanceCount;
+    unsigned int StartIndexLocation;
+    int BaseVertexLocation;
+    unsigned int StartInstanceLocation;
+};
+
+struct MeshBuckets
+{
+    std::vector<unsigned int> instanceIndices;  // Visible instances grouped by mesh, what the matrix index buffer holds
+    std::vector<IndirectCommand> commands;      // One per mesh with visible instances, in mesh order
+    std::vector<unsigned int> lodCommandOffsets;  // The draws of LOD l are [lodCommandOffsets[l], lodCommandOffsets[l + 1])
+};
+
+// CPU version of the mesh count, command and scatter passes: a counting sort of the visible instances by mesh id,
+// over the worker threads. Instances keep their order within a mesh, on the GPU that order is up to the atomics.
+// visibilityBits is bit-packed like the GPU visibility buffer, null counts every instance as visible.
+// With LODs, meshes holds numLods meshes per mesh id, LOD major, and an instance draws the one of its mesh id at
+// its LOD from lodBits (see screen_size_lod.hpp). The draws then come out LOD by LOD.
+void BucketInstancesByMesh(const uint32_t* visibilityBits,
+                           const unsigned int* meshIds,
+                           size_t numInstances,
+                           const std::vector<MeshDrawInfo>& meshes,
+                           MeshBuckets& buckets,
+                           const uint32_t* lodBits = nullptr,
+                           unsigned int numLods = 1);
+
+// Compares GPU output with the CPU buckets. The commands have to match exactly, the instances of every draw are
+// compared as sets.
+bool SameMeshBuckets(const MeshBuckets& gpu, const MeshBuckets& cpu);
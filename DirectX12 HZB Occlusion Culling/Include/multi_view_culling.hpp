@@ -0,0 +1,48 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+
+#include <vector>
+
+// Views per traversal, one bit each in a uint8_t view mask
+static const int maxCullViews = 8;
+
+struct MultiViewCullStats
+{
+    uint64_t nodesVisited = 0;
+    uint64_t nodesPruned = 0;  // Nodes every remaining view rejected, skipped for all of them at once
+    uint64_t planeTests = 0;   // Box against plane tests, 6 per view still testing the node
+
+    void Reset() { *this = MultiViewCullStats(); }
+};
+
+// A run of consecutive object positions seen by the same views
+struct MultiViewRange
+{
+    int objectIndex;
+    int objectCount;
+    uint8_t viewMask;
+};
+
+struct MultiViewCullResult
+{
+    std::vector<MultiViewRange> ranges;           // In traversal order, like FrustumBVHIntersectRanges
+    std::vector<uint8_t> viewMasks;               // Per object position, bit v set when view v sees it
+    std::vector<int> visible[maxCullViews];       // Object positions per view, like FrustumBVHIntersect
+};
+
+// Culls up to maxCullViews view-projections, e.g. two eyes and a set of shadow cascades, in a single traversal.
+// A node is tested against every view that is still intersecting it, 4 planes per SSE step. A view that is outside
+// drops out for the subtree and the node is pruned once no view is left. Views that are fully inside a plane skip
+// it further down, like in FrustumBVHIntersect.
+// Subtrees below cutoffDepth are culled over the worker threads. Every view gets the same objects as its own
+// FrustumBVHIntersect would.
+void MultiViewBVHIntersect(MultiViewCullResult& result,
+                           std::shared_ptr<BVHNode>& bvh,
+                           const XMMATRIX* viewProjections,
+                           int numViews,
+                           MultiViewCullStats* stats = nullptr,
+                           int cutoffDepth = 8);
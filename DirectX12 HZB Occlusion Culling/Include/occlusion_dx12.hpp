@@ -7,6 +7,10 @@
 
 #include "heap_dx12.hpp"
 #include "gpu_resource_dx12.hpp"
+#include "frame_scheduler.hpp"
+#include "mesh_bucketing.hpp"
+#include "compact_instance.hpp"
+#include "screen_size_lod.hpp"
 
 #include <wrl.h>
 using namespace Microsoft::WRL;
@@ -14,6 +18,7 @@ using namespace Microsoft::WRL;
 #include <DirectXMath.h>
 using namespace DirectX;
 
+struct AABB;
 struct FrustumPlanes;
 
 class CommandList;
@@ -23,10 +28,17 @@ class PipelineStateObject;
 struct VertexPosColor;
 struct InstanceData;
 
+// Frames the CPU can record ahead of the GPU before Render blocks
+static const int cullingFramesInFlight = 2;
+
+// Root constants of the culling pass, laid out like the cbuffer in hzbCulling_cs.hlsl
 struct ConstantData
 {
     unsigned int maxHzbMip;
     unsigned int numObjects;
+    unsigned int numLods;
+    float minPixelSize;
+    float lodPixelSizes[maxLods - 1];
 };
 
 struct RenderPass
@@ -47,17 +59,43 @@ public:
         return instance;
     }
 
+    // InstanceFormat::Compact keeps the instances in 24 instead of 64 bytes, the vertex shaders decode them
     void Initialize(std::shared_ptr<std::array<VertexPosColor, 8>> vertexBuffer,
                     std::shared_ptr<std::array<WORD, 36>> indexBuffer,
                     std::shared_ptr<std::vector<InstanceData>> instanceData,
                     std::shared_ptr<Heap> aabbHeap,
                     std::shared_ptr<GpuResource> aabbBuffer,
                     std::shared_ptr<bee::RenderTarget> renderTarget,
-                    const int numObjects);
+                    const int numObjects,
+                    InstanceFormat instanceFormat = InstanceFormat::Matrix);
+
+    // Replaces the single mesh from Initialize. All meshes share one vertex and index buffer, meshes says where each
+    // one is and meshIds which one every instance uses. With numLods, meshes holds that many LODs per mesh id, LOD
+    // major, and the culling pass picks one per instance by its screen size. Waits for the frames in flight.
+    void SetMeshes(const std::vector<VertexPosColor>& vertices,
+                   const std::vector<WORD>& indices,
+                   const std::vector<MeshDrawInfo>& meshes,
+                   const std::vector<unsigned int>& meshIds,
+                   unsigned int numLods = 1);
 
     void Update(XMMATRIX& vpMatrix);
     void Render(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP = nullptr);
 
+    // Uploads the world matrices and bounds of the given instances. instanceData is indexed by instance, bounds[i]
+    // belongs to changedInstances[i].
+    void UpdateInstances(const std::vector<int>& changedInstances,
+                         const std::vector<InstanceData>& instanceData,
+                         const std::vector<AABB>& bounds);
+
+    // Visibility per instance (OC_VISIBLE/OC_HIDDEN) computed on the CPU, e.g. by SoftwareOcclusion. While set,
+    // it replaces the depth prepass and the HZB test. Pass nullptr to go back to the GPU path.
+    void SetCpuVisibility(std::shared_ptr<std::vector<unsigned int>> visibility) { m_cpuVisibility = visibility; }
+
+    // Screen-size culling and LOD thresholds of the culling pass. Uses at most the LODs given to SetMeshes.
+    void SetLodSettings(const LodSettings& settings) { m_lodSettings = settings; }
+
+    const FrameSchedulerStats& GetFrameStats() const { return m_frameScheduler.GetStats(); }
+
     void ToggleFrustumCulling() { m_doFrustumCulling = !m_doFrustumCulling; }
     void ToggleHzbCulling() { m_doHzbCulling = !m_doHzbCulling; }
     void ToggleRenderCulling() { m_renderCulling = !m_renderCulling; }
@@ -67,12 +105,46 @@ public:
     void DecrementMipToDisplay();
 
 private:
+    // Instances grouped by mesh and one indirect draw per mesh, read by the indirect depth and draw passes
+    struct DrawList
+    {
+        GpuResource matrixIndex;
+        GpuResource indirectArgs;
+        GpuResource count;
+    };
+
+    // Everything a frame writes on the GPU. One set per frame in flight, so the CPU can record the next frame
+    // while the GPU still reads the last one.
+    struct FrameResources
+    {
+        GpuResource visibility;  // One bit per instance, see visibility_bits.hpp
+        GpuResource lods;        // Two bits per instance, see screen_size_lod.hpp
+        GpuResource meshCounts;
+        GpuResource meshRanks;
+        GpuResource meshOffsets;
+        GpuResource wordOffsets;       // Popcount scan of the visibility words, only with a single mesh
+        GpuResource scanPartitions;    // Look-back state of that scan
+        GpuResource scanCounter;
+        DrawList draws;
+    };
+
     OcclusionCulling() {};
 
+    FrameResources& CurrentFrame() { return m_frames[m_frameIndex]; }
+
+    // Element size and CPU copy of the instance buffer, depending on m_instanceFormat
+    UINT GetInstanceStride() const;
+    void* GetInstanceBufferData();
+
+    // Upload buffers have to live until the copy queue is past the fence value
+    void KeepUploadAlive(ComPtr<ID3D12Resource> uploadBuffer, uint64_t fenceValue);
+    void ReleaseFinishedUploads();
+
     void InitPSOs();
     void AttachRenderTargets();
     void InitViews();
     void PopulateResources();
+    void CreateMeshResources();
 
     void CreateStructuredBuffer(ComPtr<ID3D12Resource>& resource,
                                 UINT numElements,
@@ -80,27 +152,24 @@ private:
                                 D3D12_RESOURCE_FLAGS flags = D3D12_RESOURCE_FLAG_NONE);
 
     void HzbCulling(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP);
+    void CpuVisibilityCulling(XMMATRIX* debugCameraVP);
     void VisualizeMipMaps(XMMATRIX* cameraVP);
 
-    void InitDepthPSO();
-    void InitDrawPSO();
     void InitVisualizeMipsPSO();
     void InitCullingPSO();
-    void InitFirstPrefixPSO();
-    void InitSecondPrefixPSO();
-    void InitRecursivePrefixPSO();
-    void InitFillIndirectBufferPSO();
+    void InitMeshCountPSO();
+    void InitMeshCommandsPSO();
+    void InitMeshScatterPSO();
+    void InitVisibilityScanPSO();
+    void InitVisibilityCompactPSO();
     void InitIndirectDrawPSO();
     void InitIndirectDepthPSO();
 
-    void FirstFrameDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix);
-    void FirstFrameDrawPass(XMMATRIX* cameraVP);
     void GenerateMipsPass(std::shared_ptr<bee::DX12Texture>& texture);
     void CullingPass(std::shared_ptr<bee::DX12Texture>& texture, XMMATRIX& vpMatrix, UINT16 numMips);
-    void PrefixSumPass(UINT numElements);
-    void FillIndirectPass();
-    void IndirectDrawPass(XMMATRIX* cameraVP);
-    void IndirectDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix);
+    void MeshBucketingPass(FrameResources& frame);
+    void IndirectDrawPass(XMMATRIX* cameraVP, DrawList& draws);
+    void IndirectDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix, DrawList& draws);
 
     void PopulateBuffer(std::shared_ptr<CommandList>& commandList,
                         ComPtr<ID3D12Resource>& resource,
@@ -108,14 +177,17 @@ private:
                         void* data,
                         UINT numElements,
                         UINT elementSize);
+    // data holds the elements back to back, element i goes to elementIndices[i], which has to be sorted
+    void PopulateBufferElements(std::shared_ptr<CommandList>& commandList,
+                                ComPtr<ID3D12Resource>& resource,
+                                ComPtr<ID3D12Resource>& uploadBuffer,
+                                const void* data,
+                                const std::vector<int>& elementIndices,
+                                UINT elementSize);
 
     std::shared_ptr<bee::Device> m_device;
     std::shared_ptr<bee::RenderTarget> m_renderTarget;
 
-    // First-Frame
-    RenderPass m_depthPass;
-    RenderPass m_drawPass;
-
     // Debug
     RenderPass m_visualizeMipsPass;
 
@@ -123,26 +195,35 @@ private:
     RenderPass m_generateMipsPass;
     RenderPass m_cullingPass;
 
-    // Prefix Sum
-    RenderPass m_firstPrefixPass;
-    RenderPass m_secondPrefixPass;
-    RenderPass m_recursivePrefixPass;
+    // Mesh bucketing
+    RenderPass m_meshCountPass;
+    RenderPass m_meshCommandsPass;
+    RenderPass m_meshScatterPass;
+    RenderPass m_visibilityScanPass;     // Single mesh, replaces the count pass
+    RenderPass m_visibilityCompactPass;  // Single mesh, replaces the scatter pass
 
     // Execute Indirect
-    RenderPass m_fillIndirectBufferPass;
     RenderPass m_indirectDrawPass;
     RenderPass m_indirectDepthPass;
 
     GpuResource m_instanceData;
     GpuResource m_vp;
-    GpuResource m_visibility;
-    GpuResource m_scanResult;
-    GpuResource m_count;
-    GpuResource m_matrixIndex;
-    GpuResource m_indirectArgs;
-    std::vector<GpuResource> m_groupSums;
 
-    ComPtr<ID3D12CommandSignature> m_commandSignature;
+    std::array<FrameResources, cullingFramesInFlight> m_frames;
+    FrameScheduler m_frameScheduler{cullingFramesInFlight};
+    int m_frameIndex = 0;
+    int m_lastCulledFrame = -1;
+
+    std::vector<std::pair<uint64_t, ComPtr<ID3D12Resource>>> m_pendingUploads;
+
+    // Every instance, for the passes that draw without culling: the first frame, culling off and the mip view
+    DrawList m_allInstances;
+
+    GpuResource m_meshIds;
+    GpuResource m_meshTable;
+
+    ComPtr<ID3D12CommandSignature> m_drawCommandSignature;
+    ComPtr<ID3D12CommandSignature> m_depthCommandSignature;
 
     Heap m_srvHeap{L"srv Heap", 32};
     Heap m_uavHeap{L"uav Heap", 32};
@@ -152,15 +233,27 @@ private:
 
     ConstantData m_constantData;
 
-    std::shared_ptr<std::array<VertexPosColor, 8>> m_vertexBuffer = nullptr;
-    std::shared_ptr<std::array<WORD, 36>> m_indexBuffer = nullptr;
-    std::shared_ptr<std::vector<InstanceData>> m_instanceDataBuffer = nullptr;
+    std::vector<VertexPosColor> m_vertexBuffer;
+    std::vector<WORD> m_indexBuffer;
+    std::vector<MeshDrawInfo> m_meshes;
+    std::vector<unsigned int> m_meshIdBuffer;
+    std::shared_ptr<std::vector<InstanceData>> m_instanceDataBuffer = nullptr;  // Only in InstanceFormat::Matrix
+    std::vector<CompactInstance> m_compactInstances;                            // Only in InstanceFormat::Compact
+    InstanceFormat m_instanceFormat = InstanceFormat::Matrix;
 
     std::shared_ptr<FrustumPlanes> m_FrustumPlanes = nullptr;
 
+    std::shared_ptr<std::vector<unsigned int>> m_cpuVisibility = nullptr;
+    std::vector<uint32_t> m_cpuVisibilityBits;
+    std::vector<uint32_t> m_cpuLodBits;  // All LOD 0, the CPU visibility doesn't pick LODs
+
+    LodSettings m_lodSettings;
+
     uint32_t m_numVertices = 0;
     uint32_t m_numIndices = 0;
     uint32_t m_numInstances = 0;
+    uint32_t m_numMeshes = 0;  // Entries in the mesh table, every LOD counts
+    uint32_t m_numLods = 1;
 
     D3D12_VIEWPORT m_viewport;
     D3D12_RECT m_scissorRect;
@@ -168,12 +261,10 @@ private:
     int m_width = 0;
     int m_height = 0;
     int m_numObjects = 0;
-    int m_numWorkGroupBuffers = 0;
     unsigned int m_mipToDisplay = 0;
 
     bool m_doFrustumCulling = true;
     bool m_doHzbCulling = true;
     bool m_renderCulling = true;
-    bool m_isFirstFrame = true;
     bool m_initialized = false;
 };
\ No newline at end of file
@@ -31,4 +31,11 @@ struct VertexPosColor
 struct InstanceData
 {
     XMMATRIX WorldMatrix;
-};
\ No newline at end of file
+};
+
+// Arrays of InstanceData get passed on as arrays of matrices, e.g. to TransformAABBs
+static_assert(sizeof(InstanceData) == sizeof(XMMATRIX), "InstanceData has to be just the matrix");
+
+// Visibility buffer values, mirroring hzbCulling_cs.hlsl
+static const unsigned int OC_HIDDEN = 0;
+static const unsigned int OC_VISIBLE = 1;
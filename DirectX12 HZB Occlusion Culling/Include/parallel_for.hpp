@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+inline unsigned int GetNumWorkerThreads() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+// Runs worker on the calling thread and on up to numHelpers threads of a pool that lives as long as the program,
+// and returns when all of them are done. Calls from a pool thread, or while another call has the pool, run worker
+// on the calling thread only, so worker has to be able to do all of the work by itself.
+void RunOnWorkerThreads(const std::function<void()>& worker, size_t numHelpers);
+
+// Runs func(chunkIndex) for every chunk in [0, numChunks). Chunks are handed out to one thread per core.
+template <typename Func>
+void ParallelForChunks(size_t numChunks, Func&& func)
+{
+    const size_t numThreads = std::min<size_t>(GetNumWorkerThreads(), numChunks);
+    if (numThreads <= 1)
+    {
+        for (size_t i = 0; i < numChunks; ++i) func(i);
+        return;
+    }
+
+    std::atomic<size_t> nextChunk{0};
+    const std::function<void()> worker = [&]()
+    {
+        for (size_t i = nextChunk.fetch_add(1); i < numChunks; i = nextChunk.fetch_add(1))
+        {
+            func(i);
+        }
+    };
+
+    // The calling thread helps out as well
+    RunOnWorkerThreads(worker, numThreads - 1);
+}
+
+// Splits [0, count) into contiguous ranges of at least minChunkSize elements and runs func(begin, end) on each.
+template <typename Func>
+void ParallelFor(size_t count, Func&& func, size_t minChunkSize = 4096)
+{
+    if (count == 0) return;
+
+    const size_t maxChunks = (count + minChunkSize - 1) / minChunkSize;
+    const size_t numChunks = std::min<size_t>(maxChunks, GetNumWorkerThreads() * 4);
+    const size_t chunkSize = (count + numChunks - 1) / numChunks;
+
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          const size_t begin = chunk * chunkSize;
+                          const size_t end = std::min(count, begin + chunkSize);
+                          if (begin < end) func(begin, end);
+                      });
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "frustum.hpp"
+
+#include <vector>
+
+// output[i] = input[0] + ... + input[i - 1], wrapping like the uints on the GPU. Returns the total. output can be
+// input. Blocks are reduced over the worker threads, then scanned with SSE or AVX2 from their offsets.
+unsigned int ExclusiveScan(const unsigned int* input,
+                           unsigned int* output,
+                           size_t count,
+                           SimdLevel maxLevel = SimdLevel::AVX512);
+
+// Writes the indices of the non-zero flags in order. With a single mesh this is the matrix index buffer the mesh
+// bucketing passes write. outIndices needs room for count. Returns how many were written.
+size_t CompactIndices(const unsigned int* flags,
+                      size_t count,
+                      unsigned int* outIndices,
+                      SimdLevel maxLevel = SimdLevel::AVX512);
+
+// Partition state of the decoupled look-back scan, flag in the top two bits and the value below. Published with a
+// single atomic, so a reader never sees a flag with the value of another. decoupledLookbackScan_cs.hlsl uses the
+// same layout.
+enum PartitionFlag : unsigned int
+{
+    PARTITION_NOT_READY = 0,
+    PARTITION_AGGREGATE = 1,  // Sum of the partition itself
+    PARTITION_PREFIX = 2      // Sum of everything up to and including the partition
+};
+
+static const unsigned int partitionFlagShift = 30;
+static const unsigned int partitionValueMask = (1u << partitionFlagShift) - 1;
+
+inline unsigned int PackPartitionState(PartitionFlag flag, unsigned int value)
+{
+    return (static_cast<unsigned int>(flag) << partitionFlagShift) | (value & partitionValueMask);
+}
+
+inline PartitionFlag GetPartitionFlag(unsigned int state) { return static_cast<PartitionFlag>(state >> partitionFlagShift); }
+inline unsigned int GetPartitionValue(unsigned int state) { return state & partitionValueMask; }
+
+struct LookbackScanStats
+{
+    int numPartitions = 0;
+    uint64_t numSteps = 0;         // Workgroup steps until the last partition was written
+    uint64_t numStalls = 0;        // Look-back reads of a partition that hadn't published anything yet
+    int maxLookbackDistance = 0;   // Furthest a partition looked back before it found a prefix
+};
+
+// CPU emulation of the single pass scan in decoupled look-back style (Merrill & Garland). A workgroup takes the
+// next partition from a counter, reduces it and publishes the aggregate, then walks back over its predecessors,
+// adding aggregates until it finds a published prefix. Taking partitions from a counter instead of the group id
+// means every predecessor is already running, so the look-back always ends.
+// Workgroups are stepped one read or write at a time in a random order per seed, which gives orderings the GPU
+// could produce but rarely does. Totals have to fit in the 30 value bits.
+class DecoupledLookbackScan
+{
+public:
+    explicit DecoupledLookbackScan(int partitionSize = 256, int maxResidentGroups = 8);
+
+    unsigned int Run(const unsigned int* input, unsigned int* output, size_t count, uint32_t seed = 0);
+
+    const LookbackScanStats& GetStats() const { return m_stats; }
+    const std::vector<unsigned int>& GetPartitionStates() const { return m_partitionStates; }
+
+private:
+    enum class Phase
+    {
+        Acquire,
+        Reduce,
+        LookBack,
+        Write,
+        Done
+    };
+
+    struct Workgroup
+    {
+        Phase phase = Phase::Acquire;
+        int partition = 0;
+        int lookbackIndex = 0;
+        unsigned int aggregate = 0;
+        unsigned int exclusivePrefix = 0;
+    };
+
+    void Step(Workgroup& group, const unsigned int* input, unsigned int* output, size_t count);
+
+    int m_partitionSize;
+    int m_maxResidentGroups;
+
+    std::vector<unsigned int> m_partitionStates;
+    int m_partitionCounter = 0;
+
+    LookbackScanStats m_stats;
+};
@@ -21,6 +21,9 @@ using namespace Microsoft::WRL;
 struct AABB;
 struct FrustumPlanes;
 
+class DynamicBVH;
+class SceneCache;
+
 enum Mode
 {
     MODE_DEFAULT = 0,
@@ -53,12 +56,40 @@ public:
 
     void PopulateResources();
 
+    // Call after changing the world matrices in render::instanceData. Refits the BVH and uploads the instances.
+    void MoveInstances(const std::vector<int>& changedInstances);
+
+    // Sets the world matrix of one instance. Everything moved this way goes to MoveInstances in the next Update.
+    void SetInstanceTransform(int instance, const DirectX::XMMATRIX& worldMatrix);
+
+    // Frustum culls on the CPU against m_bvh and hands the result to OcclusionCulling::SetCpuVisibility, in place of
+    // the GPU culling pass
+    void ToggleBvhCulling();
+
+    // Bobs the first instances up and down through SetInstanceTransform, so they're moved and refit every frame
+    void ToggleInstanceAnimation();
+
 private:
     friend class InputHandler;
 
     DirectX::XMMATRIX m_ProjectionMatrix = {};
 
-    std::vector<AABB> m_objects;
+    std::shared_ptr<DynamicBVH> m_bvh = nullptr;  // Over the instance bounds, built or loaded in InitCubes
+    std::vector<int> m_movedInstances;            // Since the last Update, see SetInstanceTransform
+
+    // See ToggleBvhCulling. The visibility is shared with OcclusionCulling and rewritten by every Update.
+    bool m_bvhCulling = false;
+    std::vector<int> m_bvhVisibleInstances;
+    std::shared_ptr<std::vector<unsigned int>> m_bvhVisibility = nullptr;
+
+    // Matrices of the animated instances from before the animation, empty while it's off
+    std::vector<DirectX::XMMATRIX> m_animationBase;
+    float m_animationTime = 0.f;
+
+    // Where PopulateResources uploads the bounds from, either the open cache or what GenerateScene made. Both only
+    // live from InitCubes until then.
+    std::unique_ptr<SceneCache> m_sceneCache = nullptr;
+    std::vector<AABB> m_generatedBounds;
 
     std::vector<Entity> m_cameraEntities;  // [0] is main camera, [1] is debug camera
 
@@ -66,6 +97,9 @@ private:
 
     DirectX::XMMATRIX GetCameraVP(Mode mode);
 
+    void AnimateInstances(float deltaTime);
+    void CullWithBvh(const DirectX::XMMATRIX& vpMatrix);
+
     void CreateStructuredBuffer(ComPtr<ID3D12Resource>& resource,
                                 UINT numElements,
                                 UINT elementSize,
@@ -89,7 +123,7 @@ private:
     void PopulateBuffer(std::shared_ptr<CommandList>& commandList,
                         ComPtr<ID3D12Resource>& resource,
                         ComPtr<ID3D12Resource>& uploadBuffer,
-                        void* data,
+                        const void* data,
                         UINT numElements,
                         UINT elementSize);
 
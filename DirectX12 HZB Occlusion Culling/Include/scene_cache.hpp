@@ -0,0 +1,117 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. Uses MapViewOfFile or mmap, and reads the file into memory when mapping fails.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::string& path);
+    void Close();
+
+    const uint8_t* GetData() const { return m_data; }
+    size_t GetSize() const { return m_size; }
+    bool IsMapped() const { return m_mapped; }  // False when the fallback read the file instead
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+
+    std::vector<DirectX::XMFLOAT4A> m_fallback;  // 16 byte aligned, enough for the matrices and BVH nodes
+
+#if defined(_WIN32)
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#endif
+};
+
+enum SceneCacheSection : uint32_t
+{
+    SCENE_SECTION_INSTANCES = 0,   // InstanceData per instance
+    SCENE_SECTION_BOUNDS = 1,      // World space AABB per instance
+    SCENE_SECTION_BVH_NODES = 2,   // FlatBVHNode, empty when no BVH was stored
+    SCENE_SECTION_BVH_OBJECTS = 3, // Instance index per object position of the BVH
+    SCENE_SECTION_COUNT = 4
+};
+
+static const uint32_t sceneCacheMagic = 0x53425A48;  // "HZBS"
+static const uint32_t sceneCacheVersion = 3;  // 3: the renderer's binary BVH instead of the wide one
+
+// Sections start on a page, so uploads can copy straight from the mapped pages
+static const uint64_t sceneCacheAlignment = 4096;
+
+struct SceneCacheSectionInfo
+{
+    uint64_t offset;
+    uint64_t size;   // In bytes, without the padding to the next section
+    uint64_t count;  // Elements
+};
+
+struct SceneCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sceneKey;  // Whatever the scene was made from, see HashSceneSettings
+    uint64_t fileSize;
+    uint64_t checksum;  // Over the section contents, in section order
+    SceneCacheSectionInfo sections[SCENE_SECTION_COUNT];
+};
+
+// Binary scene file: a header and page aligned sections. Open maps the file and checks the magic, version, scene
+// key, sizes and checksum. The getters point into the mapped pages, nothing is copied.
+class SceneCache
+{
+public:
+    // bvhNodes and bvhObjects come from DynamicBVH::Flatten. They can be null, the BVH sections stay empty then.
+    static bool Write(const std::string& path,
+                      uint64_t sceneKey,
+                      const std::vector<InstanceData>& instances,
+                      const std::vector<AABB>& bounds,
+                      const std::vector<FlatBVHNode>* bvhNodes = nullptr,
+                      const std::vector<int>* bvhObjects = nullptr);
+
+    // Fails on a missing, outdated or damaged file. Skipping the checksum saves reading every page up front.
+    bool Open(const std::string& path, uint64_t sceneKey, bool verifyChecksum = true);
+    void Close() { m_file.Close(); m_header = nullptr; }
+
+    bool IsOpen() const { return m_header != nullptr; }
+    bool IsMapped() const { return m_file.IsMapped(); }
+
+    size_t GetNumInstances() const { return GetCount(SCENE_SECTION_INSTANCES); }
+    const InstanceData* GetInstances() const { return GetSection<InstanceData>(SCENE_SECTION_INSTANCES); }
+    const AABB* GetBounds() const { return GetSection<AABB>(SCENE_SECTION_BOUNDS); }
+
+    bool HasBVH() const { return GetCount(SCENE_SECTION_BVH_NODES) > 0; }
+    size_t GetNumBVHNodes() const { return GetCount(SCENE_SECTION_BVH_NODES); }
+    const FlatBVHNode* GetBVHNodes() const { return GetSection<FlatBVHNode>(SCENE_SECTION_BVH_NODES); }
+    const int* GetBVHObjects() const { return GetSection<int>(SCENE_SECTION_BVH_OBJECTS); }
+
+private:
+    size_t GetCount(SceneCacheSection section) const
+    {
+        return m_header ? static_cast<size_t>(m_header->sections[section].count) : 0;
+    }
+
+    template <typename T>
+    const T* GetSection(SceneCacheSection section) const
+    {
+        if (!m_header || m_header->sections[section].count == 0) return nullptr;
+        return reinterpret_cast<const T*>(m_file.GetData() + m_header->sections[section].offset);
+    }
+
+    MappedFile m_file;
+    const SceneCacheHeader* m_header = nullptr;
+};
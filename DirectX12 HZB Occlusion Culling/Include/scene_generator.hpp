@@ -0,0 +1,28 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <vector>
+
+// Random cubes in a box, the stress scene of the renderer
+struct SceneSettings
+{
+    uint32_t seed = 1431;
+    int numInstances = 0;
+    float positionRange = 200.f;  // Translations in [0, positionRange) on every axis, before the scale
+    float scale = 1.f;
+};
+
+// Fills the world matrices and the world bounds in one pass over the worker threads. Every chunk of instances has
+// its own random stream, seeded from the seed and the chunk index, so a seed gives the same scene on any number
+// of threads. Both arrays are resized to numInstances.
+void GenerateScene(const SceneSettings& settings,
+                   const AABB& meshBounds,
+                   std::vector<InstanceData>& instances,
+                   std::vector<AABB>& bounds);
+
+// Identifies the scene GenerateScene makes from these inputs, e.g. for the key of a SceneCache
+uint64_t HashSceneSettings(const SceneSettings& settings, const AABB& meshBounds);
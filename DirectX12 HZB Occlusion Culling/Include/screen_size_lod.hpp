@@ -0,0 +1,47 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+
+#include <vector>
+
+static const unsigned int maxLods = 4;
+
+// LOD 0 for boxes at least lodPixelSizes[0] pixels on screen, LOD 1 down to lodPixelSizes[1] and so on, clamped
+// to numLods - 1. Boxes under minPixelSize are dropped. Sizes are the longer side of the screen rectangle.
+struct LodSettings
+{
+    float minPixelSize = 1.f;
+    float lodPixelSizes[maxLods - 1] = {128.f, 32.f, 8.f};
+    unsigned int numLods = maxLods;
+};
+
+struct LodStats
+{
+    size_t numDropped = 0;
+    size_t numPerLod[maxLods] = {};
+};
+
+// Bit-packed LODs: bits 2 * (i % 16) of word i / 16 hold the LOD of instance i. hzbCulling_cs.hlsl writes the
+// same layout, hidden instances are left at 0.
+inline size_t GetNumLodWords(size_t count) { return (count + 15) / 16; }
+
+inline unsigned int GetLod(const uint32_t* lodBits, size_t index) { return (lodBits[index / 16] >> (index % 16 * 2)) & 3; }
+
+// Longer side of the screen rectangle of the box in pixels, the same rectangle hzbCulling_cs.hlsl picks its mip
+// from. Boxes that cross the near plane are FLT_MAX.
+float GetScreenSize(const AABB& aabb, const XMMATRIX& vpMatrix, float width, float height);
+
+unsigned int SelectLod(float screenSize, const LodSettings& settings);
+
+// Screen-size culling and LOD selection for the visible instances, over the worker threads. Instances under
+// settings.minPixelSize get their visibility bit cleared, the others their LOD in lodBits.
+LodStats SelectLods(uint32_t* visibilityBits,
+                    uint32_t* lodBits,
+                    const AABB* aabbs,
+                    size_t count,
+                    const XMMATRIX& vpMatrix,
+                    float width,
+                    float height,
+                    const LodSettings& settings = LodSettings());
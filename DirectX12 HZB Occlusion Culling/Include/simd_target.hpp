@@ -0,0 +1,18 @@
+#pragma once
+
+#include <immintrin.h>
+
+// Marks a function as compiled for a wider instruction set than the rest of the build. Only call these after
+// GetSupportedSimdLevel said the CPU has it.
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#define TARGET_AVX512
+#elif defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+// GCC turns the multiply and add into an FMA once the target has one, unless told not to
+#define TARGET_AVX2 __attribute__((target("avx2"), optimize("fp-contract=off")))
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
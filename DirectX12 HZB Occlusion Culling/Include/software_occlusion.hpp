@@ -0,0 +1,84 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+#include "occlusion_helpers_dx12.hpp"
+
+#include <vector>
+
+// Pixels per depth tile. Every tile also keeps the farthest depth of its pixels, which is what boxes test against.
+static const int softwareTileWidth = 8;
+static const int softwareTileHeight = 4;
+
+struct SoftwareOcclusionStats
+{
+    int numOccluders = 0;
+    int numTriangles = 0;  // Triangles that made it to the rasterizer
+    int numTested = 0;
+    int numOccluded = 0;
+    double rasterizeTimeMs = 0.0;
+    double testTimeMs = 0.0;
+};
+
+// CPU alternative to the GPU HZB pass. Rasterizes a set of occluders into a low resolution tiled depth buffer
+// and tests instance AABBs against the per-tile max depth, without a GPU round-trip. Depth is NDC z (0 near,
+// 1 far) and pixels no occluder covers stay at the far plane.
+class SoftwareOcclusion
+{
+public:
+    // The resolution is rounded up to whole tiles
+    SoftwareOcclusion(int width = 320, int height = 180);
+
+    void SetOccluderMesh(const VertexPosColor* vertices, int numVertices, const WORD* indices, int numIndices);
+
+    // Picks up to maxOccluders instances inside the frustum, the ones with the largest projected size
+    void SelectOccluders(std::vector<int>& occluders,
+                         const std::vector<AABB>& aabbs,
+                         const XMMATRIX& vpMatrix,
+                         FrustumPlanes& frustum,
+                         int maxOccluders);
+
+    void Rasterize(const std::vector<int>& occluders, const std::vector<InstanceData>& instanceData, const XMMATRIX& vpMatrix);
+
+    // Writes OC_VISIBLE or OC_HIDDEN per box, the same format as the GPU visibility buffer
+    void TestAABBs(std::vector<unsigned int>& visibility,
+                   const std::vector<AABB>& aabbs,
+                   const XMMATRIX& vpMatrix,
+                   FrustumPlanes& frustum);
+
+    // Occluder selection, rasterization and the test in one go
+    void Cull(std::vector<unsigned int>& visibility,
+              const std::vector<AABB>& aabbs,
+              const std::vector<InstanceData>& instanceData,
+              const XMMATRIX& vpMatrix,
+              FrustumPlanes& frustum,
+              int maxOccluders = 1024);
+
+    int GetWidth() const { return m_numTilesX * softwareTileWidth; }
+    int GetHeight() const { return m_numTilesY * softwareTileHeight; }
+    int GetNumTilesX() const { return m_numTilesX; }
+    int GetNumTilesY() const { return m_numTilesY; }
+
+    float GetDepth(int x, int y) const;
+    float GetTileMaxDepth(int tileX, int tileY) const { return m_tileMaxDepth[tileY * m_numTilesX + tileX]; }
+
+    const SoftwareOcclusionStats& GetStats() const { return m_stats; }
+
+private:
+    struct ScreenTriangle;
+
+    void RasterizeTileRow(const std::vector<ScreenTriangle>& triangles, int tileY);
+
+    std::vector<DirectX::XMFLOAT3> m_meshPositions;
+    std::vector<int> m_meshIndices;
+
+    std::vector<float> m_depth;  // Tile after tile, each tile row-major
+    std::vector<float> m_tileMaxDepth;
+
+    int m_numTilesX = 0;
+    int m_numTilesY = 0;
+
+    SoftwareOcclusionStats m_stats;
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace bee
+{
+class DX12Texture;
+class ShaderResourceView;
+class UnorderedAccessView;
+}  // namespace bee
+
+// Everything the pool creates goes through this. The device backs it with committed resources and its command
+// queues, tests can hand in a mock that only counts.
+class TransientAllocator
+{
+public:
+    virtual ~TransientAllocator() = default;
+
+    virtual std::shared_ptr<bee::DX12Texture> CreateTexture(const D3D12_RESOURCE_DESC& desc) = 0;
+    virtual std::shared_ptr<bee::ShaderResourceView> CreateShaderResourceView(
+        const std::shared_ptr<bee::DX12Texture>& texture,
+        const D3D12_SHADER_RESOURCE_VIEW_DESC& desc) = 0;
+    virtual std::shared_ptr<bee::UnorderedAccessView> CreateUnorderedAccessView(
+        const std::shared_ptr<bee::DX12Texture>& texture,
+        const D3D12_UNORDERED_ACCESS_VIEW_DESC& desc) = 0;
+
+    virtual bool IsFenceComplete(D3D12_COMMAND_LIST_TYPE queue, uint64_t fenceValue) = 0;
+};
+
+struct TransientPoolStats
+{
+    int numCreated = 0;
+    int numReused = 0;
+    int numEvicted = 0;
+    int numViewsCreated = 0;
+    int numViewsReused = 0;
+    int numPooled = 0;  // Textures the pool holds, in use or not
+    int numInUse = 0;
+};
+
+// Pool of per-frame textures, keyed by their resource desc. A released texture is handed out again once the GPU
+// is past the fence it was released with. Textures that haven't been used for a number of frames are freed.
+// Views of pooled textures are cached with them, so they're only created once per texture.
+class TransientResourcePool
+{
+public:
+    explicit TransientResourcePool(std::unique_ptr<TransientAllocator> allocator);
+
+    TransientResourcePool(const TransientResourcePool&) = delete;
+    TransientResourcePool& operator=(const TransientResourcePool&) = delete;
+
+    std::shared_ptr<bee::DX12Texture> AcquireTexture(const D3D12_RESOURCE_DESC& desc);
+
+    // fenceValue is the last signal on queue that covers every use of the texture
+    void ReleaseTexture(const std::shared_ptr<bee::DX12Texture>& texture, D3D12_COMMAND_LIST_TYPE queue, uint64_t fenceValue);
+
+    // Cached for pooled textures. Anything else gets a fresh view, the cache can't tell when it's destroyed.
+    std::shared_ptr<bee::ShaderResourceView> GetShaderResourceView(const std::shared_ptr<bee::DX12Texture>& texture,
+                                                                   const D3D12_SHADER_RESOURCE_VIEW_DESC& desc);
+    std::shared_ptr<bee::UnorderedAccessView> GetUnorderedAccessView(const std::shared_ptr<bee::DX12Texture>& texture,
+                                                                     const D3D12_UNORDERED_ACCESS_VIEW_DESC& desc);
+
+    // Once per frame. Frees released textures that are done on the GPU and unused for more than the max age.
+    void EndFrame();
+
+    // Frees every released texture the GPU is done with
+    void Trim();
+
+    void SetMaxAge(uint64_t frames) { m_maxAge = frames; }
+
+    const TransientPoolStats& GetStats() const { return m_stats; }
+
+private:
+    struct DescHash
+    {
+        size_t operator()(const D3D12_RESOURCE_DESC& desc) const;
+    };
+
+    struct DescEqual
+    {
+        bool operator()(const D3D12_RESOURCE_DESC& a, const D3D12_RESOURCE_DESC& b) const;
+    };
+
+    struct PooledTexture
+    {
+        std::shared_ptr<bee::DX12Texture> texture;
+        D3D12_RESOURCE_DESC desc;
+
+        bool inUse = false;
+        D3D12_COMMAND_LIST_TYPE queue = D3D12_COMMAND_LIST_TYPE_DIRECT;
+        uint64_t fenceValue = 0;
+        uint64_t lastUsedFrame = 0;
+
+        std::vector<std::pair<D3D12_SHADER_RESOURCE_VIEW_DESC, std::shared_ptr<bee::ShaderResourceView>>> srvs;
+        std::vector<std::pair<D3D12_UNORDERED_ACCESS_VIEW_DESC, std::shared_ptr<bee::UnorderedAccessView>>> uavs;
+    };
+
+    PooledTexture* Find(const bee::DX12Texture* texture);
+    void Evict(uint64_t minAge);  // Frames since the release
+
+    std::unique_ptr<TransientAllocator> m_allocator;
+
+    std::unordered_map<D3D12_RESOURCE_DESC, std::vector<std::unique_ptr<PooledTexture>>, DescHash, DescEqual> m_textures;
+    std::unordered_map<const bee::DX12Texture*, PooledTexture*> m_lookup;
+
+    uint64_t m_frame = 0;
+    uint64_t m_maxAge = 8;
+
+    TransientPoolStats m_stats;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+#include "hzb_culling_cpu.hpp"
+#include "hzb_pyramid.hpp"
+
+#include <vector>
+
+struct TwoPhaseCullStats
+{
+    size_t numPhase1 = 0;     // Visible last frame and inside the frustum, drawn first
+    size_t numRetested = 0;   // Tested against the new HZB: everything not drawn in phase 1, plus a slice of phase 1
+    size_t numRecovered = 0;  // Of those, the ones that turned out visible and are drawn in phase 2
+    size_t numDropped = 0;    // Drawn in phase 1, but hidden behind the new HZB, so left out of the history
+    double phase1TimeMs = 0.0;
+    double phase2TimeMs = 0.0;
+};
+
+// Two-phase occlusion culling on the CPU, with the visibility history kept across frames. Every frame:
+// - BeginFrame gives the objects that were visible last frame and are inside the frustum. Draw them, then build
+//   the HZB from the depth they leave.
+// - EndFrame tests the objects that weren't drawn in phase 1 against that HZB and gives the ones that are visible
+//   now. Draw those as well. Objects that were disoccluded this frame show up right away.
+// The phase 1 objects are in the depth the HZB is built from, so they nearly always pass. Their test only finds
+// the ones that got hidden behind other phase 1 objects, to drop them from the history, so it is spread out: every
+// frame one in historyRefreshInterval words of them is tested, the rest stays in the history as drawn. Until its
+// turn comes, a hidden object is drawn a few frames too many, never too few.
+// Without a history, after Reset or a change in the number of objects, phase 1 is empty and phase 2 tests
+// everything. Visibility is bit-packed, see visibility_bits.hpp.
+class TwoPhaseCulling
+{
+public:
+    // Forgets the history, e.g. after a camera cut where last frame's visible set says nothing
+    void Reset() { m_history.clear(); }
+
+    // 1 tests every phase 1 object again every frame
+    void SetHistoryRefreshInterval(int frames)
+    {
+        assert(frames >= 1 && "Need a refresh interval of at least one frame");
+        m_historyRefreshInterval = frames;
+    }
+
+    const std::vector<uint32_t>& BeginFrame(const std::vector<AABB>& aabbs, FrustumPlanes& frustum);
+
+    // hzb is built from the depth of the phase 1 objects, in the convention settings.mode expects
+    const std::vector<uint32_t>& EndFrame(const std::vector<AABB>& aabbs,
+                                          const HzbPyramid& hzb,
+                                          const XMMATRIX& vpMatrix,
+                                          FrustumPlanes& frustum,
+                                          const HzbCullSettings& settings = HzbCullSettings());
+
+    const std::vector<uint32_t>& GetPhase1() const { return m_phase1; }
+    const std::vector<uint32_t>& GetPhase2() const { return m_phase2; }
+
+    // Everything drawn after EndFrame that wasn't found hidden, phase 1 for the next frame
+    const std::vector<uint32_t>& GetHistory() const { return m_history; }
+
+    const TwoPhaseCullStats& GetStats() const { return m_stats; }
+
+private:
+    std::vector<uint32_t> m_history;
+    size_t m_numHistoryObjects = 0;
+    std::vector<uint32_t> m_phase1;
+    std::vector<uint32_t> m_phase2;
+
+    std::vector<uint32_t> m_tested;   // What EndFrame tests against the HZB
+    std::vector<uint32_t> m_visible;  // Of those, the ones that passed
+
+    int m_historyRefreshInterval = 4;
+    unsigned int m_frameCount = 0;
+
+    TwoPhaseCullStats m_stats;
+};
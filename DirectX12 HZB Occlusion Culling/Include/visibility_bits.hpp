@@ -0,0 +1,64 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include <vector>
+
+// Bit-packed visibility: bit i % 32 of word i / 32 is set when object i is visible. Bits past the last object stay
+// 0, so whole words can be combined and counted. hzbCulling_cs.hlsl and FrustumAABBIntersectBatch write the same
+// layout.
+inline size_t GetNumVisibilityWords(size_t count) { return (count + 31) / 32; }
+
+inline bool IsVisible(const uint32_t* bits, size_t index) { return (bits[index / 32] >> (index % 32)) & 1; }
+
+inline int CountBits(uint32_t value)
+{
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    return static_cast<int>((((value + (value >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+}
+
+inline int CountTrailingZeros(uint32_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanForward(&index, value) ? static_cast<int>(index) : 32;
+#else
+    return value ? __builtin_ctz(value) : 32;
+#endif
+}
+
+// Calls func(index) for every visible object in order. Empty words cost one compare.
+template <typename Func>
+void ForEachVisible(const uint32_t* bits, size_t count, Func&& func)
+{
+    const size_t numWords = GetNumVisibilityWords(count);
+    for (size_t word = 0; word < numWords; ++word)
+    {
+        for (uint32_t remaining = bits[word]; remaining != 0; remaining &= remaining - 1)
+        {
+            func(word * 32 + CountTrailingZeros(remaining));
+        }
+    }
+}
+
+// Converts from and to one OC_VISIBLE/OC_HIDDEN per object, what SoftwareOcclusion and HzbCullAABBs write
+void PackVisibility(const unsigned int* flags, size_t count, uint32_t* outBits);
+void UnpackVisibility(const uint32_t* bits, size_t count, unsigned int* outFlags);
+
+// Every object visible, with the bits past count left at 0
+void SetAllVisible(uint32_t* bits, size_t count);
+
+// Word by word over the worker threads. out can be one of the inputs, so several views fold into one mask.
+void AndVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords);
+void OrVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords);
+// Visible in a but not in b
+void AndNotVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords);
+// Objects that changed visibility between two frames
+void DiffVisibility(const uint32_t* previous, const uint32_t* current, uint32_t* outChanged, size_t numWords);
+
+size_t CountVisible(const uint32_t* bits, size_t numWords);
+
+// Writes the indices of the visible objects in order and returns how many. Every word gets its offset from an
+// exclusive scan of the word popcounts, then expands its bits from there. outIndices needs room for count.
+size_t CompactVisibility(const uint32_t* bits, size_t count, unsigned int* outIndices);
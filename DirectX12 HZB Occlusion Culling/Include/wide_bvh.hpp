@@ -0,0 +1,54 @@
+#pragma once
+
+#include "pch_dx12.hpp"
+
+#include "bounding_volumes.hpp"
+#include "frustum.hpp"
+
+#include <vector>
+
+// A node of the flattened 4-wide BVH. The bounds of the four children are stored as SoA, so a single
+// SSE pass per frustum plane tests all of them at once.
+struct alignas(16) WideBVHNode
+{
+    float minX[4];
+    float minY[4];
+    float minZ[4];
+    float maxX[4];
+    float maxY[4];
+    float maxZ[4];
+
+    int child[4];        // Index of the child node, or -1 if the child is a leaf
+    int objectIndex[4];  // First object below the child
+    int objectCount[4];  // Number of objects below the child, 0 for unused slots
+};
+
+// Flattened BVH4 collapsed from the binary tree made by BuildBVH. The children of every node are sorted by their
+// first object, so left to right like in the binary tree. Traversal uses an explicit stack and reports the same
+// object positions in the same order as FrustumBVHIntersect. Like there, children skip the planes their parent
+// was fully inside. With AVX2 (and maxLevel allowing it) a plane tests both corners of all four children in one
+// 8-wide pass, otherwise it takes two SSE passes.
+class WideBVH
+{
+public:
+    WideBVH() = default;
+    explicit WideBVH(const std::shared_ptr<BVHNode>& root) { Build(root); }
+
+    void Build(const std::shared_ptr<BVHNode>& root);
+
+    void FrustumIntersect(std::vector<int>& array,
+                          const FrustumPlanes& frustum,
+                          FrustumCullStats* stats = nullptr,
+                          SimdLevel maxLevel = SimdLevel::AVX512) const;
+
+    // Nodes of an earlier Build, e.g. from a SceneCache
+    void SetNodes(const WideBVHNode* nodes, size_t count) { m_nodes.assign(nodes, nodes + count); }
+
+    const std::vector<WideBVHNode>& GetNodes() const { return m_nodes; }
+    size_t GetMemoryFootprint() const { return m_nodes.size() * sizeof(WideBVHNode); }
+
+private:
+    int BuildNode(const BVHNode& node);
+
+    std::vector<WideBVHNode> m_nodes;
+};
@@ -0,0 +1,45 @@
+// Decode of CompactInstance in compact_instance.hpp: position, uniform scale and a smallest-three quaternion. The
+// largest component's index is in bits 0-1 of rotation.x, the other three follow in 20 bits each.
+struct CompactInstance
+{
+    float3 position;
+    float scale;
+    uint2 rotation;
+};
+
+#define ROTATION_MASK 0xFFFFF
+#define MAX_SMALL_COMPONENT 0.70710678f
+
+float DequantizeComponent(uint value)
+{
+    return (float(value) / float(ROTATION_MASK) * 2.0f - 1.0f) * MAX_SMALL_COMPONENT;
+}
+
+float4 DecodeRotation(uint2 rotation)
+{
+    uint largest = rotation.x & 3;
+    float a = DequantizeComponent((rotation.x >> 2) & ROTATION_MASK);
+    float b = DequantizeComponent((rotation.x >> 22) | ((rotation.y & 0x3FF) << 10));
+    float c = DequantizeComponent((rotation.y >> 10) & ROTATION_MASK);
+    float l = sqrt(max(0.0f, 1.0f - a * a - b * b - c * c));
+
+    if (largest == 0) return float4(l, a, b, c);
+    if (largest == 1) return float4(a, l, b, c);
+    if (largest == 2) return float4(a, b, l, c);
+    return float4(a, b, c, l);
+}
+
+// The matrix the instance buffer would hold in matrix form, as HLSL reads it: mul(M, float4(p, 1)) is the world
+// position
+float4x4 DecodeWorldMatrix(CompactInstance instance)
+{
+    float4 q = DecodeRotation(instance.rotation);
+    float x = q.x, y = q.y, z = q.z, w = q.w;
+    float s = instance.scale;
+    float3 t = instance.position;
+
+    return float4x4(float4((1.0f - 2.0f * (y * y + z * z)) * s, 2.0f * (x * y - w * z) * s, 2.0f * (x * z + w * y) * s, t.x),
+                    float4(2.0f * (x * y + w * z) * s, (1.0f - 2.0f * (x * x + z * z)) * s, 2.0f * (y * z - w * x) * s, t.y),
+                    float4(2.0f * (x * z - w * y) * s, 2.0f * (y * z + w * x) * s, (1.0f - 2.0f * (x * x + y * y)) * s, t.z),
+                    float4(0.0f, 0.0f, 0.0f, 1.0f));
+}
@@ -0,0 +1,130 @@
+// Single pass exclusive scan of the popcounts of the bit-packed visibility buffer with decoupled look-back. scanResult
+// gets the offset of every word, visible instance i then goes to scanResult[i / 32] plus the visible bits below it
+// in its word, like CompactVisibility in visibility_bits.cpp. MeshBucketingPass runs it in place of the mesh count
+// pass when there is a single mesh, visibility_compact_cs does the scatter. DecoupledLookbackScan in
+// parallel_scan.cpp emulates the partition state machine on the CPU.
+//
+// One dispatch of ceil(numWords / 256) groups. partitionState and partitionCounter have to be 0 before every
+// dispatch, they start out cleared and visibility_compact_cs clears them again.
+
+StructuredBuffer<uint> visibilityBuffer : register(t0);  // One bit per instance
+RWStructuredBuffer<uint> scanResult     : register(u0);  // One offset per word
+RWStructuredBuffer<uint> count          : register(u1);  // Number of visible instances
+
+// Flag in the top two bits, value below, so flag and value are published with one atomic
+globallycoherent RWStructuredBuffer<uint> partitionState : register(u2);
+globallycoherent RWStructuredBuffer<uint> partitionCounter : register(u3);
+
+cbuffer constants : register(b0) { uint numInstances; };
+
+#define PARTITION_NOT_READY 0
+#define PARTITION_AGGREGATE 1
+#define PARTITION_PREFIX    2
+
+#define FLAG_SHIFT 30
+#define VALUE_MASK 0x3FFFFFFF
+
+groupshared uint temp[256];
+groupshared uint partitionIndex;
+groupshared uint exclusivePrefix;
+
+uint PackState(uint flag, uint value) { return (flag << FLAG_SHIFT) | (value & VALUE_MASK); }
+
+[numthreads(256, 1, 1)]
+void main(uint3 threadID : SV_GroupThreadID)
+{
+    uint i = threadID.x;
+
+    // Partitions are taken in the order groups start, not by SV_GroupID. Every partition in front of this one then
+    // belongs to a group that is already running, so the look-back below always ends.
+    if (i == 0)
+    {
+        InterlockedAdd(partitionCounter[0], 1, partitionIndex);
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    uint partition = partitionIndex;
+    uint globalIndex = partition * 256 + i;
+    uint numWords = (numInstances + 31) / 32;
+
+    temp[i] = (globalIndex < numWords) ? countbits(visibilityBuffer[globalIndex]) : 0;
+    GroupMemoryBarrierWithGroupSync();
+
+    // Upsweep
+    for (uint stride = 1; stride < 256; stride *= 2)
+    {
+        uint index = (i + 1) * stride * 2 - 1;
+        if (index < 256)
+        {
+            temp[index] += temp[index - stride];
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    if (i == 255)
+    {
+        uint aggregate = temp[255];
+        temp[255] = 0;
+
+        uint original;
+        uint prefix = 0;
+        if (partition == 0)
+        {
+            InterlockedExchange(partitionState[0], PackState(PARTITION_PREFIX, aggregate), original);
+        }
+        else
+        {
+            // Publish the aggregate first, so the partitions behind this one don't have to wait for the look-back
+            InterlockedExchange(partitionState[partition], PackState(PARTITION_AGGREGATE, aggregate), original);
+
+            int lookbackIndex = partition - 1;
+            while (lookbackIndex >= 0)
+            {
+                uint state;
+                InterlockedOr(partitionState[lookbackIndex], 0, state);
+
+                uint flag = state >> FLAG_SHIFT;
+                if (flag == PARTITION_NOT_READY)
+                {
+                    continue;
+                }
+
+                prefix += state & VALUE_MASK;
+                if (flag == PARTITION_PREFIX)
+                {
+                    break;
+                }
+
+                lookbackIndex--;
+            }
+
+            InterlockedExchange(partitionState[partition], PackState(PARTITION_PREFIX, prefix + aggregate), original);
+        }
+
+        exclusivePrefix = prefix;
+
+        if ((partition + 1) * 256 >= numWords)
+        {
+            count[0] = prefix + aggregate;
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    // Downsweep
+    for (uint stride = 128; stride > 0; stride /= 2)
+    {
+        uint index = (i + 1) * stride * 2 - 1;
+        if (index < 256)
+        {
+            uint tempValue = temp[index - stride];
+            temp[index - stride] = temp[index];
+            temp[index] += tempValue;
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    if (globalIndex < numWords)
+    {
+        scanResult[globalIndex] = temp[i] + exclusivePrefix;
+    }
+}
@@ -4,10 +4,14 @@ static const uint OC_HIDDEN = 0;
 static const uint OC_VISIBLE = 1;
 static const uint OC_ERROR = 2;
 
+// Laid out like ConstantData in occlusion_dx12.hpp, see screen_size_lod.hpp for the LOD settings
 cbuffer Constants : register(b0)
 {
     uint maxHzbMip;
     uint numObjects;
+    uint numLods;
+    float minPixelSize;
+    float3 lodPixelSizes;
 };
 
 struct CameraVP
@@ -32,10 +36,19 @@ ConstantBuffer<Frustum> frustum : register(b2);
 Texture2D hzb : register(t0);
 StructuredBuffer<AABB> aabbBuffer : register(t1);
 
+// One bit per object, bit index % 32 of word index / 32. Every group of 64 writes two whole words, so the buffer
+// doesn't have to be cleared and no atomics go to memory.
 RWStructuredBuffer<uint> visibilityBuffer : register(u0);
 
+// Two bits per object, the LOD of object index in bits 2 * (index % 16) of word index / 16. Written as whole words
+// like the visibility.
+RWStructuredBuffer<uint> lodBuffer : register(u1);
+
 SamplerState pointSampler : register(s0);
 
+groupshared uint visibleBits[2];
+groupshared uint lodBits[4];
+
 #define OUTSIDE 0
 #define INSIDE 1
 
@@ -72,7 +85,7 @@ int FrustumAABBIntersect(AABB B)
     return step(6, insideCounter);
 }
 
-void CalculateMinMax(float3 aabb_min, float3 aabb_max, out float2 min_xy, out float2 max_xy, out float min_z)
+void CalculateMinMax(float3 aabb_min, float3 aabb_max, out float2 min_xy, out float2 max_xy, out float min_z, out bool crosses_near)
 {
     float3 corners[8] =
     {
@@ -89,11 +102,13 @@ void CalculateMinMax(float3 aabb_min, float3 aabb_max, out float2 min_xy, out fl
     min_xy = float2(FLT_MAX, FLT_MAX);
     max_xy = float2(-FLT_MAX, -FLT_MAX);
     min_z = 1.0f;
+    crosses_near = false;
 
     for (int i = 0; i < 8; ++i)
     {
         float4 world_space = float4(corners[i], 1.0f);
         float4 clip_space = mul(cameraCB.VP, world_space);
+        crosses_near = crosses_near || clip_space.w <= 1e-5f;
 
         float3 ndc_space = clip_space.xyz / clip_space.w;
         
@@ -105,28 +120,39 @@ void CalculateMinMax(float3 aabb_min, float3 aabb_max, out float2 min_xy, out fl
     }
 }
 
-[numthreads(64, 1, 1)]
-void main(int3 uid : SV_DispatchThreadID)
+uint SelectLod(float screenSize)
 {
-    uint index = uid.x;
+    uint lod = 0;
+
+    [unroll]
+    for (uint i = 0; i < 3; ++i)
+    {
+        lod += (i + 1 < numLods && screenSize < lodPixelSizes[i]) ? 1 : 0;
+    }
+
+    return lod;
+}
+
+bool IsVisible(uint index, out uint lod)
+{
+    lod = 0;
 
     if (index >= numObjects || FrustumAABBIntersect(aabbBuffer[index]) == OUTSIDE)
     {
-        visibilityBuffer[index] = OC_HIDDEN;
-        return;
+        return false;
     }
     
     AABB aabb = aabbBuffer[index];
     
     float3 aabb_min = aabb.min;
     float3 aabb_max = aabb.max;
-    float4 aabb_size = float4(aabb_max - aabb_min, 0);
     
     float2 min_xy = float2(1.f, 1.f);
     float2 max_xy = float2(0.f, 0.f);
     float min_z = 1;
+    bool crosses_near = false;
 
-    CalculateMinMax(aabb_min, aabb_max, min_xy, max_xy, min_z);
+    CalculateMinMax(aabb_min, aabb_max, min_xy, max_xy, min_z, crosses_near);
     
     uint baseWidth, baseHeight;
     hzb.GetDimensions(baseWidth, baseHeight);
@@ -134,6 +160,14 @@ void main(int3 uid : SV_DispatchThreadID)
     float2 boxWidth = float2(max_xy - min_xy);
     float2 texelSize = boxWidth * float2(baseWidth, baseHeight);
     float maxDimension = max(texelSize.x, texelSize.y);
+
+    // The HZB is as large as the screen, so texels are pixels. Too small to contribute, dropped before the HZB test.
+    float screenSize = crosses_near ? FLT_MAX : maxDimension;
+    if (screenSize < minPixelSize)
+    {
+        return false;
+    }
+    lod = SelectLod(screenSize);
     
     float mip = floor(log2(maxDimension));
     mip = min(mip, maxHzbMip);
@@ -147,5 +181,42 @@ void main(int3 uid : SV_DispatchThreadID)
 
     float max_z = max(max(max(sample1.x, sample2.x), sample3.x), sample4.x);
     
-    visibilityBuffer[index] = min_z <= max_z + 0.001f;
-}
\ No newline at end of file
+    return min_z <= max_z + 0.001f;
+}
+
+[numthreads(64, 1, 1)]
+void main(uint3 uid : SV_DispatchThreadID, uint3 groupThreadID : SV_GroupThreadID)
+{
+    uint index = uid.x;
+    uint i = groupThreadID.x;
+
+    if (i < 2)
+    {
+        visibleBits[i] = 0;
+    }
+    if (i < 4)
+    {
+        lodBits[i] = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    uint lod;
+    if (IsVisible(index, lod))
+    {
+        InterlockedOr(visibleBits[i / 32], 1u << (i % 32));
+        InterlockedOr(lodBits[i / 16], lod << (i % 16 * 2));
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    uint word = index / 32;
+    if (i % 32 == 0 && word < (numObjects + 31) / 32)
+    {
+        visibilityBuffer[word] = visibleBits[i / 32];
+    }
+
+    uint lodWord = index / 16;
+    if (i % 16 == 0 && lodWord < (numObjects + 15) / 16)
+    {
+        lodBuffer[lodWord] = lodBits[i / 16];
+    }
+}
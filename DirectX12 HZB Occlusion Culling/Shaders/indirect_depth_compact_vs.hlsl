@@ -0,0 +1,2 @@
+#define COMPACT_INSTANCES
+#include "indirect_depth_vs.hlsl"
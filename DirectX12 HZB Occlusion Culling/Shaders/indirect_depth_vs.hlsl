@@ -3,17 +3,33 @@ struct ViewProjection
     matrix VP;
 };
 
+ConstantBuffer<ViewProjection> ViewProjectionCB : register(b0);
+
+// indirect_*_compact_vs.hlsl defines COMPACT_INSTANCES, for the 24 byte CompactInstance buffer
+#ifdef COMPACT_INSTANCES
+#include "compact_instance.hlsli"
+
+StructuredBuffer<CompactInstance> instanceBuffer : register(t0);
+
+float4x4 GetWorldMatrix(uint instance) { return DecodeWorldMatrix(instanceBuffer[instance]); }
+#else
 struct InstanceData
 {
     matrix M;
 };
 
-ConstantBuffer<ViewProjection> ViewProjectionCB : register(b0);
-StructuredBuffer<InstanceData> instanceBuffer   : register(t0);
-StructuredBuffer<uint> matrixIndexBuffer        : register(t1);
+StructuredBuffer<InstanceData> instanceBuffer : register(t0);
+
+float4x4 GetWorldMatrix(uint instance) { return instanceBuffer[instance].M; }
+#endif
+
+StructuredBuffer<uint> matrixIndexBuffer : register(t1);
+
+// Set by the indirect command, the first slot of this draw's mesh in the matrix index buffer
+cbuffer DrawConstants : register(b1) { uint instanceOffset; };
 
 float4 main(uint instanceId : SV_InstanceID, float3 Position : POSITION) : SV_Position
 {
-    return mul(mul(ViewProjectionCB.VP, instanceBuffer[matrixIndexBuffer[instanceId]].M), float4(Position, 1.0f));
+    return mul(mul(ViewProjectionCB.VP, GetWorldMatrix(matrixIndexBuffer[instanceOffset + instanceId])), float4(Position, 1.0f));
 }         
                                                                                                                                                                       
\ No newline at end of file
@@ -0,0 +1,2 @@
+#define COMPACT_INSTANCES
+#include "indirect_draw_vs.hlsl"
@@ -3,24 +3,30 @@ struct ViewProjection
     matrix VP;
 };
 
+ConstantBuffer<ViewProjection> ViewProjectionCB : register(b0);
+
+// indirect_*_compact_vs.hlsl defines COMPACT_INSTANCES, for the 24 byte CompactInstance buffer
+#ifdef COMPACT_INSTANCES
+#include "compact_instance.hlsli"
+
+StructuredBuffer<CompactInstance> instanceBuffer : register(t0);
+
+float4x4 GetWorldMatrix(uint instance) { return DecodeWorldMatrix(instanceBuffer[instance]); }
+#else
 struct InstanceData
 {
     matrix M;
 };
 
-struct IndirectCommand
-{
-    uint IndexCountPerInstance;
-    uint InstanceCount;
-    uint StartIndexLocation;
-    int BaseVertexLocation;
-    uint StartInstanceLocation;
-};
+StructuredBuffer<InstanceData> instanceBuffer : register(t0);
 
-ConstantBuffer<ViewProjection> ViewProjectionCB : register(b0);
-StructuredBuffer<InstanceData> instanceBuffer   : register(t0);
-StructuredBuffer<uint> matrixIndexBuffer        : register(t4);
-StructuredBuffer<IndirectCommand> indirectDrawBuffer : register(t5);
+float4x4 GetWorldMatrix(uint instance) { return instanceBuffer[instance].M; }
+#endif
+
+StructuredBuffer<uint> matrixIndexBuffer : register(t1);
+
+// Set by the indirect command, the first slot of this draw's mesh in the matrix index buffer
+cbuffer DrawConstants : register(b1) { uint instanceOffset; };
 
 struct VertexInput
 {
@@ -38,9 +44,9 @@ VertexShaderOutput main(uint instanceId : SV_InstanceID, VertexInput IN)
 {
     VertexShaderOutput OUT;
 
-    int maxCount = indirectDrawBuffer[0].InstanceCount;
+    uint instance = matrixIndexBuffer[instanceOffset + instanceId];
 
-    OUT.Position = mul(mul(ViewProjectionCB.VP, instanceBuffer[matrixIndexBuffer[instanceId]].M), float4(IN.Position, 1.0f));
+    OUT.Position = mul(mul(ViewProjectionCB.VP, GetWorldMatrix(instance)), float4(IN.Position, 1.0f));
     OUT.Color = float4(IN.Color, 1.0f);
 
     return OUT;
@@ -0,0 +1,105 @@
+struct MeshDrawInfo
+{
+    uint indexCount;
+    uint startIndexLocation;
+    int baseVertexLocation;
+};
+
+struct IndirectCommand
+{
+    uint InstanceOffset;
+    uint IndexCountPerInstance;
+    uint InstanceCount;
+    uint StartIndexLocation;
+    int BaseVertexLocation;
+    uint StartInstanceLocation;
+};
+
+// Second compaction pass, a single group: scans the mesh counts into the start of every mesh in the matrix index
+// buffer, and writes one draw per mesh with visible instances. Clears the counts for the next frame.
+StructuredBuffer<MeshDrawInfo> meshTable : register(t0);
+
+RWStructuredBuffer<uint> meshCounts               : register(u0);
+RWStructuredBuffer<uint> meshOffsets              : register(u1);
+RWStructuredBuffer<IndirectCommand> indirectDrawBuffer : register(u2);
+RWStructuredBuffer<uint> drawCount                : register(u3);
+
+cbuffer constants : register(b0) { uint numMeshes; };
+
+groupshared uint instanceSums[256];
+groupshared uint drawSums[256];
+groupshared uint instanceCarry;
+groupshared uint drawCarry;
+
+[numthreads(256, 1, 1)]
+void main(uint3 threadID : SV_GroupThreadID)
+{
+    uint i = threadID.x;
+
+    if (i == 0)
+    {
+        instanceCarry = 0;
+        drawCarry = 0;
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    // 256 meshes at a time, the carries hold the totals of the ones before
+    for (uint base = 0; base < numMeshes; base += 256)
+    {
+        uint mesh = base + i;
+        uint count = (mesh < numMeshes) ? meshCounts[mesh] : 0;
+
+        instanceSums[i] = count;
+        drawSums[i] = (count > 0) ? 1 : 0;
+        GroupMemoryBarrierWithGroupSync();
+
+        // Inclusive scan, Hillis-Steele
+        for (uint stride = 1; stride < 256; stride *= 2)
+        {
+            uint instanceValue = (i >= stride) ? instanceSums[i - stride] : 0;
+            uint drawValue = (i >= stride) ? drawSums[i - stride] : 0;
+            GroupMemoryBarrierWithGroupSync();
+
+            instanceSums[i] += instanceValue;
+            drawSums[i] += drawValue;
+            GroupMemoryBarrierWithGroupSync();
+        }
+
+        uint instanceOffset = instanceCarry + instanceSums[i] - count;
+        uint drawIndex = drawCarry + drawSums[i] - ((count > 0) ? 1 : 0);
+
+        if (mesh < numMeshes)
+        {
+            meshOffsets[mesh] = instanceOffset;
+            meshCounts[mesh] = 0;
+
+            if (count > 0)
+            {
+                MeshDrawInfo info = meshTable[mesh];
+
+                IndirectCommand arg;
+                arg.InstanceOffset = instanceOffset;
+                arg.IndexCountPerInstance = info.indexCount;
+                arg.InstanceCount = count;
+                arg.StartIndexLocation = info.startIndexLocation;
+                arg.BaseVertexLocation = info.baseVertexLocation;
+                arg.StartInstanceLocation = 0;
+
+                indirectDrawBuffer[drawIndex] = arg;
+            }
+        }
+        GroupMemoryBarrierWithGroupSync();
+
+        if (i == 255)
+        {
+            instanceCarry += instanceSums[255];
+            drawCarry += drawSums[255];
+        }
+        GroupMemoryBarrierWithGroupSync();
+    }
+
+    if (i == 0)
+    {
+        drawCount[0] = drawCarry;
+    }
+}
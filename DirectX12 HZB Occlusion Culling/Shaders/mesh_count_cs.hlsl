@@ -0,0 +1,32 @@
+// First of the three compaction passes: every visible instance takes the next slot of its mesh. The slot is a rank
+// among the visible instances of the same mesh, which the popcount scan of the visibility words can't give, it only
+// ranks among all of them. Ranking per mesh that way would take a scan per mesh, so this keeps one atomic per visible
+// instance on the counter of its mesh. A single mesh skips it, see decoupledLookbackScan_cs and visibility_compact_cs.
+StructuredBuffer<uint> visibilityBuffer : register(t0);  // One bit per instance
+StructuredBuffer<uint> meshIds          : register(t1);
+StructuredBuffer<uint> lodBuffer        : register(t2);  // Two bits per instance
+
+RWStructuredBuffer<uint> meshCounts : register(u0);
+RWStructuredBuffer<uint> meshRanks  : register(u1);
+
+cbuffer constants : register(b0)
+{
+    uint numInstances;
+    uint numMeshIds;
+};
+
+// The mesh table holds every LOD of every mesh id, LOD major
+uint GetMesh(uint i) { return ((lodBuffer[i / 16] >> (i % 16 * 2)) & 3) * numMeshIds + meshIds[i]; }
+
+[numthreads(256, 1, 1)]
+void main(uint3 dispatchID : SV_DispatchThreadID)
+{
+    uint i = dispatchID.x;
+
+    if (i < numInstances && (visibilityBuffer[i / 32] >> (i % 32)) & 1)
+    {
+        uint rank;
+        InterlockedAdd(meshCounts[GetMesh(i)], 1, rank);
+        meshRanks[i] = rank;
+    }
+}
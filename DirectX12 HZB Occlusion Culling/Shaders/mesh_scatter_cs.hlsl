@@ -0,0 +1,28 @@
+// Last compaction pass: every visible instance goes to its slot within the range of its mesh
+StructuredBuffer<uint> visibilityBuffer : register(t0);  // One bit per instance
+StructuredBuffer<uint> meshIds          : register(t1);
+StructuredBuffer<uint> lodBuffer        : register(t2);  // Two bits per instance
+
+RWStructuredBuffer<uint> meshRanks         : register(u0);
+RWStructuredBuffer<uint> meshOffsets       : register(u1);
+RWStructuredBuffer<uint> matrixIndexBuffer : register(u2);
+
+cbuffer constants : register(b0)
+{
+    uint numInstances;
+    uint numMeshIds;
+};
+
+// The mesh table holds every LOD of every mesh id, LOD major
+uint GetMesh(uint i) { return ((lodBuffer[i / 16] >> (i % 16 * 2)) & 3) * numMeshIds + meshIds[i]; }
+
+[numthreads(256, 1, 1)]
+void main(uint3 dispatchID : SV_DispatchThreadID)
+{
+    uint i = dispatchID.x;
+
+    if (i < numInstances && (visibilityBuffer[i / 32] >> (i % 32)) & 1)
+    {
+        matrixIndexBuffer[meshOffsets[GetMesh(i)] + meshRanks[i]] = i;
+    }
+}
@@ -0,0 +1,38 @@
+// Scatter pass of a single mesh. Every visible instance goes to the offset of its word from decoupledLookbackScan_cs
+// plus the visible bits below it in the word, so the instances keep their order and no atomics are needed. Clears
+// the scan state for the next dispatch, the scan is done with it by now.
+StructuredBuffer<uint> visibilityBuffer : register(t0);  // One bit per instance
+
+RWStructuredBuffer<uint> matrixIndexBuffer : register(u0);
+RWStructuredBuffer<uint> wordOffsets       : register(u1);
+RWStructuredBuffer<uint> partitionState    : register(u2);
+RWStructuredBuffer<uint> partitionCounter  : register(u3);
+
+cbuffer constants : register(b0) { uint numInstances; };
+
+[numthreads(256, 1, 1)]
+void main(uint3 dispatchID : SV_DispatchThreadID)
+{
+    uint i = dispatchID.x;
+
+    // One partition per 256 words, far fewer than threads
+    uint numPartitions = ((numInstances + 31) / 32 + 255) / 256;
+    if (i < numPartitions)
+    {
+        partitionState[i] = 0;
+    }
+    if (i == 0)
+    {
+        partitionCounter[0] = 0;
+    }
+
+    if (i < numInstances)
+    {
+        uint bits = visibilityBuffer[i / 32];
+        uint bit = i % 32;
+        if ((bits >> bit) & 1)
+        {
+            matrixIndexBuffer[wordOffsets[i / 32] + countbits(bits & ((1u << bit) - 1))] = i;
+        }
+    }
+}
@@ -1,5 +1,6 @@
 #include "pch_dx12.hpp"
 #include "commandlist_dx12.hpp"
+#include "transient_resource_pool.hpp"
 
 namespace fs = std::filesystem;
 
@@ -547,7 +548,9 @@ void bee::CommandList::GenerateHzbMips(const std::shared_ptr<DX12Texture>& textu
         D3D12_SRV_DIMENSION_TEXTURE2D;  // Only 2D textures are supported (this was checked in the calling function).
     srvDesc.Texture2D.MipLevels = resourceDesc.MipLevels;
 
-    auto srv = m_Device.CreateShaderResourceView(texture, &srvDesc);
+    // The same texture comes back every frame through the transient pool, so are its views
+    auto& pool = m_Device.GetTransientResourcePool();
+    auto srv = pool.GetShaderResourceView(texture, srvDesc);
 
     for (uint32_t srcMip = 0; srcMip < resourceDesc.MipLevels - 1u;)
     {
@@ -575,7 +578,7 @@ void bee::CommandList::GenerateHzbMips(const std::shared_ptr<DX12Texture>& textu
         uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
         uavDesc.Texture2D.MipSlice = srcMip + 1;
 
-        auto uav = m_Device.CreateUnorderedAccessView(texture, nullptr, &uavDesc);
+        auto uav = pool.GetUnorderedAccessView(texture, uavDesc);
         SetUnorderedAccessView(GenerateMips::OutMip, 0, uav, D3D12_RESOURCE_STATE_UNORDERED_ACCESS, srcMip + 1, 1);
 
         Dispatch(Math::DivideByMultiple(dstWidth, 16), Math::DivideByMultiple(dstHeight, 16));  // CHANGE
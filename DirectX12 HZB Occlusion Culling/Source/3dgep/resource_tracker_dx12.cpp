@@ -223,25 +223,15 @@ void ResourceStateTracker::AddGlobalResourceState(ID3D12Resource* resource, D3D1
     }
 }
 
-// void ResourceStateTracker::RemoveGlobalResourceState( ID3D12Resource* resource, bool immediate )
-//{
-//     if ( resource != nullptr )
-//     {
-//         std::lock_guard<std::mutex> lock( ms_GlobalMutex );
-//         if ( immediate )
-//         {
-//             // Perform immediate removal of the resource in the resource state tracker.
-//              ms_GlobalResourceState.erase( resource );
-//         }
-//         else
-//         {
-//             // Defer the removal until all resources are no longer being referenced.
-//             resource->AddRef();
-//             ms_GarbageResources.push_back( resource );
-//         }
-//     }
-// }
-//
+void ResourceStateTracker::RemoveGlobalResourceState(ID3D12Resource* resource)
+{
+    if (resource != nullptr)
+    {
+        std::lock_guard<std::mutex> lock(ms_GlobalMutex);
+        ms_GlobalResourceState.erase(resource);
+    }
+}
+
 //// Check to see if a resource is unique (only a single strong ref).
 // inline bool IsUnique( ID3D12Resource* res )
 //{
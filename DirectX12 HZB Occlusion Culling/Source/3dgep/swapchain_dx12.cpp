@@ -1,5 +1,6 @@
 #include "pch_dx12.hpp"
 #include "swapchain_dx12.hpp"
+#include "transient_resource_pool.hpp"
 
 //#include <dx12lib/GUI.h>
 
@@ -180,6 +181,7 @@ UINT SwapChain::Present(const std::shared_ptr<DX12Texture>& texture)
     m_CommandQueue.WaitForFenceValue(fenceValue);
 
     m_Device.ReleaseStaleDescriptors();
+    m_Device.GetTransientResourcePool().EndFrame();
 
     return m_CurrentBackBufferIndex;
 }
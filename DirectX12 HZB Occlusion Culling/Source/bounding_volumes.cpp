@@ -1,5 +1,7 @@
 #include "bounding_volumes.hpp"
 
+#include "parallel_for.hpp"
+
 void AABB::Expand(const AABB& other) 
 {
     min.x = std::min(min.x, other.min.x);
@@ -11,105 +13,286 @@ void AABB::Expand(const AABB& other)
     max.z = std::max(max.z, other.max.z);
 }
 
-AABB TransformAABB(const AABB& aabb, const DirectX::XMMATRIX& worldMatrix) 
+float AABB::SurfaceArea() const
+{
+    const float dx = max.x - min.x;
+    const float dy = max.y - min.y;
+    const float dz = max.z - min.z;
+
+    return 2.f * (dx * dy + dy * dz + dz * dx);
+}
+
+DirectX::XMFLOAT3 AABB::Center() const
+{
+    return {(min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f};
+}
+
+// Center through the full matrix, extent through the absolute 3x3 part: every world axis gets the largest reach of
+// the box along it, which is what the 8 transformed corners would give.
+static AABB TransformCenterExtent(DirectX::FXMVECTOR center, DirectX::FXMVECTOR extent, const DirectX::XMMATRIX& worldMatrix)
+{
+    using namespace DirectX;
+
+    const XMVECTOR worldCenter = XMVector3Transform(center, worldMatrix);
+
+    XMVECTOR worldExtent = XMVectorMultiply(XMVectorSplatX(extent), XMVectorAbs(worldMatrix.r[0]));
+    worldExtent = XMVectorMultiplyAdd(XMVectorSplatY(extent), XMVectorAbs(worldMatrix.r[1]), worldExtent);
+    worldExtent = XMVectorMultiplyAdd(XMVectorSplatZ(extent), XMVectorAbs(worldMatrix.r[2]), worldExtent);
+
+    AABB transformedAABB;
+    XMStoreFloat3(&transformedAABB.min, XMVectorSubtract(worldCenter, worldExtent));
+    XMStoreFloat3(&transformedAABB.max, XMVectorAdd(worldCenter, worldExtent));
+    return transformedAABB;
+}
+
+static void GetCenterExtent(const AABB& aabb, DirectX::XMVECTOR& center, DirectX::XMVECTOR& extent)
+{
+    using namespace DirectX;
+
+    const XMVECTOR min = XMLoadFloat3(&aabb.min);
+    const XMVECTOR max = XMLoadFloat3(&aabb.max);
+    center = XMVectorScale(XMVectorAdd(min, max), 0.5f);
+    extent = XMVectorScale(XMVectorSubtract(max, min), 0.5f);
+}
+
+AABB TransformAABB(const AABB& aabb, const DirectX::XMMATRIX& worldMatrix)
 {
     assert((aabb.min.x <= aabb.max.x) && (aabb.min.y <= aabb.max.y) && (aabb.min.z <= aabb.max.z) &&
            "The min should be <= max on all axes");
 
-    DirectX::XMFLOAT3 corners[8] = {
-        {aabb.min.x, aabb.min.y, aabb.min.z},
-        {aabb.max.x, aabb.min.y, aabb.min.z},
-        {aabb.min.x, aabb.max.y, aabb.min.z},
-        {aabb.max.x, aabb.max.y, aabb.min.z},
-        {aabb.min.x, aabb.min.y, aabb.max.z},
-        {aabb.max.x, aabb.min.y, aabb.max.z},
-        {aabb.min.x, aabb.max.y, aabb.max.z},
-        {aabb.max.x, aabb.max.y, aabb.max.z},
-    };
+    DirectX::XMVECTOR center, extent;
+    GetCenterExtent(aabb, center, extent);
+    return TransformCenterExtent(center, extent, worldMatrix);
+}
 
-    AABB transformedAABB;
-    transformedAABB.min = {FLT_MAX, FLT_MAX, FLT_MAX};
-    transformedAABB.max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+void TransformAABBs(const AABB* aabbs, const DirectX::XMMATRIX* worldMatrices, AABB* out, size_t count)
+{
+    assert((count == 0 || (aabbs != nullptr && worldMatrices != nullptr && out != nullptr)) &&
+           "aabbs, worldMatrices and out can't be null.");
 
-    for (int i = 0; i < 8; ++i)
-    {
-        const DirectX::XMVECTOR cornerVec = DirectX::XMVector3Transform(DirectX::XMLoadFloat3(&corners[i]), worldMatrix);
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        DirectX::XMVECTOR center, extent;
+                        GetCenterExtent(aabbs[i], center, extent);
+                        out[i] = TransformCenterExtent(center, extent, worldMatrices[i]);
+                    }
+                });
+}
 
-        DirectX::XMFLOAT3 transformedCorner;
-        DirectX::XMStoreFloat3(&transformedCorner, cornerVec);
+void TransformAABBs(const AABB& aabb, const DirectX::XMMATRIX* worldMatrices, AABB* out, size_t count)
+{
+    assert((aabb.min.x <= aabb.max.x) && (aabb.min.y <= aabb.max.y) && (aabb.min.z <= aabb.max.z) &&
+           "The min should be <= max on all axes");
+    assert((count == 0 || (worldMatrices != nullptr && out != nullptr)) && "worldMatrices and out can't be null.");
 
-        transformedAABB.min.x = std::min(transformedAABB.min.x, transformedCorner.x);
-        transformedAABB.min.y = std::min(transformedAABB.min.y, transformedCorner.y);
-        transformedAABB.min.z = std::min(transformedAABB.min.z, transformedCorner.z);
+    // Center and extent only once
+    DirectX::XMVECTOR center, extent;
+    GetCenterExtent(aabb, center, extent);
 
-        transformedAABB.max.x = std::max(transformedAABB.max.x, transformedCorner.x);
-        transformedAABB.max.y = std::max(transformedAABB.max.y, transformedCorner.y);
-        transformedAABB.max.z = std::max(transformedAABB.max.z, transformedCorner.z);
-    }
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i) out[i] = TransformCenterExtent(center, extent, worldMatrices[i]);
+                });
+}
 
-    return transformedAABB;
+// Binned SAH settings
+static const int numBins = 16;
+static const int maxLeafSize = 4;
+static const float traversalCost = 1.f;
+static const float intersectionCost = 1.f;
+
+struct Bin
+{
+    AABB bounds;
+    int count = 0;
+};
+
+static float GetAxis(const DirectX::XMFLOAT3& v, int axis) { return axis == 0 ? v.x : (axis == 1 ? v.y : v.z); }
+
+static AABB EmptyAABB()
+{
+    AABB aabb;
+    aabb.min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    aabb.max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    return aabb;
 }
 
-std::shared_ptr<BVHNode> BuildBVH(std::vector<IndexedAABB>& objects, int start, int end) 
+static std::shared_ptr<BVHNode> BuildBVHRecursive(std::vector<IndexedAABB>& objects, int start, int end)
 {
     std::shared_ptr<BVHNode> node = std::make_shared<BVHNode>();
+    node->objectIndex = start;
+    node->objectCount = end - start;
 
-    // Make te overarching boudning box
-    IndexedAABB bounds = objects[start];
-    for (int i = start + 1; i < end; ++i)
+    // Make the overarching bounding box, and the box around the centers (used for binning)
+    AABB bounds = objects[start].aabb;
+    AABB centerBounds = EmptyAABB();
+    for (int i = start; i < end; ++i)
     {
-        bounds.aabb.Expand(objects[i].aabb);
-    }
-    node->bounds = bounds.aabb;
+        if (i > start) bounds.Expand(objects[i].aabb);
 
-    int objectCount = end - start;
+        const DirectX::XMFLOAT3 center = objects[i].aabb.Center();
+        centerBounds.Expand({center, center});
+    }
+    node->bounds = bounds;
 
-    // Leaf node
+    const int objectCount = end - start;
     if (objectCount == 1)
     {
-        node->objectIndex = start;
         return node;
     }
 
-    // Check the longest axis
-    DirectX::XMFLOAT3 size = {bounds.aabb.max.x - bounds.aabb.min.x,
-                              bounds.aabb.max.y - bounds.aabb.min.y,
-                              bounds.aabb.max.z - bounds.aabb.min.z};
-    int axis = 0;  // x-axis
-    if (size.y > size.x && size.y > size.z)
-        axis = 1;  // y-axis
-    else if (size.z > size.x)
-        axis = 2;  // z-axis
-
-    // Sort objects based on the center of their AABB along the longest axis
-    auto compare = [axis](const IndexedAABB& a, const IndexedAABB& b)
+    // Bin the objects along all three axes in one pass
+    Bin bins[3][numBins];
+    float axisMin[3];
+    float axisScale[3];
+    for (int axis = 0; axis < 3; ++axis)
     {
-        float centerA = 0.f;
-        float centerB = 0.f;
+        for (Bin& bin : bins[axis]) bin.bounds = EmptyAABB();
+
+        axisMin[axis] = GetAxis(centerBounds.min, axis);
+        const float extent = GetAxis(centerBounds.max, axis) - axisMin[axis];
+        axisScale[axis] = extent > 0.f ? numBins / extent : 0.f;
+    }
 
-        switch (axis)
+    for (int i = start; i < end; ++i)
+    {
+        const DirectX::XMFLOAT3 center = objects[i].aabb.Center();
+        for (int axis = 0; axis < 3; ++axis)
         {
-            case 0:
-                centerA = (a.aabb.min.x + a.aabb.max.x) / 2.0f;
-                centerB = (b.aabb.min.x + b.aabb.max.x) / 2.0f;
-                break;
-            case 1:
-                centerA = (a.aabb.min.y + a.aabb.max.y) / 2.0f;
-                centerB = (b.aabb.min.y + b.aabb.max.y) / 2.0f;
-                break;
-            case 2:
-                centerA = (a.aabb.min.z + a.aabb.max.z) / 2.0f;
-                centerB = (b.aabb.min.z + b.aabb.max.z) / 2.0f;
-                break;
+            const int binIndex =
+                std::min(numBins - 1, static_cast<int>((GetAxis(center, axis) - axisMin[axis]) * axisScale[axis]));
+            bins[axis][binIndex].count++;
+            bins[axis][binIndex].bounds.Expand(objects[i].aabb);
         }
-        return centerA < centerB;
-    };
-    std::sort(objects.begin() + start, objects.begin() + end, compare);
+    }
+
+    // Find the cheapest split plane over all axes
+    const float leafCost = intersectionCost * objectCount;
+    float bestCost = FLT_MAX;
+    int bestAxis = -1;
+    int bestSplit = -1;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (axisScale[axis] == 0.f) continue;
+
+        // Sweep from the right, storing area * count of everything right of each plane
+        float rightCost[numBins - 1];
+        AABB rightBounds = EmptyAABB();
+        int rightCount = 0;
+        for (int i = numBins - 1; i > 0; --i)
+        {
+            rightBounds.Expand(bins[axis][i].bounds);
+            rightCount += bins[axis][i].count;
+            rightCost[i - 1] = rightCount > 0 ? rightBounds.SurfaceArea() * rightCount : 0.f;
+        }
+
+        // Sweep from the left and evaluate every plane
+        AABB leftBounds = EmptyAABB();
+        int leftCount = 0;
+        for (int i = 0; i < numBins - 1; ++i)
+        {
+            leftBounds.Expand(bins[axis][i].bounds);
+            leftCount += bins[axis][i].count;
+            if (leftCount == 0 || leftCount == objectCount) continue;
+
+            const float cost = leftBounds.SurfaceArea() * leftCount + rightCost[i];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = i;
+            }
+        }
+    }
+
+    const float splitCost = traversalCost + intersectionCost * bestCost / bounds.SurfaceArea();
+    if (objectCount <= maxLeafSize && (bestAxis == -1 || splitCost >= leafCost))
+    {
+        return node;
+    }
 
     int mid = start + objectCount / 2;
+    if (bestAxis != -1)
+    {
+        const float min = axisMin[bestAxis];
+        const float scale = axisScale[bestAxis];
 
-    node->left = BuildBVH(objects, start, mid);
-    node->right = BuildBVH(objects, mid, end);
+        auto isLeft = [=](const IndexedAABB& object)
+        {
+            const float center = GetAxis(object.aabb.Center(), bestAxis);
+            return std::min(numBins - 1, static_cast<int>((center - min) * scale)) <= bestSplit;
+        };
+        mid = static_cast<int>(std::partition(objects.begin() + start, objects.begin() + end, isLeft) - objects.begin());
+    }
+
+    // All centers coincide (or binning degenerated), fall back to splitting the range in half
+    if (mid == start || mid == end)
+    {
+        mid = start + objectCount / 2;
+    }
+
+    node->left = BuildBVHRecursive(objects, start, mid);
+    node->right = BuildBVHRecursive(objects, mid, end);
 
     return node;
 }
+
+std::shared_ptr<BVHNode> BuildBVH(std::vector<IndexedAABB>& objects, int start, int end, BVHStats* stats)
+{
+    assert(start >= 0 && start < end && end <= static_cast<int>(objects.size()) && "Invalid object range");
+
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    std::shared_ptr<BVHNode> root = BuildBVHRecursive(objects, start, end);
+
+    if (stats)
+    {
+        const auto endTime = std::chrono::high_resolution_clock::now();
+
+        *stats = GetBVHStats(root);
+        stats->buildTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
+
+    return root;
+}
+
+static void GatherBVHStats(const BVHNode& node, int depth, double& weightedArea, BVHStats& stats)
+{
+    stats.nodeCount++;
+    stats.maxDepth = std::max(stats.maxDepth, depth);
+
+    if (node.IsLeaf())
+    {
+        weightedArea += node.bounds.SurfaceArea() * intersectionCost * node.objectCount;
+
+        stats.leafCount++;
+        stats.minLeafSize = stats.leafCount == 1 ? node.objectCount : std::min(stats.minLeafSize, node.objectCount);
+        stats.maxLeafSize = std::max(stats.maxLeafSize, node.objectCount);
+        return;
+    }
+
+    weightedArea += node.bounds.SurfaceArea() * traversalCost;
+
+    GatherBVHStats(*node.left, depth + 1, weightedArea, stats);
+    GatherBVHStats(*node.right, depth + 1, weightedArea, stats);
+}
+
+BVHStats GetBVHStats(const std::shared_ptr<BVHNode>& root)
+{
+    assert(root != nullptr && "root can't be null.");
+
+    BVHStats stats;
+    double weightedArea = 0.0;
+    GatherBVHStats(*root, 0, weightedArea, stats);
+
+    const float rootArea = root->bounds.SurfaceArea();
+    stats.sahCost = rootArea > 0.f ? static_cast<float>(weightedArea / rootArea) : 0.f;
+    stats.averageLeafSize = static_cast<float>(root->objectCount) / static_cast<float>(stats.leafCount);
+
+    return stats;
+}
@@ -0,0 +1,312 @@
+#include "compact_instance.hpp"
+
+#include "bounding_volumes.hpp"
+#include "parallel_for.hpp"
+
+#include <emmintrin.h>
+
+using namespace DirectX;
+
+static const uint32_t rotationBits = 20;
+static const uint32_t rotationMask = (1u << rotationBits) - 1;
+static const float rotationScale = static_cast<float>(rotationMask);
+
+// Apart from the largest one, no component of a unit quaternion is outside [-sqrt(1/2), sqrt(1/2)]
+static const float maxSmallComponent = 0.70710678f;
+
+static uint32_t QuantizeComponent(float value)
+{
+    const float normalized = std::clamp(value / maxSmallComponent * 0.5f + 0.5f, 0.f, 1.f);
+    return static_cast<uint32_t>(normalized * rotationScale + 0.5f);
+}
+
+static float DequantizeComponent(uint32_t value)
+{
+    return (static_cast<float>(value) / rotationScale * 2.f - 1.f) * maxSmallComponent;
+}
+
+// Index of the largest component in bits 0-1, then the other three in order, 20 bits each
+static void PackRotation(const float q[4], uint32_t rotation[2])
+{
+    int largest = 0;
+    for (int i = 1; i < 4; i++)
+    {
+        if (std::abs(q[i]) > std::abs(q[largest])) largest = i;
+    }
+
+    // q and -q are the same rotation, so the largest component can always be positive
+    const float sign = q[largest] < 0.f ? -1.f : 1.f;
+
+    uint32_t small[3];
+    for (int i = 0, j = 0; i < 4; i++)
+    {
+        if (i != largest) small[j++] = QuantizeComponent(q[i] * sign);
+    }
+
+    rotation[0] = static_cast<uint32_t>(largest) | (small[0] << 2) | ((small[1] & 0x3FF) << 22);
+    rotation[1] = (small[1] >> 10) | (small[2] << 10);
+}
+
+static void UnpackRotation(const uint32_t rotation[2], float q[4])
+{
+    const int largest = rotation[0] & 3;
+    const float small[3] = {DequantizeComponent((rotation[0] >> 2) & rotationMask),
+                            DequantizeComponent((rotation[0] >> 22) | ((rotation[1] & 0x3FF) << 10)),
+                            DequantizeComponent((rotation[1] >> 10) & rotationMask)};
+
+    const float sumSquares = small[0] * small[0] + small[1] * small[1] + small[2] * small[2];
+    for (int i = 0, j = 0; i < 4; i++)
+    {
+        q[i] = (i == largest) ? std::sqrt(std::max(0.f, 1.f - sumSquares)) : small[j++];
+    }
+}
+
+// r[i][j] maps component j to component i, the transpose of the DirectXMath row vector matrix
+static void QuaternionToRotation(const float q[4], float r[3][3])
+{
+    const float x = q[0], y = q[1], z = q[2], w = q[3];
+
+    r[0][0] = 1.f - 2.f * (y * y + z * z);
+    r[0][1] = 2.f * (x * y - w * z);
+    r[0][2] = 2.f * (x * z + w * y);
+    r[1][0] = 2.f * (x * y + w * z);
+    r[1][1] = 1.f - 2.f * (x * x + z * z);
+    r[1][2] = 2.f * (y * z - w * x);
+    r[2][0] = 2.f * (x * z - w * y);
+    r[2][1] = 2.f * (y * z + w * x);
+    r[2][2] = 1.f - 2.f * (x * x + y * y);
+}
+
+static void RotationToQuaternion(const float r[3][3], float q[4])
+{
+    const float trace = r[0][0] + r[1][1] + r[2][2];
+    if (trace > 0.f)
+    {
+        const float s = std::sqrt(trace + 1.f) * 2.f;
+        q[0] = (r[2][1] - r[1][2]) / s;
+        q[1] = (r[0][2] - r[2][0]) / s;
+        q[2] = (r[1][0] - r[0][1]) / s;
+        q[3] = 0.25f * s;
+    }
+    else if (r[0][0] > r[1][1] && r[0][0] > r[2][2])
+    {
+        const float s = std::sqrt(1.f + r[0][0] - r[1][1] - r[2][2]) * 2.f;
+        q[0] = 0.25f * s;
+        q[1] = (r[0][1] + r[1][0]) / s;
+        q[2] = (r[0][2] + r[2][0]) / s;
+        q[3] = (r[2][1] - r[1][2]) / s;
+    }
+    else if (r[1][1] > r[2][2])
+    {
+        const float s = std::sqrt(1.f + r[1][1] - r[0][0] - r[2][2]) * 2.f;
+        q[0] = (r[0][1] + r[1][0]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (r[1][2] + r[2][1]) / s;
+        q[3] = (r[0][2] - r[2][0]) / s;
+    }
+    else
+    {
+        const float s = std::sqrt(1.f + r[2][2] - r[0][0] - r[1][1]) * 2.f;
+        q[0] = (r[0][2] + r[2][0]) / s;
+        q[1] = (r[1][2] + r[2][1]) / s;
+        q[2] = 0.25f * s;
+        q[3] = (r[1][0] - r[0][1]) / s;
+    }
+
+    const float length = std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    for (int i = 0; i < 4; i++) q[i] /= length;
+}
+
+CompactInstance EncodeInstance(const XMMATRIX& worldMatrix)
+{
+    XMFLOAT4 rows[4];
+    for (int i = 0; i < 4; i++) XMStoreFloat4(&rows[i], worldMatrix.r[i]);
+
+    float axisScale[3];
+    for (int i = 0; i < 3; i++)
+    {
+        axisScale[i] = std::sqrt(rows[i].x * rows[i].x + rows[i].y * rows[i].y + rows[i].z * rows[i].z);
+    }
+
+    CompactInstance instance;
+    instance.position = {rows[3].x, rows[3].y, rows[3].z};
+    instance.scale = (axisScale[0] + axisScale[1] + axisScale[2]) / 3.f;
+
+    assert(instance.scale > 0.f && "Can't encode a zero scale");
+    assert(std::abs(axisScale[0] - instance.scale) <= 1e-3f * instance.scale &&
+           std::abs(axisScale[1] - instance.scale) <= 1e-3f * instance.scale &&
+           std::abs(axisScale[2] - instance.scale) <= 1e-3f * instance.scale && "Compact instances need a uniform scale");
+
+    // Row i of the world matrix is column i of r, times the scale
+    float r[3][3];
+    const float* rowData[3] = {&rows[0].x, &rows[1].x, &rows[2].x};
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++) r[i][j] = rowData[j][i] / instance.scale;
+    }
+
+    float q[4];
+    RotationToQuaternion(r, q);
+    PackRotation(q, instance.rotation);
+
+    return instance;
+}
+
+XMMATRIX DecodeInstance(const CompactInstance& instance)
+{
+    float q[4];
+    UnpackRotation(instance.rotation, q);
+
+    float r[3][3];
+    QuaternionToRotation(q, r);
+
+    const float s = instance.scale;
+    XMMATRIX worldMatrix;
+    worldMatrix.r[0] = XMVectorSet(r[0][0] * s, r[1][0] * s, r[2][0] * s, 0.f);
+    worldMatrix.r[1] = XMVectorSet(r[0][1] * s, r[1][1] * s, r[2][1] * s, 0.f);
+    worldMatrix.r[2] = XMVectorSet(r[0][2] * s, r[1][2] * s, r[2][2] * s, 0.f);
+    worldMatrix.r[3] = XMVectorSet(instance.position.x, instance.position.y, instance.position.z, 1.f);
+    return worldMatrix;
+}
+
+void EncodeInstances(const InstanceData* instances, CompactInstance* outCompact, size_t count)
+{
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i) outCompact[i] = EncodeInstance(instances[i].WorldMatrix);
+                });
+}
+
+static inline __m128 Select(__m128i mask, __m128 a, __m128 b)
+{
+    const __m128 m = _mm_castsi128_ps(mask);
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+}
+
+// Same as UnpackRotation, QuaternionToRotation and DecodeInstance, for four instances in structure of arrays form
+static void DecodeInstances4(const CompactInstance* compact, InstanceData* out)
+{
+    const __m128i word0 = _mm_set_epi32(static_cast<int>(compact[3].rotation[0]),
+                                        static_cast<int>(compact[2].rotation[0]),
+                                        static_cast<int>(compact[1].rotation[0]),
+                                        static_cast<int>(compact[0].rotation[0]));
+    const __m128i word1 = _mm_set_epi32(static_cast<int>(compact[3].rotation[1]),
+                                        static_cast<int>(compact[2].rotation[1]),
+                                        static_cast<int>(compact[1].rotation[1]),
+                                        static_cast<int>(compact[0].rotation[1]));
+
+    const __m128i mask = _mm_set1_epi32(static_cast<int>(rotationMask));
+    const __m128i largest = _mm_and_si128(word0, _mm_set1_epi32(3));
+    const __m128i small0 = _mm_and_si128(_mm_srli_epi32(word0, 2), mask);
+    const __m128i small1 = _mm_or_si128(_mm_srli_epi32(word0, 22), _mm_slli_epi32(_mm_and_si128(word1, _mm_set1_epi32(0x3FF)), 10));
+    const __m128i small2 = _mm_and_si128(_mm_srli_epi32(word1, 10), mask);
+
+    // (value / rotationScale * 2 - 1) * maxSmallComponent as one multiply-add
+    const __m128 dequantizeScale = _mm_set1_ps(2.f / rotationScale * maxSmallComponent);
+    const __m128 dequantizeBias = _mm_set1_ps(-maxSmallComponent);
+    const __m128 a = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(small0), dequantizeScale), dequantizeBias);
+    const __m128 b = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(small1), dequantizeScale), dequantizeBias);
+    const __m128 c = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(small2), dequantizeScale), dequantizeBias);
+
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 sumSquares = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b)), _mm_mul_ps(c, c));
+    const __m128 l = _mm_sqrt_ps(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(one, sumSquares)));
+
+    const __m128i is0 = _mm_cmpeq_epi32(largest, _mm_setzero_si128());
+    const __m128i is1 = _mm_cmpeq_epi32(largest, _mm_set1_epi32(1));
+    const __m128i is2 = _mm_cmpeq_epi32(largest, _mm_set1_epi32(2));
+    const __m128i is3 = _mm_cmpeq_epi32(largest, _mm_set1_epi32(3));
+
+    const __m128 x = Select(is0, l, a);
+    const __m128 y = Select(is0, a, Select(is1, l, b));
+    const __m128 z = Select(is3, c, Select(is2, l, b));
+    const __m128 w = Select(is3, l, c);
+
+    const __m128 two = _mm_set1_ps(2.f);
+    const __m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+    const __m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+    const __m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+    const __m128 scale = _mm_set_ps(compact[3].scale, compact[2].scale, compact[1].scale, compact[0].scale);
+    const __m128 twoScale = _mm_mul_ps(two, scale);
+
+    __m128 r00 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), scale);
+    __m128 r01 = _mm_mul_ps(_mm_sub_ps(xy, wz), twoScale);
+    __m128 r02 = _mm_mul_ps(_mm_add_ps(xz, wy), twoScale);
+    __m128 r10 = _mm_mul_ps(_mm_add_ps(xy, wz), twoScale);
+    __m128 r11 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), scale);
+    __m128 r12 = _mm_mul_ps(_mm_sub_ps(yz, wx), twoScale);
+    __m128 r20 = _mm_mul_ps(_mm_sub_ps(xz, wy), twoScale);
+    __m128 r21 = _mm_mul_ps(_mm_add_ps(yz, wx), twoScale);
+    __m128 r22 = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), scale);
+
+    __m128 px = _mm_set_ps(compact[3].position.x, compact[2].position.x, compact[1].position.x, compact[0].position.x);
+    __m128 py = _mm_set_ps(compact[3].position.y, compact[2].position.y, compact[1].position.y, compact[0].position.y);
+    __m128 pz = _mm_set_ps(compact[3].position.z, compact[2].position.z, compact[1].position.z, compact[0].position.z);
+
+    // Matrix row i is column i of r, so transposing (r0i, r1i, r2i, 0) gives row i of all four instances
+    __m128 zero0 = _mm_setzero_ps(), zero1 = _mm_setzero_ps(), zero2 = _mm_setzero_ps(), one3 = one;
+    _MM_TRANSPOSE4_PS(r00, r10, r20, zero0);
+    _MM_TRANSPOSE4_PS(r01, r11, r21, zero1);
+    _MM_TRANSPOSE4_PS(r02, r12, r22, zero2);
+    _MM_TRANSPOSE4_PS(px, py, pz, one3);
+
+    const __m128 rows0[4] = {r00, r10, r20, zero0};
+    const __m128 rows1[4] = {r01, r11, r21, zero1};
+    const __m128 rows2[4] = {r02, r12, r22, zero2};
+    const __m128 rows3[4] = {px, py, pz, one3};
+    for (int k = 0; k < 4; k++)
+    {
+        out[k].WorldMatrix.r[0] = rows0[k];
+        out[k].WorldMatrix.r[1] = rows1[k];
+        out[k].WorldMatrix.r[2] = rows2[k];
+        out[k].WorldMatrix.r[3] = rows3[k];
+    }
+}
+
+void DecodeInstances(const CompactInstance* compact, InstanceData* outInstances, size_t count)
+{
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    size_t i = begin;
+                    for (; i + 4 <= end; i += 4) DecodeInstances4(compact + i, outInstances + i);
+                    for (; i < end; ++i) outInstances[i].WorldMatrix = DecodeInstance(compact[i]);
+                });
+}
+
+AABB TransformAABB(const AABB& aabb, const CompactInstance& instance)
+{
+    float q[4];
+    UnpackRotation(instance.rotation, q);
+
+    float r[3][3];
+    QuaternionToRotation(q, r);
+
+    const float center[3] = {(aabb.min.x + aabb.max.x) * 0.5f, (aabb.min.y + aabb.max.y) * 0.5f, (aabb.min.z + aabb.max.z) * 0.5f};
+    const float extent[3] = {(aabb.max.x - aabb.min.x) * 0.5f, (aabb.max.y - aabb.min.y) * 0.5f, (aabb.max.z - aabb.min.z) * 0.5f};
+    const float position[3] = {instance.position.x, instance.position.y, instance.position.z};
+
+    // Rotated center, and the extent along each world axis from the absolute rotation
+    float worldMin[3], worldMax[3];
+    for (int i = 0; i < 3; i++)
+    {
+        float c = 0.f, e = 0.f;
+        for (int j = 0; j < 3; j++)
+        {
+            c += r[i][j] * center[j];
+            e += std::abs(r[i][j]) * extent[j];
+        }
+
+        c = position[i] + c * instance.scale;
+        e *= instance.scale;
+        worldMin[i] = c - e;
+        worldMax[i] = c + e;
+    }
+
+    AABB result;
+    result.min = {worldMin[0], worldMin[1], worldMin[2]};
+    result.max = {worldMax[0], worldMax[1], worldMax[2]};
+    return result;
+}
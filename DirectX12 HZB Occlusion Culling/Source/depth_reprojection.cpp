@@ -0,0 +1,223 @@
+#include "depth_reprojection.hpp"
+
+#include "parallel_for.hpp"
+
+#include <chrono>
+#include <cstring>
+
+// Closer to the eye plane than this and the projection can't be trusted
+static const float minClipW = 1e-5f;
+
+static const float farDepth = 1.f;
+
+// What GetSplatDepth returns for texels nothing landed on, and outside the screen
+static const float holeDepth = -1.f;
+
+static uint32_t FloatToBits(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static float BitsToFloat(uint32_t bits)
+{
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void AtomicMax(std::atomic<uint32_t>& target, uint32_t value)
+{
+    uint32_t current = target.load(std::memory_order_relaxed);
+    while (value > current && !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+void DepthReprojector::Resize(int width, int height)
+{
+    if (width == m_width && height == m_height) return;
+
+    m_width = width;
+    m_height = height;
+
+    const size_t numTexels = static_cast<size_t>(width) * height;
+    m_splat.reset(new std::atomic<uint32_t>[numTexels]);
+    m_depth.resize(numTexels);
+    m_scratch.resize(numTexels);
+}
+
+float DepthReprojector::GetSplatDepth(int x, int y) const
+{
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height) return holeDepth;
+
+    const uint32_t bits = m_splat[static_cast<size_t>(y) * m_width + x].load(std::memory_order_relaxed);
+    return bits == 0 ? holeDepth : BitsToFloat(bits);
+}
+
+DepthReprojectionStats DepthReprojector::Reproject(const float* previousDepth,
+                                                   int width,
+                                                   int height,
+                                                   int rowPitch,
+                                                   const XMMATRIX& previousVP,
+                                                   const XMMATRIX& currentVP)
+{
+    assert(previousDepth != nullptr && width > 0 && height > 0 && "Need a depth buffer");
+
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    if (rowPitch == 0) rowPitch = width;
+    Resize(width, height);
+
+    DepthReprojectionStats stats;
+    stats.numSourcePixels = width * height;
+
+    const size_t numTexels = static_cast<size_t>(width) * height;
+    ParallelFor(numTexels,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i) m_splat[i].store(0, std::memory_order_relaxed);
+                });
+
+    // Previous clip space to world space to current clip space in one matrix
+    const XMMATRIX reprojection = XMMatrixMultiply(XMMatrixInverse(nullptr, previousVP), currentVP);
+
+    std::atomic<int> numReprojected{0};
+    ParallelFor(
+        static_cast<size_t>(height),
+        [&](size_t beginRow, size_t endRow)
+        {
+            int count = 0;
+            for (size_t y = beginRow; y < endRow; ++y)
+            {
+                const float* row = previousDepth + y * rowPitch;
+                const float ndcY = 1.f - (static_cast<float>(y) + 0.5f) / height * 2.f;
+
+                for (int x = 0; x < width; ++x)
+                {
+                    // A depth of 0 can't be told apart from an empty texel
+                    const float depth = std::min(row[x], farDepth);
+                    if (!(depth > 0.f)) continue;
+
+                    const float ndcX = (static_cast<float>(x) + 0.5f) / width * 2.f - 1.f;
+
+                    XMFLOAT4 clip;
+                    XMStoreFloat4(&clip, XMVector4Transform(XMVectorSet(ndcX, ndcY, depth, 1.f), reprojection));
+                    if (clip.w <= minClipW) continue;
+
+                    // Far pixels land as far as well, so silhouettes against the sky still take the sky in the 3x3 max
+                    const float z = depth == farDepth ? farDepth : std::min(clip.z / clip.w, farDepth);
+                    if (!(z > 0.f)) continue;
+
+                    const float targetX = (clip.x / clip.w + 1.f) * 0.5f * width;
+                    const float targetY = (1.f - clip.y / clip.w) * 0.5f * height;
+                    if (!(targetX >= 0.f && targetX < width && targetY >= 0.f && targetY < height)) continue;
+
+                    const size_t target = static_cast<size_t>(targetY) * width + static_cast<size_t>(targetX);
+                    AtomicMax(m_splat[target], FloatToBits(z));
+                    count++;
+                }
+            }
+            numReprojected += count;
+        },
+        8);
+    stats.numReprojected = numReprojected;
+
+    // Cracks, holes one texel wide with depth on both sides, take the farther side. Splats spread out where the
+    // camera moves closer, and on a plane NDC depth is linear in screen space, so the surface in between is no
+    // farther. Where a row and a column of cracks cross only the diagonal neighbours have depth. Every other hole
+    // is a disocclusion and goes to far.
+    std::atomic<int> numHoles{0};
+    ParallelFor(
+        static_cast<size_t>(height),
+        [&](size_t beginRow, size_t endRow)
+        {
+            int count = 0;
+            for (size_t y = beginRow; y < endRow; ++y)
+            {
+                float* row = m_scratch.data() + y * width;
+                for (int x = 0; x < width; ++x)
+                {
+                    const float depth = GetSplatDepth(x, static_cast<int>(y));
+                    if (depth != holeDepth)
+                    {
+                        row[x] = depth;
+                        continue;
+                    }
+
+                    const float left = GetSplatDepth(x - 1, static_cast<int>(y));
+                    const float right = GetSplatDepth(x + 1, static_cast<int>(y));
+                    const float above = GetSplatDepth(x, static_cast<int>(y) - 1);
+                    const float below = GetSplatDepth(x, static_cast<int>(y) + 1);
+
+                    const float aboveLeft = GetSplatDepth(x - 1, static_cast<int>(y) - 1);
+                    const float belowRight = GetSplatDepth(x + 1, static_cast<int>(y) + 1);
+                    const float aboveRight = GetSplatDepth(x + 1, static_cast<int>(y) - 1);
+                    const float belowLeft = GetSplatDepth(x - 1, static_cast<int>(y) + 1);
+
+                    if (left != holeDepth && right != holeDepth) row[x] = std::max(left, right);
+                    else if (above != holeDepth && below != holeDepth) row[x] = std::max(above, below);
+                    else if (aboveLeft != holeDepth && belowRight != holeDepth) row[x] = std::max(aboveLeft, belowRight);
+                    else if (aboveRight != holeDepth && belowLeft != holeDepth) row[x] = std::max(aboveRight, belowLeft);
+                    else
+                    {
+                        row[x] = farDepth;
+                        count++;
+                    }
+                }
+            }
+            numHoles += count;
+        },
+        8);
+    stats.numHoles = numHoles;
+
+    // The max over 3x3 texels, so sub-pixel shifts at silhouettes err towards far. One direction at a time, the
+    // horizontal pass goes from the scratch buffer to m_depth, the vertical one works on m_depth column by column.
+    ParallelFor(
+        static_cast<size_t>(height),
+        [&](size_t beginRow, size_t endRow)
+        {
+            for (size_t y = beginRow; y < endRow; ++y)
+            {
+                const float* source = m_scratch.data() + y * width;
+                float* row = m_depth.data() + y * width;
+                for (int x = 0; x < width; ++x)
+                {
+                    row[x] = std::max(std::max(source[std::max(x - 1, 0)], source[x]), source[std::min(x + 1, width - 1)]);
+                }
+            }
+        },
+        8);
+
+    // Keeps the unfiltered rows above and at y, the row at y is overwritten before the one below reads it
+    ParallelFor(
+        static_cast<size_t>(width),
+        [&](size_t beginColumn, size_t endColumn)
+        {
+            const size_t numColumns = endColumn - beginColumn;
+            std::vector<float> above(m_depth.begin() + beginColumn, m_depth.begin() + endColumn);
+            std::vector<float> current = above;
+
+            for (int y = 0; y < height; ++y)
+            {
+                float* row = m_depth.data() + static_cast<size_t>(y) * width + beginColumn;
+                const float* below = y + 1 < height ? row + width : row;
+
+                for (size_t x = 0; x < numColumns; ++x)
+                {
+                    const float center = current[x];
+                    const float next = below[x];
+                    row[x] = std::max(std::max(above[x], center), next);
+
+                    above[x] = center;
+                    current[x] = next;
+                }
+            }
+        },
+        64);
+
+    const auto endTime = std::chrono::high_resolution_clock::now();
+    stats.timeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    return stats;
+}
@@ -24,6 +24,7 @@
 
 #include "pch_dx12.hpp"
 #include "device_dx12.hpp"
+#include "transient_resource_pool.hpp"
 
 #if defined(_DEBUG)
 #include "dxgidebug.h"
@@ -31,6 +32,38 @@
 
 using namespace bee;
 
+// Backs the transient pool with committed resources and the fences of the command queues
+class DeviceTransientAllocator : public TransientAllocator
+{
+public:
+    explicit DeviceTransientAllocator(Device& device) : m_device(device) {}
+
+    std::shared_ptr<DX12Texture> CreateTexture(const D3D12_RESOURCE_DESC& desc) override
+    {
+        return m_device.CreateTexture(desc);
+    }
+
+    std::shared_ptr<ShaderResourceView> CreateShaderResourceView(const std::shared_ptr<DX12Texture>& texture,
+                                                                 const D3D12_SHADER_RESOURCE_VIEW_DESC& desc) override
+    {
+        return m_device.CreateShaderResourceView(texture, &desc);
+    }
+
+    std::shared_ptr<UnorderedAccessView> CreateUnorderedAccessView(const std::shared_ptr<DX12Texture>& texture,
+                                                                   const D3D12_UNORDERED_ACCESS_VIEW_DESC& desc) override
+    {
+        return m_device.CreateUnorderedAccessView(texture, nullptr, &desc);
+    }
+
+    bool IsFenceComplete(D3D12_COMMAND_LIST_TYPE queue, uint64_t fenceValue) override
+    {
+        return m_device.GetCommandQueue(queue).IsFenceComplete(fenceValue);
+    }
+
+private:
+    Device& m_device;
+};
+
 #pragma region Class adapters for std::make_shared
 
 class MakeUnorderedAccessView : public UnorderedAccessView
@@ -321,6 +354,8 @@ Device::Device(std::shared_ptr<Adapter> adapter) : m_Adapter(adapter)
             std::make_unique<MakeDescriptorAllocator>(*this, static_cast<D3D12_DESCRIPTOR_HEAP_TYPE>(i));
     }
 
+    m_TransientResourcePool = std::make_unique<TransientResourcePool>(std::make_unique<DeviceTransientAllocator>(*this));
+
     // Check features.
     {
         D3D12_FEATURE_DATA_ROOT_SIGNATURE featureData;
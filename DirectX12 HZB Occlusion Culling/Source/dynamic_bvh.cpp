@@ -0,0 +1,351 @@
+#include "dynamic_bvh.hpp"
+
+#include "lbvh.hpp"
+#include "parallel_for.hpp"
+
+// Same cost model as the builders, used to keep the SAH cost up to date while refitting
+static const float traversalCost = 1.f;
+static const float intersectionCost = 1.f;
+
+static double GetWeightedArea(const BVHNode& node)
+{
+    const float weight = node.IsLeaf() ? intersectionCost * node.objectCount : traversalCost;
+    return static_cast<double>(node.bounds.SurfaceArea()) * weight;
+}
+
+DynamicBVH::~DynamicBVH()
+{
+    // Don't leave a background build running on a destroyed tree
+    if (m_rebuild.valid()) m_rebuild.wait();
+}
+
+std::unique_ptr<DynamicBVH::Hierarchy> DynamicBVH::MakeHierarchy(std::vector<IndexedAABB> objects)
+{
+    std::unique_ptr<Hierarchy> hierarchy = std::make_unique<Hierarchy>();
+    hierarchy->objects = std::move(objects);
+
+    BVHStats stats;
+    hierarchy->root = BuildLBVH(hierarchy->objects, LBVHSettings(), &stats);
+    hierarchy->buildSahCost = stats.sahCost;
+    hierarchy->weightedArea = static_cast<double>(stats.sahCost) * hierarchy->root->bounds.SurfaceArea();
+
+    LinkHierarchy(*hierarchy, stats.nodeCount);
+    return hierarchy;
+}
+
+// Fills in everything the refit needs from the objects and the tree
+void DynamicBVH::LinkHierarchy(Hierarchy& hierarchy, size_t nodeCount)
+{
+    const int numObjects = static_cast<int>(hierarchy.objects.size());
+    hierarchy.objectPosition.resize(numObjects);
+    hierarchy.objectLeaf.resize(numObjects);
+    for (int i = 0; i < numObjects; ++i)
+    {
+        const int instance = hierarchy.objects[i].index;
+        assert(instance >= 0 && instance < numObjects && "Instance indices should be in [0, number of objects)");
+        hierarchy.objectPosition[instance] = i;
+    }
+
+    // Flatten the links, the node vector doubles as the breadth-first queue. Flatten relies on this order.
+    hierarchy.nodes.reserve(nodeCount);
+    hierarchy.parent.reserve(nodeCount);
+    hierarchy.depth.reserve(nodeCount);
+
+    hierarchy.nodes.push_back(hierarchy.root.get());
+    hierarchy.parent.push_back(-1);
+    hierarchy.depth.push_back(0);
+    hierarchy.maxDepth = 0;
+
+    for (size_t i = 0; i < hierarchy.nodes.size(); ++i)
+    {
+        const BVHNode* node = hierarchy.nodes[i];
+        hierarchy.maxDepth = std::max(hierarchy.maxDepth, hierarchy.depth[i]);
+
+        if (node->IsLeaf())
+        {
+            for (int j = node->objectIndex; j < node->objectIndex + node->objectCount; ++j)
+                hierarchy.objectLeaf[j] = static_cast<int>(i);
+            continue;
+        }
+
+        for (BVHNode* child : {node->left.get(), node->right.get()})
+        {
+            hierarchy.nodes.push_back(child);
+            hierarchy.parent.push_back(static_cast<int>(i));
+            hierarchy.depth.push_back(hierarchy.depth[i] + 1);
+        }
+    }
+}
+
+void DynamicBVH::SetHierarchy(std::unique_ptr<Hierarchy> hierarchy, const AABB& meshBounds)
+{
+    if (m_rebuild.valid()) m_rebuild.wait();
+    m_rebuild = {};
+    m_movedDuringRebuild.clear();
+
+    m_meshBounds = meshBounds;
+    m_hierarchy = std::move(hierarchy);
+
+    m_refitStamp.assign(m_hierarchy->nodes.size(), 0);
+    m_refitCounter = 0;
+}
+
+void DynamicBVH::Build(std::vector<IndexedAABB> objects, const AABB& meshBounds)
+{
+    assert(!objects.empty() && "Can't build a BVH without objects");
+
+    SetHierarchy(MakeHierarchy(std::move(objects)), meshBounds);
+}
+
+void DynamicBVH::Flatten(std::vector<FlatBVHNode>& nodes, std::vector<int>& objectInstances) const
+{
+    assert(IsBuilt() && "Build the BVH before flattening it");
+
+    const Hierarchy& hierarchy = *m_hierarchy;
+
+    // Already breadth-first with the children pushed together, only the child indices have to be counted
+    nodes.resize(hierarchy.nodes.size());
+    int nextChild = 1;
+    for (size_t i = 0; i < hierarchy.nodes.size(); ++i)
+    {
+        const BVHNode& node = *hierarchy.nodes[i];
+        nodes[i] = {node.bounds, node.IsLeaf() ? -1 : nextChild, node.objectIndex, node.objectCount};
+        if (!node.IsLeaf()) nextChild += 2;
+    }
+
+    objectInstances.resize(hierarchy.objects.size());
+    for (size_t i = 0; i < hierarchy.objects.size(); ++i) objectInstances[i] = hierarchy.objects[i].index;
+}
+
+bool DynamicBVH::IsValidFlatTree(const FlatBVHNode* nodes, size_t numNodes, const int* objectInstances, size_t numInstances)
+{
+    if (numNodes == 0 || numInstances == 0) return false;
+
+    // Children come in the order their parents do, so every interior node has to point at the next free pair
+    size_t nextChild = 1;
+    std::vector<bool> covered(numInstances, false);
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        const FlatBVHNode& node = nodes[i];
+        if (node.objectIndex < 0 || node.objectCount <= 0 || static_cast<size_t>(node.objectIndex) > numInstances ||
+            static_cast<size_t>(node.objectCount) > numInstances - node.objectIndex)
+        {
+            return false;
+        }
+
+        if (node.firstChild != -1)
+        {
+            if (static_cast<size_t>(node.firstChild) != nextChild || nextChild + 2 > numNodes) return false;
+            nextChild += 2;
+            continue;
+        }
+
+        // The leaves cover every object position once
+        for (int j = node.objectIndex; j < node.objectIndex + node.objectCount; ++j)
+        {
+            if (covered[j]) return false;
+            covered[j] = true;
+        }
+    }
+    if (nextChild != numNodes || std::find(covered.begin(), covered.end(), false) != covered.end()) return false;
+
+    // And every instance is at exactly one position
+    std::vector<bool> placed(numInstances, false);
+    for (size_t i = 0; i < numInstances; ++i)
+    {
+        const int instance = objectInstances[i];
+        if (instance < 0 || static_cast<size_t>(instance) >= numInstances || placed[instance]) return false;
+        placed[instance] = true;
+    }
+
+    return true;
+}
+
+bool DynamicBVH::Restore(const FlatBVHNode* nodes,
+                         size_t numNodes,
+                         const int* objectInstances,
+                         const AABB* bounds,
+                         size_t numInstances,
+                         const AABB& meshBounds)
+{
+    assert(nodes && objectInstances && bounds && "Restore needs the nodes, the object order and the bounds");
+
+    if (!IsValidFlatTree(nodes, numNodes, objectInstances, numInstances)) return false;
+
+    std::unique_ptr<Hierarchy> hierarchy = std::make_unique<Hierarchy>();
+    hierarchy->objects.reserve(numInstances);
+    for (size_t i = 0; i < numInstances; ++i) hierarchy->objects.emplace_back(bounds[objectInstances[i]], objectInstances[i]);
+
+    // One allocation for the whole tree, owned by the root. The child links alias an empty pointer so they don't own
+    // anything, sharing the block would make every node keep itself alive.
+    std::shared_ptr<BVHNode[]> block(new BVHNode[numNodes]);
+    ParallelFor(numNodes,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        BVHNode& node = block[i];
+                        node.bounds = nodes[i].bounds;
+                        node.objectIndex = nodes[i].objectIndex;
+                        node.objectCount = nodes[i].objectCount;
+
+                        if (nodes[i].firstChild == -1) continue;
+                        node.left = std::shared_ptr<BVHNode>(std::shared_ptr<BVHNode>(), &block[nodes[i].firstChild]);
+                        node.right = std::shared_ptr<BVHNode>(std::shared_ptr<BVHNode>(), &block[nodes[i].firstChild + 1]);
+                    }
+                });
+    hierarchy->root = std::shared_ptr<BVHNode>(block, &block[0]);
+
+    LinkHierarchy(*hierarchy, numNodes);
+
+    // The cost the tree had when it was built, same as after Build
+    hierarchy->weightedArea = 0.0;
+    for (const BVHNode* node : hierarchy->nodes) hierarchy->weightedArea += GetWeightedArea(*node);
+    const float rootArea = hierarchy->root->bounds.SurfaceArea();
+    hierarchy->buildSahCost = rootArea > 0.f ? static_cast<float>(hierarchy->weightedArea / rootArea) : 0.f;
+
+    SetHierarchy(std::move(hierarchy), meshBounds);
+    return true;
+}
+
+void DynamicBVH::Refit(const std::vector<int>& changedInstances, const std::vector<AABB>& bounds)
+{
+    assert(IsBuilt() && "Build the BVH before refitting it");
+    assert(bounds.size() == changedInstances.size() && "Every changed instance needs its new bounds");
+
+    if (m_rebuild.valid() && m_rebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+        FinishRebuild();
+    }
+
+    if (changedInstances.empty()) return;
+
+    // The background build works on a snapshot, these need to be moved again once it's swapped in
+    if (m_rebuild.valid())
+    {
+        m_movedDuringRebuild.insert(m_movedDuringRebuild.end(), changedInstances.begin(), changedInstances.end());
+    }
+
+    std::vector<int> positions(changedInstances.size());
+    for (size_t i = 0; i < changedInstances.size(); ++i)
+    {
+        positions[i] = m_hierarchy->objectPosition[changedInstances[i]];
+        m_hierarchy->objects[positions[i]].aabb = bounds[i];
+    }
+
+    RefitPositions(positions);
+
+    if (!m_rebuild.valid() && GetSAHCost() > m_hierarchy->buildSahCost * m_rebuildThreshold)
+    {
+        StartRebuild();
+    }
+}
+
+void DynamicBVH::Refit(const std::vector<int>& changedInstances, const std::vector<InstanceData>& instanceData)
+{
+    // Gathered, so the moved instances go through the batch transform
+    std::vector<DirectX::XMMATRIX> worldMatrices(changedInstances.size());
+    for (size_t i = 0; i < changedInstances.size(); ++i) worldMatrices[i] = instanceData[changedInstances[i]].WorldMatrix;
+
+    std::vector<AABB> bounds(changedInstances.size());
+    TransformAABBs(m_meshBounds, worldMatrices.data(), bounds.data(), bounds.size());
+
+    Refit(changedInstances, bounds);
+}
+
+void DynamicBVH::RefitPositions(const std::vector<int>& positions)
+{
+    Hierarchy& hierarchy = *m_hierarchy;
+
+    // Mark the leaves and all their ancestors once, sorted into levels
+    m_refitCounter++;
+    std::vector<std::vector<int>> levels(hierarchy.maxDepth + 1);
+    for (int position : positions)
+    {
+        for (int node = hierarchy.objectLeaf[position]; node != -1 && m_refitStamp[node] != m_refitCounter;
+             node = hierarchy.parent[node])
+        {
+            m_refitStamp[node] = m_refitCounter;
+            levels[hierarchy.depth[node]].push_back(node);
+        }
+    }
+
+    // Deepest level first, every node on a level can be refit independently
+    for (int depth = hierarchy.maxDepth; depth >= 0; --depth)
+    {
+        const std::vector<int>& level = levels[depth];
+        std::vector<double> areaDelta(level.size());
+
+        ParallelFor(
+            level.size(),
+            [&](size_t begin, size_t end)
+            {
+                for (size_t i = begin; i < end; ++i)
+                {
+                    BVHNode& node = *hierarchy.nodes[level[i]];
+                    const double oldArea = GetWeightedArea(node);
+
+                    if (node.IsLeaf())
+                    {
+                        node.bounds = hierarchy.objects[node.objectIndex].aabb;
+                        for (int j = node.objectIndex + 1; j < node.objectIndex + node.objectCount; ++j)
+                            node.bounds.Expand(hierarchy.objects[j].aabb);
+                    }
+                    else
+                    {
+                        node.bounds = node.left->bounds;
+                        node.bounds.Expand(node.right->bounds);
+                    }
+
+                    areaDelta[i] = GetWeightedArea(node) - oldArea;
+                }
+            },
+            256);
+
+        for (double delta : areaDelta) hierarchy.weightedArea += delta;
+    }
+}
+
+float DynamicBVH::GetSAHCost() const
+{
+    const float rootArea = m_hierarchy->root->bounds.SurfaceArea();
+    return rootArea > 0.f ? static_cast<float>(m_hierarchy->weightedArea / rootArea) : 0.f;
+}
+
+void DynamicBVH::StartRebuild()
+{
+    m_movedDuringRebuild.clear();
+    m_rebuild = std::async(std::launch::async, &DynamicBVH::MakeHierarchy, m_hierarchy->objects);
+}
+
+void DynamicBVH::FinishRebuild()
+{
+    std::unique_ptr<Hierarchy> hierarchy = m_rebuild.get();
+
+    // Carry over the bounds of everything that moved after the snapshot was taken
+    std::vector<int> positions;
+    positions.reserve(m_movedDuringRebuild.size());
+    for (int instance : m_movedDuringRebuild)
+    {
+        const int position = hierarchy->objectPosition[instance];
+        hierarchy->objects[position].aabb = GetInstanceBounds(instance);
+        positions.push_back(position);
+    }
+    m_movedDuringRebuild.clear();
+
+    m_hierarchy = std::move(hierarchy);
+    m_refitStamp.assign(m_hierarchy->nodes.size(), 0);
+    m_refitCounter = 0;
+
+    RefitPositions(positions);
+}
+
+void DynamicBVH::FrustumIntersect(std::vector<int>& instances, FrustumPlanes& frustum)
+{
+    assert(IsBuilt() && "Build the BVH before intersecting it");
+
+    const size_t first = instances.size();
+    FrustumBVHIntersect(instances, m_hierarchy->root, frustum);
+
+    for (size_t i = first; i < instances.size(); ++i) instances[i] = m_hierarchy->objects[instances[i]].index;
+}
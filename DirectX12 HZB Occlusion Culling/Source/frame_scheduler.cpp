@@ -0,0 +1,109 @@
+#include "frame_scheduler.hpp"
+
+FrameScheduler::FrameScheduler(int numFramesInFlight)
+{
+    assert(numFramesInFlight > 0 && "Need at least one frame in flight");
+    m_fenceValues.resize(numFramesInFlight, 0);
+}
+
+int FrameScheduler::BeginFrame(FrameFence& fence)
+{
+    assert(!m_recording && "BeginFrame called twice without EndFrame");
+
+    const uint64_t fenceValue = m_fenceValues[m_frameIndex];
+    if (fenceValue != 0 && !fence.IsFenceComplete(fenceValue))
+    {
+        fence.WaitForFenceValue(fenceValue);
+        m_stats.numCpuWaits++;
+    }
+
+    m_recording = true;
+    return m_frameIndex;
+}
+
+void FrameScheduler::EndFrame(FrameFence& fence)
+{
+    assert(m_recording && "EndFrame called without BeginFrame");
+
+    m_fenceValues[m_frameIndex] = fence.Signal();
+    m_frameIndex = (m_frameIndex + 1) % GetNumFramesInFlight();
+    m_recording = false;
+    m_stats.numFrames++;
+}
+
+void FrameScheduler::WaitForIdle(FrameFence& fence)
+{
+    assert(!m_recording && "Can't wait for idle while recording a frame");
+
+    for (uint64_t& fenceValue : m_fenceValues)
+    {
+        if (fenceValue != 0) fence.WaitForFenceValue(fenceValue);
+        fenceValue = 0;
+    }
+}
+
+int FrameScheduler::GetPreviousFrameIndex() const
+{
+    // While recording, the frame before this one. Otherwise the last one that ended.
+    const int numFrames = GetNumFramesInFlight();
+    return (m_frameIndex + numFrames - 1) % numFrames;
+}
+
+uint64_t CpuFenceEmulator::Signal()
+{
+    m_pending.push_back({++m_fenceValue, std::move(m_waits)});
+    m_waits.clear();
+    return m_fenceValue;
+}
+
+void CpuFenceEmulator::WaitForFenceValue(uint64_t fenceValue)
+{
+    assert(fenceValue <= m_fenceValue && "Waiting for a value that was never signalled");
+
+    if (IsFenceComplete(fenceValue)) return;
+
+    m_numCpuWaits++;
+    RunUntil(fenceValue);
+}
+
+void CpuFenceEmulator::Wait(CpuFenceEmulator& other)
+{
+    assert(&other != this && "A queue can't wait on itself");
+    m_waits.emplace_back(&other, other.m_fenceValue);
+}
+
+int CpuFenceEmulator::Step(int numSignals)
+{
+    int numCompleted = 0;
+    while (numCompleted < numSignals && !m_pending.empty() && CanComplete(m_pending.front()))
+    {
+        m_completedValue = m_pending.front().value;
+        m_pending.erase(m_pending.begin());
+        numCompleted++;
+    }
+
+    return numCompleted;
+}
+
+bool CpuFenceEmulator::CanComplete(const PendingSignal& signal) const
+{
+    for (auto& [queue, fenceValue] : signal.waits)
+    {
+        if (!queue->IsFenceComplete(fenceValue)) return false;
+    }
+
+    return true;
+}
+
+void CpuFenceEmulator::RunUntil(uint64_t fenceValue)
+{
+    while (m_completedValue < fenceValue)
+    {
+        // The other queues only ever wait on signals that already exist, so this can't go around in circles
+        for (auto& [queue, waitValue] : m_pending.front().waits) queue->RunUntil(waitValue);
+
+        const int numCompleted = Step();
+        assert(numCompleted == 1 && "Emulated GPU made no progress");
+        (void)numCompleted;
+    }
+}
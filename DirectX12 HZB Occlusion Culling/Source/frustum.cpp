@@ -1,5 +1,9 @@
 #include "frustum.hpp"
 
+#include "parallel_for.hpp"
+
+#include <numeric>
+
 void NormalizePlane(Plane& plane) 
 {
     float mag;
@@ -114,34 +118,79 @@ IntersectionType FrustumAABBIntersect(AABB& B, Plane* planes)
 
 void AddAllChildren(std::vector<int>& array, std::shared_ptr<BVHNode>& node) 
 {
-    if (node->objectIndex != -1)
+    // The objects below a node are stored contiguously, so there is no need to walk down to the leaves
+    const size_t offset = array.size();
+    array.resize(offset + node->objectCount);
+    std::iota(array.begin() + offset, array.end(), node->objectIndex);
+}
+
+static const unsigned int allPlanes = 0x3f;
+
+// Tests the planes in planeMask, clearing the bits of the planes the box is fully inside. The plane that culled the
+// node last time is tried first, with coherent camera movement it mostly culls it again.
+static IntersectionType FrustumAABBIntersectMasked(BVHNode& node,
+                                                   Plane* planes,
+                                                   unsigned int& planeMask,
+                                                   FrustumCullStats& stats)
+{
+    const int lastPlane = node.lastRejectingPlane.load(std::memory_order_relaxed);
+    if (planeMask & (1 << lastPlane))
     {
-        array.push_back(node->objectIndex);
+        stats.planeTests++;
+        const IntersectionType result = PlaneAABBIntersect(node.bounds, planes[lastPlane]);
+        if (result == OUTSIDE)
+        {
+            return OUTSIDE;
+        }
+        if (result == INSIDE)
+        {
+            planeMask &= ~(1 << lastPlane);
+        }
     }
-    else
+
+    for (int i = 0; i < 6; ++i)
     {
-        AddAllChildren(array, node->left);
-        AddAllChildren(array, node->right);
+        if (i == lastPlane || !(planeMask & (1 << i))) continue;
+
+        stats.planeTests++;
+        const IntersectionType result = PlaneAABBIntersect(node.bounds, planes[i]);
+        if (result == OUTSIDE)
+        {
+            node.lastRejectingPlane.store(static_cast<uint8_t>(i), std::memory_order_relaxed);
+            return OUTSIDE;
+        }
+        if (result == INSIDE)
+        {
+            planeMask &= ~(1 << i);
+        }
     }
+
+    return planeMask == 0 ? INSIDE : INTERSECT;
 }
 
-void FrustumBVHIntersect(std::vector<int>& array, std::shared_ptr<BVHNode>& bvh, FrustumPlanes& frustum) 
+static void FrustumBVHIntersectMasked(std::vector<int>& array,
+                                      std::shared_ptr<BVHNode>& bvh,
+                                      FrustumPlanes& frustum,
+                                      unsigned int planeMask,
+                                      FrustumCullStats& stats)
 {
-    IntersectionType intersect = FrustumAABBIntersect(bvh->bounds, frustum.planes);
+    stats.nodesVisited++;
+
+    IntersectionType intersect = FrustumAABBIntersectMasked(*bvh, frustum.planes, planeMask, stats);
     if (intersect == INSIDE)
     {
         AddAllChildren(array, bvh);
     }
     if (intersect == INTERSECT)
     {
-        if (bvh->objectIndex != -1)
+        if (bvh->IsLeaf())
         {
-            array.push_back(bvh->objectIndex);
+            AddAllChildren(array, bvh);
         }
         else
         {
-            FrustumBVHIntersect(array, bvh->left, frustum);
-            FrustumBVHIntersect(array, bvh->right, frustum);
+            FrustumBVHIntersectMasked(array, bvh->left, frustum, planeMask, stats);
+            FrustumBVHIntersectMasked(array, bvh->right, frustum, planeMask, stats);
         }
     }
 
@@ -149,6 +198,176 @@ void FrustumBVHIntersect(std::vector<int>& array, std::shared_ptr<BVHNode>& bvh,
     return;
 }
 
+void FrustumBVHIntersect(std::vector<int>& array,
+                         std::shared_ptr<BVHNode>& bvh,
+                         FrustumPlanes& frustum,
+                         FrustumCullStats* stats)
+{
+    FrustumCullStats localStats;
+    FrustumBVHIntersectMasked(array, bvh, frustum, allPlanes, stats ? *stats : localStats);
+}
+
+static void AddRange(std::vector<ObjectRange>& ranges, int objectIndex, int objectCount)
+{
+    // Siblings are stored next to each other, so neighbouring ranges usually merge
+    if (!ranges.empty() && ranges.back().objectIndex + ranges.back().objectCount == objectIndex)
+    {
+        ranges.back().objectCount += objectCount;
+    }
+    else
+    {
+        ranges.push_back({objectIndex, objectCount});
+    }
+}
+
+static void FrustumBVHIntersectRangesMasked(std::vector<ObjectRange>& ranges,
+                                            BVHNode& node,
+                                            Plane* planes,
+                                            unsigned int planeMask,
+                                            FrustumCullStats& stats)
+{
+    stats.nodesVisited++;
+
+    const IntersectionType intersect = FrustumAABBIntersectMasked(node, planes, planeMask, stats);
+    if (intersect == OUTSIDE) return;
+
+    if (intersect == INSIDE || node.IsLeaf())
+    {
+        AddRange(ranges, node.objectIndex, node.objectCount);
+        return;
+    }
+
+    FrustumBVHIntersectRangesMasked(ranges, *node.left, planes, planeMask, stats);
+    FrustumBVHIntersectRangesMasked(ranges, *node.right, planes, planeMask, stats);
+}
+
+// A piece of the output in traversal order: either ranges found above the cutoff depth, or a subtree task
+struct CullSegment
+{
+    BVHNode* task = nullptr;
+    unsigned int planeMask = 0;
+
+    std::vector<ObjectRange> ranges;
+    FrustumCullStats stats;
+    size_t outputOffset = 0;
+};
+
+static void CollectCullSegments(std::vector<CullSegment>& segments,
+                                BVHNode& node,
+                                Plane* planes,
+                                unsigned int planeMask,
+                                int depth,
+                                int cutoffDepth,
+                                FrustumCullStats& stats)
+{
+    if (depth == cutoffDepth && !node.IsLeaf())
+    {
+        CullSegment segment;
+        segment.task = &node;
+        segment.planeMask = planeMask;
+        segments.push_back(std::move(segment));
+        return;
+    }
+
+    stats.nodesVisited++;
+
+    const IntersectionType intersect = FrustumAABBIntersectMasked(node, planes, planeMask, stats);
+    if (intersect == OUTSIDE) return;
+
+    if (intersect == INSIDE || node.IsLeaf())
+    {
+        if (segments.empty() || segments.back().task != nullptr) segments.emplace_back();
+        AddRange(segments.back().ranges, node.objectIndex, node.objectCount);
+        return;
+    }
+
+    CollectCullSegments(segments, *node.left, planes, planeMask, depth + 1, cutoffDepth, stats);
+    CollectCullSegments(segments, *node.right, planes, planeMask, depth + 1, cutoffDepth, stats);
+}
+
+static void CullSegmentsParallel(std::vector<CullSegment>& segments,
+                                 std::shared_ptr<BVHNode>& bvh,
+                                 FrustumPlanes& frustum,
+                                 FrustumCullStats* stats,
+                                 int cutoffDepth)
+{
+    assert(bvh != nullptr && "bvh can't be null.");
+
+    FrustumCullStats topStats;
+    CollectCullSegments(segments, *bvh, frustum.planes, allPlanes, 0, cutoffDepth, topStats);
+
+    // Every task writes to its own segment, so the workers share nothing
+    ParallelForChunks(segments.size(),
+                      [&](size_t i)
+                      {
+                          CullSegment& segment = segments[i];
+                          if (segment.task)
+                          {
+                              FrustumBVHIntersectRangesMasked(segment.ranges,
+                                                              *segment.task,
+                                                              frustum.planes,
+                                                              segment.planeMask,
+                                                              segment.stats);
+                          }
+                      });
+
+    if (stats)
+    {
+        stats->nodesVisited += topStats.nodesVisited;
+        stats->planeTests += topStats.planeTests;
+        for (const CullSegment& segment : segments)
+        {
+            stats->nodesVisited += segment.stats.nodesVisited;
+            stats->planeTests += segment.stats.planeTests;
+        }
+    }
+}
+
+void FrustumBVHIntersectParallel(std::vector<int>& array,
+                                 std::shared_ptr<BVHNode>& bvh,
+                                 FrustumPlanes& frustum,
+                                 FrustumCullStats* stats,
+                                 int cutoffDepth)
+{
+    std::vector<CullSegment> segments;
+    CullSegmentsParallel(segments, bvh, frustum, stats, cutoffDepth);
+
+    // Give every segment its place in the output, then expand the ranges in parallel
+    size_t offset = array.size();
+    for (CullSegment& segment : segments)
+    {
+        segment.outputOffset = offset;
+        for (const ObjectRange& range : segment.ranges) offset += range.objectCount;
+    }
+    array.resize(offset);
+
+    ParallelForChunks(segments.size(),
+                      [&](size_t i)
+                      {
+                          auto output = array.begin() + segments[i].outputOffset;
+                          for (const ObjectRange& range : segments[i].ranges)
+                          {
+                              std::iota(output, output + range.objectCount, range.objectIndex);
+                              output += range.objectCount;
+                          }
+                      });
+}
+
+void FrustumBVHIntersectRanges(std::vector<ObjectRange>& ranges,
+                               std::shared_ptr<BVHNode>& bvh,
+                               FrustumPlanes& frustum,
+                               FrustumCullStats* stats,
+                               int cutoffDepth)
+{
+    std::vector<CullSegment> segments;
+    CullSegmentsParallel(segments, bvh, frustum, stats, cutoffDepth);
+
+    for (const CullSegment& segment : segments)
+    {
+        for (const ObjectRange& range : segment.ranges) AddRange(ranges, range.objectIndex, range.objectCount);
+    }
+}
+
 XMFLOAT3 IntersectionPoint(const Plane& a, const Plane& b, const Plane& c) 
 {
     // Formula from: https://stackoverflow.com/questions/28822211/how-to-draw-a-frustum-in-opengl
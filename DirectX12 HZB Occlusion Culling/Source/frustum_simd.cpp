@@ -0,0 +1,203 @@
+#include "frustum.hpp"
+
+#include "simd_target.hpp"
+
+// The kernels evaluate ((a * x + b * y) + c * z) + d, the same order XMVector3Dot sums in, and never use FMA.
+// That keeps every path bit-exact with PlaneAABBIntersect.
+
+void AABBSoA::Resize(size_t count)
+{
+    minX.resize(count);
+    minY.resize(count);
+    minZ.resize(count);
+    maxX.resize(count);
+    maxY.resize(count);
+    maxZ.resize(count);
+}
+
+void AABBSoA::Set(size_t index, const AABB& aabb)
+{
+    minX[index] = aabb.min.x;
+    minY[index] = aabb.min.y;
+    minZ[index] = aabb.min.z;
+    maxX[index] = aabb.max.x;
+    maxY[index] = aabb.max.y;
+    maxZ[index] = aabb.max.z;
+}
+
+// A plane with the arrays holding its positive vertex. Which corner that is only depends on the plane.
+struct BatchPlane
+{
+    const float* x;
+    const float* y;
+    const float* z;
+    float a, b, c, d;
+};
+
+static SimdLevel DetectSimdLevel()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    const bool osSavesRegisters = (info[2] & (1 << 27)) != 0;
+    const bool hasAVX = (info[2] & (1 << 28)) != 0;
+    if (!osSavesRegisters || !hasAVX || maxLeaf < 7) return SimdLevel::SSE;
+
+    // The OS also has to save the wider registers on a context switch
+    const unsigned long long xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x6) != 0x6) return SimdLevel::SSE;
+
+    __cpuidex(info, 7, 0);
+    const bool hasAVX2 = (info[1] & (1 << 5)) != 0;
+    const bool hasAVX512 = (info[1] & (1 << 16)) != 0;
+
+    if (hasAVX512 && (xcr0 & 0xe6) == 0xe6) return SimdLevel::AVX512;
+    if (hasAVX2) return SimdLevel::AVX2;
+    return SimdLevel::SSE;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    return SimdLevel::SSE;
+#endif
+}
+
+SimdLevel GetSupportedSimdLevel()
+{
+    static const SimdLevel level = DetectSimdLevel();
+    return level;
+}
+
+static void IntersectScalar(const BatchPlane* planes, size_t begin, size_t end, uint32_t* visibilityMask)
+{
+    for (size_t i = begin; i < end; ++i)
+    {
+        bool visible = true;
+        for (int p = 0; p < 6 && visible; ++p)
+        {
+            const BatchPlane& plane = planes[p];
+            const float distance = ((plane.a * plane.x[i] + plane.b * plane.y[i]) + plane.c * plane.z[i]) + plane.d;
+            visible = !(distance < 0.f);
+        }
+
+        if (visible) visibilityMask[i / 32] |= 1u << (i % 32);
+    }
+}
+
+static size_t IntersectSSE(const BatchPlane* planes, size_t count, uint32_t* visibilityMask)
+{
+    const __m128 zero = _mm_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 outside = zero;
+        for (int p = 0; p < 6; ++p)
+        {
+            const BatchPlane& plane = planes[p];
+            const __m128 ax = _mm_mul_ps(_mm_set1_ps(plane.a), _mm_loadu_ps(plane.x + i));
+            const __m128 by = _mm_mul_ps(_mm_set1_ps(plane.b), _mm_loadu_ps(plane.y + i));
+            const __m128 cz = _mm_mul_ps(_mm_set1_ps(plane.c), _mm_loadu_ps(plane.z + i));
+            const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(ax, by), cz), _mm_set1_ps(plane.d));
+
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, zero));
+            if (_mm_movemask_ps(outside) == 0xf) break;
+        }
+
+        const uint32_t visible = ~static_cast<uint32_t>(_mm_movemask_ps(outside)) & 0xf;
+        visibilityMask[i / 32] |= visible << (i % 32);
+    }
+
+    return i;
+}
+
+TARGET_AVX2 static size_t IntersectAVX2(const BatchPlane* planes, size_t count, uint32_t* visibilityMask)
+{
+    const __m256 zero = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 outside = zero;
+        for (int p = 0; p < 6; ++p)
+        {
+            const BatchPlane& plane = planes[p];
+            const __m256 ax = _mm256_mul_ps(_mm256_set1_ps(plane.a), _mm256_loadu_ps(plane.x + i));
+            const __m256 by = _mm256_mul_ps(_mm256_set1_ps(plane.b), _mm256_loadu_ps(plane.y + i));
+            const __m256 cz = _mm256_mul_ps(_mm256_set1_ps(plane.c), _mm256_loadu_ps(plane.z + i));
+            const __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(ax, by), cz), _mm256_set1_ps(plane.d));
+
+            outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, zero, _CMP_LT_OQ));
+            if (_mm256_movemask_ps(outside) == 0xff) break;
+        }
+
+        const uint32_t visible = ~static_cast<uint32_t>(_mm256_movemask_ps(outside)) & 0xff;
+        visibilityMask[i / 32] |= visible << (i % 32);
+    }
+
+    return i;
+}
+
+TARGET_AVX512 static size_t IntersectAVX512(const BatchPlane* planes, size_t count, uint32_t* visibilityMask)
+{
+    const __m512 zero = _mm512_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __mmask16 outside = 0;
+        for (int p = 0; p < 6; ++p)
+        {
+            const BatchPlane& plane = planes[p];
+            const __m512 ax = _mm512_mul_ps(_mm512_set1_ps(plane.a), _mm512_loadu_ps(plane.x + i));
+            const __m512 by = _mm512_mul_ps(_mm512_set1_ps(plane.b), _mm512_loadu_ps(plane.y + i));
+            const __m512 cz = _mm512_mul_ps(_mm512_set1_ps(plane.c), _mm512_loadu_ps(plane.z + i));
+            const __m512 distance = _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(ax, by), cz), _mm512_set1_ps(plane.d));
+
+            outside |= _mm512_cmp_ps_mask(distance, zero, _CMP_LT_OQ);
+            if (outside == 0xffff) break;
+        }
+
+        const uint32_t visible = ~static_cast<uint32_t>(outside) & 0xffff;
+        visibilityMask[i / 32] |= visible << (i % 32);
+    }
+
+    return i;
+}
+
+void FrustumAABBIntersectBatch(const AABBSoA& boxes,
+                               const FrustumPlanes& frustum,
+                               uint32_t* visibilityMask,
+                               SimdLevel maxLevel)
+{
+    assert(visibilityMask != nullptr && "visibilityMask can't be null.");
+
+    const size_t count = boxes.Size();
+    std::fill(visibilityMask, visibilityMask + (count + 31) / 32, 0u);
+
+    BatchPlane planes[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        const Plane& plane = frustum.planes[p];
+        planes[p].x = plane.a >= 0 ? boxes.maxX.data() : boxes.minX.data();
+        planes[p].y = plane.b >= 0 ? boxes.maxY.data() : boxes.minY.data();
+        planes[p].z = plane.c >= 0 ? boxes.maxZ.data() : boxes.minZ.data();
+        planes[p].a = plane.a;
+        planes[p].b = plane.b;
+        planes[p].c = plane.c;
+        planes[p].d = plane.d;
+    }
+
+    const SimdLevel level = std::min(maxLevel, GetSupportedSimdLevel());
+
+    // Whatever doesn't fill a whole vector is done one box at a time
+    size_t done = 0;
+    if (level == SimdLevel::AVX512) done = IntersectAVX512(planes, count, visibilityMask);
+    else if (level == SimdLevel::AVX2) done = IntersectAVX2(planes, count, visibilityMask);
+    else if (level == SimdLevel::SSE) done = IntersectSSE(planes, count, visibilityMask);
+
+    IntersectScalar(planes, done, count, visibilityMask);
+}
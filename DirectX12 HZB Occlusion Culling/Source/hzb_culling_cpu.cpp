@@ -0,0 +1,469 @@
+#include "hzb_culling_cpu.hpp"
+
+#include "parallel_for.hpp"
+#include "visibility_bits.hpp"
+
+// Closer to the eye plane than this and the projection of a corner can't be trusted
+static const float minClipW = 1e-5f;
+
+// Screen rectangle of a box in uv space (y pointing down) and its closest depth
+struct ScreenRect
+{
+    float minX, minY, maxX, maxY;
+    float minZ;
+    bool crossesNearPlane;
+};
+
+// Same as CalculateMinMax in hzbCulling_cs.hlsl, minus the remap in Fixed mode
+static ScreenRect ProjectAABB(const AABB& aabb, const XMMATRIX& vpMatrix, HzbCullMode mode)
+{
+    ScreenRect rect = {FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX, mode == HzbCullMode::Shader ? 1.f : FLT_MAX, false};
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const XMVECTOR corner = XMVectorSet(c & 4 ? aabb.max.x : aabb.min.x,
+                                            c & 2 ? aabb.max.y : aabb.min.y,
+                                            c & 1 ? aabb.max.z : aabb.min.z,
+                                            1.f);
+        XMFLOAT4 clip;
+        XMStoreFloat4(&clip, XMVector4Transform(corner, vpMatrix));
+        if (clip.w <= minClipW) rect.crossesNearPlane = true;
+
+        const float x = (clip.x / clip.w + 1.f) / 2.f;
+        const float y = (1.f - clip.y / clip.w) / 2.f;
+        const float z = mode == HzbCullMode::Shader ? (clip.z / clip.w - 0.9f) * 10.f : clip.z / clip.w;
+
+        rect.minX = std::min(rect.minX, x);
+        rect.minY = std::min(rect.minY, y);
+        rect.maxX = std::max(rect.maxX, x);
+        rect.maxY = std::max(rect.maxY, y);
+        rect.minZ = std::min(rect.minZ, z);
+    }
+
+    return rect;
+}
+
+// Texel a point sampler with clamp addressing picks for a uv coordinate
+static int UVToTexel(float uv, int size)
+{
+    if (!(uv > 0.f)) return 0;  // Also catches NaN
+    if (uv >= 1.f) return size - 1;
+    return std::min(size - 1, static_cast<int>(uv * size));
+}
+
+static bool IsVisibleShader(const ScreenRect& rect, const HzbPyramid& hzb, const HzbCullSettings& settings)
+{
+    const float texelsX = (rect.maxX - rect.minX) * hzb.GetMipWidth(0);
+    const float texelsY = (rect.maxY - rect.minY) * hzb.GetMipHeight(0);
+
+    // SampleLevel clamps the level to the texture, including the -inf of an empty rectangle
+    const float maxMip = static_cast<float>(std::min<unsigned int>(settings.maxHzbMip, hzb.GetNumMips() - 1));
+    float mip = std::floor(std::log2(std::max(texelsX, texelsY)));
+    if (!(mip >= 0.f)) mip = 0.f;
+    const int level = static_cast<int>(std::min(mip, maxMip));
+
+    const int width = hzb.GetMipWidth(level);
+    const int height = hzb.GetMipHeight(level);
+    const int minX = UVToTexel(rect.minX, width);
+    const int minY = UVToTexel(rect.minY, height);
+    const int maxX = UVToTexel(rect.maxX, width);
+    const int maxY = UVToTexel(rect.maxY, height);
+
+    const float maxZ = std::max(std::max(std::max(hzb.GetTexel(level, minX, minY), hzb.GetTexel(level, maxX, minY)),
+                                         hzb.GetTexel(level, minX, maxY)),
+                                hzb.GetTexel(level, maxX, maxY));
+
+    return rect.minZ <= maxZ + settings.depthBias;
+}
+
+static bool IsVisibleFixed(const ScreenRect& rect, const HzbPyramid& hzb, const HzbCullSettings& settings)
+{
+    if (rect.crossesNearPlane) return true;
+
+    // Full resolution pixels under the rectangle
+    const int minX = UVToTexel(rect.minX, hzb.GetMipWidth(0));
+    const int minY = UVToTexel(rect.minY, hzb.GetMipHeight(0));
+    const int maxX = UVToTexel(rect.maxX, hzb.GetMipWidth(0));
+    const int maxY = UVToTexel(rect.maxY, hzb.GetMipHeight(0));
+
+    // Start where the footprint is 2 or 3 texels wide, then go up until it's at most 2. A texel at mip n covers
+    // the pixels that shift down to it, the last one also picks up the extra pixel of odd sizes.
+    const int maxMip = static_cast<int>(std::min<unsigned int>(settings.maxHzbMip, hzb.GetNumMips() - 1));
+    const int span = std::max(maxX - minX, maxY - minY);
+    int level = span > 1 ? std::min(maxMip, static_cast<int>(std::log2(span))) : 0;
+    while (level < maxMip && ((maxX >> level) - (minX >> level) > 1 || (maxY >> level) - (minY >> level) > 1)) level++;
+
+    const int lastX = hzb.GetMipWidth(level) - 1;
+    const int lastY = hzb.GetMipHeight(level) - 1;
+    const float maxZ = hzb.GetMaxDepth(level,
+                                       std::min(minX >> level, lastX),
+                                       std::min(minY >> level, lastY),
+                                       std::min(maxX >> level, lastX),
+                                       std::min(maxY >> level, lastY));
+
+    return rect.minZ <= maxZ + settings.depthBias;
+}
+
+static bool IsVisibleReference(const ScreenRect& rect, const HzbPyramid& hzb, const HzbCullSettings& settings)
+{
+    if (rect.crossesNearPlane) return true;
+
+    const int minX = UVToTexel(rect.minX, hzb.GetMipWidth(0));
+    const int minY = UVToTexel(rect.minY, hzb.GetMipHeight(0));
+    const int maxX = UVToTexel(rect.maxX, hzb.GetMipWidth(0));
+    const int maxY = UVToTexel(rect.maxY, hzb.GetMipHeight(0));
+
+    for (int y = minY; y <= maxY; ++y)
+    {
+        const float* row = hzb.GetRow(0, y);
+        for (int x = minX; x <= maxX; ++x)
+        {
+            if (rect.minZ <= row[x] + settings.depthBias) return true;
+        }
+    }
+
+    return false;
+}
+
+static bool IsVisibleByMode(const ScreenRect& rect, const HzbPyramid& hzb, const HzbCullSettings& settings)
+{
+    return settings.mode == HzbCullMode::Shader ? IsVisibleShader(rect, hzb, settings) : IsVisibleFixed(rect, hzb, settings);
+}
+
+template <typename Test>
+static void CullAABBs(std::vector<unsigned int>& visibility,
+                      const std::vector<AABB>& aabbs,
+                      const XMMATRIX& vpMatrix,
+                      FrustumPlanes& frustum,
+                      HzbCullMode mode,
+                      Test&& isVisible)
+{
+    visibility.resize(aabbs.size());
+
+    ParallelFor(
+        aabbs.size(),
+        [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                AABB aabb = aabbs[i];
+                if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE)
+                {
+                    visibility[i] = OC_HIDDEN;
+                    continue;
+                }
+
+                visibility[i] = isVisible(ProjectAABB(aabb, vpMatrix, mode)) ? OC_VISIBLE : OC_HIDDEN;
+            }
+        },
+        1024);
+}
+
+void HzbCullAABBs(std::vector<unsigned int>& visibility,
+                  const std::vector<AABB>& aabbs,
+                  const HzbPyramid& hzb,
+                  const XMMATRIX& vpMatrix,
+                  FrustumPlanes& frustum,
+                  const HzbCullSettings& settings)
+{
+    assert(hzb.GetNumMips() > 0 && "Build the HZB before culling against it");
+
+    if (settings.mode == HzbCullMode::Shader)
+    {
+        CullAABBs(visibility,
+                  aabbs,
+                  vpMatrix,
+                  frustum,
+                  settings.mode,
+                  [&](const ScreenRect& rect) { return IsVisibleShader(rect, hzb, settings); });
+    }
+    else
+    {
+        CullAABBs(visibility,
+                  aabbs,
+                  vpMatrix,
+                  frustum,
+                  settings.mode,
+                  [&](const ScreenRect& rect) { return IsVisibleFixed(rect, hzb, settings); });
+    }
+}
+
+void HzbCullAABBBits(std::vector<uint32_t>& visibilityBits,
+                     const uint32_t* testBits,
+                     const std::vector<AABB>& aabbs,
+                     const HzbPyramid& hzb,
+                     const XMMATRIX& vpMatrix,
+                     FrustumPlanes& frustum,
+                     const HzbCullSettings& settings)
+{
+    assert(hzb.GetNumMips() > 0 && "Build the HZB before culling against it");
+
+    const size_t numWords = GetNumVisibilityWords(aabbs.size());
+    visibilityBits.resize(numWords);
+
+    // Whole words per task, so no two threads write the same word
+    ParallelFor(
+        numWords,
+        [&](size_t begin, size_t end)
+        {
+            for (size_t word = begin; word < end; ++word)
+            {
+                uint32_t visible = 0;
+                for (uint32_t remaining = testBits[word]; remaining != 0; remaining &= remaining - 1)
+                {
+                    const int bit = CountTrailingZeros(remaining);
+                    AABB aabb = aabbs[word * 32 + bit];
+                    if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE) continue;
+
+                    if (IsVisibleByMode(ProjectAABB(aabb, vpMatrix, settings.mode), hzb, settings)) visible |= 1u << bit;
+                }
+                visibilityBits[word] = visible;
+            }
+        },
+        32);
+}
+
+void HzbCullReference(std::vector<unsigned int>& visibility,
+                      const std::vector<AABB>& aabbs,
+                      const HzbPyramid& hzb,
+                      const XMMATRIX& vpMatrix,
+                      FrustumPlanes& frustum,
+                      const HzbCullSettings& settings)
+{
+    assert(hzb.GetNumMips() > 0 && "Build the HZB before culling against it");
+
+    CullAABBs(visibility,
+              aabbs,
+              vpMatrix,
+              frustum,
+              settings.mode,
+              [&](const ScreenRect& rect) { return IsVisibleReference(rect, hzb, settings); });
+}
+
+// What every node test needs, shared by the worker threads
+struct HzbBVHCullContext
+{
+    const HzbPyramid& hzb;
+    const XMMATRIX& vpMatrix;
+    FrustumPlanes& frustum;
+    const HzbCullSettings& settings;
+};
+
+static void AddCandidateRange(std::vector<ObjectRange>& ranges, int objectIndex, int objectCount)
+{
+    // Neighbouring leaves are stored next to each other, so their ranges usually merge
+    if (!ranges.empty() && ranges.back().objectIndex + ranges.back().objectCount == objectIndex)
+    {
+        ranges.back().objectCount += objectCount;
+    }
+    else
+    {
+        ranges.push_back({objectIndex, objectCount});
+    }
+}
+
+// Returns whether the children have to be visited, insideFrustum turns true once the frustum test can be skipped
+static bool HzbCullNode(std::vector<ObjectRange>& ranges,
+                        BVHNode& node,
+                        const HzbBVHCullContext& context,
+                        bool& insideFrustum,
+                        HzbBVHCullStats& stats)
+{
+    stats.nodesVisited++;
+
+    if (!insideFrustum)
+    {
+        const IntersectionType intersect = FrustumAABBIntersect(node.bounds, context.frustum.planes);
+        if (intersect == OUTSIDE)
+        {
+            stats.nodesOutside++;
+            stats.objectsSkipped += node.objectCount;
+            return false;
+        }
+        insideFrustum = intersect == INSIDE;
+    }
+
+    const ScreenRect rect = ProjectAABB(node.bounds, context.vpMatrix, context.settings.mode);
+    if (!rect.crossesNearPlane && !IsVisibleByMode(rect, context.hzb, context.settings))
+    {
+        stats.nodesOccluded++;
+        stats.objectsSkipped += node.objectCount;
+        return false;
+    }
+
+    if (node.IsLeaf())
+    {
+        stats.leavesEmitted++;
+        stats.objectsEmitted += node.objectCount;
+        AddCandidateRange(ranges, node.objectIndex, node.objectCount);
+        return false;
+    }
+
+    return true;
+}
+
+static void HzbCullSubtree(std::vector<ObjectRange>& ranges,
+                           BVHNode& node,
+                           const HzbBVHCullContext& context,
+                           bool insideFrustum,
+                           HzbBVHCullStats& stats)
+{
+    if (!HzbCullNode(ranges, node, context, insideFrustum, stats)) return;
+
+    HzbCullSubtree(ranges, *node.left, context, insideFrustum, stats);
+    HzbCullSubtree(ranges, *node.right, context, insideFrustum, stats);
+}
+
+// A piece of the output in traversal order: either ranges found above the cutoff depth, or a subtree task
+struct HzbCullSegment
+{
+    BVHNode* task = nullptr;
+    bool insideFrustum = false;
+
+    std::vector<ObjectRange> ranges;
+    HzbBVHCullStats stats;
+};
+
+static void CollectHzbCullSegments(std::vector<HzbCullSegment>& segments,
+                                   BVHNode& node,
+                                   const HzbBVHCullContext& context,
+                                   bool insideFrustum,
+                                   int depth,
+                                   int cutoffDepth,
+                                   HzbBVHCullStats& stats)
+{
+    if (depth == cutoffDepth && !node.IsLeaf())
+    {
+        HzbCullSegment segment;
+        segment.task = &node;
+        segment.insideFrustum = insideFrustum;
+        segments.push_back(std::move(segment));
+        return;
+    }
+
+    if (segments.empty() || segments.back().task != nullptr) segments.emplace_back();
+    if (!HzbCullNode(segments.back().ranges, node, context, insideFrustum, stats)) return;
+
+    CollectHzbCullSegments(segments, *node.left, context, insideFrustum, depth + 1, cutoffDepth, stats);
+    CollectHzbCullSegments(segments, *node.right, context, insideFrustum, depth + 1, cutoffDepth, stats);
+}
+
+static void AddStats(HzbBVHCullStats& total, const HzbBVHCullStats& stats)
+{
+    total.nodesVisited += stats.nodesVisited;
+    total.nodesOutside += stats.nodesOutside;
+    total.nodesOccluded += stats.nodesOccluded;
+    total.leavesEmitted += stats.leavesEmitted;
+    total.objectsEmitted += stats.objectsEmitted;
+    total.objectsSkipped += stats.objectsSkipped;
+}
+
+void HzbCullBVH(std::vector<ObjectRange>& candidates,
+                std::shared_ptr<BVHNode>& bvh,
+                const HzbPyramid& hzb,
+                const XMMATRIX& vpMatrix,
+                FrustumPlanes& frustum,
+                const HzbCullSettings& settings,
+                HzbBVHCullStats* stats,
+                int cutoffDepth)
+{
+    assert(bvh != nullptr && "bvh can't be null.");
+    assert(hzb.GetNumMips() > 0 && "Build the HZB before culling against it");
+
+    const HzbBVHCullContext context = {hzb, vpMatrix, frustum, settings};
+
+    std::vector<HzbCullSegment> segments;
+    HzbBVHCullStats topStats;
+    CollectHzbCullSegments(segments, *bvh, context, false, 0, cutoffDepth, topStats);
+
+    // Every task writes to its own segment, so the workers share nothing
+    ParallelForChunks(segments.size(),
+                      [&](size_t i)
+                      {
+                          HzbCullSegment& segment = segments[i];
+                          if (segment.task)
+                          {
+                              HzbCullSubtree(segment.ranges, *segment.task, context, segment.insideFrustum, segment.stats);
+                          }
+                      });
+
+    for (const HzbCullSegment& segment : segments)
+    {
+        for (const ObjectRange& range : segment.ranges) AddCandidateRange(candidates, range.objectIndex, range.objectCount);
+    }
+
+    if (stats)
+    {
+        AddStats(*stats, topStats);
+        for (const HzbCullSegment& segment : segments) AddStats(*stats, segment.stats);
+    }
+}
+
+void HzbCullCandidates(std::vector<unsigned int>& visibility,
+                       const std::vector<ObjectRange>& candidates,
+                       const std::vector<IndexedAABB>& objects,
+                       const HzbPyramid& hzb,
+                       const XMMATRIX& vpMatrix,
+                       FrustumPlanes& frustum,
+                       const HzbCullSettings& settings)
+{
+    assert(hzb.GetNumMips() > 0 && "Build the HZB before culling against it");
+
+    visibility.assign(objects.size(), OC_HIDDEN);
+
+    // Every object is in one range at most, so the writes never overlap
+    ParallelFor(
+        candidates.size(),
+        [&](size_t begin, size_t end)
+        {
+            for (size_t r = begin; r < end; ++r)
+            {
+                const ObjectRange& range = candidates[r];
+                for (int i = range.objectIndex; i < range.objectIndex + range.objectCount; ++i)
+                {
+                    AABB aabb = objects[i].aabb;
+                    if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE) continue;
+
+                    const bool visible = IsVisibleByMode(ProjectAABB(aabb, vpMatrix, settings.mode), hzb, settings);
+                    visibility[objects[i].index] = visible ? OC_VISIBLE : OC_HIDDEN;
+                }
+            }
+        },
+        16);
+}
+
+HzbCullReport ValidateHzbCulling(const std::vector<AABB>& aabbs,
+                                 const HzbPyramid& hzb,
+                                 const XMMATRIX& vpMatrix,
+                                 FrustumPlanes& frustum,
+                                 const HzbCullSettings& settings)
+{
+    HzbCullReport report;
+    report.numObjects = static_cast<int>(aabbs.size());
+
+    std::vector<unsigned int> visibility;
+    std::vector<unsigned int> reference;
+
+    auto startTime = std::chrono::high_resolution_clock::now();
+    HzbCullAABBs(visibility, aabbs, hzb, vpMatrix, frustum, settings);
+    auto endTime = std::chrono::high_resolution_clock::now();
+    report.cullTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+
+    startTime = std::chrono::high_resolution_clock::now();
+    HzbCullReference(reference, aabbs, hzb, vpMatrix, frustum, settings);
+    endTime = std::chrono::high_resolution_clock::now();
+    report.referenceTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+
+    for (size_t i = 0; i < aabbs.size(); ++i)
+    {
+        const bool visible = visibility[i] == OC_VISIBLE;
+        const bool referenceVisible = reference[i] == OC_VISIBLE;
+
+        report.numVisible += visible;
+        report.numReferenceVisible += referenceVisible;
+        report.numFalsePositives += visible && !referenceVisible;
+        report.numFalseNegatives += !visible && referenceVisible;
+    }
+
+    return report;
+}
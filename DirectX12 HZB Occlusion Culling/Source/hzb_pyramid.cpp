@@ -0,0 +1,236 @@
+#include "hzb_pyramid.hpp"
+
+#include "parallel_for.hpp"
+#include "simd_target.hpp"
+
+// Rows are padded to this many floats, so the kernels never need a scalar tail
+static const int rowAlignment = 16;
+
+static int AlignRow(int width) { return (width + rowAlignment - 1) / rowAlignment * rowAlignment; }
+
+// Max of numRows rows into dst, count is a multiple of rowAlignment
+static void MaxRowsScalar(float* dst, const float* const* rows, int numRows, int count)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        float depth = rows[0][i];
+        for (int r = 1; r < numRows; ++r) depth = std::max(depth, rows[r][i]);
+        dst[i] = depth;
+    }
+}
+
+// dst[x] = max(src[2x], src[2x + 1])
+static void PairMaxScalar(float* dst, const float* src, int dstCount)
+{
+    for (int x = 0; x < dstCount; ++x) dst[x] = std::max(src[2 * x], src[2 * x + 1]);
+}
+
+static void MaxRowsSSE(float* dst, const float* const* rows, int numRows, int count)
+{
+    for (int i = 0; i < count; i += 4)
+    {
+        __m128 depth = _mm_load_ps(rows[0] + i);
+        for (int r = 1; r < numRows; ++r) depth = _mm_max_ps(depth, _mm_load_ps(rows[r] + i));
+        _mm_store_ps(dst + i, depth);
+    }
+}
+
+static void PairMaxSSE(float* dst, const float* src, int dstCount)
+{
+    for (int x = 0; x < dstCount; x += 4)
+    {
+        const __m128 a = _mm_load_ps(src + 2 * x);
+        const __m128 b = _mm_load_ps(src + 2 * x + 4);
+        const __m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_store_ps(dst + x, _mm_max_ps(even, odd));
+    }
+}
+
+TARGET_AVX2 static void MaxRowsAVX2(float* dst, const float* const* rows, int numRows, int count)
+{
+    for (int i = 0; i < count; i += 8)
+    {
+        __m256 depth = _mm256_load_ps(rows[0] + i);
+        for (int r = 1; r < numRows; ++r) depth = _mm256_max_ps(depth, _mm256_load_ps(rows[r] + i));
+        _mm256_store_ps(dst + i, depth);
+    }
+}
+
+TARGET_AVX2 static void PairMaxAVX2(float* dst, const float* src, int dstCount)
+{
+    for (int x = 0; x < dstCount; x += 8)
+    {
+        const __m256 a = _mm256_load_ps(src + 2 * x);
+        const __m256 b = _mm256_load_ps(src + 2 * x + 8);
+
+        // The shuffles work per 128-bit lane, giving [0 1 4 5 | 2 3 6 7]. The permute puts them back in order.
+        const __m256 even = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m256 odd = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        const __m256d pairs = _mm256_castps_pd(_mm256_max_ps(even, odd));
+        _mm256_store_ps(dst + x, _mm256_castpd_ps(_mm256_permute4x64_pd(pairs, _MM_SHUFFLE(3, 1, 2, 0))));
+    }
+}
+
+void HzbPyramid::Build(const float* depth, int width, int height, int rowPitch, int numMips, SimdLevel maxLevel)
+{
+    assert(depth != nullptr && "depth can't be null.");
+    assert(width > 0 && height > 0 && "The depth image needs at least one texel");
+
+    if (rowPitch == 0) rowPitch = width;
+    assert(rowPitch >= width && "rowPitch can't be smaller than the width");
+
+    const int fullChain = static_cast<int>(std::log2(std::max(width, height))) + 1;
+    if (numMips == 0 || numMips > fullChain) numMips = fullChain;
+
+    m_mips.resize(numMips);
+    size_t totalSize = 0;
+    for (int mip = 0; mip < numMips; ++mip)
+    {
+        Mip& level = m_mips[mip];
+        level.width = std::max(1, width >> mip);
+        level.height = std::max(1, height >> mip);
+        level.rowPitch = AlignRow(level.width);
+        level.offset = totalSize;
+        totalSize += static_cast<size_t>(level.rowPitch) * level.height;
+    }
+
+    // Over-allocate so the first row can start on a cache line. The padding is zeroed and stays that way, so a
+    // rebuild at the same size reuses the memory as is.
+    if (m_storage.size() != totalSize + rowAlignment) m_storage.assign(totalSize + rowAlignment, 0.f);
+    const uintptr_t address = reinterpret_cast<uintptr_t>(m_storage.data());
+    const uintptr_t alignment = rowAlignment * sizeof(float);
+    m_data = reinterpret_cast<float*>((address + alignment - 1) & ~(alignment - 1));
+
+    ParallelFor(
+        height,
+        [&](size_t begin, size_t end)
+        {
+            for (size_t y = begin; y < end; ++y)
+            {
+                const float* src = depth + y * rowPitch;
+                std::copy(src, src + width, m_data + y * m_mips[0].rowPitch);
+            }
+        },
+        64);
+
+    SimdLevel level = std::min(maxLevel, GetSupportedSimdLevel());
+    if (level == SimdLevel::AVX512) level = SimdLevel::AVX2;
+
+    for (int mip = 1; mip < numMips; ++mip)
+    {
+        // Small mips aren't worth waking up the worker threads for
+        ParallelFor(
+            m_mips[mip].height,
+            [&](size_t begin, size_t end) { ReduceRows(mip, static_cast<int>(begin), static_cast<int>(end), level); },
+            32);
+    }
+}
+
+void HzbPyramid::ReduceRows(int dstMip, int firstRow, int lastRow, SimdLevel level)
+{
+    const Mip& src = m_mips[dstMip - 1];
+    const Mip& dst = m_mips[dstMip];
+
+    // Rounded up to whole vectors, which stays inside the padding of the destination row
+    const int dstCount = AlignRow(dst.width);
+
+    // Vertical max of the source rows, aligned like the mips themselves. The pair max reads 2 * dstCount floats,
+    // which is more than the source row pitch for some widths (16 -> 8 reads 32). The extra floats stay zero and
+    // only end up in the padding of the destination row.
+    const size_t rowMaxSize = std::max<size_t>(src.rowPitch, 2 * static_cast<size_t>(dstCount));
+    std::vector<float> rowStorage(rowMaxSize + rowAlignment, 0.f);
+    const uintptr_t alignment = rowAlignment * sizeof(float);
+    float* rowMax =
+        reinterpret_cast<float*>((reinterpret_cast<uintptr_t>(rowStorage.data()) + alignment - 1) & ~(alignment - 1));
+
+    for (int y = firstRow; y < lastRow; ++y)
+    {
+        // The last row also covers the extra row of an odd source, a 1 texel high source only has one
+        const int firstSrcRow = std::min(2 * y, src.height - 1);
+        const int lastSrcRow = y == dst.height - 1 ? src.height - 1 : 2 * y + 1;
+
+        const float* rows[3];
+        int numRows = 0;
+        for (int r = firstSrcRow; r <= lastSrcRow; ++r) rows[numRows++] = GetRow(dstMip - 1, r);
+
+        float* dstRow = m_data + dst.offset + static_cast<size_t>(y) * dst.rowPitch;
+
+        if (level == SimdLevel::AVX2)
+        {
+            MaxRowsAVX2(rowMax, rows, numRows, src.rowPitch);
+            PairMaxAVX2(dstRow, rowMax, dstCount);
+        }
+        else if (level == SimdLevel::SSE)
+        {
+            MaxRowsSSE(rowMax, rows, numRows, src.rowPitch);
+            PairMaxSSE(dstRow, rowMax, dstCount);
+        }
+        else
+        {
+            MaxRowsScalar(rowMax, rows, numRows, src.rowPitch);
+            PairMaxScalar(dstRow, rowMax, dstCount);
+        }
+
+        // Same for the columns: an odd source adds one to the last texel, a 1 texel wide source has no pair
+        if (src.width == 1) dstRow[0] = rowMax[0];
+        else if (src.width & 1) dstRow[dst.width - 1] = std::max(dstRow[dst.width - 1], rowMax[src.width - 1]);
+
+        // Keep the padding at zero, the pairs past the width pick up whatever the source padding had
+        std::fill(dstRow + dst.width, dstRow + dst.rowPitch, 0.f);
+    }
+}
+
+float HzbPyramid::GetTexel(int mip, int x, int y) const
+{
+    const Mip& level = m_mips[mip];
+    x = std::clamp(x, 0, level.width - 1);
+    y = std::clamp(y, 0, level.height - 1);
+    return GetRow(mip, y)[x];
+}
+
+float HzbPyramid::GetMaxDepth(int mip, int minX, int minY, int maxX, int maxY) const
+{
+    const Mip& level = m_mips[mip];
+    minX = std::clamp(minX, 0, level.width - 1);
+    maxX = std::clamp(maxX, 0, level.width - 1);
+    minY = std::clamp(minY, 0, level.height - 1);
+    maxY = std::clamp(maxY, 0, level.height - 1);
+
+    float depth = -FLT_MAX;
+    for (int y = minY; y <= maxY; ++y)
+    {
+        const float* row = GetRow(mip, y);
+        for (int x = minX; x <= maxX; ++x) depth = std::max(depth, row[x]);
+    }
+
+    return depth;
+}
+
+HzbCompareResult HzbPyramid::CompareMip(int mip, const float* gpuTexels, int rowPitch, float tolerance) const
+{
+    assert(gpuTexels != nullptr && "gpuTexels can't be null.");
+
+    const Mip& level = m_mips[mip];
+    if (rowPitch == 0) rowPitch = level.width;
+
+    HzbCompareResult result;
+    result.numTexels = level.width * level.height;
+
+    for (int y = 0; y < level.height; ++y)
+    {
+        const float* cpuRow = GetRow(mip, y);
+        const float* gpuRow = gpuTexels + static_cast<size_t>(y) * rowPitch;
+
+        for (int x = 0; x < level.width; ++x)
+        {
+            const float difference = gpuRow[x] - cpuRow[x];
+            if (difference < -tolerance) result.numBelow++;
+            else if (difference > tolerance) result.numAbove++;
+
+            result.maxError = std::max(result.maxError, std::abs(difference));
+        }
+    }
+
+    return result;
+}
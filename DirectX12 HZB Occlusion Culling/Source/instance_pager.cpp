@@ -0,0 +1,416 @@
+#include "instance_pager.hpp"
+
+#include "parallel_for.hpp"
+
+#include <fstream>
+#include <numeric>
+
+static const uint32_t cellFileMagic = 0x43425A48;  // "HZBC"
+static const uint32_t cellFileVersion = 1;
+
+// Upper bound on the grid, cellSize is too small for the scene past this
+static const uint64_t maxGridCells = uint64_t(1) << 26;
+
+struct CellFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numCells;
+    float cellSize;
+    uint64_t numInstances;
+};
+
+// Bytes of a cell on disk and in memory
+static size_t GetInstanceBytes() { return sizeof(InstanceData) + sizeof(AABB) + sizeof(uint32_t); }
+
+// How far the box is outside the frustum, 0 when it is inside or touching it. Only looks at the planes one at a
+// time, so next to the edges of the frustum this can be less than the real distance, never more.
+static float DistanceToFrustum(const AABB& box, const FrustumPlanes& frustum)
+{
+    float distance = 0.f;
+    for (const Plane& plane : frustum.planes)
+    {
+        const float x = plane.a >= 0 ? box.max.x : box.min.x;
+        const float y = plane.b >= 0 ? box.max.y : box.min.y;
+        const float z = plane.c >= 0 ? box.max.z : box.min.z;
+        distance = std::max(distance, -(plane.a * x + plane.b * y + plane.c * z + plane.d));
+    }
+
+    return distance;
+}
+
+bool InstancePager::WriteCells(const std::string& path,
+                               const InstanceData* instances,
+                               const AABB* bounds,
+                               size_t count,
+                               float cellSize)
+{
+    assert((count == 0 || (instances != nullptr && bounds != nullptr)) && "instances and bounds can't be null.");
+    assert(cellSize > 0.f && "cellSize has to be positive");
+
+    XMFLOAT3 sceneMin = {FLT_MAX, FLT_MAX, FLT_MAX};
+    XMFLOAT3 sceneMax = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    for (size_t i = 0; i < count; ++i)
+    {
+        const XMFLOAT3 center = bounds[i].Center();
+        sceneMin = {std::min(sceneMin.x, center.x), std::min(sceneMin.y, center.y), std::min(sceneMin.z, center.z)};
+        sceneMax = {std::max(sceneMax.x, center.x), std::max(sceneMax.y, center.y), std::max(sceneMax.z, center.z)};
+    }
+
+    auto getGridSize = [&](float min, float max) { return count ? static_cast<uint64_t>((max - min) / cellSize) + 1 : 1; };
+    const uint64_t gridX = getGridSize(sceneMin.x, sceneMax.x);
+    const uint64_t gridY = getGridSize(sceneMin.y, sceneMax.y);
+    const uint64_t gridZ = getGridSize(sceneMin.z, sceneMax.z);
+    if (gridX * gridY * gridZ > maxGridCells)
+    {
+        Log::Warn("Instance pager :: A cell size of {} makes too many cells", cellSize);
+        return false;
+    }
+
+    // Counting sort of the instances by grid cell
+    std::vector<uint32_t> cellOfInstance(count);
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const XMFLOAT3 center = bounds[i].Center();
+                        const uint64_t x = std::min(gridX - 1, static_cast<uint64_t>((center.x - sceneMin.x) / cellSize));
+                        const uint64_t y = std::min(gridY - 1, static_cast<uint64_t>((center.y - sceneMin.y) / cellSize));
+                        const uint64_t z = std::min(gridZ - 1, static_cast<uint64_t>((center.z - sceneMin.z) / cellSize));
+                        cellOfInstance[i] = static_cast<uint32_t>(x + gridX * (y + gridY * z));
+                    }
+                });
+
+    std::vector<uint32_t> gridOffsets(gridX * gridY * gridZ + 1, 0);
+    for (uint32_t cell : cellOfInstance) gridOffsets[cell + 1]++;
+    std::partial_sum(gridOffsets.begin(), gridOffsets.end(), gridOffsets.begin());
+
+    std::vector<uint32_t> sortedInstances(count);
+    {
+        std::vector<uint32_t> next(gridOffsets.begin(), gridOffsets.end() - 1);
+        for (size_t i = 0; i < count; ++i) sortedInstances[next[cellOfInstance[i]]++] = static_cast<uint32_t>(i);
+    }
+
+    // Only the cells with instances, in grid order
+    std::vector<PagedCellInfo> cells;
+    std::vector<uint32_t> cellFirst;
+    uint64_t offset = sizeof(CellFileHeader);
+    for (size_t gridCell = 0; gridCell + 1 < gridOffsets.size(); ++gridCell)
+    {
+        const uint32_t first = gridOffsets[gridCell];
+        const uint32_t numInstances = gridOffsets[gridCell + 1] - first;
+        if (numInstances == 0) continue;
+
+        PagedCellInfo cell = {};
+        cell.bounds = bounds[sortedInstances[first]];
+        for (uint32_t i = 1; i < numInstances; ++i) cell.bounds.Expand(bounds[sortedInstances[first + i]]);
+        cell.numInstances = numInstances;
+        cells.push_back(cell);
+        cellFirst.push_back(first);
+    }
+
+    offset += cells.size() * sizeof(PagedCellInfo);
+    for (PagedCellInfo& cell : cells)
+    {
+        cell.offset = offset;
+        offset += cell.numInstances * GetInstanceBytes();
+    }
+
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    if (!stream)
+    {
+        Log::Warn("Instance pager :: Can't write {}", path);
+        return false;
+    }
+
+    CellFileHeader header = {};
+    header.magic = cellFileMagic;
+    header.version = cellFileVersion;
+    header.numCells = static_cast<uint32_t>(cells.size());
+    header.cellSize = cellSize;
+    header.numInstances = count;
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(reinterpret_cast<const char*>(cells.data()), static_cast<std::streamsize>(cells.size() * sizeof(PagedCellInfo)));
+
+    CellData data;
+    for (size_t c = 0; c < cells.size(); ++c)
+    {
+        const uint32_t* cellInstances = sortedInstances.data() + cellFirst[c];
+        const uint32_t numInstances = cells[c].numInstances;
+
+        data.instances.resize(numInstances);
+        data.bounds.resize(numInstances);
+        data.instanceIds.assign(cellInstances, cellInstances + numInstances);
+        for (uint32_t i = 0; i < numInstances; ++i)
+        {
+            data.instances[i] = instances[cellInstances[i]];
+            data.bounds[i] = bounds[cellInstances[i]];
+        }
+
+        stream.write(reinterpret_cast<const char*>(data.instances.data()), numInstances * sizeof(InstanceData));
+        stream.write(reinterpret_cast<const char*>(data.bounds.data()), numInstances * sizeof(AABB));
+        stream.write(reinterpret_cast<const char*>(data.instanceIds.data()), numInstances * sizeof(uint32_t));
+    }
+
+    if (!stream)
+    {
+        Log::Warn("Instance pager :: Writing {} failed", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool InstancePager::Open(const std::string& path, const InstancePagerSettings& settings)
+{
+    Close();
+
+    std::ifstream stream(path, std::ios::binary);
+    CellFileHeader header = {};
+    if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header)) || header.magic != cellFileMagic ||
+        header.version != cellFileVersion)
+    {
+        Log::Warn("Instance pager :: {} is not a cell file of this version", path);
+        return false;
+    }
+
+    m_cells.resize(header.numCells);
+    if (!stream.read(reinterpret_cast<char*>(m_cells.data()), static_cast<std::streamsize>(header.numCells * sizeof(PagedCellInfo))))
+    {
+        Log::Warn("Instance pager :: {} is truncated", path);
+        m_cells.clear();
+        return false;
+    }
+
+    m_path = path;
+    m_settings = settings;
+    m_cellStates.assign(m_cells.size(), CellState::Unloaded);
+    m_cellData.resize(m_cells.size());
+    m_cellDistances.assign(m_cells.size(), FLT_MAX);
+
+    m_stats = InstancePagerStats();
+    m_stats.numCells = static_cast<int>(m_cells.size());
+
+    m_stopLoader = false;
+    m_loader = std::thread(&InstancePager::LoaderThread, this);
+    return true;
+}
+
+void InstancePager::Close()
+{
+    if (m_loader.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopLoader = true;
+            m_loadQueue.clear();
+        }
+        m_loadRequested.notify_all();
+        m_loader.join();
+    }
+
+    m_finishedLoads.clear();
+    m_cells.clear();
+    m_cellStates.clear();
+    m_cellData.clear();
+    m_cellDistances.clear();
+    m_loadingBytes = 0;
+    m_residencyVersion++;
+    m_stats = InstancePagerStats();
+}
+
+void InstancePager::LoaderThread()
+{
+    std::ifstream stream(m_path, std::ios::binary);
+
+    for (;;)
+    {
+        int cell;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_loadRequested.wait(lock, [&]() { return m_stopLoader || !m_loadQueue.empty(); });
+            if (m_stopLoader) return;
+
+            cell = m_loadQueue.front();
+            m_loadQueue.pop_front();
+        }
+
+        // m_cells doesn't change while the loader runs
+        const PagedCellInfo& info = m_cells[cell];
+        auto data = std::make_unique<CellData>();
+        data->instances.resize(info.numInstances);
+        data->bounds.resize(info.numInstances);
+        data->instanceIds.resize(info.numInstances);
+
+        stream.clear();
+        stream.seekg(static_cast<std::streamoff>(info.offset));
+        stream.read(reinterpret_cast<char*>(data->instances.data()), info.numInstances * sizeof(InstanceData));
+        stream.read(reinterpret_cast<char*>(data->bounds.data()), info.numInstances * sizeof(AABB));
+        stream.read(reinterpret_cast<char*>(data->instanceIds.data()), info.numInstances * sizeof(uint32_t));
+        if (!stream) data = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_finishedLoads.push_back({cell, std::move(data)});
+        }
+        m_loadFinished.notify_all();
+    }
+}
+
+size_t InstancePager::GetCellBytes(int cell) const { return m_cells[cell].numInstances * GetInstanceBytes(); }
+
+void InstancePager::TakeFinishedLoads()
+{
+    std::vector<FinishedLoad> finishedLoads;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        finishedLoads.swap(m_finishedLoads);
+    }
+
+    for (FinishedLoad& load : finishedLoads)
+    {
+        const int cell = load.cell;
+        m_loadingBytes -= GetCellBytes(cell);
+        m_stats.numLoadingCells--;
+
+        if (!load.data)
+        {
+            Log::Warn("Instance pager :: Reading cell {} failed", cell);
+            m_cellStates[cell] = CellState::Unloaded;
+            continue;
+        }
+
+        // The camera can have moved away while it was loading
+        if (m_cellDistances[cell] > m_settings.evictDistance)
+        {
+            m_cellStates[cell] = CellState::Unloaded;
+            continue;
+        }
+
+        m_cellStates[cell] = CellState::Resident;
+        m_cellData[cell] = std::move(load.data);
+
+        m_stats.numResidentCells++;
+        m_stats.numResidentInstances += m_cells[cell].numInstances;
+        m_stats.residentBytes += GetCellBytes(cell);
+        m_stats.numLoads++;
+        m_residencyVersion++;
+    }
+}
+
+void InstancePager::Evict(int cell)
+{
+    assert(m_cellStates[cell] == CellState::Resident && "Only resident cells can be evicted");
+
+    m_cellStates[cell] = CellState::Unloaded;
+    m_cellData[cell] = nullptr;
+
+    m_stats.numResidentCells--;
+    m_stats.numResidentInstances -= m_cells[cell].numInstances;
+    m_stats.residentBytes -= GetCellBytes(cell);
+    m_stats.numEvictions++;
+    m_residencyVersion++;
+}
+
+void InstancePager::Update(const FrustumPlanes& frustum)
+{
+    const int numCells = static_cast<int>(m_cells.size());
+
+    ParallelFor(
+        m_cells.size(),
+        [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i) m_cellDistances[i] = DistanceToFrustum(m_cells[i].bounds, frustum);
+        },
+        1024);
+
+    TakeFinishedLoads();
+
+    std::vector<int> resident;
+    std::vector<int> wanted;
+    for (int cell = 0; cell < numCells; ++cell)
+    {
+        const float distance = m_cellDistances[cell];
+        if (m_cellStates[cell] == CellState::Resident)
+        {
+            if (distance > m_settings.evictDistance) Evict(cell);
+            else resident.push_back(cell);
+        }
+        else if (m_cellStates[cell] == CellState::Unloaded && distance <= m_settings.loadDistance)
+        {
+            wanted.push_back(cell);
+        }
+    }
+
+    // Nearest cells first. Over the budget, a wanted cell can push out resident cells further away than itself.
+    auto nearer = [&](int a, int b) { return m_cellDistances[a] < m_cellDistances[b]; };
+    std::sort(wanted.begin(), wanted.end(), nearer);
+    std::sort(resident.begin(), resident.end(), nearer);
+
+    std::vector<int> requests;
+    for (int cell : wanted)
+    {
+        if (m_stats.numLoadingCells >= m_settings.maxLoadsInFlight) break;
+
+        const size_t bytes = GetCellBytes(cell);
+        while (m_stats.residentBytes + m_loadingBytes + bytes > m_settings.budgetBytes && !resident.empty() &&
+               m_cellDistances[resident.back()] > m_cellDistances[cell])
+        {
+            Evict(resident.back());
+            resident.pop_back();
+        }
+
+        if (m_stats.residentBytes + m_loadingBytes + bytes > m_settings.budgetBytes)
+        {
+            m_stats.numOverBudget++;
+            continue;
+        }
+
+        m_cellStates[cell] = CellState::Loading;
+        m_loadingBytes += bytes;
+        m_stats.numLoadingCells++;
+        requests.push_back(cell);
+    }
+
+    if (requests.empty()) return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_loadQueue.insert(m_loadQueue.end(), requests.begin(), requests.end());
+    }
+    m_loadRequested.notify_one();
+}
+
+void InstancePager::WaitForLoads()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_loadFinished.wait(lock, [&]() { return static_cast<int>(m_finishedLoads.size()) == m_stats.numLoadingCells; });
+    }
+
+    TakeFinishedLoads();
+}
+
+size_t InstancePager::GatherResident(std::vector<InstanceData>& instances,
+                                     std::vector<AABB>& bounds,
+                                     std::vector<uint32_t>& instanceIds) const
+{
+    instances.resize(m_stats.numResidentInstances);
+    bounds.resize(m_stats.numResidentInstances);
+    instanceIds.resize(m_stats.numResidentInstances);
+
+    size_t offset = 0;
+    for (size_t cell = 0; cell < m_cells.size(); ++cell)
+    {
+        const CellData* data = m_cellData[cell].get();
+        if (!data) continue;
+
+        std::copy(data->instances.begin(), data->instances.end(), instances.begin() + offset);
+        std::copy(data->bounds.begin(), data->bounds.end(), bounds.begin() + offset);
+        std::copy(data->instanceIds.begin(), data->instanceIds.end(), instanceIds.begin() + offset);
+        offset += data->instances.size();
+    }
+
+    return offset;
+}
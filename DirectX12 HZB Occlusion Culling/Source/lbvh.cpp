@@ -0,0 +1,596 @@
+#include "lbvh.hpp"
+
+#include "parallel_for.hpp"
+
+#include <array>
+#include <atomic>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Same cost model as the binned SAH builder
+static const float traversalCost = 1.f;
+static const float intersectionCost = 1.f;
+
+// Number of subtrees a treelet is restructured over. The optimal split search is O(3^n) per node.
+static const int treeletSize = 5;
+
+// Child references in the flat hierarchy: >= 0 is an internal node, < 0 is the object ~ref
+static bool IsObjectRef(int ref) { return ref < 0; }
+
+struct LBVHFlatTree
+{
+    std::vector<int> left;
+    std::vector<int> right;
+    std::vector<int> parent;
+    std::vector<int> objectParent;
+    std::vector<AABB> bounds;
+    std::vector<int> count;
+    std::vector<float> cost;
+};
+
+static AABB EmptyAABB()
+{
+    AABB aabb;
+    aabb.min = {FLT_MAX, FLT_MAX, FLT_MAX};
+    aabb.max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+    return aabb;
+}
+
+static int CountLeadingZeros(uint64_t value)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    return _BitScanReverse64(&index, value) ? 63 - static_cast<int>(index) : 64;
+#else
+    return value ? __builtin_clzll(value) : 64;
+#endif
+}
+
+// Spreads the lower 10 bits out so there are two zero bits between each
+static uint64_t ExpandBits10(uint64_t v)
+{
+    v &= 0x3ff;
+    v = (v | v << 16) & 0x30000ff;
+    v = (v | v << 8) & 0x300f00f;
+    v = (v | v << 4) & 0x30c30c3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+// Spreads the lower 21 bits out so there are two zero bits between each
+static uint64_t ExpandBits21(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v << 8) & 0x100f00f00f00f00f;
+    v = (v | v << 4) & 0x10c30c30c30c30c3;
+    v = (v | v << 2) & 0x1249249249249249;
+    return v;
+}
+
+static AABB GetCenterBounds(const std::vector<IndexedAABB>& objects)
+{
+    const size_t numChunks = std::min<size_t>(GetNumWorkerThreads() * 4, (objects.size() + 4095) / 4096);
+    const size_t chunkSize = (objects.size() + numChunks - 1) / numChunks;
+    std::vector<AABB> chunkBounds(numChunks, EmptyAABB());
+
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          const size_t end = std::min(objects.size(), (chunk + 1) * chunkSize);
+                          for (size_t i = chunk * chunkSize; i < end; ++i)
+                          {
+                              const DirectX::XMFLOAT3 center = objects[i].aabb.Center();
+                              chunkBounds[chunk].Expand({center, center});
+                          }
+                      });
+
+    AABB centerBounds = EmptyAABB();
+    for (const AABB& bounds : chunkBounds) centerBounds.Expand(bounds);
+    return centerBounds;
+}
+
+static void ComputeMortonCodes(const std::vector<IndexedAABB>& objects, std::vector<uint64_t>& codes, bool use63BitCodes)
+{
+    const AABB centerBounds = GetCenterBounds(objects);
+    const int bitsPerAxis = use63BitCodes ? 21 : 10;
+    const float gridSize = static_cast<float>((1 << bitsPerAxis) - 1);
+
+    const float extentX = centerBounds.max.x - centerBounds.min.x;
+    const float extentY = centerBounds.max.y - centerBounds.min.y;
+    const float extentZ = centerBounds.max.z - centerBounds.min.z;
+    const float scaleX = extentX > 0.f ? gridSize / extentX : 0.f;
+    const float scaleY = extentY > 0.f ? gridSize / extentY : 0.f;
+    const float scaleZ = extentZ > 0.f ? gridSize / extentZ : 0.f;
+
+    auto quantize = [=](float value, float min, float scale)
+    { return static_cast<uint64_t>(std::min(gridSize, std::max(0.f, (value - min) * scale))); };
+
+    ParallelFor(objects.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        const DirectX::XMFLOAT3 center = objects[i].aabb.Center();
+                        const uint64_t x = quantize(center.x, centerBounds.min.x, scaleX);
+                        const uint64_t y = quantize(center.y, centerBounds.min.y, scaleY);
+                        const uint64_t z = quantize(center.z, centerBounds.min.z, scaleZ);
+
+                        codes[i] = use63BitCodes ? (ExpandBits21(x) << 2) | (ExpandBits21(y) << 1) | ExpandBits21(z)
+                                                 : (ExpandBits10(x) << 2) | (ExpandBits10(y) << 1) | ExpandBits10(z);
+                    }
+                });
+}
+
+// Stable least-significant-digit radix sort of (key, value) pairs, 8 bits per pass. Every chunk histograms
+// and scatters its own range, so the chunks only meet when the digit offsets are computed.
+static void RadixSortPairs(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int numBits)
+{
+    const size_t count = keys.size();
+    const size_t numChunks = std::max<size_t>(1, std::min<size_t>(GetNumWorkerThreads() * 4, count / 65536));
+    const size_t chunkSize = (count + numChunks - 1) / numChunks;
+
+    std::vector<uint64_t> tempKeys(count);
+    std::vector<uint32_t> tempValues(count);
+    std::vector<std::array<size_t, 256>> offsets(numChunks);
+
+    for (int shift = 0; shift < numBits; shift += 8)
+    {
+        ParallelForChunks(numChunks,
+                          [&](size_t chunk)
+                          {
+                              std::array<size_t, 256>& histogram = offsets[chunk];
+                              histogram.fill(0);
+
+                              const size_t end = std::min(count, (chunk + 1) * chunkSize);
+                              for (size_t i = chunk * chunkSize; i < end; ++i) histogram[(keys[i] >> shift) & 0xff]++;
+                          });
+
+        // Exclusive scan over digits first, then chunks, which keeps the sort stable
+        size_t sum = 0;
+        for (int digit = 0; digit < 256; ++digit)
+        {
+            for (size_t chunk = 0; chunk < numChunks; ++chunk)
+            {
+                const size_t digitCount = offsets[chunk][digit];
+                offsets[chunk][digit] = sum;
+                sum += digitCount;
+            }
+        }
+
+        ParallelForChunks(numChunks,
+                          [&](size_t chunk)
+                          {
+                              std::array<size_t, 256>& offset = offsets[chunk];
+
+                              const size_t end = std::min(count, (chunk + 1) * chunkSize);
+                              for (size_t i = chunk * chunkSize; i < end; ++i)
+                              {
+                                  const size_t destination = offset[(keys[i] >> shift) & 0xff]++;
+                                  tempKeys[destination] = keys[i];
+                                  tempValues[destination] = values[i];
+                              }
+                          });
+
+        keys.swap(tempKeys);
+        values.swap(tempValues);
+    }
+}
+
+// Length of the common prefix of the codes at i and j. Duplicate codes fall back to comparing the indices.
+static int Delta(const std::vector<uint64_t>& codes, int i, int j)
+{
+    if (j < 0 || j >= static_cast<int>(codes.size())) return -1;
+
+    if (codes[i] == codes[j])
+    {
+        return 64 + CountLeadingZeros(static_cast<uint64_t>(i ^ j)) - 32;
+    }
+    return CountLeadingZeros(codes[i] ^ codes[j]);
+}
+
+// Karras 2012, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees"
+static void EmitHierarchy(const std::vector<uint64_t>& codes, LBVHFlatTree& tree)
+{
+    const int numInternal = static_cast<int>(codes.size()) - 1;
+
+    ParallelFor(numInternal,
+                [&](size_t begin, size_t end)
+                {
+                    for (int i = static_cast<int>(begin); i < static_cast<int>(end); ++i)
+                    {
+                        // The direction in which the range of this node extends
+                        const int d = Delta(codes, i, i + 1) - Delta(codes, i, i - 1) >= 0 ? 1 : -1;
+                        const int deltaMin = Delta(codes, i, i - d);
+
+                        // Upper bound of the range length, then binary search the other end
+                        int maxLength = 2;
+                        while (Delta(codes, i, i + maxLength * d) > deltaMin) maxLength *= 2;
+
+                        int length = 0;
+                        for (int step = maxLength / 2; step >= 1; step /= 2)
+                        {
+                            if (Delta(codes, i, i + (length + step) * d) > deltaMin) length += step;
+                        }
+                        const int j = i + length * d;
+
+                        // Binary search the position of the highest differing bit within the range
+                        const int deltaNode = Delta(codes, i, j);
+                        int split = 0;
+                        int step = length;
+                        do
+                        {
+                            step = (step + 1) / 2;
+                            if (Delta(codes, i, i + (split + step) * d) > deltaNode) split += step;
+                        } while (step > 1);
+                        const int gamma = i + split * d + std::min(d, 0);
+
+                        const int left = std::min(i, j) == gamma ? ~gamma : gamma;
+                        const int right = std::max(i, j) == gamma + 1 ? ~(gamma + 1) : gamma + 1;
+                        tree.left[i] = left;
+                        tree.right[i] = right;
+
+                        if (IsObjectRef(left)) tree.objectParent[~left] = i;
+                        else tree.parent[left] = i;
+
+                        if (IsObjectRef(right)) tree.objectParent[~right] = i;
+                        else tree.parent[right] = i;
+                    }
+                });
+}
+
+static float GetNodeCost(const AABB& bounds, int count, float childCost, int maxLeafSize)
+{
+    const float area = bounds.SurfaceArea();
+    const float cost = traversalCost * area + childCost;
+
+    // Small subtrees get collapsed into a single leaf when that is cheaper
+    return count <= maxLeafSize ? std::min(cost, intersectionCost * area * count) : cost;
+}
+
+static const AABB& GetBounds(const LBVHFlatTree& tree, const std::vector<IndexedAABB>& objects, int ref)
+{
+    return IsObjectRef(ref) ? objects[~ref].aabb : tree.bounds[ref];
+}
+
+static int GetCount(const LBVHFlatTree& tree, int ref) { return IsObjectRef(ref) ? 1 : tree.count[ref]; }
+
+static float GetCost(const LBVHFlatTree& tree, const std::vector<IndexedAABB>& objects, int ref)
+{
+    return IsObjectRef(ref) ? intersectionCost * objects[~ref].aabb.SurfaceArea() : tree.cost[ref];
+}
+
+// Walks up from every object in parallel. The second thread to reach a node knows both children are done
+// and handles it, the first one stops there.
+template <typename Func>
+static void ProcessBottomUp(const LBVHFlatTree& tree, Func&& processNode)
+{
+    const size_t numObjects = tree.objectParent.size();
+    std::unique_ptr<std::atomic<int>[]> visits(new std::atomic<int>[numObjects - 1]);
+    for (size_t i = 0; i < numObjects - 1; ++i) visits[i].store(0, std::memory_order_relaxed);
+
+    ParallelFor(numObjects,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        int node = tree.objectParent[i];
+                        while (node != -1)
+                        {
+                            if (visits[node].fetch_add(1, std::memory_order_acq_rel) == 0) break;
+
+                            processNode(node);
+                            node = tree.parent[node];
+                        }
+                    }
+                });
+}
+
+static void FitBounds(const std::vector<IndexedAABB>& objects, LBVHFlatTree& tree, int maxLeafSize)
+{
+    ProcessBottomUp(tree,
+                    [&](int node)
+                    {
+                        const int left = tree.left[node];
+                        const int right = tree.right[node];
+
+                        AABB bounds = GetBounds(tree, objects, left);
+                        bounds.Expand(GetBounds(tree, objects, right));
+
+                        tree.bounds[node] = bounds;
+                        tree.count[node] = GetCount(tree, left) + GetCount(tree, right);
+                        tree.cost[node] = GetNodeCost(bounds, tree.count[node],
+                                                      GetCost(tree, objects, left) + GetCost(tree, objects, right),
+                                                      maxLeafSize);
+                    });
+}
+
+// The bounds and count of a node stay the same when the treelets below it are rewritten, its cost doesn't
+static void RefreshCost(const std::vector<IndexedAABB>& objects, LBVHFlatTree& tree, int node, int maxLeafSize)
+{
+    const float childCost = GetCost(tree, objects, tree.left[node]) + GetCost(tree, objects, tree.right[node]);
+    tree.cost[node] = GetNodeCost(tree.bounds[node], tree.count[node], childCost, maxLeafSize);
+}
+
+// Karras & Aila 2013, "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies". Finds the
+// SAH-optimal topology over the treelet below root and rebuilds it in place, reusing its internal nodes.
+static void OptimizeTreelet(const std::vector<IndexedAABB>& objects, LBVHFlatTree& tree, int root, int maxLeafSize)
+{
+    int leaves[treeletSize] = {tree.left[root], tree.right[root]};
+    int internals[treeletSize - 1] = {root};
+    int numLeaves = 2;
+    int numInternals = 1;
+
+    // Grow the treelet by opening up the leaf with the largest surface area
+    while (numLeaves < treeletSize)
+    {
+        int largest = -1;
+        float largestArea = -1.f;
+        for (int i = 0; i < numLeaves; ++i)
+        {
+            if (IsObjectRef(leaves[i])) continue;
+
+            const float area = tree.bounds[leaves[i]].SurfaceArea();
+            if (area > largestArea)
+            {
+                largest = i;
+                largestArea = area;
+            }
+        }
+        if (largest == -1) break;
+
+        const int node = leaves[largest];
+        internals[numInternals++] = node;
+        leaves[largest] = tree.left[node];
+        leaves[numLeaves++] = tree.right[node];
+    }
+
+    if (numLeaves < 3) return;
+
+    // Dynamic programming over all subsets of the treelet leaves
+    const int numSubsets = 1 << numLeaves;
+    AABB subsetBounds[1 << treeletSize];
+    int subsetCount[1 << treeletSize];
+    float optimalCost[1 << treeletSize];
+    int optimalPartition[1 << treeletSize];
+
+    for (int subset = 1; subset < numSubsets; ++subset)
+    {
+        subsetBounds[subset] = EmptyAABB();
+        subsetCount[subset] = 0;
+        for (int i = 0; i < numLeaves; ++i)
+        {
+            if ((subset & (1 << i)) == 0) continue;
+
+            subsetBounds[subset].Expand(GetBounds(tree, objects, leaves[i]));
+            subsetCount[subset] += GetCount(tree, leaves[i]);
+        }
+
+        if ((subset & (subset - 1)) == 0)
+        {
+            int i = 0;
+            while ((subset >> i) != 1) ++i;
+            optimalCost[subset] = GetCost(tree, objects, leaves[i]);
+            optimalPartition[subset] = 0;
+            continue;
+        }
+
+        // Only partitions holding the lowest bit, every split is then visited once
+        const int lowestBit = subset & -subset;
+        float bestCost = FLT_MAX;
+        int bestPartition = 0;
+        for (int partition = (subset - 1) & subset; partition > 0; partition = (partition - 1) & subset)
+        {
+            if ((partition & lowestBit) == 0) continue;
+
+            const float cost = optimalCost[partition] + optimalCost[subset ^ partition];
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestPartition = partition;
+            }
+        }
+
+        optimalCost[subset] = GetNodeCost(subsetBounds[subset], subsetCount[subset], bestCost, maxLeafSize);
+        optimalPartition[subset] = bestPartition;
+    }
+
+    const int fullSet = numSubsets - 1;
+    if (optimalCost[fullSet] >= tree.cost[root] * 0.999f) return;
+
+    int nextInternal = 0;
+    auto rebuild = [&](auto& self, int subset) -> int
+    {
+        if ((subset & (subset - 1)) == 0)
+        {
+            int i = 0;
+            while ((subset >> i) != 1) ++i;
+            return leaves[i];
+        }
+
+        const int node = internals[nextInternal++];
+        const int left = self(self, optimalPartition[subset]);
+        const int right = self(self, subset ^ optimalPartition[subset]);
+
+        tree.left[node] = left;
+        tree.right[node] = right;
+        tree.bounds[node] = subsetBounds[subset];
+        tree.count[node] = subsetCount[subset];
+        tree.cost[node] = optimalCost[subset];
+
+        if (IsObjectRef(left)) tree.objectParent[~left] = node;
+        else tree.parent[left] = node;
+
+        if (IsObjectRef(right)) tree.objectParent[~right] = node;
+        else tree.parent[right] = node;
+
+        return node;
+    };
+    rebuild(rebuild, fullSet);
+}
+
+static void GatherObjects(const LBVHFlatTree& tree, int ref, std::vector<int>& output)
+{
+    if (IsObjectRef(ref))
+    {
+        output.push_back(~ref);
+        return;
+    }
+
+    GatherObjects(tree, tree.left[ref], output);
+    GatherObjects(tree, tree.right[ref], output);
+}
+
+// Converts the flat subtree to BVHNodes covering [first, first + count), writing its objects to that range
+static std::shared_ptr<BVHNode> ConvertSubtree(const LBVHFlatTree& tree,
+                                               const std::vector<IndexedAABB>& sortedObjects,
+                                               std::vector<IndexedAABB>& objects,
+                                               int ref,
+                                               int first,
+                                               int maxLeafSize)
+{
+    std::shared_ptr<BVHNode> node = std::make_shared<BVHNode>();
+    node->bounds = GetBounds(tree, sortedObjects, ref);
+    node->objectIndex = first;
+    node->objectCount = GetCount(tree, ref);
+
+    if (node->objectCount <= maxLeafSize)
+    {
+        std::vector<int> leafObjects;
+        GatherObjects(tree, ref, leafObjects);
+        for (size_t i = 0; i < leafObjects.size(); ++i) objects[first + i] = sortedObjects[leafObjects[i]];
+        return node;
+    }
+
+    const int left = tree.left[ref];
+    node->left = ConvertSubtree(tree, sortedObjects, objects, left, first, maxLeafSize);
+    node->right = ConvertSubtree(tree, sortedObjects, objects, tree.right[ref], first + GetCount(tree, left), maxLeafSize);
+
+    return node;
+}
+
+struct ConvertTask
+{
+    int ref;
+    int first;
+    std::shared_ptr<BVHNode>* output;
+};
+
+// Converts the top of the tree on this thread and queues every subtree smaller than taskSize
+static void ConvertTop(const LBVHFlatTree& tree,
+                       const std::vector<IndexedAABB>& sortedObjects,
+                       int ref,
+                       int first,
+                       int taskSize,
+                       std::shared_ptr<BVHNode>& output,
+                       std::vector<ConvertTask>& tasks)
+{
+    if (GetCount(tree, ref) <= taskSize)
+    {
+        tasks.push_back({ref, first, &output});
+        return;
+    }
+
+    output = std::make_shared<BVHNode>();
+    output->bounds = tree.bounds[ref];
+    output->objectIndex = first;
+    output->objectCount = tree.count[ref];
+
+    const int left = tree.left[ref];
+    ConvertTop(tree, sortedObjects, left, first, taskSize, output->left, tasks);
+    ConvertTop(tree, sortedObjects, tree.right[ref], first + GetCount(tree, left), taskSize, output->right, tasks);
+}
+
+std::shared_ptr<BVHNode> BuildLBVH(std::vector<IndexedAABB>& objects, const LBVHSettings& settings, BVHStats* stats)
+{
+    assert(!objects.empty() && "Can't build a BVH without objects");
+    assert(settings.maxLeafSize >= 1 && "Leaves need room for at least one object");
+
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    const int numObjects = static_cast<int>(objects.size());
+    std::shared_ptr<BVHNode> root = nullptr;
+
+    if (numObjects == 1)
+    {
+        root = std::make_shared<BVHNode>();
+        root->bounds = objects[0].aabb;
+        root->objectIndex = 0;
+        root->objectCount = 1;
+    }
+    else
+    {
+        // Sort the objects along the Morton curve
+        std::vector<uint64_t> codes(numObjects);
+        ComputeMortonCodes(objects, codes, settings.use63BitCodes);
+
+        std::vector<uint32_t> order(numObjects);
+        ParallelFor(numObjects,
+                    [&](size_t begin, size_t end)
+                    {
+                        for (size_t i = begin; i < end; ++i) order[i] = static_cast<uint32_t>(i);
+                    });
+        RadixSortPairs(codes, order, settings.use63BitCodes ? 63 : 30);
+
+        std::vector<IndexedAABB> sortedObjects(numObjects, IndexedAABB(AABB()));
+        ParallelFor(numObjects,
+                    [&](size_t begin, size_t end)
+                    {
+                        for (size_t i = begin; i < end; ++i) sortedObjects[i] = objects[order[i]];
+                    });
+
+        // Emit the hierarchy, internal node 0 is the root
+        LBVHFlatTree tree;
+        tree.left.resize(numObjects - 1);
+        tree.right.resize(numObjects - 1);
+        tree.parent.resize(numObjects - 1);
+        tree.objectParent.resize(numObjects);
+        tree.bounds.resize(numObjects - 1);
+        tree.count.resize(numObjects - 1);
+        tree.cost.resize(numObjects - 1);
+        tree.parent[0] = -1;
+
+        EmitHierarchy(codes, tree);
+        FitBounds(sortedObjects, tree, settings.maxLeafSize);
+
+        if (settings.optimizeTreelets)
+        {
+            // Both children are done when a node comes up, so its cost is refreshed from theirs before its own
+            // treelet is looked at. That carries every rewrite below up to the root.
+            ProcessBottomUp(tree,
+                            [&](int node)
+                            {
+                                RefreshCost(sortedObjects, tree, node, settings.maxLeafSize);
+                                if (tree.count[node] > settings.maxLeafSize)
+                                    OptimizeTreelet(sortedObjects, tree, node, settings.maxLeafSize);
+                            });
+        }
+
+        // Convert to BVHNodes, the subtrees in parallel
+        const int taskSize = std::max(settings.maxLeafSize, numObjects / static_cast<int>(GetNumWorkerThreads() * 16));
+
+        std::vector<ConvertTask> tasks;
+        ConvertTop(tree, sortedObjects, 0, 0, taskSize, root, tasks);
+
+        ParallelForChunks(tasks.size(),
+                          [&](size_t i)
+                          {
+                              const ConvertTask& task = tasks[i];
+                              *task.output = ConvertSubtree(tree, sortedObjects, objects, task.ref, task.first,
+                                                            settings.maxLeafSize);
+                          });
+    }
+
+    if (stats)
+    {
+        const auto endTime = std::chrono::high_resolution_clock::now();
+
+        *stats = GetBVHStats(root);
+        stats->buildTimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    }
+
+    return root;
+}
@@ -0,0 +1,132 @@
+#include "mesh_bucketing.hpp"
+
+#include "parallel_for.hpp"
+#include "screen_size_lod.hpp"
+#include "visibility_bits.hpp"
+
+// Instances per chunk. Every chunk keeps a count per mesh, so this has to stay well above the number of meshes.
+// A multiple of 32, so chunks start on a visibility word.
+static const size_t bucketChunkSize = 65536;
+
+// Calls func(index) for the visible instances of a chunk, skipping hidden words at once
+template <typename Func>
+static void ForEachVisibleInChunk(const uint32_t* visibilityBits, size_t numInstances, size_t chunk, Func&& func)
+{
+    const size_t begin = chunk * bucketChunkSize;
+    const size_t end = std::min(numInstances, begin + bucketChunkSize);
+    if (!visibilityBits)
+    {
+        for (size_t i = begin; i < end; ++i) func(i);
+        return;
+    }
+
+    ForEachVisible(visibilityBits + begin / 32, end - begin, [&](size_t i) { func(begin + i); });
+}
+
+void BucketInstancesByMesh(const uint32_t* visibilityBits,
+                           const unsigned int* meshIds,
+                           size_t numInstances,
+                           const std::vector<MeshDrawInfo>& meshes,
+                           MeshBuckets& buckets,
+                           const uint32_t* lodBits,
+                           unsigned int numLods)
+{
+    assert((numInstances == 0 || meshIds != nullptr) && "meshIds can't be null.");
+    assert(numLods >= 1 && meshes.size() % numLods == 0 && "Need the same number of LODs for every mesh id");
+
+    const size_t numMeshes = meshes.size();
+    const size_t numMeshIds = numMeshes / numLods;
+    const size_t numChunks = (numInstances + bucketChunkSize - 1) / bucketChunkSize;
+
+    // Index into meshes, LOD major
+    auto getMesh = [&](size_t i)
+    {
+        assert(meshIds[i] < numMeshIds && "Mesh id out of range");
+        return lodBits ? GetLod(lodBits, i) * numMeshIds + meshIds[i] : meshIds[i];
+    };
+
+    // Count per chunk and mesh
+    std::vector<unsigned int> offsets(numChunks * numMeshes, 0);
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          unsigned int* counts = offsets.data() + chunk * numMeshes;
+                          ForEachVisibleInChunk(visibilityBits,
+                                                numInstances,
+                                                chunk,
+                                                [&](size_t i) { counts[getMesh(i)]++; });
+                      });
+
+    // Mesh major, then chunk, so every mesh ends up contiguous and in instance order
+    buckets.commands.clear();
+    buckets.lodCommandOffsets.assign(numLods + 1, 0);
+    unsigned int total = 0;
+    for (size_t mesh = 0; mesh < numMeshes; ++mesh)
+    {
+        if (mesh % numMeshIds == 0)
+        {
+            buckets.lodCommandOffsets[mesh / numMeshIds] = static_cast<unsigned int>(buckets.commands.size());
+        }
+
+        const unsigned int meshStart = total;
+        for (size_t chunk = 0; chunk < numChunks; ++chunk)
+        {
+            unsigned int& offset = offsets[chunk * numMeshes + mesh];
+            const unsigned int count = offset;
+            offset = total;
+            total += count;
+        }
+
+        if (total == meshStart) continue;
+
+        IndirectCommand command;
+        command.InstanceOffset = meshStart;
+        command.IndexCountPerInstance = meshes[mesh].indexCount;
+        command.InstanceCount = total - meshStart;
+        command.StartIndexLocation = meshes[mesh].startIndexLocation;
+        command.BaseVertexLocation = meshes[mesh].baseVertexLocation;
+        command.StartInstanceLocation = 0;
+        buckets.commands.push_back(command);
+    }
+    buckets.lodCommandOffsets[numLods] = static_cast<unsigned int>(buckets.commands.size());
+
+    buckets.instanceIndices.resize(total);
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          unsigned int* next = offsets.data() + chunk * numMeshes;
+                          ForEachVisibleInChunk(visibilityBits,
+                                                numInstances,
+                                                chunk,
+                                                [&](size_t i)
+                                                { buckets.instanceIndices[next[getMesh(i)]++] = static_cast<unsigned int>(i); });
+                      });
+}
+
+bool SameMeshBuckets(const MeshBuckets& gpu, const MeshBuckets& cpu)
+{
+    if (gpu.commands.size() != cpu.commands.size()) return false;
+    if (gpu.instanceIndices.size() != cpu.instanceIndices.size()) return false;
+
+    for (size_t i = 0; i < cpu.commands.size(); ++i)
+    {
+        const IndirectCommand& a = gpu.commands[i];
+        const IndirectCommand& b = cpu.commands[i];
+        if (a.InstanceOffset != b.InstanceOffset || a.IndexCountPerInstance != b.IndexCountPerInstance ||
+            a.InstanceCount != b.InstanceCount || a.StartIndexLocation != b.StartIndexLocation ||
+            a.BaseVertexLocation != b.BaseVertexLocation || a.StartInstanceLocation != b.StartInstanceLocation)
+        {
+            return false;
+        }
+
+        std::vector<unsigned int> gpuInstances(gpu.instanceIndices.begin() + a.InstanceOffset,
+                                               gpu.instanceIndices.begin() + a.InstanceOffset + a.InstanceCount);
+        std::sort(gpuInstances.begin(), gpuInstances.end());
+        if (!std::equal(gpuInstances.begin(), gpuInstances.end(), cpu.instanceIndices.begin() + b.InstanceOffset))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,325 @@
+#include "multi_view_culling.hpp"
+
+#include "parallel_for.hpp"
+#include "simd_target.hpp"
+#include "visibility_bits.hpp"
+
+#include <cstring>
+#include <numeric>
+
+// Every view owns 8 plane slots, so plane p of view v is bit 8 * v + p of a plane mask and a view is two SSE steps.
+// The last two slots hold a plane every box is inside of.
+static const int planeSlotsPerView = 8;
+static const uint64_t allViewPlanes = 0x3f;
+
+static uint64_t GetViewPlaneBits(int view) { return allViewPlanes << (view * planeSlotsPerView); }
+
+// Four planes with the corner to take from the box for their positive vertex, the negative one is the other corner
+struct PlaneQuad
+{
+    __m128 a, b, c, d;
+    __m128 useMaxX, useMaxY, useMaxZ;
+};
+
+struct MultiViewPlanes
+{
+    PlaneQuad quads[maxCullViews * planeSlotsPerView / 4];
+};
+
+// The state a node hands down to its children
+struct MultiViewState
+{
+    uint64_t planeMask;       // Planes of the testing views the parent wasn't fully inside of
+    uint8_t testingViews;     // Views that intersect the parent
+    uint8_t acceptedViews;    // Views the parent was fully inside of, they see the whole subtree
+};
+
+static void SetPlaneQuads(MultiViewPlanes& planes, const XMMATRIX* viewProjections, int numViews)
+{
+    alignas(16) float values[7][maxCullViews * planeSlotsPerView] = {};
+
+    for (int view = 0; view < numViews; ++view)
+    {
+        FrustumPlanes frustum;
+        ExtractPlanes(frustum.planes, viewProjections[view], false);
+
+        for (int slot = 0; slot < planeSlotsPerView; ++slot)
+        {
+            // 0 * x + 1 >= 0 for any box
+            const Plane plane = slot < 6 ? frustum.planes[slot] : Plane{0.f, 0.f, 0.f, 1.f};
+            const int i = view * planeSlotsPerView + slot;
+
+            values[0][i] = plane.a;
+            values[1][i] = plane.b;
+            values[2][i] = plane.c;
+            values[3][i] = plane.d;
+
+            // All bits set selects the max corner, the same choice PlaneAABBIntersect makes
+            uint32_t useMax[3] = {plane.a >= 0 ? ~0u : 0u, plane.b >= 0 ? ~0u : 0u, plane.c >= 0 ? ~0u : 0u};
+            memcpy(&values[4][i], &useMax[0], sizeof(float));
+            memcpy(&values[5][i], &useMax[1], sizeof(float));
+            memcpy(&values[6][i], &useMax[2], sizeof(float));
+        }
+    }
+
+    for (int q = 0; q < numViews * planeSlotsPerView / 4; ++q)
+    {
+        PlaneQuad& quad = planes.quads[q];
+        quad.a = _mm_load_ps(&values[0][q * 4]);
+        quad.b = _mm_load_ps(&values[1][q * 4]);
+        quad.c = _mm_load_ps(&values[2][q * 4]);
+        quad.d = _mm_load_ps(&values[3][q * 4]);
+        quad.useMaxX = _mm_load_ps(&values[4][q * 4]);
+        quad.useMaxY = _mm_load_ps(&values[5][q * 4]);
+        quad.useMaxZ = _mm_load_ps(&values[6][q * 4]);
+    }
+}
+
+// Sums in the same order as XMVector3Dot and without FMA, so it's bit-exact with PlaneAABBIntersect
+static __m128 GetPlaneDistances(const PlaneQuad& quad, __m128 x, __m128 y, __m128 z)
+{
+    const __m128 ax = _mm_mul_ps(quad.a, x);
+    const __m128 by = _mm_mul_ps(quad.b, y);
+    const __m128 cz = _mm_mul_ps(quad.c, z);
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(ax, by), cz), quad.d);
+}
+
+static __m128 Select(__m128 mask, __m128 a, __m128 b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+
+// Tests the box against the planes of the testing views. Views the box is outside of stop testing, views that
+// are inside of all their planes move to the accepted views.
+static void MultiViewAABBIntersect(const AABB& box,
+                                   const MultiViewPlanes& planes,
+                                   MultiViewState& state,
+                                   MultiViewCullStats& stats)
+{
+    const __m128 minX = _mm_set1_ps(box.min.x);
+    const __m128 minY = _mm_set1_ps(box.min.y);
+    const __m128 minZ = _mm_set1_ps(box.min.z);
+    const __m128 maxX = _mm_set1_ps(box.max.x);
+    const __m128 maxY = _mm_set1_ps(box.max.y);
+    const __m128 maxZ = _mm_set1_ps(box.max.z);
+    const __m128 zero = _mm_setzero_ps();
+
+    uint64_t outside = 0;
+    uint64_t inside = 0;
+    for (uint32_t views = state.testingViews; views != 0; views &= views - 1)
+    {
+        const int view = CountTrailingZeros(views);
+        stats.planeTests += 6;
+
+        for (int q = view * 2; q < view * 2 + 2; ++q)
+        {
+            const PlaneQuad& quad = planes.quads[q];
+            const __m128 s1 = GetPlaneDistances(quad,
+                                                Select(quad.useMaxX, maxX, minX),
+                                                Select(quad.useMaxY, maxY, minY),
+                                                Select(quad.useMaxZ, maxZ, minZ));
+            const __m128 s2 = GetPlaneDistances(quad,
+                                                Select(quad.useMaxX, minX, maxX),
+                                                Select(quad.useMaxY, minY, maxY),
+                                                Select(quad.useMaxZ, minZ, maxZ));
+
+            outside |= static_cast<uint64_t>(_mm_movemask_ps(_mm_cmplt_ps(s1, zero))) << (q * 4);
+            inside |= static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpge_ps(s2, zero))) << (q * 4);
+        }
+    }
+
+    const uint64_t rejected = outside & state.planeMask;
+    state.planeMask &= ~inside;
+
+    for (uint32_t views = state.testingViews; views != 0; views &= views - 1)
+    {
+        const int view = CountTrailingZeros(views);
+        const uint64_t viewPlanes = GetViewPlaneBits(view);
+        if (rejected & viewPlanes)
+        {
+            state.testingViews &= ~(1u << view);
+            state.planeMask &= ~viewPlanes;
+        }
+        else if (!(state.planeMask & viewPlanes))
+        {
+            state.testingViews &= ~(1u << view);
+            state.acceptedViews |= 1u << view;
+        }
+    }
+}
+
+static void AddRange(std::vector<MultiViewRange>& ranges, int objectIndex, int objectCount, uint8_t viewMask)
+{
+    if (!ranges.empty() && ranges.back().viewMask == viewMask &&
+        ranges.back().objectIndex + ranges.back().objectCount == objectIndex)
+    {
+        ranges.back().objectCount += objectCount;
+    }
+    else
+    {
+        ranges.push_back({objectIndex, objectCount, viewMask});
+    }
+}
+
+// Adds the node's range once no view needs to look further down. Returns whether the children still have to be
+// visited.
+static bool VisitNode(std::vector<MultiViewRange>& ranges,
+                      const BVHNode& node,
+                      const MultiViewPlanes& planes,
+                      MultiViewState& state,
+                      MultiViewCullStats& stats)
+{
+    stats.nodesVisited++;
+
+    MultiViewAABBIntersect(node.bounds, planes, state, stats);
+    if (state.testingViews == 0 && state.acceptedViews == 0)
+    {
+        stats.nodesPruned++;
+        return false;
+    }
+
+    if (state.testingViews == 0 || node.IsLeaf())
+    {
+        AddRange(ranges, node.objectIndex, node.objectCount, state.testingViews | state.acceptedViews);
+        return false;
+    }
+
+    return true;
+}
+
+static void MultiViewBVHIntersectMasked(std::vector<MultiViewRange>& ranges,
+                                        const BVHNode& node,
+                                        const MultiViewPlanes& planes,
+                                        MultiViewState state,
+                                        MultiViewCullStats& stats)
+{
+    if (!VisitNode(ranges, node, planes, state, stats)) return;
+
+    MultiViewBVHIntersectMasked(ranges, *node.left, planes, state, stats);
+    MultiViewBVHIntersectMasked(ranges, *node.right, planes, state, stats);
+}
+
+// A piece of the output in traversal order: either ranges found above the cutoff depth, or a subtree task
+struct MultiViewCullSegment
+{
+    const BVHNode* task = nullptr;
+    MultiViewState state = {};
+
+    std::vector<MultiViewRange> ranges;
+    MultiViewCullStats stats;
+};
+
+static void CollectCullSegments(std::vector<MultiViewCullSegment>& segments,
+                                const BVHNode& node,
+                                const MultiViewPlanes& planes,
+                                MultiViewState state,
+                                int depth,
+                                int cutoffDepth,
+                                MultiViewCullStats& stats)
+{
+    if (depth == cutoffDepth && !node.IsLeaf())
+    {
+        MultiViewCullSegment segment;
+        segment.task = &node;
+        segment.state = state;
+        segments.push_back(std::move(segment));
+        return;
+    }
+
+    if (segments.empty() || segments.back().task != nullptr) segments.emplace_back();
+    if (!VisitNode(segments.back().ranges, node, planes, state, stats)) return;
+
+    CollectCullSegments(segments, *node.left, planes, state, depth + 1, cutoffDepth, stats);
+    CollectCullSegments(segments, *node.right, planes, state, depth + 1, cutoffDepth, stats);
+}
+
+void MultiViewBVHIntersect(MultiViewCullResult& result,
+                           std::shared_ptr<BVHNode>& bvh,
+                           const XMMATRIX* viewProjections,
+                           int numViews,
+                           MultiViewCullStats* stats,
+                           int cutoffDepth)
+{
+    assert(bvh != nullptr && "bvh can't be null.");
+    assert(numViews > 0 && numViews <= maxCullViews && "Between 1 and maxCullViews views");
+
+    MultiViewPlanes planes;
+    SetPlaneQuads(planes, viewProjections, numViews);
+
+    MultiViewState rootState = {};
+    for (int view = 0; view < numViews; ++view) rootState.planeMask |= GetViewPlaneBits(view);
+    rootState.testingViews = static_cast<uint8_t>((1u << numViews) - 1);
+
+    std::vector<MultiViewCullSegment> segments;
+    MultiViewCullStats topStats;
+    CollectCullSegments(segments, *bvh, planes, rootState, 0, cutoffDepth, topStats);
+
+    // Every task writes to its own segment, so the workers share nothing
+    ParallelForChunks(segments.size(),
+                      [&](size_t i)
+                      {
+                          MultiViewCullSegment& segment = segments[i];
+                          if (segment.task)
+                          {
+                              MultiViewBVHIntersectMasked(segment.ranges, *segment.task, planes, segment.state, segment.stats);
+                          }
+                      });
+
+    result.ranges.clear();
+    for (const MultiViewCullSegment& segment : segments)
+    {
+        for (const MultiViewRange& range : segment.ranges)
+        {
+            AddRange(result.ranges, range.objectIndex, range.objectCount, range.viewMask);
+        }
+    }
+
+    if (stats)
+    {
+        stats->nodesVisited += topStats.nodesVisited;
+        stats->nodesPruned += topStats.nodesPruned;
+        stats->planeTests += topStats.planeTests;
+        for (const MultiViewCullSegment& segment : segments)
+        {
+            stats->nodesVisited += segment.stats.nodesVisited;
+            stats->nodesPruned += segment.stats.nodesPruned;
+            stats->planeTests += segment.stats.planeTests;
+        }
+    }
+
+    // Object positions start at the root's objectIndex, so the masks are indexed by position
+    const std::vector<MultiViewRange>& ranges = result.ranges;
+    result.viewMasks.assign(bvh->objectIndex + bvh->objectCount, 0);
+    ParallelFor(ranges.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        std::fill_n(result.viewMasks.begin() + ranges[i].objectIndex, ranges[i].objectCount, ranges[i].viewMask);
+                    }
+                },
+                256);
+
+    // One list per view, in the same order FrustumBVHIntersect would give them
+    ParallelForChunks(maxCullViews,
+                      [&](size_t view)
+                      {
+                          std::vector<int>& visible = result.visible[view];
+                          visible.clear();
+                          if (static_cast<int>(view) >= numViews) return;
+
+                          const uint8_t viewBit = static_cast<uint8_t>(1u << view);
+                          size_t count = 0;
+                          for (const MultiViewRange& range : ranges)
+                          {
+                              if (range.viewMask & viewBit) count += range.objectCount;
+                          }
+
+                          visible.resize(count);
+                          auto output = visible.begin();
+                          for (const MultiViewRange& range : ranges)
+                          {
+                              if (!(range.viewMask & viewBit)) continue;
+
+                              std::iota(output, output + range.objectCount, range.objectIndex);
+                              output += range.objectCount;
+                          }
+                      });
+}
@@ -3,39 +3,76 @@
 
 #include "occlusion_helpers_dx12.hpp"
 #include "frustum.hpp"
+#include "bounding_volumes.hpp"
+#include "transient_resource_pool.hpp"
+#include "compact_instance.hpp"
+#include "visibility_bits.hpp"
+
+#include <numeric>
 
 using namespace DirectX;
 
-struct IndirectCommand
+// The direct queue ends every frame. The compute and copy work of a frame is waited on by the direct queue before
+// the final draw, so its fence covers the whole frame.
+class DirectQueueFence : public FrameFence
 {
-    unsigned int IndexCountPerInstance;
-    unsigned int InstanceCount;
-    unsigned int StartIndexLocation;
-    int BaseVertexLocation;
-    unsigned int StartInstanceLocation;
+public:
+    explicit DirectQueueFence(CommandQueue& queue) : m_queue(queue) {}
+
+    uint64_t Signal() override { return m_queue.Signal(); }
+    bool IsFenceComplete(uint64_t fenceValue) override { return m_queue.IsFenceComplete(fenceValue); }
+    void WaitForFenceValue(uint64_t fenceValue) override { m_queue.WaitForFenceValue(fenceValue); }
+
+private:
+    CommandQueue& m_queue;
 };
 
+// Visibility words per group of decoupledLookbackScan_cs
+static const size_t scanPartitionSize = 256;
+
+static UINT GetNumScanPartitions(size_t numInstances)
+{
+    return static_cast<UINT>((GetNumVisibilityWords(numInstances) + scanPartitionSize - 1) / scanPartitionSize);
+}
+
 void OcclusionCulling::Initialize(std::shared_ptr<std::array<VertexPosColor, 8>> vertexBuffer,
                                        std::shared_ptr<std::array<WORD, 36>> indexBuffer,
                                        std::shared_ptr<std::vector<InstanceData>> instanceData,
                                        std::shared_ptr<Heap> aabbHeap,
                                        std::shared_ptr<GpuResource> aabbBuffer,
                                        std::shared_ptr<RenderTarget> renderTarget,
-                                       const int numObjects)
+                                       const int numObjects,
+                                       InstanceFormat instanceFormat)
 {
     assert(!m_initialized && "The culling class is already initialized");
 
-    m_vertexBuffer = vertexBuffer;
+    m_vertexBuffer.assign(vertexBuffer->begin(), vertexBuffer->end());
     m_numVertices = static_cast<uint32_t>(vertexBuffer->size());
-    m_indexBuffer = indexBuffer;
+    m_indexBuffer.assign(indexBuffer->begin(), indexBuffer->end());
     m_numIndices = static_cast<uint32_t>(indexBuffer->size());
-    m_instanceDataBuffer = instanceData;
     m_numInstances = static_cast<uint32_t>(instanceData->size());
+    m_instanceFormat = instanceFormat;
+
+    // The compact copy replaces the matrices, on the CPU and on the GPU
+    if (m_instanceFormat == InstanceFormat::Compact)
+    {
+        m_compactInstances.resize(instanceData->size());
+        EncodeInstances(instanceData->data(), m_compactInstances.data(), instanceData->size());
+    }
+    else
+    {
+        m_instanceDataBuffer = instanceData;
+    }
     m_aabbHeap = aabbHeap;
     m_aabbBuffer = aabbBuffer;
     m_renderTarget = renderTarget;
     m_numObjects = numObjects;
 
+    // A single mesh used by every instance, until SetMeshes
+    m_meshes = {{m_numIndices, 0, 0}};
+    m_numMeshes = 1;
+    m_meshIdBuffer.assign(numObjects, 0);
+
     m_device = Engine.m_device;
 
     m_width = m_device->GetWidth();
@@ -54,13 +91,59 @@ void OcclusionCulling::Initialize(std::shared_ptr<std::array<VertexPosColor, 8>>
 
     PopulateResources();
 
+    CreateMeshResources();
+
     m_initialized = true;
 }
 
+void OcclusionCulling::SetMeshes(const std::vector<VertexPosColor>& vertices,
+                                 const std::vector<WORD>& indices,
+                                 const std::vector<MeshDrawInfo>& meshes,
+                                 const std::vector<unsigned int>& meshIds,
+                                 unsigned int numLods)
+{
+    assert(m_initialized && "Initialize the culling class before setting meshes");
+    assert(!meshes.empty() && "Need at least one mesh");
+    assert(numLods >= 1 && numLods <= maxLods && meshes.size() % numLods == 0 && "Need numLods meshes per mesh id");
+    assert(meshIds.size() == static_cast<size_t>(m_numObjects) && "Need one mesh id per instance");
+
+    // The mesh buffers are shared by the frames in flight
+    DirectQueueFence frameFence(m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT));
+    m_frameScheduler.WaitForIdle(frameFence);
+
+    m_vertexBuffer = vertices;
+    m_numVertices = static_cast<uint32_t>(vertices.size());
+    m_indexBuffer = indices;
+    m_numIndices = static_cast<uint32_t>(indices.size());
+    m_meshes = meshes;
+    m_numMeshes = static_cast<uint32_t>(meshes.size());
+    m_numLods = numLods;
+    m_meshIdBuffer = meshIds;
+
+    CreateMeshResources();
+
+    // The draws of earlier frames point into the old mesh table
+    m_lastCulledFrame = -1;
+}
+
 void OcclusionCulling::Update(XMMATRIX& cameraVP) { ExtractPlanes(m_FrustumPlanes->planes, cameraVP, false); }
 
 void OcclusionCulling::Render(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP)
 {
+    auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
+    auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    auto& commandQueueCopy = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COPY);
+
+    // Only blocks when the GPU is still busy with the frame that used this slot last
+    DirectQueueFence frameFence(commandQueueDirect);
+    m_frameIndex = m_frameScheduler.BeginFrame(frameFence);
+
+    ReleaseFinishedUploads();
+
+    // Instance updates go through the copy queue
+    commandQueueCompute.Wait(commandQueueCopy);
+    commandQueueDirect.Wait(commandQueueCopy);
+
     if (m_renderCulling)
     {
         HzbCulling(mainCameraVP, debugCameraVP);
@@ -69,18 +152,89 @@ void OcclusionCulling::Render(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP)
     {
         VisualizeMipMaps(&mainCameraVP);
     }
+
+    m_frameScheduler.EndFrame(frameFence);
+}
+
+void OcclusionCulling::UpdateInstances(const std::vector<int>& changedInstances,
+                                       const std::vector<InstanceData>& instanceData,
+                                       const std::vector<AABB>& bounds)
+{
+    assert(m_initialized && "Initialize the culling class before updating instances");
+    assert(bounds.size() == changedInstances.size() && "Need one AABB per changed instance");
+
+    if (changedInstances.empty()) return;
+
+    // Sorted, so neighbouring instances end up in a single copy. An instance given twice keeps its last bounds.
+    std::vector<int> order(changedInstances.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return changedInstances[a] < changedInstances[b]; });
+
+    std::vector<int> sortedInstances;
+    std::vector<AABB> sortedBounds;
+    sortedInstances.reserve(order.size());
+    sortedBounds.reserve(order.size());
+    for (int i : order)
+    {
+        if (!sortedInstances.empty() && sortedInstances.back() == changedInstances[i])
+        {
+            sortedBounds.back() = bounds[i];
+            continue;
+        }
+        sortedInstances.push_back(changedInstances[i]);
+        sortedBounds.push_back(bounds[i]);
+    }
+
+    const UINT instanceStride = GetInstanceStride();
+    std::vector<unsigned char> packedInstances(sortedInstances.size() * instanceStride);
+    for (size_t i = 0; i < sortedInstances.size(); ++i)
+    {
+        const int instance = sortedInstances[i];
+        assert(instance >= 0 && instance < m_numObjects && "Instance index out of range");
+
+        if (m_instanceFormat == InstanceFormat::Compact)
+        {
+            m_compactInstances[instance] = EncodeInstance(instanceData[instance].WorldMatrix);
+        }
+        else
+        {
+            (*m_instanceDataBuffer)[instance] = instanceData[instance];
+        }
+
+        memcpy(packedInstances.data() + i * instanceStride,
+               static_cast<const unsigned char*>(GetInstanceBufferData()) + static_cast<size_t>(instance) * instanceStride,
+               instanceStride);
+    }
+
+    auto& commandQueue = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COPY);
+    auto commandList = commandQueue.GetCommandList();
+
+    ComPtr<ID3D12Resource> uploadBuffer1;
+    auto& instanceResource = m_instanceData.GetResource();
+    PopulateBufferElements(commandList, instanceResource, uploadBuffer1, packedInstances.data(), sortedInstances, instanceStride);
+
+    ComPtr<ID3D12Resource> uploadBuffer2;
+    auto& aabbResource = m_aabbBuffer->GetResource();
+    PopulateBufferElements(commandList, aabbResource, uploadBuffer2, sortedBounds.data(), sortedInstances, sizeof(AABB));
+
+    // Both buffers are shared by the frames in flight. The last direct signal comes after all of their work, the
+    // next frame waits for the copy in Render.
+    commandQueue.Wait(m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT));
+    auto fence = commandQueue.ExecuteCommandList(commandList);
+
+    KeepUploadAlive(uploadBuffer1, fence);
+    KeepUploadAlive(uploadBuffer2, fence);
 }
 
 void OcclusionCulling::InitPSOs()
 {
-    InitDepthPSO();
-    InitDrawPSO();
     InitVisualizeMipsPSO();
     InitCullingPSO();
-    InitFirstPrefixPSO();
-    InitSecondPrefixPSO();
-    InitRecursivePrefixPSO();
-    InitFillIndirectBufferPSO();
+    InitMeshCountPSO();
+    InitMeshCommandsPSO();
+    InitMeshScatterPSO();
+    InitVisibilityScanPSO();
+    InitVisibilityCompactPSO();
     InitIndirectDrawPSO();
     InitIndirectDepthPSO();
 }
@@ -141,66 +295,92 @@ void OcclusionCulling::InitViews()
 {
     {
         auto& resource = m_instanceData.GetResource();
-        CreateStructuredBuffer(resource, m_numObjects, sizeof(InstanceData), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+        CreateStructuredBuffer(resource, m_numObjects, GetInstanceStride(), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
         resource->SetName(L"instance data resource");
-        m_instanceData.SetSRV(m_srvHeap.CreateSRV(resource, m_numObjects, sizeof(InstanceData)));  // 0
-        m_instanceData.SetUAV(m_uavHeap.CreateUAV(resource, m_numObjects, sizeof(InstanceData)));
+        m_instanceData.SetSRV(m_srvHeap.CreateSRV(resource, m_numObjects, GetInstanceStride()));
+        m_instanceData.SetUAV(m_uavHeap.CreateUAV(resource, m_numObjects, GetInstanceStride()));
     }
 
+    // Everything else is bound as root views, so no descriptors and no cap on the number of instances
+    for (FrameResources& frame : m_frames)
     {
-        auto& resource = m_visibility.GetResource();
-        CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        resource->SetName(L"visibility resource");
-        m_visibility.SetSRV(m_srvHeap.CreateSRV(resource, m_numObjects, sizeof(unsigned int)));  // 1
-        m_visibility.SetUAV(m_uavHeap.CreateUAV(resource, m_numObjects, sizeof(unsigned int)));
-    }
+        {
+            auto& resource = frame.visibility.GetResource();
+            CreateStructuredBuffer(resource,
+                                   static_cast<UINT>(GetNumVisibilityWords(m_numObjects)),
+                                   sizeof(uint32_t),
+                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"visibility resource");
+        }
 
-    {
-        auto& resource = m_scanResult.GetResource();
-        CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        resource->SetName(L"scan result resource");
-        m_scanResult.SetSRV(m_srvHeap.CreateSRV(resource, m_numObjects, sizeof(unsigned int)));  // 2
-        m_scanResult.SetUAV(m_uavHeap.CreateUAV(resource, m_numObjects, sizeof(unsigned int)));
-    }
+        {
+            auto& resource = frame.lods.GetResource();
+            CreateStructuredBuffer(resource,
+                                   static_cast<UINT>(GetNumLodWords(m_numObjects)),
+                                   sizeof(uint32_t),
+                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"lod resource");
+        }
 
-    {
-        auto& resource = m_count.GetResource();
-        CreateStructuredBuffer(resource, m_numObjects, sizeof(uint32_t), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        resource->SetName(L"count resource");
-        m_count.SetSRV(m_srvHeap.CreateSRV(resource, 1, sizeof(uint32_t)));  // 3
-        m_count.SetUAV(m_uavHeap.CreateUAV(resource, 1, sizeof(uint32_t)));
+        {
+            auto& resource = frame.meshRanks.GetResource();
+            CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"mesh rank resource");
+        }
+
+        {
+            auto& resource = frame.wordOffsets.GetResource();
+            CreateStructuredBuffer(resource,
+                                   static_cast<UINT>(GetNumVisibilityWords(m_numObjects)),
+                                   sizeof(uint32_t),
+                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"word offset resource");
+        }
+
+        {
+            auto& resource = frame.scanPartitions.GetResource();
+            CreateStructuredBuffer(resource,
+                                   GetNumScanPartitions(m_numObjects),
+                                   sizeof(uint32_t),
+                                   D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"scan partition resource");
+        }
+
+        {
+            auto& resource = frame.scanCounter.GetResource();
+            CreateStructuredBuffer(resource, 1, sizeof(uint32_t), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"scan counter resource");
+        }
+
+        {
+            auto& resource = frame.draws.matrixIndex.GetResource();
+            CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"WorldMatrixIndex resource");
+        }
+
+        {
+            auto& resource = frame.draws.count.GetResource();
+            CreateStructuredBuffer(resource, 1, sizeof(uint32_t), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"count resource");
+        }
     }
 
     {
-        auto& resource = m_matrixIndex.GetResource();
-        CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        resource->SetName(L"WorldMatrixIndex resource");
-        m_matrixIndex.SetSRV(m_srvHeap.CreateSRV(resource, m_numObjects, sizeof(unsigned int)));  // 4
-        m_matrixIndex.SetUAV(m_uavHeap.CreateUAV(resource, m_numObjects, sizeof(unsigned int)));
+        auto& resource = m_allInstances.matrixIndex.GetResource();
+        CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int));
+        resource->SetName(L"all instances WorldMatrixIndex resource");
     }
 
     {
-        // Max objects to draw is for now 600.000. This because I'm using 1 descriptor table of UAVs, that is limited to 32
-        // (using 2 already for other buffers) descriptors. 30 * 20.000 = 600.000
-        auto& resource = m_indirectArgs.GetResource();
-        CreateStructuredBuffer(resource, 100000, sizeof(IndirectCommand), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        resource->SetName(L"indirect args buffer");
-        m_indirectArgs.SetSRV(m_srvHeap.CreateSRV(resource, 20000, sizeof(IndirectCommand)));  // 5
-        m_indirectArgs.SetUAV(m_uavHeap.CreateUAV(resource, 20000, sizeof(IndirectCommand)));
+        auto& resource = m_allInstances.count.GetResource();
+        CreateStructuredBuffer(resource, 1, sizeof(uint32_t));
+        resource->SetName(L"all instances count resource");
     }
 
-    // amount is equal to log256(n) == log(n)/log(256)
-    m_numWorkGroupBuffers = static_cast<int>(std::ceil(std::log(m_numObjects) / std::log(256)));
-    int amountofSums = m_numObjects / 256;
-    for (int i = 0; i < m_numWorkGroupBuffers; i++)
     {
-        ComPtr<ID3D12Resource> groupSumBuffer;  // 6 + i
-        CreateStructuredBuffer(groupSumBuffer, amountofSums, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
-        m_groupSums.push_back(groupSumBuffer);
-
-        m_groupSums[i].SetUAV(m_uavHeap.CreateUAV(groupSumBuffer, amountofSums, sizeof(unsigned int)));
-
-        amountofSums = static_cast<int>(std::ceil(static_cast<double>(amountofSums) / 256.f));
+        auto& resource = m_meshIds.GetResource();
+        CreateStructuredBuffer(resource, m_numObjects, sizeof(unsigned int));
+        resource->SetName(L"mesh id resource");
     }
 }
 
@@ -216,231 +396,195 @@ void OcclusionCulling::PopulateResources()
     PopulateBuffer(commandList,
                    instanceResource,
                    uploadBuffer1,
-                   m_instanceDataBuffer.get()->data(),
+                   GetInstanceBufferData(),
                    m_numObjects,
-                   sizeof(InstanceData));
-
-    std::vector<unsigned int> visibilityData(m_numObjects, 1);
-    ComPtr<ID3D12Resource> uploadBuffer2;
-    auto& visibilityResource = m_visibility.GetResource();
-    PopulateBuffer(commandList, visibilityResource, uploadBuffer2, visibilityData.data(), m_numObjects, sizeof(unsigned int));
+                   GetInstanceStride());
+
+    // Everything starts out visible, in every frame
+    std::vector<uint32_t> visibilityData(GetNumVisibilityWords(m_numObjects));
+    SetAllVisible(visibilityData.data(), m_numObjects);
+    // And at LOD 0
+    m_cpuLodBits.assign(GetNumLodWords(m_numObjects), 0);
+    // The look-back state of the scan is cleared by the pass after it, so it only starts at zero once
+    std::vector<uint32_t> scanZeros(GetNumScanPartitions(m_numObjects), 0);
+    std::vector<ComPtr<ID3D12Resource>> uploadBuffers(cullingFramesInFlight * 4);
+    for (int i = 0; i < cullingFramesInFlight; i++)
+    {
+        auto& visibilityResource = m_frames[i].visibility.GetResource();
+        PopulateBuffer(commandList,
+                       visibilityResource,
+                       uploadBuffers[i * 4],
+                       visibilityData.data(),
+                       static_cast<UINT>(visibilityData.size()),
+                       sizeof(uint32_t));
+
+        auto& lodResource = m_frames[i].lods.GetResource();
+        PopulateBuffer(commandList,
+                       lodResource,
+                       uploadBuffers[i * 4 + 1],
+                       m_cpuLodBits.data(),
+                       static_cast<UINT>(m_cpuLodBits.size()),
+                       sizeof(uint32_t));
+
+        auto& scanPartitionResource = m_frames[i].scanPartitions.GetResource();
+        PopulateBuffer(commandList,
+                       scanPartitionResource,
+                       uploadBuffers[i * 4 + 2],
+                       scanZeros.data(),
+                       static_cast<UINT>(scanZeros.size()),
+                       sizeof(uint32_t));
+
+        auto& scanCounterResource = m_frames[i].scanCounter.GetResource();
+        PopulateBuffer(commandList, scanCounterResource, uploadBuffers[i * 4 + 3], scanZeros.data(), 1, sizeof(uint32_t));
+    }
 
+    // Only once, at startup
     auto fence = commandQueue.ExecuteCommandList(commandList);
     commandQueue.WaitForFenceValue(fence);
 }
 
-void OcclusionCulling::CreateStructuredBuffer(ComPtr<ID3D12Resource>& resource,
-                                                   UINT numElements,
-                                                   UINT elementSize,
-                                                   D3D12_RESOURCE_FLAGS flags)
+void OcclusionCulling::CreateMeshResources()
 {
-    D3D12_RESOURCE_DESC instanceBufferDesc = {};
-    instanceBufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
-    instanceBufferDesc.Width = elementSize * numElements;  // Total buffer size
-    instanceBufferDesc.Height = 1;
-    instanceBufferDesc.DepthOrArraySize = 1;
-    instanceBufferDesc.MipLevels = 1;
-    instanceBufferDesc.Format = DXGI_FORMAT_UNKNOWN;  // Structured buffers use a typeless format
-    instanceBufferDesc.SampleDesc.Count = 1;
-    instanceBufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
-    instanceBufferDesc.Flags = flags;
+    // Everything sized by the number of meshes. SetMeshes calls this again after a WaitForIdle, the old buffers are
+    // released in CreateStructuredBuffer.
+    {
+        auto& resource = m_meshTable.GetResource();
+        CreateStructuredBuffer(resource, m_numMeshes, sizeof(MeshDrawInfo));
+        resource->SetName(L"mesh table resource");
+    }
 
-    CD3DX12_HEAP_PROPERTIES heapProperties(D3D12_HEAP_TYPE_DEFAULT);
-    m_device->GetD3D12Device()->CreateCommittedResource(&heapProperties,  // Default heap for GPU access
-                                                        D3D12_HEAP_FLAG_NONE,
-                                                        &instanceBufferDesc,
-                                                        D3D12_RESOURCE_STATE_COMMON,  // Initial state
-                                                        nullptr,
-                                                        IID_PPV_ARGS(&resource));
+    for (FrameResources& frame : m_frames)
+    {
+        {
+            auto& resource = frame.meshCounts.GetResource();
+            CreateStructuredBuffer(resource, m_numMeshes, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"mesh count resource");
+        }
 
-    ResourceStateTracker::AddGlobalResourceState(resource.Get(), D3D12_RESOURCE_STATE_COMMON);
-}
+        {
+            auto& resource = frame.meshOffsets.GetResource();
+            CreateStructuredBuffer(resource, m_numMeshes, sizeof(unsigned int), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"mesh offset resource");
+        }
 
-void OcclusionCulling::InitDepthPSO()
-{
-    // Load the vertex shader.
-    ComPtr<ID3DBlob> vertexShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/depth_vs.cso", &vertexShaderBlob));
+        {
+            auto& resource = frame.draws.indirectArgs.GetResource();
+            CreateStructuredBuffer(resource, m_numMeshes, sizeof(IndirectCommand), D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
+            resource->SetName(L"indirect args buffer");
+        }
+    }
 
-    // Load the pixel shader.
-    ComPtr<ID3DBlob> pixelShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/depth_ps.cso", &pixelShaderBlob));
+    {
+        auto& resource = m_allInstances.indirectArgs.GetResource();
+        CreateStructuredBuffer(resource, m_numMeshes, sizeof(IndirectCommand));
+        resource->SetName(L"all instances indirect args buffer");
+    }
 
-    // Allow input layout and deny unnecessary access to certain pipeline stages.
-    D3D12_ROOT_SIGNATURE_FLAGS rootSignatureFlags =
-        D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT | D3D12_ROOT_SIGNATURE_FLAG_DENY_HULL_SHADER_ROOT_ACCESS |
-        D3D12_ROOT_SIGNATURE_FLAG_DENY_DOMAIN_SHADER_ROOT_ACCESS | D3D12_ROOT_SIGNATURE_FLAG_DENY_GEOMETRY_SHADER_ROOT_ACCESS |
-        D3D12_ROOT_SIGNATURE_FLAG_DENY_PIXEL_SHADER_ROOT_ACCESS;
+    // The draw list of every instance never changes with the camera, so it is built once on the CPU
+    MeshBuckets allInstances;
+    BucketInstancesByMesh(nullptr, m_meshIdBuffer.data(), m_numObjects, m_meshes, allInstances, nullptr, m_numLods);
+    unsigned int numDraws = static_cast<unsigned int>(allInstances.commands.size());
 
-    // A single 32-bit constant root parameter that is used by the vertex shader.
-    CD3DX12_ROOT_PARAMETER1 rootParameters[2];
-    rootParameters[0].InitAsConstants(sizeof(XMMATRIX) / 4, 0, 0, D3D12_SHADER_VISIBILITY_VERTEX);  // VP matrix
-    rootParameters[1].InitAsShaderResourceView(0, 0);                                               // Instance Data
+    auto& commandQueue = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COPY);
+    auto commandList = commandQueue.GetCommandList();
 
-    CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDescription;
-    rootSignatureDescription.Init_1_1(_countof(rootParameters), rootParameters, 0, nullptr, rootSignatureFlags);
+    std::vector<ComPtr<ID3D12Resource>> uploadBuffers(5 + cullingFramesInFlight);
 
-    m_depthPass.rs = m_device->CreateRootSignature(rootSignatureDescription.Desc_1_1);
-    m_depthPass.rs->GetD3D12RootSignature()->SetName(L"Depth RS");
+    auto& meshIdResource = m_meshIds.GetResource();
+    PopulateBuffer(commandList, meshIdResource, uploadBuffers[0], m_meshIdBuffer.data(), m_numObjects, sizeof(unsigned int));
 
-    // Create the vertex input layout
-    D3D12_INPUT_ELEMENT_DESC inputLayout[] = {
-        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0}};
+    auto& meshTableResource = m_meshTable.GetResource();
+    PopulateBuffer(commandList, meshTableResource, uploadBuffers[1], m_meshes.data(), m_numMeshes, sizeof(MeshDrawInfo));
 
-    // Create a color buffer with sRGB for gamma correction.
-    DXGI_FORMAT backBufferFormat = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
-
-    DXGI_SAMPLE_DESC sampleDesc;
-    sampleDesc.Count = 1;
-    sampleDesc.Quality = 0;
+    auto& matrixIndexResource = m_allInstances.matrixIndex.GetResource();
+    PopulateBuffer(commandList,
+                   matrixIndexResource,
+                   uploadBuffers[2],
+                   allInstances.instanceIndices.data(),
+                   m_numObjects,
+                   sizeof(unsigned int));
 
-    struct PipelineStateStream
+    auto& indirectArgsResource = m_allInstances.indirectArgs.GetResource();
+    PopulateBuffer(commandList,
+                   indirectArgsResource,
+                   uploadBuffers[3],
+                   allInstances.commands.data(),
+                   numDraws,
+                   sizeof(IndirectCommand));
+
+    auto& countResource = m_allInstances.count.GetResource();
+    PopulateBuffer(commandList, countResource, uploadBuffers[4], &numDraws, 1, sizeof(unsigned int));
+
+    // The command pass clears the counts after it read them, so they only start at zero once
+    std::vector<unsigned int> zeros(m_numMeshes, 0);
+    for (int i = 0; i < cullingFramesInFlight; i++)
     {
-        CD3DX12_PIPELINE_STATE_STREAM_ROOT_SIGNATURE pRootSignature;
-        CD3DX12_PIPELINE_STATE_STREAM_INPUT_LAYOUT InputLayout;
-        CD3DX12_PIPELINE_STATE_STREAM_PRIMITIVE_TOPOLOGY PrimitiveTopologyType;
-        CD3DX12_PIPELINE_STATE_STREAM_VS VS;
-        CD3DX12_PIPELINE_STATE_STREAM_PS PS;
-        CD3DX12_PIPELINE_STATE_STREAM_DEPTH_STENCIL_FORMAT DSVFormat;
-        CD3DX12_PIPELINE_STATE_STREAM_DEPTH_STENCIL DepthStencil;
-        CD3DX12_PIPELINE_STATE_STREAM_RENDER_TARGET_FORMATS RTVFormats;
-        CD3DX12_PIPELINE_STATE_STREAM_RASTERIZER Rasterizer;
-        CD3DX12_PIPELINE_STATE_STREAM_SAMPLE_DESC SampleDesc;
-    } pipelineStateStream;
-
-    D3D12_RT_FORMAT_ARRAY rtvFormats = {};
-    rtvFormats.NumRenderTargets = 1;
-    rtvFormats.RTFormats[0] = backBufferFormat;
-
-    D3D12_RASTERIZER_DESC rasterizerDesc = {};
-    rasterizerDesc.FillMode = D3D12_FILL_MODE_SOLID;  // Solid fill mode (no wireframe)
-    rasterizerDesc.CullMode = D3D12_CULL_MODE_BACK;   // Enable backface culling
-    rasterizerDesc.FrontCounterClockwise = FALSE;     // Clockwise winding is front-facing
-    rasterizerDesc.DepthBias = 0;
-    rasterizerDesc.DepthBiasClamp = 0.0f;
-    rasterizerDesc.SlopeScaledDepthBias = 0.0f;
-    rasterizerDesc.DepthClipEnable = TRUE;  // Enable depth clipping
-    rasterizerDesc.MultisampleEnable = TRUE;
-    rasterizerDesc.AntialiasedLineEnable = FALSE;
-    rasterizerDesc.ForcedSampleCount = 0;
-    rasterizerDesc.ConservativeRaster = D3D12_CONSERVATIVE_RASTERIZATION_MODE_OFF;
-
-    CD3DX12_DEPTH_STENCIL_DESC depthStencilDesc = {};
-    depthStencilDesc.DepthEnable = TRUE;
-    depthStencilDesc.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ALL;
-    depthStencilDesc.DepthFunc = D3D12_COMPARISON_FUNC_LESS;
-    depthStencilDesc.StencilEnable = FALSE;
-
-    pipelineStateStream.pRootSignature = m_depthPass.rs->GetD3D12RootSignature().Get();
-    pipelineStateStream.InputLayout = {inputLayout, _countof(inputLayout)};
-    pipelineStateStream.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
-    pipelineStateStream.VS = CD3DX12_SHADER_BYTECODE(vertexShaderBlob.Get());
-    pipelineStateStream.PS = CD3DX12_SHADER_BYTECODE(pixelShaderBlob.Get());
-    pipelineStateStream.DSVFormat = DXGI_FORMAT_D32_FLOAT;
-    pipelineStateStream.DepthStencil = {depthStencilDesc};
-    pipelineStateStream.RTVFormats = rtvFormats;
-    pipelineStateStream.Rasterizer = {CD3DX12_RASTERIZER_DESC(rasterizerDesc)};
-    pipelineStateStream.SampleDesc = sampleDesc;
+        auto& meshCountResource = m_frames[i].meshCounts.GetResource();
+        PopulateBuffer(commandList, meshCountResource, uploadBuffers[5 + i], zeros.data(), m_numMeshes, sizeof(unsigned int));
+    }
 
-    m_depthPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_depthPass.pso->GetD3D12PipelineState()->SetName(L"Depth PSO");
+    // Only at startup and when the meshes change
+    auto fence = commandQueue.ExecuteCommandList(commandList);
+    commandQueue.WaitForFenceValue(fence);
 }
 
-void OcclusionCulling::InitDrawPSO()
+UINT OcclusionCulling::GetInstanceStride() const
 {
-    // Load the vertex shader.
-    ComPtr<ID3DBlob> vertexShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/draw_objects_vs.cso", &vertexShaderBlob));
-
-    // Load the pixel shader.
-    ComPtr<ID3DBlob> pixelShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/draw_objects_ps.cso", &pixelShaderBlob));
-
-    // Allow input layout and deny unnecessary access to certain pipeline stages.
-    D3D12_ROOT_SIGNATURE_FLAGS rootSignatureFlags =
-        D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT | D3D12_ROOT_SIGNATURE_FLAG_DENY_HULL_SHADER_ROOT_ACCESS |
-        D3D12_ROOT_SIGNATURE_FLAG_DENY_DOMAIN_SHADER_ROOT_ACCESS | D3D12_ROOT_SIGNATURE_FLAG_DENY_GEOMETRY_SHADER_ROOT_ACCESS |
-        D3D12_ROOT_SIGNATURE_FLAG_DENY_PIXEL_SHADER_ROOT_ACCESS;
-
-    // A single 32-bit constant root parameter that is used by the vertex shader.
-    CD3DX12_ROOT_PARAMETER1 rootParameters[3];
-    rootParameters[0].InitAsConstants(sizeof(XMMATRIX) / 4, 0, 0, D3D12_SHADER_VISIBILITY_VERTEX);  // VP matrix
-    rootParameters[1].InitAsShaderResourceView(0, 0);                                               // Instance Data
-    rootParameters[2].InitAsShaderResourceView(1, 0);                                               // Cull Results
-
-    CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDescription;
-    rootSignatureDescription.Init_1_1(_countof(rootParameters), rootParameters, 0, nullptr, rootSignatureFlags);
-
-    m_drawPass.rs = m_device->CreateRootSignature(rootSignatureDescription.Desc_1_1);
-    m_drawPass.rs->GetD3D12RootSignature()->SetName(L"Draw Objects RS");
-
-    // Create the vertex input layout
-    D3D12_INPUT_ELEMENT_DESC inputLayout[] = {
-        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
-        {"COLOR", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0},
-        {"WORLD", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 0, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1},
-        {"WORLD", 1, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 16, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1},
-        {"WORLD", 2, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 32, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1},
-        {"WORLD", 3, DXGI_FORMAT_R32G32B32A32_FLOAT, 1, 48, D3D12_INPUT_CLASSIFICATION_PER_INSTANCE_DATA, 1},
-    };
-
-    // Create a color buffer with sRGB for gamma correction.
-    DXGI_FORMAT backBufferFormat = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
-
-    DXGI_SAMPLE_DESC sampleDesc;
-    sampleDesc.Count = 1;
-    sampleDesc.Quality = 0;
-
-    struct PipelineStateStream
-    {
-        CD3DX12_PIPELINE_STATE_STREAM_ROOT_SIGNATURE pRootSignature;
-        CD3DX12_PIPELINE_STATE_STREAM_INPUT_LAYOUT InputLayout;
-        CD3DX12_PIPELINE_STATE_STREAM_PRIMITIVE_TOPOLOGY PrimitiveTopologyType;
-        CD3DX12_PIPELINE_STATE_STREAM_VS VS;
-        CD3DX12_PIPELINE_STATE_STREAM_PS PS;
-        CD3DX12_PIPELINE_STATE_STREAM_DEPTH_STENCIL_FORMAT DSVFormat;
-        CD3DX12_PIPELINE_STATE_STREAM_DEPTH_STENCIL DepthStencil;
-        CD3DX12_PIPELINE_STATE_STREAM_RENDER_TARGET_FORMATS RTVFormats;
-        CD3DX12_PIPELINE_STATE_STREAM_RASTERIZER Rasterizer;
-        CD3DX12_PIPELINE_STATE_STREAM_SAMPLE_DESC SampleDesc;
-    } pipelineStateStream;
+    return m_instanceFormat == InstanceFormat::Compact ? sizeof(CompactInstance) : sizeof(InstanceData);
+}
 
-    D3D12_RT_FORMAT_ARRAY rtvFormats = {};
-    rtvFormats.NumRenderTargets = 1;
-    rtvFormats.RTFormats[0] = backBufferFormat;
+void* OcclusionCulling::GetInstanceBufferData()
+{
+    if (m_instanceFormat == InstanceFormat::Compact) return m_compactInstances.data();
+    return m_instanceDataBuffer->data();
+}
 
-    D3D12_RASTERIZER_DESC rasterizerDesc = {};
-    rasterizerDesc.FillMode = D3D12_FILL_MODE_SOLID;  // Solid fill mode (no wireframe)
-    rasterizerDesc.CullMode = D3D12_CULL_MODE_BACK;   // Enable backface culling
-    rasterizerDesc.FrontCounterClockwise = FALSE;     // Clockwise winding is front-facing
-    rasterizerDesc.DepthBias = 0;
-    rasterizerDesc.DepthBiasClamp = 0.0f;
-    rasterizerDesc.SlopeScaledDepthBias = 0.0f;
-    rasterizerDesc.DepthClipEnable = TRUE;  // Enable depth clipping
-    rasterizerDesc.MultisampleEnable = FALSE;
-    rasterizerDesc.AntialiasedLineEnable = FALSE;
-    rasterizerDesc.ForcedSampleCount = 0;
-    rasterizerDesc.ConservativeRaster = D3D12_CONSERVATIVE_RASTERIZATION_MODE_OFF;
+void OcclusionCulling::KeepUploadAlive(ComPtr<ID3D12Resource> uploadBuffer, uint64_t fenceValue)
+{
+    m_pendingUploads.emplace_back(fenceValue, uploadBuffer);
+}
 
-    CD3DX12_DEPTH_STENCIL_DESC depthStencilDesc = {};
-    depthStencilDesc.DepthEnable = TRUE;
-    depthStencilDesc.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ALL;
-    depthStencilDesc.DepthFunc = D3D12_COMPARISON_FUNC_LESS;
-    depthStencilDesc.StencilEnable = FALSE;
+void OcclusionCulling::ReleaseFinishedUploads()
+{
+    auto& commandQueueCopy = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COPY);
+    m_pendingUploads.erase(std::remove_if(m_pendingUploads.begin(),
+                                          m_pendingUploads.end(),
+                                          [&](const auto& upload) { return commandQueueCopy.IsFenceComplete(upload.first); }),
+                           m_pendingUploads.end());
+}
 
-    pipelineStateStream.pRootSignature = m_drawPass.rs->GetD3D12RootSignature().Get();
-    pipelineStateStream.InputLayout = {inputLayout, _countof(inputLayout)};
-    pipelineStateStream.PrimitiveTopologyType = D3D12_PRIMITIVE_TOPOLOGY_TYPE_TRIANGLE;
-    pipelineStateStream.VS = CD3DX12_SHADER_BYTECODE(vertexShaderBlob.Get());
-    pipelineStateStream.PS = CD3DX12_SHADER_BYTECODE(pixelShaderBlob.Get());
-    pipelineStateStream.DSVFormat = DXGI_FORMAT_D32_FLOAT;
-    pipelineStateStream.DepthStencil = {depthStencilDesc};
-    pipelineStateStream.RTVFormats = rtvFormats;
-    pipelineStateStream.Rasterizer = {CD3DX12_RASTERIZER_DESC(rasterizerDesc)};
-    pipelineStateStream.SampleDesc = sampleDesc;
+void OcclusionCulling::CreateStructuredBuffer(ComPtr<ID3D12Resource>& resource,
+                                                   UINT numElements,
+                                                   UINT elementSize,
+                                                   D3D12_RESOURCE_FLAGS flags)
+{
+    // A buffer made again, e.g. by SetMeshes. The tracker keeps its state by pointer, so drop it before the release.
+    if (resource)
+    {
+        ResourceStateTracker::RemoveGlobalResourceState(resource.Get());
+        resource.Reset();
+    }
+
+    D3D12_RESOURCE_DESC instanceBufferDesc = {};
+    instanceBufferDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+    instanceBufferDesc.Width = elementSize * numElements;  // Total buffer size
+    instanceBufferDesc.Height = 1;
+    instanceBufferDesc.DepthOrArraySize = 1;
+    instanceBufferDesc.MipLevels = 1;
+    instanceBufferDesc.Format = DXGI_FORMAT_UNKNOWN;  // Structured buffers use a typeless format
+    instanceBufferDesc.SampleDesc.Count = 1;
+    instanceBufferDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+    instanceBufferDesc.Flags = flags;
+
+    CD3DX12_HEAP_PROPERTIES heapProperties(D3D12_HEAP_TYPE_DEFAULT);
+    m_device->GetD3D12Device()->CreateCommittedResource(&heapProperties,  // Default heap for GPU access
+                                                        D3D12_HEAP_FLAG_NONE,
+                                                        &instanceBufferDesc,
+                                                        D3D12_RESOURCE_STATE_COMMON,  // Initial state
+                                                        nullptr,
+                                                        IID_PPV_ARGS(&resource));
 
-    m_drawPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_drawPass.pso->GetD3D12PipelineState()->SetName(L"Draw Objects PSO");
+    ResourceStateTracker::AddGlobalResourceState(resource.Get(), D3D12_RESOURCE_STATE_COMMON);
 }
 
 void OcclusionCulling::InitVisualizeMipsPSO()
@@ -547,13 +691,14 @@ void OcclusionCulling::InitCullingPSO()
     CD3DX12_DESCRIPTOR_RANGE1 descriptorRanges[1];
     descriptorRanges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0);  // SRV at t0 : HZB texture
 
-    CD3DX12_ROOT_PARAMETER1 rootParameters[6];
-    rootParameters[0].InitAsConstants(2, 0);                           // constant data
+    CD3DX12_ROOT_PARAMETER1 rootParameters[7];
+    rootParameters[0].InitAsConstants(sizeof(ConstantData) / 4, 0);   // constant data
     rootParameters[1].InitAsConstants(sizeof(XMMATRIX) / 4, 1);        // VP matrix
     rootParameters[2].InitAsConstants((sizeof(XMFLOAT4) * 6) / 4, 2);  // Frustum planes
     rootParameters[3].InitAsDescriptorTable(1, descriptorRanges);
     rootParameters[4].InitAsShaderResourceView(1, 0);
     rootParameters[5].InitAsUnorderedAccessView(0, 0);
+    rootParameters[6].InitAsUnorderedAccessView(1, 0);  // lods (u1)
 
     CD3DX12_STATIC_SAMPLER_DESC pointSampler = CD3DX12_STATIC_SAMPLER_DESC(0,
                                                                            D3D12_FILTER_MIN_MAG_MIP_POINT,
@@ -596,22 +741,24 @@ void OcclusionCulling::InitCullingPSO()
     m_cullingPass.pso->GetD3D12PipelineState()->SetName(L"HZB Culling PSO");
 }
 
-void OcclusionCulling::InitFirstPrefixPSO()
+void OcclusionCulling::InitMeshCountPSO()
 {
     ComPtr<ID3DBlob> computeShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/firstPassPrefixSum_cs.cso", &computeShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/mesh_count_cs.cso", &computeShaderBlob));
 
-    CD3DX12_ROOT_PARAMETER1 rootParameters[4];
-    rootParameters[0].InitAsUnorderedAccessView(0, 0);  // uav
-    rootParameters[1].InitAsUnorderedAccessView(1, 0);  // uav
-    rootParameters[2].InitAsUnorderedAccessView(2, 0);  // uav
-    rootParameters[3].InitAsConstants(1, 0);            // m_numInstances
+    CD3DX12_ROOT_PARAMETER1 rootParameters[6];
+    rootParameters[0].InitAsConstants(2, 0);            // numInstances, numMeshIds
+    rootParameters[1].InitAsShaderResourceView(0, 0);   // visibility (t0)
+    rootParameters[2].InitAsShaderResourceView(1, 0);   // mesh ids (t1)
+    rootParameters[3].InitAsUnorderedAccessView(0, 0);  // mesh counts (u0)
+    rootParameters[4].InitAsUnorderedAccessView(1, 0);  // mesh ranks (u1)
+    rootParameters[5].InitAsShaderResourceView(2, 0);   // lods (t2)
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDesc;
     rootSignatureDesc.Init_1_1(_countof(rootParameters), rootParameters);
 
-    m_firstPrefixPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
-    m_firstPrefixPass.rs->GetD3D12RootSignature()->SetName(L"First Pass RS");
+    m_meshCountPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
+    m_meshCountPass.rs->GetD3D12RootSignature()->SetName(L"Mesh Count RS");
 
     ComPtr<ID3DBlob> signature;
     ComPtr<ID3DBlob> error;
@@ -620,7 +767,7 @@ void OcclusionCulling::InitFirstPrefixPSO()
         m_device->GetD3D12Device()->CreateRootSignature(0,
                                                         signature->GetBufferPointer(),
                                                         signature->GetBufferSize(),
-                                                        IID_PPV_ARGS(&m_firstPrefixPass.rs->GetD3D12RootSignature())));
+                                                        IID_PPV_ARGS(&m_meshCountPass.rs->GetD3D12RootSignature())));
 
     struct PipelineStateStream
     {
@@ -628,29 +775,31 @@ void OcclusionCulling::InitFirstPrefixPSO()
         CD3DX12_PIPELINE_STATE_STREAM_CS CS;
     } pipelineStateStream;
 
-    pipelineStateStream.pRootSignature = m_firstPrefixPass.rs->GetD3D12RootSignature().Get();
+    pipelineStateStream.pRootSignature = m_meshCountPass.rs->GetD3D12RootSignature().Get();
     pipelineStateStream.CS = CD3DX12_SHADER_BYTECODE(computeShaderBlob.Get());
 
-    m_firstPrefixPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_firstPrefixPass.pso->GetD3D12PipelineState()->SetName(L"First Pass PSO");
+    m_meshCountPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
+    m_meshCountPass.pso->GetD3D12PipelineState()->SetName(L"Mesh Count PSO");
 }
 
-void OcclusionCulling::InitSecondPrefixPSO()
+void OcclusionCulling::InitMeshCommandsPSO()
 {
     ComPtr<ID3DBlob> computeShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/secondPassPrefixSum_cs.cso", &computeShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/mesh_commands_cs.cso", &computeShaderBlob));
 
-    CD3DX12_ROOT_PARAMETER1 rootParameters[4];
-    rootParameters[0].InitAsUnorderedAccessView(0, 0);  // uav (u0)
-    rootParameters[1].InitAsUnorderedAccessView(1, 0);  // uav (u1)
-    rootParameters[2].InitAsUnorderedAccessView(2, 0);  // uav (u2)
-    rootParameters[3].InitAsConstants(1, 0);            // m_numInstances
+    CD3DX12_ROOT_PARAMETER1 rootParameters[6];
+    rootParameters[0].InitAsConstants(1, 0);            // numMeshes
+    rootParameters[1].InitAsShaderResourceView(0, 0);   // mesh table (t0)
+    rootParameters[2].InitAsUnorderedAccessView(0, 0);  // mesh counts (u0)
+    rootParameters[3].InitAsUnorderedAccessView(1, 0);  // mesh offsets (u1)
+    rootParameters[4].InitAsUnorderedAccessView(2, 0);  // indirect args (u2)
+    rootParameters[5].InitAsUnorderedAccessView(3, 0);  // draw count (u3)
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDesc;
     rootSignatureDesc.Init_1_1(_countof(rootParameters), rootParameters);
 
-    m_secondPrefixPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
-    m_secondPrefixPass.rs->GetD3D12RootSignature()->SetName(L"Second Pass RS");
+    m_meshCommandsPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
+    m_meshCommandsPass.rs->GetD3D12RootSignature()->SetName(L"Mesh Commands RS");
 
     ComPtr<ID3DBlob> signature;
     ComPtr<ID3DBlob> error;
@@ -659,7 +808,7 @@ void OcclusionCulling::InitSecondPrefixPSO()
         m_device->GetD3D12Device()->CreateRootSignature(0,
                                                         signature->GetBufferPointer(),
                                                         signature->GetBufferSize(),
-                                                        IID_PPV_ARGS(&m_secondPrefixPass.rs->GetD3D12RootSignature())));
+                                                        IID_PPV_ARGS(&m_meshCommandsPass.rs->GetD3D12RootSignature())));
 
     struct PipelineStateStream
     {
@@ -667,28 +816,32 @@ void OcclusionCulling::InitSecondPrefixPSO()
         CD3DX12_PIPELINE_STATE_STREAM_CS CS;
     } pipelineStateStream;
 
-    pipelineStateStream.pRootSignature = m_secondPrefixPass.rs->GetD3D12RootSignature().Get();
+    pipelineStateStream.pRootSignature = m_meshCommandsPass.rs->GetD3D12RootSignature().Get();
     pipelineStateStream.CS = CD3DX12_SHADER_BYTECODE(computeShaderBlob.Get());
 
-    m_secondPrefixPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_secondPrefixPass.pso->GetD3D12PipelineState()->SetName(L"Second Pass PSO");
+    m_meshCommandsPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
+    m_meshCommandsPass.pso->GetD3D12PipelineState()->SetName(L"Mesh Commands PSO");
 }
 
-void OcclusionCulling::InitRecursivePrefixPSO()
+void OcclusionCulling::InitMeshScatterPSO()
 {
     ComPtr<ID3DBlob> computeShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/recursivePrefixSum_cs.cso", &computeShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/mesh_scatter_cs.cso", &computeShaderBlob));
 
-    CD3DX12_ROOT_PARAMETER1 rootParameters[3];
-    rootParameters[0].InitAsUnorderedAccessView(0, 0);  // uav
-    rootParameters[1].InitAsUnorderedAccessView(1, 0);  // uav
-    rootParameters[2].InitAsConstants(1, 0);            // m_numInstances
+    CD3DX12_ROOT_PARAMETER1 rootParameters[7];
+    rootParameters[0].InitAsConstants(2, 0);            // numInstances, numMeshIds
+    rootParameters[1].InitAsShaderResourceView(0, 0);   // visibility (t0)
+    rootParameters[2].InitAsShaderResourceView(1, 0);   // mesh ids (t1)
+    rootParameters[3].InitAsUnorderedAccessView(0, 0);  // mesh ranks (u0)
+    rootParameters[4].InitAsUnorderedAccessView(1, 0);  // mesh offsets (u1)
+    rootParameters[5].InitAsUnorderedAccessView(2, 0);  // matrix index buffer (u2)
+    rootParameters[6].InitAsShaderResourceView(2, 0);   // lods (t2)
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDesc;
     rootSignatureDesc.Init_1_1(_countof(rootParameters), rootParameters);
 
-    m_recursivePrefixPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
-    m_recursivePrefixPass.rs->GetD3D12RootSignature()->SetName(L"Recursive Presum RS");
+    m_meshScatterPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
+    m_meshScatterPass.rs->GetD3D12RootSignature()->SetName(L"Mesh Scatter RS");
 
     ComPtr<ID3DBlob> signature;
     ComPtr<ID3DBlob> error;
@@ -697,7 +850,7 @@ void OcclusionCulling::InitRecursivePrefixPSO()
         m_device->GetD3D12Device()->CreateRootSignature(0,
                                                         signature->GetBufferPointer(),
                                                         signature->GetBufferSize(),
-                                                        IID_PPV_ARGS(&m_recursivePrefixPass.rs->GetD3D12RootSignature())));
+                                                        IID_PPV_ARGS(&m_meshScatterPass.rs->GetD3D12RootSignature())));
 
     struct PipelineStateStream
     {
@@ -705,35 +858,72 @@ void OcclusionCulling::InitRecursivePrefixPSO()
         CD3DX12_PIPELINE_STATE_STREAM_CS CS;
     } pipelineStateStream;
 
-    pipelineStateStream.pRootSignature = m_recursivePrefixPass.rs->GetD3D12RootSignature().Get();
+    pipelineStateStream.pRootSignature = m_meshScatterPass.rs->GetD3D12RootSignature().Get();
     pipelineStateStream.CS = CD3DX12_SHADER_BYTECODE(computeShaderBlob.Get());
 
-    m_recursivePrefixPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_recursivePrefixPass.pso->GetD3D12PipelineState()->SetName(L"Recursive Presum PSO");
+    m_meshScatterPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
+    m_meshScatterPass.pso->GetD3D12PipelineState()->SetName(L"Mesh Scatter PSO");
 }
 
-void OcclusionCulling::InitFillIndirectBufferPSO()
+void OcclusionCulling::InitVisibilityScanPSO()
 {
     ComPtr<ID3DBlob> computeShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/fill_indirect_draw_buffer_cs.cso", &computeShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/decoupledLookbackScan_cs.cso", &computeShaderBlob));
 
-    CD3DX12_DESCRIPTOR_RANGE1 uavRanges[1];
-    uavRanges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV,
-                      5,
-                      1,
-                      0,
-                      D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE,
-                      D3D12_DESCRIPTOR_RANGE_OFFSET_APPEND);  // 5 UAVs at t1
+    CD3DX12_ROOT_PARAMETER1 rootParameters[6];
+    rootParameters[0].InitAsConstants(1, 0);            // numInstances
+    rootParameters[1].InitAsShaderResourceView(0, 0);   // visibility (t0)
+    rootParameters[2].InitAsUnorderedAccessView(0, 0);  // word offsets (u0)
+    rootParameters[3].InitAsUnorderedAccessView(1, 0);  // mesh counts (u1)
+    rootParameters[4].InitAsUnorderedAccessView(2, 0);  // partition states (u2)
+    rootParameters[5].InitAsUnorderedAccessView(3, 0);  // partition counter (u3)
 
-    CD3DX12_ROOT_PARAMETER1 rootParameters[2];
-    rootParameters[0].InitAsDescriptorTable(_countof(uavRanges), uavRanges);
-    rootParameters[1].InitAsConstants(1, 0);
+    CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDesc;
+    rootSignatureDesc.Init_1_1(_countof(rootParameters), rootParameters);
+
+    m_visibilityScanPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
+    m_visibilityScanPass.rs->GetD3D12RootSignature()->SetName(L"Visibility Scan RS");
+
+    ComPtr<ID3DBlob> signature;
+    ComPtr<ID3DBlob> error;
+    ThrowIfFailed(D3D12SerializeVersionedRootSignature(&rootSignatureDesc, &signature, &error));
+    ThrowIfFailed(
+        m_device->GetD3D12Device()->CreateRootSignature(0,
+                                                        signature->GetBufferPointer(),
+                                                        signature->GetBufferSize(),
+                                                        IID_PPV_ARGS(&m_visibilityScanPass.rs->GetD3D12RootSignature())));
+
+    struct PipelineStateStream
+    {
+        CD3DX12_PIPELINE_STATE_STREAM_ROOT_SIGNATURE pRootSignature;
+        CD3DX12_PIPELINE_STATE_STREAM_CS CS;
+    } pipelineStateStream;
+
+    pipelineStateStream.pRootSignature = m_visibilityScanPass.rs->GetD3D12RootSignature().Get();
+    pipelineStateStream.CS = CD3DX12_SHADER_BYTECODE(computeShaderBlob.Get());
+
+    m_visibilityScanPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
+    m_visibilityScanPass.pso->GetD3D12PipelineState()->SetName(L"Visibility Scan PSO");
+}
+
+void OcclusionCulling::InitVisibilityCompactPSO()
+{
+    ComPtr<ID3DBlob> computeShaderBlob;
+    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/visibility_compact_cs.cso", &computeShaderBlob));
+
+    CD3DX12_ROOT_PARAMETER1 rootParameters[6];
+    rootParameters[0].InitAsConstants(1, 0);            // numInstances
+    rootParameters[1].InitAsShaderResourceView(0, 0);   // visibility (t0)
+    rootParameters[2].InitAsUnorderedAccessView(0, 0);  // matrix index buffer (u0)
+    rootParameters[3].InitAsUnorderedAccessView(1, 0);  // word offsets (u1)
+    rootParameters[4].InitAsUnorderedAccessView(2, 0);  // partition states (u2)
+    rootParameters[5].InitAsUnorderedAccessView(3, 0);  // partition counter (u3)
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDesc;
     rootSignatureDesc.Init_1_1(_countof(rootParameters), rootParameters);
 
-    m_fillIndirectBufferPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
-    m_fillIndirectBufferPass.rs->GetD3D12RootSignature()->SetName(L"Fill Indirect Buffer RS");
+    m_visibilityCompactPass.rs = m_device->CreateRootSignature(rootSignatureDesc.Desc_1_1);
+    m_visibilityCompactPass.rs->GetD3D12RootSignature()->SetName(L"Visibility Compact RS");
 
     ComPtr<ID3DBlob> signature;
     ComPtr<ID3DBlob> error;
@@ -742,7 +932,7 @@ void OcclusionCulling::InitFillIndirectBufferPSO()
         m_device->GetD3D12Device()->CreateRootSignature(0,
                                                         signature->GetBufferPointer(),
                                                         signature->GetBufferSize(),
-                                                        IID_PPV_ARGS(&m_fillIndirectBufferPass.rs->GetD3D12RootSignature())));
+                                                        IID_PPV_ARGS(&m_visibilityCompactPass.rs->GetD3D12RootSignature())));
 
     struct PipelineStateStream
     {
@@ -750,17 +940,20 @@ void OcclusionCulling::InitFillIndirectBufferPSO()
         CD3DX12_PIPELINE_STATE_STREAM_CS CS;
     } pipelineStateStream;
 
-    pipelineStateStream.pRootSignature = m_fillIndirectBufferPass.rs->GetD3D12RootSignature().Get();
+    pipelineStateStream.pRootSignature = m_visibilityCompactPass.rs->GetD3D12RootSignature().Get();
     pipelineStateStream.CS = CD3DX12_SHADER_BYTECODE(computeShaderBlob.Get());
 
-    m_fillIndirectBufferPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
-    m_fillIndirectBufferPass.pso->GetD3D12PipelineState()->SetName(L"Fill Indirect Buffer PSO");
+    m_visibilityCompactPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
+    m_visibilityCompactPass.pso->GetD3D12PipelineState()->SetName(L"Visibility Compact PSO");
 }
 
 void OcclusionCulling::InitIndirectDrawPSO()
 {
     ComPtr<ID3DBlob> vertexShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/indirect_draw_vs.cso", &vertexShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(m_instanceFormat == InstanceFormat::Compact
+                                        ? L"../bee/compiledShaders/indirect_draw_compact_vs.cso"
+                                        : L"../bee/compiledShaders/indirect_draw_vs.cso",
+                                    &vertexShaderBlob));
 
     ComPtr<ID3DBlob> pixelShaderBlob;
     ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/draw_objects_ps.cso", &pixelShaderBlob));
@@ -770,20 +963,11 @@ void OcclusionCulling::InitIndirectDrawPSO()
         D3D12_ROOT_SIGNATURE_FLAG_DENY_DOMAIN_SHADER_ROOT_ACCESS | D3D12_ROOT_SIGNATURE_FLAG_DENY_GEOMETRY_SHADER_ROOT_ACCESS |
         D3D12_ROOT_SIGNATURE_FLAG_DENY_PIXEL_SHADER_ROOT_ACCESS;
 
-    CD3DX12_DESCRIPTOR_RANGE1 srvRanges[6]{};
-    srvRanges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-    srvRanges[1].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 1, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-    srvRanges[2].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 2, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-    srvRanges[3].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 3, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-    srvRanges[4].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 4, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-    srvRanges[5].Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 5, 0, D3D12_DESCRIPTOR_RANGE_FLAG_DESCRIPTORS_VOLATILE);
-
-    CD3DX12_DESCRIPTOR_RANGE1 cbvRanges[1]{};
-    cbvRanges[0].Init(D3D12_DESCRIPTOR_RANGE_TYPE_CBV, 1, 0);
-
-    CD3DX12_ROOT_PARAMETER1 rootParameters[2];
-    rootParameters[0].InitAsConstants(sizeof(XMMATRIX) / 4, 0, 0, D3D12_SHADER_VISIBILITY_VERTEX);
-    rootParameters[1].InitAsDescriptorTable(_countof(srvRanges), srvRanges);
+    CD3DX12_ROOT_PARAMETER1 rootParameters[4];
+    rootParameters[0].InitAsConstants(sizeof(XMMATRIX) / 4, 0, 0, D3D12_SHADER_VISIBILITY_VERTEX);  // VP matrix
+    rootParameters[1].InitAsShaderResourceView(0, 0);                                               // Instance Data
+    rootParameters[2].InitAsShaderResourceView(1, 0);                                               // matrix index buffer
+    rootParameters[3].InitAsConstants(1, 1, 0, D3D12_SHADER_VISIBILITY_VERTEX);                     // instance offset
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDescription;
     rootSignatureDescription.Init_1_1(_countof(rootParameters), rootParameters, 0, nullptr, rootSignatureFlags);
@@ -860,9 +1044,15 @@ void OcclusionCulling::InitIndirectDrawPSO()
 
     ////////////////////////////////
 
-    D3D12_INDIRECT_ARGUMENT_DESC args[1] = {};
+    // The instance offset changes per draw, so the signature sets root parameter 3 before every indexed draw
+    D3D12_INDIRECT_ARGUMENT_DESC args[2] = {};
 
-    args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
+    args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT;
+    args[0].Constant.RootParameterIndex = 3;
+    args[0].Constant.DestOffsetIn32BitValues = 0;
+    args[0].Constant.Num32BitValuesToSet = 1;
+
+    args[1].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
 
     D3D12_COMMAND_SIGNATURE_DESC cmdSignatureDesc = {};
     cmdSignatureDesc.ByteStride = sizeof(IndirectCommand);
@@ -870,14 +1060,19 @@ void OcclusionCulling::InitIndirectDrawPSO()
     cmdSignatureDesc.pArgumentDescs = args;
     cmdSignatureDesc.NodeMask = 0;
 
-    m_device->GetD3D12Device()->CreateCommandSignature(&cmdSignatureDesc, nullptr, IID_PPV_ARGS(&m_commandSignature));
+    ThrowIfFailed(m_device->GetD3D12Device()->CreateCommandSignature(&cmdSignatureDesc,
+                                                                     m_indirectDrawPass.rs->GetD3D12RootSignature().Get(),
+                                                                     IID_PPV_ARGS(&m_drawCommandSignature)));
 }
 
 void OcclusionCulling::InitIndirectDepthPSO()
 {
     // Load the vertex shader.
     ComPtr<ID3DBlob> vertexShaderBlob;
-    ThrowIfFailed(D3DReadFileToBlob(L"../bee/compiledShaders/indirect_depth_vs.cso", &vertexShaderBlob));
+    ThrowIfFailed(D3DReadFileToBlob(m_instanceFormat == InstanceFormat::Compact
+                                        ? L"../bee/compiledShaders/indirect_depth_compact_vs.cso"
+                                        : L"../bee/compiledShaders/indirect_depth_vs.cso",
+                                    &vertexShaderBlob));
 
     // Load the pixel shader.
     ComPtr<ID3DBlob> pixelShaderBlob;
@@ -890,10 +1085,11 @@ void OcclusionCulling::InitIndirectDepthPSO()
         D3D12_ROOT_SIGNATURE_FLAG_DENY_PIXEL_SHADER_ROOT_ACCESS;
 
     // A single 32-bit constant root parameter that is used by the vertex shader.
-    CD3DX12_ROOT_PARAMETER1 rootParameters[3];
+    CD3DX12_ROOT_PARAMETER1 rootParameters[4];
     rootParameters[0].InitAsConstants(sizeof(XMMATRIX) / 4, 0, 0, D3D12_SHADER_VISIBILITY_VERTEX);  // VP matrix
     rootParameters[1].InitAsShaderResourceView(0, 0);                                               // Instance Data
     rootParameters[2].InitAsShaderResourceView(1, 0);                                               // matrix index buffer
+    rootParameters[3].InitAsConstants(1, 1, 0, D3D12_SHADER_VISIBILITY_VERTEX);                     // instance offset
 
     CD3DX12_VERSIONED_ROOT_SIGNATURE_DESC rootSignatureDescription;
     rootSignatureDescription.Init_1_1(_countof(rootParameters), rootParameters, 0, nullptr, rootSignatureFlags);
@@ -962,123 +1158,60 @@ void OcclusionCulling::InitIndirectDepthPSO()
 
     m_indirectDepthPass.pso = m_device->CreatePipelineStateObject(pipelineStateStream);
     m_indirectDepthPass.pso->GetD3D12PipelineState()->SetName(L"Indirect Depth PSO");
-}
-
-void OcclusionCulling::FirstFrameDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix)
-{
-    assert(commandList && "commandlist can't be null.");
-    {
-        // Clear the render targets.
-        {
-            commandList->ClearDepthStencilTexture(m_renderTarget->GetTexture(AttachmentPoint::DepthStencil),
-                                                  D3D12_CLEAR_FLAG_DEPTH);
-        }
-
-        commandList->SetPipelineState(m_depthPass.pso);
-        commandList->SetGraphicsRootSignature(m_depthPass.rs);
-
-        {
-            // Bind the descriptor heap
-            ID3D12DescriptorHeap* ppHeaps[] = {m_srvHeap.GetD3D12Heap().Get()};
-            commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
 
-            auto adress = m_instanceData.GetResource()->GetGPUVirtualAddress();
-            commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(1, adress);
-        }
+    ////////////////////////////////
 
-        commandList->SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-        commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.get());
-        commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.get());
+    // Same arguments as the draw, a command signature with root arguments belongs to a single root signature
+    D3D12_INDIRECT_ARGUMENT_DESC args[2] = {};
 
-        commandList->SetViewport(m_viewport);
-        commandList->SetScissorRect(m_scissorRect);
+    args[0].Type = D3D12_INDIRECT_ARGUMENT_TYPE_CONSTANT;
+    args[0].Constant.RootParameterIndex = 3;
+    args[0].Constant.DestOffsetIn32BitValues = 0;
+    args[0].Constant.Num32BitValuesToSet = 1;
 
-        commandList->SetRenderTarget(*m_renderTarget);
+    args[1].Type = D3D12_INDIRECT_ARGUMENT_TYPE_DRAW_INDEXED;
 
-        commandList->SetGraphics32BitConstants(0, sizeof(XMMATRIX) / 4, &vpMatrix);
+    D3D12_COMMAND_SIGNATURE_DESC cmdSignatureDesc = {};
+    cmdSignatureDesc.ByteStride = sizeof(IndirectCommand);
+    cmdSignatureDesc.NumArgumentDescs = _countof(args);
+    cmdSignatureDesc.pArgumentDescs = args;
+    cmdSignatureDesc.NodeMask = 0;
 
-        // Draw all objects in shader, but use visibility buffer to cull objects. (look into dispatch?)
-        commandList->DrawIndexed(m_numIndices, m_numInstances, 0, 0, 0);
-    }
+    ThrowIfFailed(m_device->GetD3D12Device()->CreateCommandSignature(&cmdSignatureDesc,
+                                                                     m_indirectDepthPass.rs->GetD3D12RootSignature().Get(),
+                                                                     IID_PPV_ARGS(&m_depthCommandSignature)));
 }
 
-void OcclusionCulling::FirstFrameDrawPass(XMMATRIX* cameraVP)
+void OcclusionCulling::HzbCulling(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP)
 {
-    auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
-    auto commandList = commandQueueDirect.GetCommandList();
-
-    // Clear the render targets.
-    {
-        FLOAT clearColor[] = {0.4f, 0.6f, 0.9f, 1.0f};
-
-        commandList->ClearTexture(m_renderTarget->GetTexture(AttachmentPoint::Color0), clearColor);
-        commandList->ClearDepthStencilTexture(m_renderTarget->GetTexture(AttachmentPoint::DepthStencil),
-                                              D3D12_CLEAR_FLAG_DEPTH);
-    }
-
-    commandList->SetPipelineState(m_drawPass.pso);
-    commandList->SetGraphicsRootSignature(m_drawPass.rs);
-
-    commandList->SetViewport(m_viewport);
-    commandList->SetScissorRect(m_scissorRect);
-    commandList->SetRenderTarget(*m_renderTarget);
-
-    commandList->SetGraphics32BitConstants(0, sizeof(XMMATRIX) / 4, cameraVP);
-
-    commandList->TransitionBarrier(m_visibility.GetResource(), D3D12_RESOURCE_STATE_ALL_SHADER_RESOURCE);
-
-    {
-        // Bind the descriptor heap
-        ID3D12DescriptorHeap* ppHeaps[] = {m_srvHeap.GetD3D12Heap().Get()};
-        commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
-
-        auto adress = m_instanceData.GetResource()->GetGPUVirtualAddress();
-        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(1, adress);
-    }
+    if (!debugCameraVP) debugCameraVP = &mainCameraVP;
 
+    if (m_cpuVisibility && m_doHzbCulling)
     {
-        // Bind the descriptor heap
-        ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-        commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(
-            2,
-            m_visibility.GetResource()->GetGPUVirtualAddress());
+        CpuVisibilityCulling(debugCameraVP);
+        return;
     }
 
-    commandList->SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.get());
-    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.get());
-
-    // Draw all objects in shader, but use visibility buffer to cull objects. (look into dispatch?)
-    commandList->DrawIndexed(m_numIndices, m_numInstances, 0, 0, 0);
-
-    commandQueueDirect.ExecuteCommandList(commandList);
-
-    auto fenceValue = commandQueueDirect.Signal();
-    commandQueueDirect.WaitForFenceValue(fenceValue);
-}
-
-void OcclusionCulling::HzbCulling(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraVP)
-{
-    if (!debugCameraVP) debugCameraVP = &mainCameraVP;
-
     auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
     auto commandList = commandQueueDirect.GetCommandList();
 
-    if (m_isFirstFrame || !m_doHzbCulling)
+    // The draws of the last culled frame make the occluders. Its slot isn't reused before this frame is done.
+    if (m_lastCulledFrame < 0 || !m_doHzbCulling)
     {
-        FirstFrameDepthPass(commandList, mainCameraVP);
-        m_isFirstFrame = false;
+        IndirectDepthPass(commandList, mainCameraVP, m_allInstances);
     }
     else
     {
-        IndirectDepthPass(commandList, mainCameraVP);
+        IndirectDepthPass(commandList, mainCameraVP, m_frames[m_lastCulledFrame].draws);
     }
 
     auto depthTexture = m_renderTarget->GetTexture(AttachmentPoint::DepthStencil);
 
     UINT16 numMips = static_cast<UINT16>(std::log2(std::max(m_width, m_height))) + 1;
     m_constantData.maxHzbMip = numMips;
+    m_constantData.numLods = std::min(m_numLods, m_lodSettings.numLods);
+    m_constantData.minPixelSize = m_lodSettings.minPixelSize;
+    std::copy(std::begin(m_lodSettings.lodPixelSizes), std::end(m_lodSettings.lodPixelSizes), m_constantData.lodPixelSizes);
 
     auto srvUavDesc = CD3DX12_RESOURCE_DESC::Tex2D(DXGI_FORMAT_R32_TYPELESS,
                                                    m_width,
@@ -1089,86 +1222,109 @@ void OcclusionCulling::HzbCulling(XMMATRIX& mainCameraVP, XMMATRIX* debugCameraV
                                                    0,
                                                    D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
 
-    auto depthTextureSRV = m_device->CreateTexture(srvUavDesc);
+    // Same desc every frame, so the pool hands back last frame's texture once the GPU is done with it
+    auto& resourcePool = m_device->GetTransientResourcePool();
+    auto depthTextureSRV = resourcePool.AcquireTexture(srvUavDesc);
     depthTextureSRV->SetName(L"Depth Texture SRV");
 
     commandList->CopyResource(depthTextureSRV, depthTexture);
 
     commandList->TransitionBarrier(depthTextureSRV, D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
 
-    commandQueueDirect.ExecuteCommandList(commandList);
-
-    // Fence to make sure the depth buffer is correctly drawn before generating mips
-    auto fenceValue = commandQueueDirect.Signal();
-    commandQueueDirect.WaitForFenceValue(fenceValue);
+    auto fenceValue = commandQueueDirect.ExecuteCommandList(commandList);
 
     if (m_doHzbCulling)
     {
+        // The mips are generated from the copy of the depth buffer, on the GPU timeline
+        auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+        commandQueueCompute.Wait(commandQueueDirect);
+
         GenerateMipsPass(depthTextureSRV);
 
         CullingPass(depthTextureSRV, mainCameraVP, numMips);
 
-        PrefixSumPass(m_numInstances);
+        // The culling pass is the last one to read it
+        resourcePool.ReleaseTexture(depthTextureSRV, D3D12_COMMAND_LIST_TYPE_COMPUTE, commandQueueCompute.Signal());
+
+        MeshBucketingPass(CurrentFrame());
+
+        commandQueueDirect.Wait(commandQueueCompute);
 
-        FillIndirectPass();
+        IndirectDrawPass(debugCameraVP, CurrentFrame().draws);
 
-        IndirectDrawPass(debugCameraVP);
+        m_lastCulledFrame = m_frameIndex;
     }
     else
     {
-        FirstFrameDrawPass(debugCameraVP);
+        resourcePool.ReleaseTexture(depthTextureSRV, D3D12_COMMAND_LIST_TYPE_DIRECT, fenceValue);
+
+        IndirectDrawPass(debugCameraVP, m_allInstances);
     }
 }
 
-void OcclusionCulling::VisualizeMipMaps(XMMATRIX* cameraVP)
+void OcclusionCulling::CpuVisibilityCulling(XMMATRIX* debugCameraVP)
 {
+    assert(m_cpuVisibility->size() == static_cast<size_t>(m_numObjects) && "Need one visibility value per instance");
+
+    // The visibility is already known, so no depth prepass or HZB. Pack it, upload it and bucket as usual.
+    m_cpuVisibilityBits.resize(GetNumVisibilityWords(m_numObjects));
+    PackVisibility(m_cpuVisibility->data(), m_numObjects, m_cpuVisibilityBits.data());
+
+    auto& commandQueueCopy = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COPY);
+    auto commandListCopy = commandQueueCopy.GetCommandList();
+
+    ComPtr<ID3D12Resource> uploadBuffer;
+    auto& visibilityResource = CurrentFrame().visibility.GetResource();
+    PopulateBuffer(commandListCopy,
+                   visibilityResource,
+                   uploadBuffer,
+                   m_cpuVisibilityBits.data(),
+                   static_cast<UINT>(m_cpuVisibilityBits.size()),
+                   sizeof(uint32_t));
+
+    // The culling pass may have left other LODs in this frame's buffer
+    ComPtr<ID3D12Resource> lodUploadBuffer;
+    auto& lodResource = CurrentFrame().lods.GetResource();
+    PopulateBuffer(commandListCopy,
+                   lodResource,
+                   lodUploadBuffer,
+                   m_cpuLodBits.data(),
+                   static_cast<UINT>(m_cpuLodBits.size()),
+                   sizeof(uint32_t));
+
+    auto fence = commandQueueCopy.ExecuteCommandList(commandListCopy);
+    KeepUploadAlive(uploadBuffer, fence);
+    KeepUploadAlive(lodUploadBuffer, fence);
+
+    // Bucketing rewrites this slot's draws. The direct queue can still be reading them, e.g. as the occluders of
+    // a GPU path frame in between, so it waits for the direct queue like HzbCulling does.
     auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
-    auto commandList = commandQueueDirect.GetCommandList();
+    auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    commandQueueCompute.Wait(commandQueueCopy);
+    commandQueueCompute.Wait(commandQueueDirect);
 
-    // Clear the render targets.
-    {
-        FLOAT clearColor[] = {0.4f, 0.6f, 0.9f, 1.0f};
+    MeshBucketingPass(CurrentFrame());
 
-        commandList->ClearTexture(m_renderTarget->GetTexture(AttachmentPoint::Color0), clearColor);
-        commandList->ClearDepthStencilTexture(m_renderTarget->GetTexture(AttachmentPoint::DepthStencil),
-                                              D3D12_CLEAR_FLAG_DEPTH);
-    }
+    commandQueueDirect.Wait(commandQueueCompute);
 
-    commandList->SetPipelineState(m_depthPass.pso);
-    commandList->SetGraphicsRootSignature(m_depthPass.rs);
+    IndirectDrawPass(debugCameraVP, CurrentFrame().draws);
 
-    {
-        // Bind the descriptor heap
-        ID3D12DescriptorHeap* ppHeaps[] = {m_srvHeap.GetD3D12Heap().Get()};
-        commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
+    m_lastCulledFrame = m_frameIndex;
+}
 
-        auto adress = m_instanceData.GetResource()->GetGPUVirtualAddress();
-        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(1, adress);
-    }
+void OcclusionCulling::VisualizeMipMaps(XMMATRIX* cameraVP)
+{
+    auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
+    auto commandList = commandQueueDirect.GetCommandList();
 
+    // Clear the render targets. The depth pass clears the depth.
     {
-        ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-        commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(
-            2,
-            m_visibility.GetResource()->GetGPUVirtualAddress());
-    }
-
-    commandList->SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.get());
-    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.get());
-
-    commandList->SetViewport(m_viewport);
-    commandList->SetScissorRect(m_scissorRect);
-
-    commandList->SetRenderTarget(*m_renderTarget);
-
-    ////////////////////////////////////////
+        FLOAT clearColor[] = {0.4f, 0.6f, 0.9f, 1.0f};
 
-    commandList->SetGraphics32BitConstants(0, sizeof(XMMATRIX) / 4, cameraVP);
+        commandList->ClearTexture(m_renderTarget->GetTexture(AttachmentPoint::Color0), clearColor);
+    }
 
-    // Draw all objects in shader, but use visibility buffer to cull objects. (look into dispatch?)
-    commandList->DrawIndexed(m_numIndices, m_numInstances, 0, 0, 0);
+    IndirectDepthPass(commandList, *cameraVP, m_allInstances);
 
     auto depthTexture = m_renderTarget->GetTexture(AttachmentPoint::DepthStencil);
 
@@ -1183,7 +1339,8 @@ void OcclusionCulling::VisualizeMipMaps(XMMATRIX* cameraVP)
                                                    0,
                                                    D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS);
 
-    auto depthTextureSRV = m_device->CreateTexture(srvUavDesc);
+    auto& resourcePool = m_device->GetTransientResourcePool();
+    auto depthTextureSRV = resourcePool.AcquireTexture(srvUavDesc);
     depthTextureSRV->SetName(L"Depth Texture SRV");
 
     commandList->CopyResource(depthTextureSRV, depthTexture);
@@ -1192,19 +1349,17 @@ void OcclusionCulling::VisualizeMipMaps(XMMATRIX* cameraVP)
 
     commandQueueDirect.ExecuteCommandList(commandList);
 
-    // Fence to make sure the depth buffer is correctly drawn before generating mips
-    auto fenceValue = commandQueueDirect.Signal();
-    commandQueueDirect.WaitForFenceValue(fenceValue);
-
+    // Mips from the copy of the depth buffer, then back to the direct queue to show one
     auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    commandQueueCompute.Wait(commandQueueDirect);
+
     auto commandListCompute = commandQueueCompute.GetCommandList();
 
     commandListCompute->GenerateMips(depthTextureSRV);
 
     commandQueueCompute.ExecuteCommandList(commandListCompute);
 
-    fenceValue = commandQueueCompute.Signal();
-    commandQueueCompute.WaitForFenceValue(fenceValue);
+    commandQueueDirect.Wait(commandQueueCompute);
 
     ///////////////////////
 
@@ -1230,11 +1385,9 @@ void OcclusionCulling::VisualizeMipMaps(XMMATRIX* cameraVP)
 
     commandList->Draw(3);
 
-    commandQueueDirect.ExecuteCommandList(commandList);
+    auto fenceValue = commandQueueDirect.ExecuteCommandList(commandList);
 
-    // Fence to make sure the depth buffer is correctly drawn before generating mips
-    fenceValue = commandQueueDirect.Signal();
-    commandQueueDirect.WaitForFenceValue(fenceValue);
+    resourcePool.ReleaseTexture(depthTextureSRV, D3D12_COMMAND_LIST_TYPE_DIRECT, fenceValue);
 }
 
 void OcclusionCulling::GenerateMipsPass(std::shared_ptr<DX12Texture>& texture)
@@ -1252,12 +1405,14 @@ void OcclusionCulling::CullingPass(std::shared_ptr<DX12Texture>& texture, XMMATR
     auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
     auto commandListCompute = commandQueueCompute.GetCommandList();
 
+    auto& visibility = CurrentFrame().visibility;
+
     commandListCompute->TransitionBarrier(texture->GetD3D12Resource(), D3D12_RESOURCE_STATE_COPY_DEST);
 
     commandListCompute->SetPipelineState(m_cullingPass.pso);
     commandListCompute->SetComputeRootSignature(m_cullingPass.rs);
 
-    commandListCompute->SetCompute32BitConstants(0, 2, &m_constantData);
+    commandListCompute->SetCompute32BitConstants(0, sizeof(ConstantData) / 4, &m_constantData);
 
     // Always use the main camera for culling (Mode::MODE_DEFAULT)
     commandListCompute->SetCompute32BitConstants(1, sizeof(XMMATRIX) / 4, &vpMatrix);
@@ -1278,7 +1433,10 @@ void OcclusionCulling::CullingPass(std::shared_ptr<DX12Texture>& texture, XMMATR
         commandListCompute->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
         commandListCompute->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
             5,
-            m_visibility.GetResource()->GetGPUVirtualAddress());
+            visibility.GetResource()->GetGPUVirtualAddress());
+        commandListCompute->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
+            6,
+            CurrentFrame().lods.GetResource()->GetGPUVirtualAddress());
     }
 
     int threadsPerGroup = 64;                                                  // Assuming 16x16 threads per group
@@ -1286,165 +1444,110 @@ void OcclusionCulling::CullingPass(std::shared_ptr<DX12Texture>& texture, XMMATR
 
     commandListCompute->Dispatch(numGroups);
 
-    commandListCompute->UAVBarrier(m_visibility.GetResource());
+    commandListCompute->UAVBarrier(visibility.GetResource());
+    commandListCompute->UAVBarrier(CurrentFrame().lods.GetResource());
 
     commandQueueCompute.ExecuteCommandList(commandListCompute);
 }
 
-void OcclusionCulling::PrefixSumPass(UINT numElements)
+void OcclusionCulling::MeshBucketingPass(FrameResources& frame)
 {
-    assert(numElements > 0 && "numElements must be > 0.");
+    auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    auto commandListCompute = commandQueueCompute.GetCommandList();
+    auto d3d12CommandList = commandListCompute->GetD3D12CommandList();
 
-    auto& computeQueue = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
+    DrawList& draws = frame.draws;
+    commandListCompute->TransitionBarrier(draws.matrixIndex.GetResource(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    commandListCompute->TransitionBarrier(draws.indirectArgs.GetResource(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    commandListCompute->TransitionBarrier(draws.count.GetResource(), D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
 
     const int threadsPerGroup = 256;
-    int numIndices = numElements;
-    int numGroups = (numElements + threadsPerGroup - 1) / threadsPerGroup;
+    int numGroups = (m_numInstances + threadsPerGroup - 1) / threadsPerGroup;
 
-    std::vector<int> groupBufferSizes;
+    // Every LOD of a mesh id has its own table entry, so the count and scatter passes key on both
+    const uint32_t bucketConstants[] = {m_numInstances, m_numMeshes / m_numLods};
 
-    for (int i = 0; i < m_numWorkGroupBuffers; i++)
+    // A single draw needs no ranks per mesh: the popcount scan of the visibility words gives every visible instance
+    // its slot, in instance order and without atomics. The total goes to the mesh count, like the count pass.
+    const bool singleMesh = m_numMeshes == 1;
+    if (singleMesh)
     {
-        assert(i < m_numWorkGroupBuffers);
-
-        groupBufferSizes.push_back(numGroups);
-        auto commandList = computeQueue.GetCommandList();
-
-        if (i == 0)
-        {
-            commandList->SetPipelineState(m_firstPrefixPass.pso);
-            commandList->SetComputeRootSignature(m_firstPrefixPass.rs);
-            commandList->SetCompute32BitConstants(3, 1, &numIndices);
-            {
-                ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    0,
-                    m_visibility.GetResource()->GetGPUVirtualAddress());
-
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    1,
-                    m_scanResult.GetResource()->GetGPUVirtualAddress());
-
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    2,
-                    m_groupSums[i].GetResource()->GetGPUVirtualAddress());
-            }
-
-            commandList->Dispatch(numGroups);
-            commandList->UAVBarrier(m_scanResult.GetResource());
-            commandList->UAVBarrier(m_groupSums[i].GetResource());
-        }
-        else
-        {
-            commandList->SetPipelineState(m_recursivePrefixPass.pso);
-            commandList->SetComputeRootSignature(m_recursivePrefixPass.rs);
-            commandList->SetCompute32BitConstants(2, 1, &numIndices);
-            {
-                ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    0,
-                    m_groupSums[i - 1].GetResource()->GetGPUVirtualAddress());
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    1,
-                    m_groupSums[i].GetResource()->GetGPUVirtualAddress());
-            }
-
-            commandList->Dispatch(numGroups);
-            commandList->UAVBarrier(m_groupSums[i - 1].GetResource());
-            commandList->UAVBarrier(m_groupSums[i].GetResource());
-        }
-
-        computeQueue.ExecuteCommandList(commandList);
-
-        numIndices = numGroups;
-        numGroups = static_cast<int>(std::ceil(static_cast<double>(numGroups) / 256.f));
+        commandListCompute->SetPipelineState(m_visibilityScanPass.pso);
+        commandListCompute->SetComputeRootSignature(m_visibilityScanPass.rs);
+        commandListCompute->SetCompute32BitConstants(0, 1, &m_numInstances);
+        d3d12CommandList->SetComputeRootShaderResourceView(1, frame.visibility.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(2, frame.wordOffsets.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(3, frame.meshCounts.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(4, frame.scanPartitions.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(5, frame.scanCounter.GetResource()->GetGPUVirtualAddress());
+
+        commandListCompute->Dispatch(GetNumScanPartitions(m_numInstances));
+        commandListCompute->UAVBarrier(frame.wordOffsets.GetResource());
+        commandListCompute->UAVBarrier(frame.meshCounts.GetResource());
     }
-
-    for (int i = m_numWorkGroupBuffers - 1; i >= 0; i--)
+    else
     {
-        auto commandList = computeQueue.GetCommandList();
-        commandList->SetPipelineState(m_secondPrefixPass.pso);
-        commandList->SetComputeRootSignature(m_secondPrefixPass.rs);
-
-        if (i > 0)
-        {
-            commandList->SetCompute32BitConstants(3, 1, &groupBufferSizes[i - 1]);
-            {
-                ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    0,
-                    m_groupSums[i - 1].GetResource()->GetGPUVirtualAddress());
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    1,
-                    m_groupSums[i].GetResource()->GetGPUVirtualAddress());
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    2,
-                    m_count.GetResource()->GetGPUVirtualAddress());
-            }
-            commandList->Dispatch(groupBufferSizes[i]);
-            commandList->UAVBarrier(m_groupSums[i - 1].GetResource());
-            commandList->UAVBarrier(m_groupSums[i].GetResource());
-        }
-        else
-        {
-            commandList->SetCompute32BitConstants(3, 1, &numElements);
-            {
-                ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    0,
-                    m_scanResult.GetResource()->GetGPUVirtualAddress());
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    1,
-                    m_groupSums[i].GetResource()->GetGPUVirtualAddress());
-                commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-                commandList->GetD3D12CommandList()->SetComputeRootUnorderedAccessView(
-                    2,
-                    m_count.GetResource()->GetGPUVirtualAddress());
-            }
-            commandList->Dispatch(groupBufferSizes[i]);
-            commandList->UAVBarrier(m_scanResult.GetResource());
-            commandList->UAVBarrier(m_groupSums[i].GetResource());
-        }
-        computeQueue.ExecuteCommandList(commandList);
+        // Count the visible instances of every mesh, every instance keeps its rank within its mesh
+        commandListCompute->SetPipelineState(m_meshCountPass.pso);
+        commandListCompute->SetComputeRootSignature(m_meshCountPass.rs);
+        commandListCompute->SetCompute32BitConstants(0, 2, bucketConstants);
+        d3d12CommandList->SetComputeRootShaderResourceView(1, frame.visibility.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootShaderResourceView(2, m_meshIds.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(3, frame.meshCounts.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(4, frame.meshRanks.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootShaderResourceView(5, frame.lods.GetResource()->GetGPUVirtualAddress());
+
+        commandListCompute->Dispatch(numGroups);
+        commandListCompute->UAVBarrier(frame.meshCounts.GetResource());
+        commandListCompute->UAVBarrier(frame.meshRanks.GetResource());
     }
-}
 
-void OcclusionCulling::FillIndirectPass()
-{
-    auto& commandQueueCompute = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_COMPUTE);
-    auto commandListCompute = commandQueueCompute.GetCommandList();
+    // A single group turns the counts into mesh offsets and one draw per mesh with visible instances
+    commandListCompute->SetPipelineState(m_meshCommandsPass.pso);
+    commandListCompute->SetComputeRootSignature(m_meshCommandsPass.rs);
+    commandListCompute->SetCompute32BitConstants(0, 1, &m_numMeshes);
+    d3d12CommandList->SetComputeRootShaderResourceView(1, m_meshTable.GetResource()->GetGPUVirtualAddress());
+    d3d12CommandList->SetComputeRootUnorderedAccessView(2, frame.meshCounts.GetResource()->GetGPUVirtualAddress());
+    d3d12CommandList->SetComputeRootUnorderedAccessView(3, frame.meshOffsets.GetResource()->GetGPUVirtualAddress());
+    d3d12CommandList->SetComputeRootUnorderedAccessView(4, draws.indirectArgs.GetResource()->GetGPUVirtualAddress());
+    d3d12CommandList->SetComputeRootUnorderedAccessView(5, draws.count.GetResource()->GetGPUVirtualAddress());
 
-    commandListCompute->SetPipelineState(m_fillIndirectBufferPass.pso);
-    commandListCompute->SetComputeRootSignature(m_fillIndirectBufferPass.rs);
-    commandListCompute->SetCompute32BitConstants(1, 1, &m_numInstances);
+    commandListCompute->Dispatch(1);
+    commandListCompute->UAVBarrier(frame.meshOffsets.GetResource());
 
+    if (singleMesh)
     {
-        ID3D12DescriptorHeap* uavHeap[] = {m_uavHeap.GetD3D12Heap().Get()};
-        commandListCompute->GetD3D12CommandList()->SetDescriptorHeaps(_countof(uavHeap), uavHeap);
-
-        auto handle = m_uavHeap.GetD3D12Heap()->GetGPUDescriptorHandleForHeapStart();
-        auto incrementSize =
-            m_device->GetD3D12Device()->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-        handle.ptr += incrementSize;
-        commandListCompute->GetD3D12CommandList()->SetComputeRootDescriptorTable(0, handle);
+        // Every visible instance to the offset of its word plus the visible bits below it. Also clears the scan.
+        commandListCompute->SetPipelineState(m_visibilityCompactPass.pso);
+        commandListCompute->SetComputeRootSignature(m_visibilityCompactPass.rs);
+        commandListCompute->SetCompute32BitConstants(0, 1, &m_numInstances);
+        d3d12CommandList->SetComputeRootShaderResourceView(1, frame.visibility.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(2, draws.matrixIndex.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(3, frame.wordOffsets.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(4, frame.scanPartitions.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(5, frame.scanCounter.GetResource()->GetGPUVirtualAddress());
+    }
+    else
+    {
+        // Every visible instance to its offset plus rank
+        commandListCompute->SetPipelineState(m_meshScatterPass.pso);
+        commandListCompute->SetComputeRootSignature(m_meshScatterPass.rs);
+        commandListCompute->SetCompute32BitConstants(0, 2, bucketConstants);
+        d3d12CommandList->SetComputeRootShaderResourceView(1, frame.visibility.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootShaderResourceView(2, m_meshIds.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(3, frame.meshRanks.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(4, frame.meshOffsets.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootUnorderedAccessView(5, draws.matrixIndex.GetResource()->GetGPUVirtualAddress());
+        d3d12CommandList->SetComputeRootShaderResourceView(6, frame.lods.GetResource()->GetGPUVirtualAddress());
     }
 
-    commandListCompute->Dispatch(static_cast<int>(m_numInstances / 256) + 1);
-    commandListCompute->UAVBarrier(m_indirectArgs.GetResource());
-    auto fenceValue = commandQueueCompute.ExecuteCommandList(commandListCompute);
-    commandQueueCompute.WaitForFenceValue(fenceValue);
+    commandListCompute->Dispatch(numGroups);
+    commandListCompute->UAVBarrier(draws.matrixIndex.GetResource());
+
+    commandQueueCompute.ExecuteCommandList(commandListCompute);
 }
 
-void OcclusionCulling::IndirectDrawPass(XMMATRIX* cameraVP)
+void OcclusionCulling::IndirectDrawPass(XMMATRIX* cameraVP, DrawList& draws)
 {
     auto& commandQueueDirect = m_device->GetCommandQueue(D3D12_COMMAND_LIST_TYPE_DIRECT);
     auto commandList = commandQueueDirect.GetCommandList();
@@ -1467,28 +1570,35 @@ void OcclusionCulling::IndirectDrawPass(XMMATRIX* cameraVP)
 
     commandList->SetGraphics32BitConstants(0, sizeof(XMMATRIX) / 4, cameraVP);
 
-    commandList->TransitionBarrier(m_indirectArgs.GetResource(), D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    commandList->TransitionBarrier(draws.matrixIndex.GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+    commandList->TransitionBarrier(draws.indirectArgs.GetResource(), D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    commandList->TransitionBarrier(draws.count.GetResource(), D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    commandList->FlushResourceBarriers();
+
+    {
+        auto adress = m_instanceData.GetResource()->GetGPUVirtualAddress();
+        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(1, adress);
 
-    ID3D12DescriptorHeap* srvHeaps[] = {m_srvHeap.GetD3D12Heap().Get()};
-    commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(srvHeaps), srvHeaps);
-    commandList->GetD3D12CommandList()->SetGraphicsRootDescriptorTable(
-        1,
-        m_srvHeap.GetD3D12Heap()->GetGPUDescriptorHandleForHeapStart());
+        adress = draws.matrixIndex.GetResource()->GetGPUVirtualAddress();
+        commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(2, adress);
+    }
 
     commandList->SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.get());
-    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.get());
+    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.data());
+    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.data());
 
-    commandList->GetD3D12CommandList()
-        ->ExecuteIndirect(m_commandSignature.Get(), 1, m_indirectArgs.GetResource().Get(), 0, m_count.GetResource().Get(), 0);
+    // One command per mesh at most, the count buffer says how many were written
+    commandList->GetD3D12CommandList()->ExecuteIndirect(m_drawCommandSignature.Get(),
+                                                        m_numMeshes,
+                                                        draws.indirectArgs.GetResource().Get(),
+                                                        0,
+                                                        draws.count.GetResource().Get(),
+                                                        0);
 
     commandQueueDirect.ExecuteCommandList(commandList);
-
-    auto fenceValue = commandQueueDirect.Signal();
-    commandQueueDirect.WaitForFenceValue(fenceValue);
 }
 
-void OcclusionCulling::IndirectDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix)
+void OcclusionCulling::IndirectDepthPass(std::shared_ptr<CommandList> commandList, XMMATRIX& vpMatrix, DrawList& draws)
 {
     assert(commandList && "commandlist can't be null.");
 
@@ -1498,25 +1608,25 @@ void OcclusionCulling::IndirectDepthPass(std::shared_ptr<CommandList> commandLis
                                               D3D12_CLEAR_FLAG_DEPTH);
     }
 
-    // commandList->SetPipelineState(m_PipelineState);
     commandList->SetPipelineState(m_indirectDepthPass.pso);
     commandList->SetGraphicsRootSignature(m_indirectDepthPass.rs);
 
-    {
-        // Bind the descriptor heap
-        ID3D12DescriptorHeap* ppHeaps[] = {m_srvHeap.GetD3D12Heap().Get()};
-        commandList->GetD3D12CommandList()->SetDescriptorHeaps(_countof(ppHeaps), ppHeaps);
+    commandList->TransitionBarrier(draws.matrixIndex.GetResource(), D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE);
+    commandList->TransitionBarrier(draws.indirectArgs.GetResource(), D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    commandList->TransitionBarrier(draws.count.GetResource(), D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT);
+    commandList->FlushResourceBarriers();
 
+    {
         auto adress = m_instanceData.GetResource()->GetGPUVirtualAddress();
         commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(1, adress);
 
-        adress = m_matrixIndex.GetResource()->GetGPUVirtualAddress();
+        adress = draws.matrixIndex.GetResource()->GetGPUVirtualAddress();
         commandList->GetD3D12CommandList()->SetGraphicsRootShaderResourceView(2, adress);
     }
 
     commandList->SetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
-    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.get());
-    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.get());
+    commandList->SetDynamicVertexBuffer(0, m_numVertices, sizeof(VertexPosColor), m_vertexBuffer.data());
+    commandList->SetDynamicIndexBuffer(m_numIndices, DXGI_FORMAT_R16_UINT, m_indexBuffer.data());
 
     commandList->SetViewport(m_viewport);
     commandList->SetScissorRect(m_scissorRect);
@@ -1525,8 +1635,12 @@ void OcclusionCulling::IndirectDepthPass(std::shared_ptr<CommandList> commandLis
 
     commandList->SetGraphics32BitConstants(0, sizeof(XMMATRIX) / 4, &vpMatrix);
 
-    commandList->GetD3D12CommandList()
-        ->ExecuteIndirect(m_commandSignature.Get(), 1, m_indirectArgs.GetResource().Get(), 0, m_count.GetResource().Get(), 0);
+    commandList->GetD3D12CommandList()->ExecuteIndirect(m_depthCommandSignature.Get(),
+                                                        m_numMeshes,
+                                                        draws.indirectArgs.GetResource().Get(),
+                                                        0,
+                                                        draws.count.GetResource().Get(),
+                                                        0);
 }
 
 void OcclusionCulling::IncrementMipToDisplay()
@@ -1582,3 +1696,51 @@ void OcclusionCulling::PopulateBuffer(std::shared_ptr<CommandList>& commandList,
                                                          0,                           // Source offset
                                                          elementSize * numElements);  // Size of the data
 }
+
+void OcclusionCulling::PopulateBufferElements(std::shared_ptr<CommandList>& commandList,
+                                              ComPtr<ID3D12Resource>& resource,
+                                              ComPtr<ID3D12Resource>& uploadBuffer,
+                                              const void* data,
+                                              const std::vector<int>& elementIndices,
+                                              UINT elementSize)
+{
+    const UINT numElements = static_cast<UINT>(elementIndices.size());
+
+    CD3DX12_HEAP_PROPERTIES uploadHeapProps(D3D12_HEAP_TYPE_UPLOAD);
+    D3D12_RESOURCE_DESC uploadDesc = {};
+    uploadDesc.Dimension = D3D12_RESOURCE_DIMENSION_BUFFER;
+    uploadDesc.Width = elementSize * numElements;
+    uploadDesc.Height = 1;
+    uploadDesc.DepthOrArraySize = 1;
+    uploadDesc.MipLevels = 1;
+    uploadDesc.SampleDesc.Count = 1;
+    uploadDesc.Layout = D3D12_TEXTURE_LAYOUT_ROW_MAJOR;
+
+    ThrowIfFailed(
+        m_device->GetD3D12Device()->CreateCommittedResource(&uploadHeapProps,
+                                                            D3D12_HEAP_FLAG_NONE,
+                                                            &uploadDesc,
+                                                            D3D12_RESOURCE_STATE_GENERIC_READ,  // Must be in a readable state
+                                                            nullptr,
+                                                            IID_PPV_ARGS(&uploadBuffer)));
+
+    // Already packed back to back by the caller
+    void* mappedData;
+    uploadBuffer->Map(0, nullptr, &mappedData);
+    memcpy(mappedData, data, static_cast<size_t>(elementSize) * numElements);
+    uploadBuffer->Unmap(0, nullptr);
+
+    // One copy per run of consecutive element indices
+    UINT runStart = 0;
+    for (UINT i = 1; i <= numElements; ++i)
+    {
+        if (i < numElements && elementIndices[i] == elementIndices[i - 1] + 1) continue;
+
+        commandList->GetD3D12CommandList()->CopyBufferRegion(resource.Get(),
+                                                             static_cast<UINT64>(elementIndices[runStart]) * elementSize,
+                                                             uploadBuffer.Get(),
+                                                             static_cast<UINT64>(runStart) * elementSize,
+                                                             static_cast<UINT64>(i - runStart) * elementSize);
+        runStart = i;
+    }
+}
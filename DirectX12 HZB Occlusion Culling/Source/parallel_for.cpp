@@ -0,0 +1,114 @@
+#include "parallel_for.hpp"
+
+#include <condition_variable>
+#include <mutex>
+
+// Set on the pool threads, and on a caller while it has the pool
+static thread_local bool t_insideParallelCall = false;
+
+// Threads are started once, on the first parallel call. Creating them per call cost more than the small passes.
+class WorkerPool
+{
+public:
+    WorkerPool()
+    {
+        const unsigned int numThreads = GetNumWorkerThreads() - 1;
+        m_threads.reserve(numThreads);
+        for (unsigned int i = 0; i < numThreads; ++i) m_threads.emplace_back([this]() { WorkerLoop(); });
+    }
+
+    ~WorkerPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto& thread : m_threads) thread.join();
+    }
+
+    size_t GetNumThreads() const { return m_threads.size(); }
+
+    // Only one call at a time has the pool, see RunOnWorkerThreads
+    std::mutex& GetSubmitMutex() { return m_submitMutex; }
+
+    void Run(const std::function<void()>& worker, size_t numHelpers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &worker;
+            m_numUnclaimed = numHelpers;
+            m_numRunning = numHelpers;
+        }
+        m_wake.notify_all();
+
+        worker();
+
+        // Helpers that haven't woken up yet would find nothing left to do
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_numRunning -= m_numUnclaimed;
+        m_numUnclaimed = 0;
+        m_done.wait(lock, [this]() { return m_numRunning == 0; });
+        m_job = nullptr;
+    }
+
+private:
+    void WorkerLoop()
+    {
+        t_insideParallelCall = true;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true)
+        {
+            m_wake.wait(lock, [this]() { return m_stop || m_numUnclaimed > 0; });
+            if (m_stop) return;
+
+            m_numUnclaimed--;
+            const std::function<void()>* job = m_job;
+
+            lock.unlock();
+            (*job)();
+            lock.lock();
+
+            if (--m_numRunning == 0) m_done.notify_all();
+        }
+    }
+
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_submitMutex;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+
+    const std::function<void()>* m_job = nullptr;
+    size_t m_numUnclaimed = 0;
+    size_t m_numRunning = 0;
+    bool m_stop = false;
+};
+
+void RunOnWorkerThreads(const std::function<void()>& worker, size_t numHelpers)
+{
+    static WorkerPool pool;
+
+    numHelpers = std::min(numHelpers, pool.GetNumThreads());
+
+    // Nested calls would wait for threads that are busy with the outer call, and a second caller for the first
+    // one. Running worker here does all of the work as well, only without the helpers.
+    if (numHelpers == 0 || t_insideParallelCall)
+    {
+        worker();
+        return;
+    }
+
+    std::unique_lock<std::mutex> submitLock(pool.GetSubmitMutex(), std::try_to_lock);
+    if (!submitLock.owns_lock())
+    {
+        worker();
+        return;
+    }
+
+    t_insideParallelCall = true;
+    pool.Run(worker, numHelpers);
+    t_insideParallelCall = false;
+}
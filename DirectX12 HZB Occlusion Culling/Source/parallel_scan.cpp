@@ -0,0 +1,315 @@
+#include "parallel_scan.hpp"
+
+#include "parallel_for.hpp"
+#include "simd_target.hpp"
+
+#include <numeric>
+#include <random>
+
+// Elements per block, a multiple of every vector width. Big enough that the per-block setup disappears.
+static const size_t scanBlockSize = 16384;
+
+static void ScanBlockScalar(const unsigned int* input, unsigned int* output, size_t count, unsigned int offset)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const unsigned int value = input[i];
+        output[i] = offset;
+        offset += value;
+    }
+}
+
+static void ScanBlockSSE(const unsigned int* input, unsigned int* output, size_t count, unsigned int offset)
+{
+    __m128i carry = _mm_set1_epi32(static_cast<int>(offset));
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+
+        // Inclusive scan of the four lanes in two shifted adds
+        __m128i sum = _mm_add_epi32(values, _mm_slli_si128(values, 4));
+        sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_add_epi32(carry, _mm_sub_epi32(sum, values)));
+        carry = _mm_add_epi32(carry, _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 3, 3)));
+    }
+
+    ScanBlockScalar(input + i, output + i, count - i, static_cast<unsigned int>(_mm_cvtsi128_si32(carry)));
+}
+
+TARGET_AVX2 static void ScanBlockAVX2(const unsigned int* input, unsigned int* output, size_t count, unsigned int offset)
+{
+    __m256i carry = _mm256_set1_epi32(static_cast<int>(offset));
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+
+        // The byte shifts stay inside each 128-bit lane, so the low lane's total is added to the high lane after
+        __m256i sum = _mm256_add_epi32(values, _mm256_slli_si256(values, 4));
+        sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 8));
+        const __m256i lowTotal = _mm256_shuffle_epi32(_mm256_permute2x128_si256(sum, sum, 0x08), _MM_SHUFFLE(3, 3, 3, 3));
+        sum = _mm256_add_epi32(sum, lowTotal);
+
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_add_epi32(carry, _mm256_sub_epi32(sum, values)));
+        carry = _mm256_add_epi32(carry, _mm256_permutevar8x32_epi32(sum, _mm256_set1_epi32(7)));
+    }
+
+    ScanBlockScalar(input + i, output + i, count - i, static_cast<unsigned int>(_mm256_extract_epi32(carry, 0)));
+}
+
+static void ScanBlock(const unsigned int* input, unsigned int* output, size_t count, unsigned int offset, SimdLevel level)
+{
+    if (level >= SimdLevel::AVX2) ScanBlockAVX2(input, output, count, offset);
+    else if (level == SimdLevel::SSE) ScanBlockSSE(input, output, count, offset);
+    else ScanBlockScalar(input, output, count, offset);
+}
+
+static SimdLevel GetScanSimdLevel(SimdLevel maxLevel)
+{
+    // Nothing to gain from AVX-512 over AVX2 here
+    const SimdLevel level = std::min(maxLevel, GetSupportedSimdLevel());
+    return level == SimdLevel::AVX512 ? SimdLevel::AVX2 : level;
+}
+
+unsigned int ExclusiveScan(const unsigned int* input, unsigned int* output, size_t count, SimdLevel maxLevel)
+{
+    assert((count == 0 || (input != nullptr && output != nullptr)) && "input and output can't be null.");
+
+    const SimdLevel level = GetScanSimdLevel(maxLevel);
+    const size_t numBlocks = (count + scanBlockSize - 1) / scanBlockSize;
+
+    // Reduce every block, scan the block sums, then scan each block from its offset
+    std::vector<unsigned int> blockOffsets(numBlocks);
+    ParallelForChunks(numBlocks,
+                      [&](size_t block)
+                      {
+                          const size_t begin = block * scanBlockSize;
+                          const size_t end = std::min(count, begin + scanBlockSize);
+                          blockOffsets[block] = std::accumulate(input + begin, input + end, 0u);
+                      });
+
+    unsigned int total = 0;
+    for (unsigned int& offset : blockOffsets)
+    {
+        const unsigned int blockSum = offset;
+        offset = total;
+        total += blockSum;
+    }
+
+    ParallelForChunks(numBlocks,
+                      [&](size_t block)
+                      {
+                          const size_t begin = block * scanBlockSize;
+                          const size_t end = std::min(count, begin + scanBlockSize);
+                          ScanBlock(input + begin, output + begin, end - begin, blockOffsets[block], level);
+                      });
+
+    return total;
+}
+
+// Set bits of a 4 bit movemask
+static const int numBitsSet[16] = {0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4};
+
+// Non-zero flags in [begin, end). SSE is enough, the compare and movemask keep up with the loads.
+static size_t CountFlags(const unsigned int* flags, size_t begin, size_t end, SimdLevel level)
+{
+    size_t numSet = 0;
+    size_t i = begin;
+    if (level != SimdLevel::Scalar)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= end; i += 4)
+        {
+            const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flags + i));
+            const int zeroMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, zero)));
+            numSet += 4 - numBitsSet[zeroMask];
+        }
+    }
+
+    for (; i < end; ++i) numSet += flags[i] != 0;
+    return numSet;
+}
+
+static void WriteFlagIndices(const unsigned int* flags, size_t begin, size_t end, unsigned int* out, SimdLevel level)
+{
+    size_t i = begin;
+    if (level != SimdLevel::Scalar)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= end; i += 4)
+        {
+            const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flags + i));
+            int setMask = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, zero))) & 0xF;
+
+            // Mostly all or nothing for culled scenes, so the common cases skip the bit loop
+            if (setMask == 0) continue;
+            if (setMask == 0xF)
+            {
+                const __m128i indices = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(i)), _mm_setr_epi32(0, 1, 2, 3));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), indices);
+                out += 4;
+                continue;
+            }
+
+            for (int lane = 0; setMask != 0; ++lane, setMask >>= 1)
+            {
+                if (setMask & 1) *out++ = static_cast<unsigned int>(i + lane);
+            }
+        }
+    }
+
+    for (; i < end; ++i)
+    {
+        if (flags[i]) *out++ = static_cast<unsigned int>(i);
+    }
+}
+
+size_t CompactIndices(const unsigned int* flags, size_t count, unsigned int* outIndices, SimdLevel maxLevel)
+{
+    assert((count == 0 || (flags != nullptr && outIndices != nullptr)) && "flags and outIndices can't be null.");
+
+    const SimdLevel level = GetScanSimdLevel(maxLevel);
+    const size_t numBlocks = (count + scanBlockSize - 1) / scanBlockSize;
+
+    // Count per block, scan the counts, then every block writes from its offset
+    std::vector<size_t> blockOffsets(numBlocks);
+    ParallelForChunks(numBlocks,
+                      [&](size_t block)
+                      {
+                          const size_t begin = block * scanBlockSize;
+                          blockOffsets[block] = CountFlags(flags, begin, std::min(count, begin + scanBlockSize), level);
+                      });
+
+    size_t total = 0;
+    for (size_t& offset : blockOffsets)
+    {
+        const size_t blockCount = offset;
+        offset = total;
+        total += blockCount;
+    }
+
+    ParallelForChunks(numBlocks,
+                      [&](size_t block)
+                      {
+                          const size_t begin = block * scanBlockSize;
+                          const size_t end = std::min(count, begin + scanBlockSize);
+                          WriteFlagIndices(flags, begin, end, outIndices + blockOffsets[block], level);
+                      });
+
+    return total;
+}
+
+DecoupledLookbackScan::DecoupledLookbackScan(int partitionSize, int maxResidentGroups)
+    : m_partitionSize(partitionSize), m_maxResidentGroups(maxResidentGroups)
+{
+    assert(partitionSize > 0 && "Partitions need at least one element");
+    assert(maxResidentGroups > 0 && "Need at least one workgroup");
+}
+
+unsigned int DecoupledLookbackScan::Run(const unsigned int* input, unsigned int* output, size_t count, uint32_t seed)
+{
+    assert((count == 0 || (input != nullptr && output != nullptr)) && "input and output can't be null.");
+
+    m_stats = LookbackScanStats();
+    m_stats.numPartitions = static_cast<int>((count + m_partitionSize - 1) / m_partitionSize);
+
+    // Cleared before every dispatch on the GPU as well
+    m_partitionStates.assign(m_stats.numPartitions, PackPartitionState(PARTITION_NOT_READY, 0));
+    m_partitionCounter = 0;
+
+    std::vector<Workgroup> groups(std::min(m_maxResidentGroups, std::max(1, m_stats.numPartitions)));
+    std::mt19937 random(seed);
+
+    // Every step reads or writes one partition state. Look-backs that keep stalling are bounded by the number of
+    // partitions in front, anything past this means the state machine is stuck.
+    const uint64_t maxSteps = (static_cast<uint64_t>(m_stats.numPartitions) + 1) * (m_stats.numPartitions + 8) * 8;
+
+    size_t numRunning = groups.size();
+    while (numRunning > 0)
+    {
+        Workgroup& group = groups[random() % groups.size()];
+        if (group.phase == Phase::Done) continue;
+
+        Step(group, input, output, count);
+        m_stats.numSteps++;
+        if (group.phase == Phase::Done) numRunning--;
+
+        assert(m_stats.numSteps < maxSteps && "Decoupled look-back made no progress");
+    }
+
+    return m_stats.numPartitions > 0 ? GetPartitionValue(m_partitionStates.back()) : 0;
+}
+
+void DecoupledLookbackScan::Step(Workgroup& group, const unsigned int* input, unsigned int* output, size_t count)
+{
+    switch (group.phase)
+    {
+        case Phase::Acquire:
+        {
+            // InterlockedAdd on the partition counter
+            group.partition = m_partitionCounter++;
+            group.phase = group.partition < m_stats.numPartitions ? Phase::Reduce : Phase::Done;
+            break;
+        }
+        case Phase::Reduce:
+        {
+            const size_t begin = static_cast<size_t>(group.partition) * m_partitionSize;
+            const size_t end = std::min(count, begin + m_partitionSize);
+            group.aggregate = std::accumulate(input + begin, input + end, 0u);
+            group.exclusivePrefix = 0;
+
+            // The first partition has nothing in front of it, its aggregate is already its prefix
+            if (group.partition == 0)
+            {
+                m_partitionStates[0] = PackPartitionState(PARTITION_PREFIX, group.aggregate);
+                group.phase = Phase::Write;
+            }
+            else
+            {
+                m_partitionStates[group.partition] = PackPartitionState(PARTITION_AGGREGATE, group.aggregate);
+                group.lookbackIndex = group.partition - 1;
+                group.phase = Phase::LookBack;
+            }
+            break;
+        }
+        case Phase::LookBack:
+        {
+            const unsigned int state = m_partitionStates[group.lookbackIndex];
+            const PartitionFlag flag = GetPartitionFlag(state);
+
+            // Spin on the same predecessor
+            if (flag == PARTITION_NOT_READY)
+            {
+                m_stats.numStalls++;
+                break;
+            }
+
+            group.exclusivePrefix += GetPartitionValue(state);
+            if (flag == PARTITION_AGGREGATE)
+            {
+                group.lookbackIndex--;
+                assert(group.lookbackIndex >= 0 && "Partition 0 always publishes a prefix");
+                break;
+            }
+
+            m_stats.maxLookbackDistance = std::max(m_stats.maxLookbackDistance, group.partition - group.lookbackIndex);
+            m_partitionStates[group.partition] =
+                PackPartitionState(PARTITION_PREFIX, group.exclusivePrefix + group.aggregate);
+            group.phase = Phase::Write;
+            break;
+        }
+        case Phase::Write:
+        {
+            const size_t begin = static_cast<size_t>(group.partition) * m_partitionSize;
+            const size_t end = std::min(count, begin + m_partitionSize);
+            ScanBlockScalar(input + begin, output + begin, end - begin, group.exclusivePrefix);
+            group.phase = Phase::Acquire;
+            break;
+        }
+        case Phase::Done: break;
+    }
+}
@@ -2,8 +2,10 @@
 #include "render_dx12.hpp"
 
 #include "bounding_volumes.hpp"
+#include "dynamic_bvh.hpp"
 #include "frustum.hpp"
-#include "tools/random.hpp"
+#include "scene_cache.hpp"
+#include "scene_generator.hpp"
 
 #include "rendering/render_components.hpp"
 
@@ -21,16 +23,37 @@ using namespace DirectX;
 #include <functional>  // For std::bind
 #include <string>      // For std::wstring
 #include <array>
+#include <cmath>
 #include <vector>
 
-struct IndirectCommand
+static const float cubeScale = 1.f;
+
+// See ToggleInstanceAnimation
+static const size_t numAnimatedInstances = 4096;
+static const float animationHeight = 4.f;
+
+// Written on the first run, loaded on the next ones as long as the scene settings stay the same
+static const char* sceneCachePath = "scene_cache.bin";
+
+static AABB GetCubeAABB()
+{
+    AABB cubeAABB{};
+    cubeAABB.min = {-cubeScale, -cubeScale, -cubeScale};
+    cubeAABB.max = {cubeScale, cubeScale, cubeScale};
+    return cubeAABB;
+}
+
+// bounds is indexed by instance
+static std::shared_ptr<DynamicBVH> BuildInstanceBVH(const AABB* bounds, size_t numInstances, const AABB& meshBounds)
 {
-    unsigned int IndexCountPerInstance;
-    unsigned int InstanceCount;
-    unsigned int StartIndexLocation;
-    int BaseVertexLocation;
-    unsigned int StartInstanceLocation;
-};
+    std::vector<IndexedAABB> objects;
+    objects.reserve(numInstances);
+    for (size_t i = 0; i < numInstances; ++i) objects.emplace_back(bounds[i], static_cast<int>(i));
+
+    auto bvh = std::make_shared<DynamicBVH>();
+    bvh->Build(std::move(objects), meshBounds);
+    return bvh;
+}
 
 Renderer::Renderer()
     : m_ScissorRect(CD3DX12_RECT(0, 0, LONG_MAX, LONG_MAX)),
@@ -67,7 +90,8 @@ bool Renderer::LoadContent()
                                                std::make_shared<Heap>(m_aabbHeap),
                                                std::make_shared<GpuResource>(m_aabbBuffer),
                                                m_RenderTarget,
-                                               render::numInstances);
+                                               render::numInstances,
+                                               InstanceFormat::Compact);
 
     return true;
 }
@@ -153,27 +177,45 @@ void Renderer::InitCameras()
 
 void Renderer::InitCubes()
 {
-    render::instanceData.resize(render::numInstances);
+    SceneSettings settings;
+    settings.numInstances = render::numInstances;
+    settings.scale = cubeScale;
 
-    const float scale = 1.f;
-    AABB cubeAABB{};
-    cubeAABB.min = {-scale, -scale, -scale};
-    cubeAABB.max = {scale, scale, scale};
+    const AABB cubeAABB = GetCubeAABB();
+    const uint64_t sceneKey = HashSceneSettings(settings, cubeAABB);
 
-    xorshift32_state xss;
-    xss.a = 1431;
-    const int modulus = 200000;
-    for (int i = 0; i < render::numInstances; i++)
+    m_sceneCache = std::make_unique<SceneCache>();
+    if (m_sceneCache->Open(sceneCachePath, sceneKey))
     {
-        // make a uniform matrix
-        render::instanceData[i].WorldMatrix =
-            DirectX::XMMatrixTranslation(static_cast<float>(xorshift32(&xss) % modulus) * 0.001f,
-                                                                  static_cast<float>(xorshift32(&xss) % modulus) * 0.001f,
-                                                                  static_cast<float>(xorshift32(&xss) % modulus) * 0.001f);
-        render::instanceData[i].WorldMatrix =
-            DirectX::XMMatrixMultiply(render::instanceData[i].WorldMatrix, DirectX::XMMatrixScaling(scale, scale, scale));
-
-        m_objects.push_back(TransformAABB(cubeAABB, render::instanceData[i].WorldMatrix));
+        // MoveInstances changes the matrices, so they need their own copy. The bounds are read from the mapped pages.
+        const size_t numInstances = m_sceneCache->GetNumInstances();
+        render::instanceData.assign(m_sceneCache->GetInstances(), m_sceneCache->GetInstances() + numInstances);
+
+        const AABB* bounds = m_sceneCache->GetBounds();
+        m_bvh = std::make_shared<DynamicBVH>();
+        const bool loadedBVH = m_sceneCache->HasBVH() && m_bvh->Restore(m_sceneCache->GetBVHNodes(),
+                                                                          m_sceneCache->GetNumBVHNodes(),
+                                                                          m_sceneCache->GetBVHObjects(),
+                                                                          bounds,
+                                                                          numInstances,
+                                                                          cubeAABB);
+        if (!loadedBVH) m_bvh = BuildInstanceBVH(bounds, numInstances, cubeAABB);
+
+        Log::Info("Scene cache :: Loaded {} instances from {}, {}",
+                  numInstances,
+                  sceneCachePath,
+                  loadedBVH ? "BVH included" : "rebuilt the BVH");
+    }
+    else
+    {
+        m_sceneCache = nullptr;
+        GenerateScene(settings, cubeAABB, render::instanceData, m_generatedBounds);
+        m_bvh = BuildInstanceBVH(m_generatedBounds.data(), m_generatedBounds.size(), cubeAABB);
+
+        std::vector<FlatBVHNode> bvhNodes;
+        std::vector<int> bvhObjects;
+        m_bvh->Flatten(bvhNodes, bvhObjects);
+        SceneCache::Write(sceneCachePath, sceneKey, render::instanceData, m_generatedBounds, &bvhNodes, &bvhObjects);
     }
 }
 
@@ -192,11 +234,99 @@ void Renderer::PopulateResources()
 
     ComPtr<ID3D12Resource> uploadBuffer;
     auto& aabbResource = m_aabbBuffer.GetResource();
-    PopulateBuffer(commandList,
-                   aabbResource, uploadBuffer, m_objects.data(), static_cast<UINT>(m_objects.size()), sizeof(AABB));
+    // Straight from the mapped pages when the scene came from the cache
+    const void* aabbData = m_sceneCache ? static_cast<const void*>(m_sceneCache->GetBounds()) : m_generatedBounds.data();
+    const UINT numInstances = static_cast<UINT>(render::instanceData.size());
+    PopulateBuffer(commandList, aabbResource, uploadBuffer, aabbData, numInstances, sizeof(AABB));
 
     const auto fence = commandQueue.ExecuteCommandList(commandList);
     commandQueue.WaitForFenceValue(fence);
+
+    // From here on the BVH has the only CPU copy of the bounds
+    m_sceneCache = nullptr;
+    m_generatedBounds.clear();
+    m_generatedBounds.shrink_to_fit();
+}
+
+void Renderer::MoveInstances(const std::vector<int>& changedInstances)
+{
+    // Their matrices are spread over the whole instance array, copy them together for TransformAABBs
+    std::vector<XMMATRIX> worldMatrices(changedInstances.size());
+    for (size_t i = 0; i < changedInstances.size(); ++i)
+    {
+        worldMatrices[i] = render::instanceData[changedInstances[i]].WorldMatrix;
+    }
+
+    std::vector<AABB> bounds(changedInstances.size());
+    TransformAABBs(GetCubeAABB(), worldMatrices.data(), bounds.data(), bounds.size());
+
+    // Already transformed, the BVH takes the bounds as they are
+    m_bvh->Refit(changedInstances, bounds);
+
+    OcclusionCulling::GetInstance().UpdateInstances(changedInstances, render::instanceData, bounds);
+}
+
+void Renderer::SetInstanceTransform(int instance, const XMMATRIX& worldMatrix)
+{
+    assert(instance >= 0 && instance < static_cast<int>(render::instanceData.size()) && "Instance index out of range");
+
+    render::instanceData[instance].WorldMatrix = worldMatrix;
+    m_movedInstances.push_back(instance);
+}
+
+void Renderer::ToggleBvhCulling()
+{
+    m_bvhCulling = !m_bvhCulling;
+
+    // Everything visible until the next Update has culled
+    m_bvhVisibility = m_bvhCulling ? std::make_shared<std::vector<unsigned int>>(render::instanceData.size(), OC_VISIBLE) : nullptr;
+    OcclusionCulling::GetInstance().SetCpuVisibility(m_bvhVisibility);
+}
+
+void Renderer::CullWithBvh(const XMMATRIX& vpMatrix)
+{
+    FrustumPlanes frustum;
+    ExtractPlanes(frustum.planes, vpMatrix, false);
+
+    // Moved instances are already refit, see Update
+    m_bvhVisibleInstances.clear();
+    m_bvh->FrustumIntersect(m_bvhVisibleInstances, frustum);
+
+    std::vector<unsigned int>& visibility = *m_bvhVisibility;
+    std::fill(visibility.begin(), visibility.end(), OC_HIDDEN);
+    for (int instance : m_bvhVisibleInstances) visibility[instance] = OC_VISIBLE;
+}
+
+void Renderer::ToggleInstanceAnimation()
+{
+    if (m_animationBase.empty())
+    {
+        const size_t count = std::min(numAnimatedInstances, render::instanceData.size());
+        m_animationBase.resize(count);
+        for (size_t i = 0; i < count; ++i) m_animationBase[i] = render::instanceData[i].WorldMatrix;
+        m_animationTime = 0.f;
+    }
+    else
+    {
+        // Back to where they started
+        for (size_t i = 0; i < m_animationBase.size(); ++i) SetInstanceTransform(static_cast<int>(i), m_animationBase[i]);
+        m_animationBase.clear();
+    }
+}
+
+void Renderer::AnimateInstances(float deltaTime)
+{
+    m_animationTime += deltaTime;
+
+    for (size_t i = 0; i < m_animationBase.size(); ++i)
+    {
+        // Out of phase, so neighbouring instances don't move as one block
+        const float height = std::sin(m_animationTime * 2.f + static_cast<float>(i) * 0.1f) * animationHeight;
+
+        XMMATRIX worldMatrix = m_animationBase[i];
+        worldMatrix.r[3] = XMVectorAdd(worldMatrix.r[3], XMVectorSet(0.f, height, 0.f, 0.f));
+        SetInstanceTransform(static_cast<int>(i), worldMatrix);
+    }
 }
 
 void Renderer::Render()
@@ -216,11 +346,25 @@ void Renderer::Render()
     m_SwapChain->Present(m_RenderTarget->GetTexture(AttachmentPoint::Color0));
 }
 
-void Renderer::Update(float)
+void Renderer::Update(float deltaTime)
 {
+    if (!m_animationBase.empty()) AnimateInstances(deltaTime);
+
+    if (!m_movedInstances.empty())
+    {
+        // An instance can be moved more than once per frame
+        std::sort(m_movedInstances.begin(), m_movedInstances.end());
+        m_movedInstances.erase(std::unique(m_movedInstances.begin(), m_movedInstances.end()), m_movedInstances.end());
+
+        MoveInstances(m_movedInstances);
+        m_movedInstances.clear();
+    }
+
     // Always use main camera for culling
     XMMATRIX vpMatrix = GetCameraVP(Mode::MODE_DEFAULT);
 
+    if (m_bvhCulling) CullWithBvh(vpMatrix);
+
     // Add occlusion update
     OcclusionCulling::GetInstance().Update(vpMatrix);
 }
@@ -358,7 +502,7 @@ void Renderer::CreateUAV(ComPtr<ID3D12Resource>& resource,
 void Renderer::PopulateBuffer(std::shared_ptr<CommandList>& commandList,
                                    ComPtr<ID3D12Resource>& resource,
                                    ComPtr<ID3D12Resource>& uploadBuffer,
-                                   void* data,
+                                   const void* data,
                                    UINT numElements,
                                    UINT elementSize)
 {
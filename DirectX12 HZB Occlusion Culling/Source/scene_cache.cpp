@@ -0,0 +1,278 @@
+#include "scene_cache.hpp"
+
+#include "parallel_for.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Bytes per checksum block. Blocks are hashed over the worker threads and then chained in order.
+static const size_t checksumBlockSize = 1 << 20;
+
+static uint64_t MixHash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// Eight bytes per step, so it keeps up with the reads
+static uint64_t HashBlock(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ MixHash(word)) * 0x100000001B3ull;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    return MixHash(hash ^ tail);
+}
+
+static uint64_t HashBytes(uint64_t hash, const uint8_t* data, size_t size)
+{
+    const size_t numBlocks = (size + checksumBlockSize - 1) / checksumBlockSize;
+
+    std::vector<uint64_t> blockHashes(numBlocks);
+    ParallelForChunks(numBlocks,
+                      [&](size_t block)
+                      {
+                          const size_t begin = block * checksumBlockSize;
+                          blockHashes[block] = HashBlock(data + begin, std::min(size, begin + checksumBlockSize) - begin);
+                      });
+
+    for (uint64_t blockHash : blockHashes) hash = MixHash(hash ^ blockHash);
+    return hash;
+}
+
+static uint64_t AlignOffset(uint64_t offset) { return (offset + sceneCacheAlignment - 1) & ~(sceneCacheAlignment - 1); }
+
+bool MappedFile::Open(const std::string& path)
+{
+    Close();
+
+#if defined(_WIN32)
+    m_file = CreateFileA(path.c_str(),
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         nullptr,
+                         OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                         nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(m_file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        Close();
+        return false;
+    }
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_mapping)
+    {
+        m_data = static_cast<const uint8_t*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        m_mapped = m_data != nullptr;
+    }
+#else
+    const int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) return false;
+
+    struct stat fileStat;
+    if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        close(file);
+        return false;
+    }
+    m_size = static_cast<size_t>(fileStat.st_size);
+
+    void* view = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view != MAP_FAILED)
+    {
+        m_data = static_cast<const uint8_t*>(view);
+        m_mapped = true;
+    }
+#endif
+
+    if (m_mapped) return true;
+
+    // Mapping failed, read the whole file instead
+    std::ifstream stream(path, std::ios::binary);
+    m_fallback.resize((m_size + sizeof(DirectX::XMFLOAT4A) - 1) / sizeof(DirectX::XMFLOAT4A));
+    if (!stream.read(reinterpret_cast<char*>(m_fallback.data()), static_cast<std::streamsize>(m_size)))
+    {
+        Close();
+        return false;
+    }
+
+    m_data = reinterpret_cast<const uint8_t*>(m_fallback.data());
+    return true;
+}
+
+void MappedFile::Close()
+{
+#if defined(_WIN32)
+    if (m_mapped) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+    m_mapping = nullptr;
+    m_file = INVALID_HANDLE_VALUE;
+#else
+    if (m_mapped) munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+
+    m_fallback.clear();
+    m_fallback.shrink_to_fit();
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
+
+bool SceneCache::Write(const std::string& path,
+                       uint64_t sceneKey,
+                       const std::vector<InstanceData>& instances,
+                       const std::vector<AABB>& bounds,
+                       const std::vector<FlatBVHNode>* bvhNodes,
+                       const std::vector<int>* bvhObjects)
+{
+    assert(instances.size() == bounds.size() && "Need one AABB per instance");
+    assert((bvhNodes == nullptr) == (bvhObjects == nullptr) && "The BVH needs its object order");
+
+    const void* data[SCENE_SECTION_COUNT] = {};
+    SceneCacheHeader header = {};
+    header.magic = sceneCacheMagic;
+    header.version = sceneCacheVersion;
+    header.sceneKey = sceneKey;
+
+    auto setSection = [&](SceneCacheSection section, const void* sectionData, size_t count, size_t elementSize)
+    {
+        data[section] = sectionData;
+        header.sections[section].count = count;
+        header.sections[section].size = count * elementSize;
+    };
+
+    setSection(SCENE_SECTION_INSTANCES, instances.data(), instances.size(), sizeof(InstanceData));
+    setSection(SCENE_SECTION_BOUNDS, bounds.data(), bounds.size(), sizeof(AABB));
+    if (bvhNodes)
+    {
+        assert(bvhObjects->size() == instances.size() && "The BVH has to hold every instance");
+        setSection(SCENE_SECTION_BVH_NODES, bvhNodes->data(), bvhNodes->size(), sizeof(FlatBVHNode));
+        setSection(SCENE_SECTION_BVH_OBJECTS, bvhObjects->data(), bvhObjects->size(), sizeof(int));
+    }
+
+    uint64_t offset = AlignOffset(sizeof(SceneCacheHeader));
+    header.checksum = 0;
+    for (uint32_t i = 0; i < SCENE_SECTION_COUNT; ++i)
+    {
+        header.sections[i].offset = offset;
+        offset = AlignOffset(offset + header.sections[i].size);
+
+        header.checksum = HashBytes(header.checksum, static_cast<const uint8_t*>(data[i]), header.sections[i].size);
+    }
+    header.fileSize = offset;
+
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    if (!stream)
+    {
+        Log::Warn("Scene cache :: Can't write {}", path);
+        return false;
+    }
+
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    const std::vector<char> padding(sceneCacheAlignment, 0);
+    uint64_t written = sizeof(header);
+    for (uint32_t i = 0; i < SCENE_SECTION_COUNT; ++i)
+    {
+        const SceneCacheSectionInfo& section = header.sections[i];
+        stream.write(padding.data(), static_cast<std::streamsize>(section.offset - written));
+        stream.write(static_cast<const char*>(data[i]), static_cast<std::streamsize>(section.size));
+        written = section.offset + section.size;
+    }
+    stream.write(padding.data(), static_cast<std::streamsize>(header.fileSize - written));
+
+    if (!stream)
+    {
+        Log::Warn("Scene cache :: Writing {} failed", path);
+        return false;
+    }
+
+    return true;
+}
+
+bool SceneCache::Open(const std::string& path, uint64_t sceneKey, bool verifyChecksum)
+{
+    Close();
+
+    if (!m_file.Open(path)) return false;
+
+    const uint8_t* data = m_file.GetData();
+    const size_t size = m_file.GetSize();
+
+    const SceneCacheHeader* header = reinterpret_cast<const SceneCacheHeader*>(data);
+    const char* problem = nullptr;
+    if (size < sizeof(SceneCacheHeader) || header->magic != sceneCacheMagic) problem = "not a scene cache";
+    else if (header->version != sceneCacheVersion) problem = "old version";
+    else if (header->sceneKey != sceneKey) problem = "made from other scene settings";
+    else if (header->fileSize != size) problem = "truncated";
+
+    // Every section in the file, aligned and sized for its element type
+    static const size_t elementSizes[SCENE_SECTION_COUNT] = {sizeof(InstanceData), sizeof(AABB), sizeof(FlatBVHNode), sizeof(int)};
+    for (uint32_t i = 0; i < SCENE_SECTION_COUNT && !problem; ++i)
+    {
+        const SceneCacheSectionInfo& section = header->sections[i];
+        if (section.offset % sceneCacheAlignment != 0 || section.size != section.count * elementSizes[i] ||
+            section.offset > size || section.size > size - section.offset)
+        {
+            problem = "bad section table";
+        }
+    }
+
+    if (!problem && header->sections[SCENE_SECTION_BOUNDS].count != header->sections[SCENE_SECTION_INSTANCES].count)
+    {
+        problem = "bounds don't match the instances";
+    }
+
+    if (!problem && header->sections[SCENE_SECTION_BVH_NODES].count > 0 &&
+        header->sections[SCENE_SECTION_BVH_OBJECTS].count != header->sections[SCENE_SECTION_INSTANCES].count)
+    {
+        problem = "BVH doesn't match the instances";
+    }
+
+    if (!problem && verifyChecksum)
+    {
+        uint64_t checksum = 0;
+        for (const SceneCacheSectionInfo& section : header->sections)
+        {
+            checksum = HashBytes(checksum, data + section.offset, section.size);
+        }
+
+        if (checksum != header->checksum) problem = "checksum mismatch";
+    }
+
+    if (problem)
+    {
+        Log::Warn("Scene cache :: Ignoring {}, {}", path, problem);
+        m_file.Close();
+        return false;
+    }
+
+    m_header = header;
+    return true;
+}
@@ -0,0 +1,95 @@
+#include "scene_generator.hpp"
+
+#include "parallel_for.hpp"
+#include "tools/random.hpp"
+
+// Instances per random stream. Fixed, so the streams don't depend on how the work is split.
+static const size_t sceneChunkSize = 16384;
+
+// Spreads seed and chunk over all bits (murmur3 finalizer), so neighbouring chunks get unrelated streams
+static uint32_t GetChunkSeed(uint32_t seed, size_t chunk)
+{
+    uint32_t hash = seed ^ (static_cast<uint32_t>(chunk) * 0x9E3779B9u);
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+
+    // xorshift gets stuck at 0
+    return hash ? hash : 1;
+}
+
+// Top 24 bits to [0, 1)
+static float GetUnitFloat(xorshift32_state& state) { return static_cast<float>(xorshift32(&state) >> 8) * (1.f / 16777216.f); }
+
+void GenerateScene(const SceneSettings& settings,
+                   const AABB& meshBounds,
+                   std::vector<InstanceData>& instances,
+                   std::vector<AABB>& bounds)
+{
+    assert(settings.numInstances >= 0 && "numInstances can't be negative");
+
+    const size_t count = static_cast<size_t>(settings.numInstances);
+    instances.resize(count);
+    bounds.resize(count);
+
+    const float scale = settings.scale;
+    const size_t numChunks = (count + sceneChunkSize - 1) / sceneChunkSize;
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          xorshift32_state state;
+                          state.a = GetChunkSeed(settings.seed, chunk);
+
+                          const size_t begin = chunk * sceneChunkSize;
+                          const size_t end = std::min(count, begin + sceneChunkSize);
+                          for (size_t i = begin; i < end; ++i)
+                          {
+                              const float x = GetUnitFloat(state) * settings.positionRange;
+                              const float y = GetUnitFloat(state) * settings.positionRange;
+                              const float z = GetUnitFloat(state) * settings.positionRange;
+
+                              // Translation, then scale, without the matrix multiply
+                              XMMATRIX& world = instances[i].WorldMatrix;
+                              world = XMMatrixScaling(scale, scale, scale);
+                              world.r[3] = XMVectorSet(x * scale, y * scale, z * scale, 1.f);
+                          }
+
+                          // Already on a worker thread, so the batch runs right here
+                          TransformAABBs(meshBounds,
+                                         &instances[begin].WorldMatrix,
+                                         bounds.data() + begin,
+                                         end - begin);
+                      });
+}
+
+uint64_t HashSceneSettings(const SceneSettings& settings, const AABB& meshBounds)
+{
+    // Bump when GenerateScene changes, so old caches don't match anymore
+    const uint32_t generatorVersion = 1;
+
+    const uint32_t values[] = {generatorVersion,
+                               settings.seed,
+                               static_cast<uint32_t>(settings.numInstances),
+                               static_cast<uint32_t>(sceneChunkSize)};
+    const float floats[] = {settings.positionRange,
+                            settings.scale,
+                            meshBounds.min.x,
+                            meshBounds.min.y,
+                            meshBounds.min.z,
+                            meshBounds.max.x,
+                            meshBounds.max.y,
+                            meshBounds.max.z};
+
+    // FNV-1a over the bytes
+    uint64_t hash = 0xCBF29CE484222325ull;
+    auto addBytes = [&](const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    };
+    addBytes(values, sizeof(values));
+    addBytes(floats, sizeof(floats));
+    return hash;
+}
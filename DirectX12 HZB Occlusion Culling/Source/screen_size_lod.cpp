@@ -0,0 +1,104 @@
+#include "screen_size_lod.hpp"
+
+#include "parallel_for.hpp"
+#include "visibility_bits.hpp"
+
+// Instances per chunk, a multiple of 32 so every chunk starts on a visibility word and two LOD words
+static const size_t lodChunkSize = 16384;
+
+// Closer to the eye plane than this and the projection of a corner can't be trusted
+static const float minClipW = 1e-5f;
+
+float GetScreenSize(const AABB& aabb, const XMMATRIX& vpMatrix, float width, float height)
+{
+    float minX = FLT_MAX;
+    float minY = FLT_MAX;
+    float maxX = -FLT_MAX;
+    float maxY = -FLT_MAX;
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const XMVECTOR corner = XMVectorSet(c & 4 ? aabb.max.x : aabb.min.x,
+                                            c & 2 ? aabb.max.y : aabb.min.y,
+                                            c & 1 ? aabb.max.z : aabb.min.z,
+                                            1.f);
+        XMFLOAT4 clip;
+        XMStoreFloat4(&clip, XMVector4Transform(corner, vpMatrix));
+        if (clip.w <= minClipW) return FLT_MAX;
+
+        const float x = clip.x / clip.w;
+        const float y = clip.y / clip.w;
+        minX = std::min(minX, x);
+        minY = std::min(minY, y);
+        maxX = std::max(maxX, x);
+        maxY = std::max(maxY, y);
+    }
+
+    // NDC spans 2 units over the screen
+    return std::max((maxX - minX) * 0.5f * width, (maxY - minY) * 0.5f * height);
+}
+
+unsigned int SelectLod(float screenSize, const LodSettings& settings)
+{
+    unsigned int lod = 0;
+    while (lod + 1 < settings.numLods && screenSize < settings.lodPixelSizes[lod]) lod++;
+    return lod;
+}
+
+LodStats SelectLods(uint32_t* visibilityBits,
+                    uint32_t* lodBits,
+                    const AABB* aabbs,
+                    size_t count,
+                    const XMMATRIX& vpMatrix,
+                    float width,
+                    float height,
+                    const LodSettings& settings)
+{
+    assert(settings.numLods >= 1 && settings.numLods <= maxLods && "Between 1 and maxLods LODs");
+
+    const size_t numChunks = (count + lodChunkSize - 1) / lodChunkSize;
+    const size_t numLodWords = GetNumLodWords(count);
+
+    std::vector<LodStats> chunkStats(numChunks);
+    ParallelForChunks(numChunks,
+                      [&](size_t chunk)
+                      {
+                          LodStats& stats = chunkStats[chunk];
+                          const size_t beginWord = chunk * lodChunkSize / 32;
+                          const size_t endWord = GetNumVisibilityWords(std::min(count, (chunk + 1) * lodChunkSize));
+
+                          for (size_t word = beginWord; word < endWord; ++word)
+                          {
+                              uint32_t visible = visibilityBits[word];
+                              uint32_t lods[2] = {0, 0};
+
+                              for (uint32_t remaining = visible; remaining != 0; remaining &= remaining - 1)
+                              {
+                                  const int bit = CountTrailingZeros(remaining);
+                                  const float screenSize = GetScreenSize(aabbs[word * 32 + bit], vpMatrix, width, height);
+                                  if (screenSize < settings.minPixelSize)
+                                  {
+                                      visible &= ~(1u << bit);
+                                      stats.numDropped++;
+                                      continue;
+                                  }
+
+                                  const unsigned int lod = SelectLod(screenSize, settings);
+                                  lods[bit / 16] |= lod << (bit % 16 * 2);
+                                  stats.numPerLod[lod]++;
+                              }
+
+                              visibilityBits[word] = visible;
+                              lodBits[word * 2] = lods[0];
+                              if (word * 2 + 1 < numLodWords) lodBits[word * 2 + 1] = lods[1];
+                          }
+                      });
+
+    LodStats stats;
+    for (const LodStats& chunk : chunkStats)
+    {
+        stats.numDropped += chunk.numDropped;
+        for (unsigned int lod = 0; lod < maxLods; ++lod) stats.numPerLod[lod] += chunk.numPerLod[lod];
+    }
+    return stats;
+}
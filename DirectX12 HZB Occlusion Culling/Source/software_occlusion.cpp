@@ -0,0 +1,372 @@
+#include "software_occlusion.hpp"
+
+#include "parallel_for.hpp"
+
+#include <emmintrin.h>
+
+static const int pixelsPerTile = softwareTileWidth * softwareTileHeight;
+
+// Anything closer than this to the eye plane counts as crossing the near plane
+static const float minClipW = 1e-4f;
+
+// A triangle in pixel coordinates. The edge functions are positive inside, the depth is a plane over x and y.
+// Inside when positive, or zero on an edge that follows the top-left fill rule. Edges shared by two triangles
+// then cover every pixel once, without cracks between them.
+static inline __m128 InsideEdge(__m128 edge, __m128 topLeft)
+{
+    const __m128 zero = _mm_setzero_ps();
+    return _mm_or_ps(_mm_cmpgt_ps(edge, zero), _mm_and_ps(topLeft, _mm_cmpeq_ps(edge, zero)));
+}
+
+struct SoftwareOcclusion::ScreenTriangle
+{
+    float edgeA[3], edgeB[3], edgeC[3];
+    bool topLeft[3];  // Owns the pixels exactly on the edge
+    float depthA, depthB, depthC;
+    int minX, minY, maxX, maxY;
+};
+
+SoftwareOcclusion::SoftwareOcclusion(int width, int height)
+{
+    assert(width > 0 && height > 0 && "The depth buffer needs at least one pixel");
+
+    m_numTilesX = (width + softwareTileWidth - 1) / softwareTileWidth;
+    m_numTilesY = (height + softwareTileHeight - 1) / softwareTileHeight;
+
+    m_depth.assign(static_cast<size_t>(m_numTilesX) * m_numTilesY * pixelsPerTile, 1.f);
+    m_tileMaxDepth.assign(static_cast<size_t>(m_numTilesX) * m_numTilesY, 1.f);
+}
+
+void SoftwareOcclusion::SetOccluderMesh(const VertexPosColor* vertices, int numVertices, const WORD* indices, int numIndices)
+{
+    assert(numIndices % 3 == 0 && "The occluder mesh should be a triangle list");
+
+    m_meshPositions.resize(numVertices);
+    for (int i = 0; i < numVertices; ++i) m_meshPositions[i] = vertices[i].Position;
+
+    m_meshIndices.assign(indices, indices + numIndices);
+}
+
+float SoftwareOcclusion::GetDepth(int x, int y) const
+{
+    const int tile = (y / softwareTileHeight) * m_numTilesX + x / softwareTileWidth;
+    const int pixel = (y % softwareTileHeight) * softwareTileWidth + x % softwareTileWidth;
+    return m_depth[static_cast<size_t>(tile) * pixelsPerTile + pixel];
+}
+
+void SoftwareOcclusion::SelectOccluders(std::vector<int>& occluders,
+                                        const std::vector<AABB>& aabbs,
+                                        const XMMATRIX& vpMatrix,
+                                        FrustumPlanes& frustum,
+                                        int maxOccluders)
+{
+    // Projected size squared, or -1 when the box can't be an occluder
+    std::vector<float> scores(aabbs.size());
+    ParallelFor(aabbs.size(),
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        AABB aabb = aabbs[i];
+                        scores[i] = -1.f;
+                        if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE) continue;
+
+                        const XMFLOAT3 center = aabb.Center();
+                        const float w = XMVectorGetW(XMVector3Transform(XMLoadFloat3(&center), vpMatrix));
+                        if (w <= minClipW) continue;
+
+                        const float dx = aabb.max.x - aabb.min.x;
+                        const float dy = aabb.max.y - aabb.min.y;
+                        const float dz = aabb.max.z - aabb.min.z;
+                        scores[i] = (dx * dx + dy * dy + dz * dz) / (w * w);
+                    }
+                });
+
+    occluders.clear();
+    for (size_t i = 0; i < scores.size(); ++i)
+    {
+        if (scores[i] > 0.f) occluders.push_back(static_cast<int>(i));
+    }
+
+    if (static_cast<int>(occluders.size()) > maxOccluders)
+    {
+        auto isLarger = [&](int a, int b) { return scores[a] > scores[b]; };
+        std::nth_element(occluders.begin(), occluders.begin() + maxOccluders, occluders.end(), isLarger);
+        occluders.resize(maxOccluders);
+    }
+}
+
+void SoftwareOcclusion::Rasterize(const std::vector<int>& occluders,
+                                  const std::vector<InstanceData>& instanceData,
+                                  const XMMATRIX& vpMatrix)
+{
+    assert(!m_meshIndices.empty() && "Set the occluder mesh before rasterizing");
+
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    const int numMeshTriangles = static_cast<int>(m_meshIndices.size()) / 3;
+    const int numMeshVertices = static_cast<int>(m_meshPositions.size());
+    const float width = static_cast<float>(GetWidth());
+    const float height = static_cast<float>(GetHeight());
+
+    // Set up the triangles of every occluder in parallel, dropping the ones that can't cover a pixel
+    std::vector<ScreenTriangle> triangles(occluders.size() * numMeshTriangles);
+    std::vector<char> validTriangles(triangles.size(), 0);
+
+    ParallelFor(
+        occluders.size(),
+        [&](size_t begin, size_t end)
+        {
+            std::vector<XMFLOAT4> screen(numMeshVertices);
+
+            for (size_t o = begin; o < end; ++o)
+            {
+                const XMMATRIX wvp = XMMatrixMultiply(instanceData[occluders[o]].WorldMatrix, vpMatrix);
+                for (int v = 0; v < numMeshVertices; ++v)
+                {
+                    XMFLOAT4 clip;
+                    XMStoreFloat4(&clip, XMVector3Transform(XMLoadFloat3(&m_meshPositions[v]), wvp));
+
+                    // Pixel coordinates with y pointing down, like the uv's in the culling shader
+                    const float invW = 1.f / clip.w;
+                    screen[v] = {(clip.x * invW * 0.5f + 0.5f) * width,
+                                 (0.5f - clip.y * invW * 0.5f) * height,
+                                 clip.z * invW,
+                                 clip.w};
+                }
+
+                for (int t = 0; t < numMeshTriangles; ++t)
+                {
+                    const XMFLOAT4& v0 = screen[m_meshIndices[t * 3 + 0]];
+                    const XMFLOAT4& v1 = screen[m_meshIndices[t * 3 + 1]];
+                    const XMFLOAT4& v2 = screen[m_meshIndices[t * 3 + 2]];
+
+                    // Skipping a triangle only removes occlusion, so crossing the near plane is simply dropped
+                    if (v0.w <= minClipW || v1.w <= minClipW || v2.w <= minClipW) continue;
+                    if (v0.z < 0.f || v1.z < 0.f || v2.z < 0.f) continue;
+
+                    const float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+                    if (area == 0.f) continue;
+
+                    ScreenTriangle& triangle = triangles[o * numMeshTriangles + t];
+                    triangle.minX = std::max(0, static_cast<int>(std::floor(std::min({v0.x, v1.x, v2.x}))));
+                    triangle.minY = std::max(0, static_cast<int>(std::floor(std::min({v0.y, v1.y, v2.y}))));
+                    triangle.maxX = std::min(GetWidth() - 1, static_cast<int>(std::ceil(std::max({v0.x, v1.x, v2.x}))));
+                    triangle.maxY = std::min(GetHeight() - 1, static_cast<int>(std::ceil(std::max({v0.y, v1.y, v2.y}))));
+                    if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY) continue;
+
+                    // Both windings are drawn, the edges get flipped so the inside is always positive
+                    const float sign = area > 0.f ? 1.f : -1.f;
+                    const XMFLOAT4* vertices[3] = {&v0, &v1, &v2};
+                    for (int e = 0; e < 3; ++e)
+                    {
+                        const XMFLOAT4& a = *vertices[e];
+                        const XMFLOAT4& b = *vertices[(e + 1) % 3];
+                        triangle.edgeA[e] = sign * (a.y - b.y);
+                        triangle.edgeB[e] = sign * (b.x - a.x);
+                        triangle.edgeC[e] = sign * (a.x * b.y - b.x * a.y);
+
+                        // Neighbours evaluate a shared edge to exactly the negated value, the fill rule picks one
+                        triangle.topLeft[e] = triangle.edgeA[e] > 0.f || (triangle.edgeA[e] == 0.f && triangle.edgeB[e] > 0.f);
+                    }
+
+                    triangle.depthA = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+                    triangle.depthB = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+                    triangle.depthC = v0.z - triangle.depthA * v0.x - triangle.depthB * v0.y;
+
+                    validTriangles[o * numMeshTriangles + t] = 1;
+                }
+            }
+        },
+        64);
+
+    size_t numValid = 0;
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+        if (validTriangles[i]) triangles[numValid++] = triangles[i];
+    }
+    triangles.resize(numValid);
+
+    // Every tile row is a strip of the screen only one thread writes to
+    ParallelForChunks(m_numTilesY, [&](size_t tileY) { RasterizeTileRow(triangles, static_cast<int>(tileY)); });
+
+    m_stats.numOccluders = static_cast<int>(occluders.size());
+    m_stats.numTriangles = static_cast<int>(triangles.size());
+    m_stats.rasterizeTimeMs =
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+void SoftwareOcclusion::RasterizeTileRow(const std::vector<ScreenTriangle>& triangles, int tileY)
+{
+    float* rowDepth = &m_depth[static_cast<size_t>(tileY) * m_numTilesX * pixelsPerTile];
+    std::fill(rowDepth, rowDepth + m_numTilesX * pixelsPerTile, 1.f);
+
+    const int rowMinY = tileY * softwareTileHeight;
+    const int rowMaxY = rowMinY + softwareTileHeight - 1;
+
+    const __m128 allBits = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    const __m128 pixelOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+
+    for (const ScreenTriangle& triangle : triangles)
+    {
+        if (triangle.maxY < rowMinY || triangle.minY > rowMaxY) continue;
+
+        const __m128 edgeA0 = _mm_set1_ps(triangle.edgeA[0]);
+        const __m128 edgeA1 = _mm_set1_ps(triangle.edgeA[1]);
+        const __m128 edgeA2 = _mm_set1_ps(triangle.edgeA[2]);
+        const __m128 topLeft0 = triangle.topLeft[0] ? allBits : _mm_setzero_ps();
+        const __m128 topLeft1 = triangle.topLeft[1] ? allBits : _mm_setzero_ps();
+        const __m128 topLeft2 = triangle.topLeft[2] ? allBits : _mm_setzero_ps();
+        const __m128 depthA = _mm_set1_ps(triangle.depthA);
+
+        const int firstTileX = triangle.minX / softwareTileWidth;
+        const int lastTileX = triangle.maxX / softwareTileWidth;
+        for (int tileX = firstTileX; tileX <= lastTileX; ++tileX)
+        {
+            float* tileDepth = rowDepth + tileX * pixelsPerTile;
+
+            for (int row = 0; row < softwareTileHeight; ++row)
+            {
+                const float y = static_cast<float>(rowMinY + row) + 0.5f;
+
+                // Everything constant along the row folds into the C term
+                const __m128 edgeRow0 = _mm_set1_ps(triangle.edgeB[0] * y + triangle.edgeC[0]);
+                const __m128 edgeRow1 = _mm_set1_ps(triangle.edgeB[1] * y + triangle.edgeC[1]);
+                const __m128 edgeRow2 = _mm_set1_ps(triangle.edgeB[2] * y + triangle.edgeC[2]);
+                const __m128 depthRow = _mm_set1_ps(triangle.depthB * y + triangle.depthC);
+
+                for (int column = 0; column < softwareTileWidth; column += 4)
+                {
+                    const __m128 x = _mm_add_ps(_mm_set1_ps(static_cast<float>(tileX * softwareTileWidth + column)),
+                                                pixelOffsets);
+
+                    const __m128 inside =
+                        _mm_and_ps(_mm_and_ps(InsideEdge(_mm_add_ps(_mm_mul_ps(edgeA0, x), edgeRow0), topLeft0),
+                                              InsideEdge(_mm_add_ps(_mm_mul_ps(edgeA1, x), edgeRow1), topLeft1)),
+                                   InsideEdge(_mm_add_ps(_mm_mul_ps(edgeA2, x), edgeRow2), topLeft2));
+                    if (_mm_movemask_ps(inside) == 0) continue;
+
+                    float* pixels = tileDepth + row * softwareTileWidth + column;
+                    const __m128 oldDepth = _mm_loadu_ps(pixels);
+                    const __m128 depth = _mm_min_ps(oldDepth, _mm_add_ps(_mm_mul_ps(depthA, x), depthRow));
+                    _mm_storeu_ps(pixels, _mm_or_ps(_mm_and_ps(inside, depth), _mm_andnot_ps(inside, oldDepth)));
+                }
+            }
+        }
+    }
+
+    // Conservative depth per tile: the farthest of its pixels
+    for (int tileX = 0; tileX < m_numTilesX; ++tileX)
+    {
+        const float* tileDepth = rowDepth + tileX * pixelsPerTile;
+
+        __m128 maxDepth = _mm_loadu_ps(tileDepth);
+        for (int i = 4; i < pixelsPerTile; i += 4) maxDepth = _mm_max_ps(maxDepth, _mm_loadu_ps(tileDepth + i));
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, maxDepth);
+        m_tileMaxDepth[tileY * m_numTilesX + tileX] = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+}
+
+void SoftwareOcclusion::TestAABBs(std::vector<unsigned int>& visibility,
+                                  const std::vector<AABB>& aabbs,
+                                  const XMMATRIX& vpMatrix,
+                                  FrustumPlanes& frustum)
+{
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    visibility.resize(aabbs.size());
+
+    const float width = static_cast<float>(GetWidth());
+    const float height = static_cast<float>(GetHeight());
+
+    std::vector<int> chunkOccluded(GetNumWorkerThreads() * 4, 0);
+    const size_t chunkSize = (aabbs.size() + chunkOccluded.size() - 1) / chunkOccluded.size();
+
+    ParallelForChunks(chunkOccluded.size(),
+                      [&](size_t chunk)
+                      {
+                          const size_t end = std::min(aabbs.size(), (chunk + 1) * chunkSize);
+                          for (size_t i = chunk * chunkSize; i < end; ++i)
+                          {
+                              AABB aabb = aabbs[i];
+                              if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE)
+                              {
+                                  visibility[i] = OC_HIDDEN;
+                                  continue;
+                              }
+
+                              // Screen rectangle and closest depth of the box
+                              float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+                              float minZ = FLT_MAX;
+                              bool crossesNearPlane = false;
+                              for (int c = 0; c < 8 && !crossesNearPlane; ++c)
+                              {
+                                  const XMVECTOR corner = XMVectorSet(c & 1 ? aabb.max.x : aabb.min.x,
+                                                                      c & 2 ? aabb.max.y : aabb.min.y,
+                                                                      c & 4 ? aabb.max.z : aabb.min.z,
+                                                                      1.f);
+                                  XMFLOAT4 clip;
+                                  XMStoreFloat4(&clip, XMVector4Transform(corner, vpMatrix));
+                                  if (clip.w <= minClipW)
+                                  {
+                                      crossesNearPlane = true;
+                                      break;
+                                  }
+
+                                  const float invW = 1.f / clip.w;
+                                  const float x = (clip.x * invW * 0.5f + 0.5f) * width;
+                                  const float y = (0.5f - clip.y * invW * 0.5f) * height;
+                                  minX = std::min(minX, x);
+                                  maxX = std::max(maxX, x);
+                                  minY = std::min(minY, y);
+                                  maxY = std::max(maxY, y);
+                                  minZ = std::min(minZ, clip.z * invW);
+                              }
+
+                              if (crossesNearPlane)
+                              {
+                                  visibility[i] = OC_VISIBLE;
+                                  continue;
+                              }
+
+                              const int firstTileX = std::max(0, static_cast<int>(minX) / softwareTileWidth);
+                              const int lastTileX = std::min(m_numTilesX - 1, static_cast<int>(maxX) / softwareTileWidth);
+                              const int firstTileY = std::max(0, static_cast<int>(minY) / softwareTileHeight);
+                              const int lastTileY = std::min(m_numTilesY - 1, static_cast<int>(maxY) / softwareTileHeight);
+
+                              // Visible as soon as one tile has something farther away than the box
+                              bool visible = false;
+                              for (int tileY = firstTileY; tileY <= lastTileY && !visible; ++tileY)
+                              {
+                                  for (int tileX = firstTileX; tileX <= lastTileX && !visible; ++tileX)
+                                  {
+                                      visible = minZ <= m_tileMaxDepth[tileY * m_numTilesX + tileX];
+                                  }
+                              }
+
+                              visibility[i] = visible ? OC_VISIBLE : OC_HIDDEN;
+                              if (!visible) chunkOccluded[chunk]++;
+                          }
+                      });
+
+    m_stats.numTested = static_cast<int>(aabbs.size());
+    m_stats.numOccluded = 0;
+    for (int occluded : chunkOccluded) m_stats.numOccluded += occluded;
+    m_stats.testTimeMs =
+        std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - startTime).count();
+}
+
+void SoftwareOcclusion::Cull(std::vector<unsigned int>& visibility,
+                             const std::vector<AABB>& aabbs,
+                             const std::vector<InstanceData>& instanceData,
+                             const XMMATRIX& vpMatrix,
+                             FrustumPlanes& frustum,
+                             int maxOccluders)
+{
+    std::vector<int> occluders;
+    SelectOccluders(occluders, aabbs, vpMatrix, frustum, maxOccluders);
+    Rasterize(occluders, instanceData, vpMatrix);
+    TestAABBs(visibility, aabbs, vpMatrix, frustum);
+}
@@ -0,0 +1,174 @@
+#include "transient_resource_pool.hpp"
+
+#include <cstring>
+
+static void HashCombine(size_t& seed, uint64_t value) { seed ^= std::hash<uint64_t>()(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2); }
+
+// View descs are mostly unions, compared as bytes. Descs that are zero-initialized before filling them in, like
+// everywhere in this repo, compare equal. Any other difference is just a cache miss.
+template <typename ViewDesc>
+static bool SameViewDesc(const ViewDesc& a, const ViewDesc& b)
+{
+    return std::memcmp(&a, &b, sizeof(ViewDesc)) == 0;
+}
+
+size_t TransientResourcePool::DescHash::operator()(const D3D12_RESOURCE_DESC& desc) const
+{
+    size_t seed = 0;
+    HashCombine(seed, desc.Dimension);
+    HashCombine(seed, desc.Width);
+    HashCombine(seed, desc.Height);
+    HashCombine(seed, (static_cast<uint64_t>(desc.DepthOrArraySize) << 16) | desc.MipLevels);
+    HashCombine(seed, desc.Format);
+    HashCombine(seed, desc.Flags);
+    return seed;
+}
+
+bool TransientResourcePool::DescEqual::operator()(const D3D12_RESOURCE_DESC& a, const D3D12_RESOURCE_DESC& b) const
+{
+    // Field by field, the desc has padding after Dimension
+    return a.Dimension == b.Dimension && a.Alignment == b.Alignment && a.Width == b.Width && a.Height == b.Height &&
+           a.DepthOrArraySize == b.DepthOrArraySize && a.MipLevels == b.MipLevels && a.Format == b.Format &&
+           a.SampleDesc.Count == b.SampleDesc.Count && a.SampleDesc.Quality == b.SampleDesc.Quality &&
+           a.Layout == b.Layout && a.Flags == b.Flags;
+}
+
+TransientResourcePool::TransientResourcePool(std::unique_ptr<TransientAllocator> allocator)
+    : m_allocator(std::move(allocator))
+{
+    assert(m_allocator && "The pool needs an allocator");
+}
+
+std::shared_ptr<bee::DX12Texture> TransientResourcePool::AcquireTexture(const D3D12_RESOURCE_DESC& desc)
+{
+    auto& bucket = m_textures[desc];
+
+    for (auto& pooled : bucket)
+    {
+        if (pooled->inUse || !m_allocator->IsFenceComplete(pooled->queue, pooled->fenceValue)) continue;
+
+        pooled->inUse = true;
+        pooled->lastUsedFrame = m_frame;
+        m_stats.numReused++;
+        m_stats.numInUse++;
+        return pooled->texture;
+    }
+
+    auto pooled = std::make_unique<PooledTexture>();
+    pooled->texture = m_allocator->CreateTexture(desc);
+    pooled->desc = desc;
+    pooled->inUse = true;
+    pooled->lastUsedFrame = m_frame;
+
+    m_lookup[pooled->texture.get()] = pooled.get();
+    bucket.push_back(std::move(pooled));
+
+    m_stats.numCreated++;
+    m_stats.numPooled++;
+    m_stats.numInUse++;
+    return bucket.back()->texture;
+}
+
+void TransientResourcePool::ReleaseTexture(const std::shared_ptr<bee::DX12Texture>& texture,
+                                           D3D12_COMMAND_LIST_TYPE queue,
+                                           uint64_t fenceValue)
+{
+    PooledTexture* pooled = Find(texture.get());
+    assert(pooled && "Only textures from AcquireTexture can be released");
+    assert(pooled->inUse && "Texture released twice");
+
+    pooled->inUse = false;
+    pooled->queue = queue;
+    pooled->fenceValue = fenceValue;
+    pooled->lastUsedFrame = m_frame;
+    m_stats.numInUse--;
+}
+
+std::shared_ptr<bee::ShaderResourceView> TransientResourcePool::GetShaderResourceView(
+    const std::shared_ptr<bee::DX12Texture>& texture,
+    const D3D12_SHADER_RESOURCE_VIEW_DESC& desc)
+{
+    PooledTexture* pooled = Find(texture.get());
+    if (pooled)
+    {
+        for (auto& [viewDesc, view] : pooled->srvs)
+        {
+            if (!SameViewDesc(viewDesc, desc)) continue;
+
+            m_stats.numViewsReused++;
+            return view;
+        }
+    }
+
+    auto view = m_allocator->CreateShaderResourceView(texture, desc);
+    if (pooled) pooled->srvs.emplace_back(desc, view);
+
+    m_stats.numViewsCreated++;
+    return view;
+}
+
+std::shared_ptr<bee::UnorderedAccessView> TransientResourcePool::GetUnorderedAccessView(
+    const std::shared_ptr<bee::DX12Texture>& texture,
+    const D3D12_UNORDERED_ACCESS_VIEW_DESC& desc)
+{
+    PooledTexture* pooled = Find(texture.get());
+    if (pooled)
+    {
+        for (auto& [viewDesc, view] : pooled->uavs)
+        {
+            if (!SameViewDesc(viewDesc, desc)) continue;
+
+            m_stats.numViewsReused++;
+            return view;
+        }
+    }
+
+    auto view = m_allocator->CreateUnorderedAccessView(texture, desc);
+    if (pooled) pooled->uavs.emplace_back(desc, view);
+
+    m_stats.numViewsCreated++;
+    return view;
+}
+
+void TransientResourcePool::EndFrame()
+{
+    m_frame++;
+    Evict(m_maxAge + 1);
+}
+
+void TransientResourcePool::Trim() { Evict(0); }
+
+void TransientResourcePool::Evict(uint64_t minAge)
+{
+    for (auto bucket = m_textures.begin(); bucket != m_textures.end();)
+    {
+        auto& textures = bucket->second;
+        for (size_t i = 0; i < textures.size();)
+        {
+            PooledTexture& pooled = *textures[i];
+
+            // Still on the GPU, or used recently enough to be needed again soon
+            if (pooled.inUse || m_frame - pooled.lastUsedFrame < minAge ||
+                !m_allocator->IsFenceComplete(pooled.queue, pooled.fenceValue))
+            {
+                ++i;
+                continue;
+            }
+
+            m_lookup.erase(pooled.texture.get());
+            textures[i] = std::move(textures.back());
+            textures.pop_back();
+
+            m_stats.numEvicted++;
+            m_stats.numPooled--;
+        }
+
+        bucket = textures.empty() ? m_textures.erase(bucket) : std::next(bucket);
+    }
+}
+
+TransientResourcePool::PooledTexture* TransientResourcePool::Find(const bee::DX12Texture* texture)
+{
+    auto it = m_lookup.find(texture);
+    return it != m_lookup.end() ? it->second : nullptr;
+}
@@ -0,0 +1,105 @@
+#include "two_phase_culling.hpp"
+
+#include "occlusion_helpers_dx12.hpp"
+#include "parallel_for.hpp"
+#include "visibility_bits.hpp"
+
+#include <chrono>
+
+// Words per task, every word is up to 32 frustum tests in BeginFrame
+static const size_t phase1ChunkSize = 256;
+
+const std::vector<uint32_t>& TwoPhaseCulling::BeginFrame(const std::vector<AABB>& aabbs, FrustumPlanes& frustum)
+{
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    const size_t numWords = GetNumVisibilityWords(aabbs.size());
+
+    // A history for a different set of objects is no history
+    if (m_history.empty() || m_numHistoryObjects != aabbs.size())
+    {
+        m_history.assign(numWords, 0);
+        m_numHistoryObjects = aabbs.size();
+    }
+    m_phase1.resize(numWords);
+
+    // Only last frame's visible objects are tested, so this is cheap when most of the scene is hidden
+    ParallelFor(
+        numWords,
+        [&](size_t begin, size_t end)
+        {
+            for (size_t word = begin; word < end; ++word)
+            {
+                uint32_t visible = m_history[word];
+                for (uint32_t remaining = visible; remaining != 0; remaining &= remaining - 1)
+                {
+                    const int bit = CountTrailingZeros(remaining);
+                    AABB aabb = aabbs[word * 32 + bit];
+                    if (FrustumAABBIntersect(aabb, frustum.planes) == OUTSIDE) visible &= ~(1u << bit);
+                }
+                m_phase1[word] = visible;
+            }
+        },
+        phase1ChunkSize);
+
+    m_stats = TwoPhaseCullStats();
+    m_stats.numPhase1 = CountVisible(m_phase1.data(), numWords);
+
+    const auto endTime = std::chrono::high_resolution_clock::now();
+    m_stats.phase1TimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    return m_phase1;
+}
+
+const std::vector<uint32_t>& TwoPhaseCulling::EndFrame(const std::vector<AABB>& aabbs,
+                                                       const HzbPyramid& hzb,
+                                                       const XMMATRIX& vpMatrix,
+                                                       FrustumPlanes& frustum,
+                                                       const HzbCullSettings& settings)
+{
+    const size_t numWords = GetNumVisibilityWords(aabbs.size());
+    assert(m_phase1.size() == numWords && "Call BeginFrame with the same objects first");
+
+    const auto startTime = std::chrono::high_resolution_clock::now();
+
+    // Everything phase 1 didn't draw, and the phase 1 objects of this frame's slice of words
+    const size_t refreshSlice = m_frameCount++ % m_historyRefreshInterval;
+    const size_t lastWordBits = aabbs.size() % 32;
+    m_tested.resize(numWords);
+    ParallelFor(
+        numWords,
+        [&](size_t begin, size_t end)
+        {
+            for (size_t word = begin; word < end; ++word)
+            {
+                uint32_t tested = ~m_phase1[word];
+                if (word % m_historyRefreshInterval == refreshSlice) tested = ~0u;
+                if (word == numWords - 1 && lastWordBits != 0) tested &= (1u << lastWordBits) - 1;
+                m_tested[word] = tested;
+            }
+        },
+        phase1ChunkSize);
+
+    HzbCullAABBBits(m_visible, m_tested.data(), aabbs, hzb, vpMatrix, frustum, settings);
+
+    // Phase 2 is what passed on top of phase 1. The history keeps the phase 1 objects that weren't tested.
+    m_phase2.resize(numWords);
+    ParallelFor(
+        numWords,
+        [&](size_t begin, size_t end)
+        {
+            for (size_t word = begin; word < end; ++word)
+            {
+                m_phase2[word] = m_visible[word] & ~m_phase1[word];
+                m_history[word] = m_visible[word] | (m_phase1[word] & ~m_tested[word]);
+            }
+        },
+        phase1ChunkSize);
+
+    m_stats.numRetested = CountVisible(m_tested.data(), numWords);
+    m_stats.numRecovered = CountVisible(m_phase2.data(), numWords);
+    m_stats.numDropped = m_stats.numPhase1 + m_stats.numRecovered - CountVisible(m_history.data(), numWords);
+
+    const auto endTime = std::chrono::high_resolution_clock::now();
+    m_stats.phase2TimeMs = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+    return m_phase2;
+}
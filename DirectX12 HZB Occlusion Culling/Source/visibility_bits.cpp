@@ -0,0 +1,138 @@
+#include "visibility_bits.hpp"
+
+#include "occlusion_helpers_dx12.hpp"
+#include "parallel_for.hpp"
+#include "parallel_scan.hpp"
+
+// Words per task. The word loops are memory bound, small chunks only add scheduling.
+static const size_t wordChunkSize = 16384;
+
+void PackVisibility(const unsigned int* flags, size_t count, uint32_t* outBits)
+{
+    assert((count == 0 || (flags != nullptr && outBits != nullptr)) && "flags and outBits can't be null.");
+
+    const size_t numFullWords = count / 32;
+    ParallelFor(numFullWords,
+                [&](size_t begin, size_t end)
+                {
+                    const __m128i zero = _mm_setzero_si128();
+                    for (size_t word = begin; word < end; ++word)
+                    {
+                        // Four flags per movemask, eight of them per word
+                        uint32_t bits = 0;
+                        const unsigned int* wordFlags = flags + word * 32;
+                        for (int i = 0; i < 32; i += 4)
+                        {
+                            const __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(wordFlags + i));
+                            const int zeroMask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(values, zero)));
+                            bits |= static_cast<uint32_t>(~zeroMask & 0xF) << i;
+                        }
+                        outBits[word] = bits;
+                    }
+                },
+                wordChunkSize);
+
+    if (numFullWords * 32 < count)
+    {
+        uint32_t bits = 0;
+        for (size_t i = numFullWords * 32; i < count; ++i)
+        {
+            if (flags[i]) bits |= 1u << (i % 32);
+        }
+        outBits[numFullWords] = bits;
+    }
+}
+
+void UnpackVisibility(const uint32_t* bits, size_t count, unsigned int* outFlags)
+{
+    assert((count == 0 || (bits != nullptr && outFlags != nullptr)) && "bits and outFlags can't be null.");
+
+    ParallelFor(count,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i)
+                    {
+                        outFlags[i] = IsVisible(bits, i) ? OC_VISIBLE : OC_HIDDEN;
+                    }
+                });
+}
+
+void SetAllVisible(uint32_t* bits, size_t count)
+{
+    const size_t numWords = GetNumVisibilityWords(count);
+    std::fill(bits, bits + numWords, ~0u);
+    if (count % 32) bits[numWords - 1] = (1u << (count % 32)) - 1;
+}
+
+template <typename Op>
+static void CombineWords(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords, Op op)
+{
+    assert((numWords == 0 || (a != nullptr && b != nullptr && out != nullptr)) && "Masks can't be null.");
+
+    ParallelFor(numWords,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i) out[i] = op(a[i], b[i]);
+                },
+                wordChunkSize);
+}
+
+void AndVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords)
+{
+    CombineWords(a, b, out, numWords, [](uint32_t x, uint32_t y) { return x & y; });
+}
+
+void OrVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords)
+{
+    CombineWords(a, b, out, numWords, [](uint32_t x, uint32_t y) { return x | y; });
+}
+
+void AndNotVisibility(const uint32_t* a, const uint32_t* b, uint32_t* out, size_t numWords)
+{
+    CombineWords(a, b, out, numWords, [](uint32_t x, uint32_t y) { return x & ~y; });
+}
+
+void DiffVisibility(const uint32_t* previous, const uint32_t* current, uint32_t* outChanged, size_t numWords)
+{
+    CombineWords(previous, current, outChanged, numWords, [](uint32_t x, uint32_t y) { return x ^ y; });
+}
+
+size_t CountVisible(const uint32_t* bits, size_t numWords)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < numWords; ++i) total += CountBits(bits[i]);
+    return total;
+}
+
+size_t CompactVisibility(const uint32_t* bits, size_t count, unsigned int* outIndices)
+{
+    assert((count == 0 || (bits != nullptr && outIndices != nullptr)) && "bits and outIndices can't be null.");
+
+    const size_t numWords = GetNumVisibilityWords(count);
+
+    std::vector<unsigned int> wordOffsets(numWords);
+    ParallelFor(numWords,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; ++i) wordOffsets[i] = CountBits(bits[i]);
+                },
+                wordChunkSize);
+
+    const unsigned int total = ExclusiveScan(wordOffsets.data(), wordOffsets.data(), numWords);
+
+    ParallelFor(numWords,
+                [&](size_t begin, size_t end)
+                {
+                    for (size_t word = begin; word < end; ++word)
+                    {
+                        unsigned int* out = outIndices + wordOffsets[word];
+                        for (uint32_t remaining = bits[word]; remaining != 0; remaining &= remaining - 1)
+                        {
+                            *out++ = static_cast<unsigned int>(word * 32 + CountTrailingZeros(remaining));
+                        }
+                    }
+                },
+                wordChunkSize);
+
+    return total;
+}
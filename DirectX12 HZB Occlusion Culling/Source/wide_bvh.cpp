@@ -0,0 +1,355 @@
+#include "wide_bvh.hpp"
+
+#include "simd_target.hpp"
+
+#include <algorithm>
+#include <numeric>
+
+static const int bvhWidth = 4;
+
+void WideBVH::Build(const std::shared_ptr<BVHNode>& root)
+{
+    assert(root != nullptr && "root can't be null.");
+
+    m_nodes.clear();
+    BuildNode(*root);
+}
+
+int WideBVH::BuildNode(const BVHNode& node)
+{
+    // Collapse the binary tree: keep opening the interior child with the largest surface area until the
+    // node has 4 children (or only leaves are left).
+    const BVHNode* children[bvhWidth] = {};
+    int numChildren = 0;
+
+    if (node.IsLeaf())
+    {
+        children[numChildren++] = &node;
+    }
+    else
+    {
+        children[numChildren++] = node.left.get();
+        children[numChildren++] = node.right.get();
+    }
+
+    while (numChildren < bvhWidth)
+    {
+        int largest = -1;
+        float largestArea = -1.f;
+        for (int i = 0; i < numChildren; ++i)
+        {
+            if (children[i]->IsLeaf()) continue;
+
+            const float area = children[i]->bounds.SurfaceArea();
+            if (area > largestArea)
+            {
+                largestArea = area;
+                largest = i;
+            }
+        }
+
+        if (largest == -1) break;
+
+        const BVHNode* opened = children[largest];
+        children[largest] = opened->left.get();
+        children[numChildren++] = opened->right.get();
+    }
+
+    // Back to the order of the binary tree. Every node covers a contiguous object range, left before right.
+    std::sort(children,
+              children + numChildren,
+              [](const BVHNode* a, const BVHNode* b) { return a->objectIndex < b->objectIndex; });
+
+    const int index = static_cast<int>(m_nodes.size());
+    m_nodes.emplace_back();
+
+    for (int i = 0; i < bvhWidth; ++i)
+    {
+        WideBVHNode& wideNode = m_nodes[index];
+
+        if (i >= numChildren)
+        {
+            // Unused slot, the inverted bounds are never reported since objectCount is 0
+            wideNode.minX[i] = wideNode.minY[i] = wideNode.minZ[i] = FLT_MAX;
+            wideNode.maxX[i] = wideNode.maxY[i] = wideNode.maxZ[i] = -FLT_MAX;
+            wideNode.child[i] = -1;
+            wideNode.objectIndex[i] = 0;
+            wideNode.objectCount[i] = 0;
+            continue;
+        }
+
+        const BVHNode& child = *children[i];
+        wideNode.minX[i] = child.bounds.min.x;
+        wideNode.minY[i] = child.bounds.min.y;
+        wideNode.minZ[i] = child.bounds.min.z;
+        wideNode.maxX[i] = child.bounds.max.x;
+        wideNode.maxY[i] = child.bounds.max.y;
+        wideNode.maxZ[i] = child.bounds.max.z;
+        wideNode.objectIndex[i] = child.objectIndex;
+        wideNode.objectCount[i] = child.objectCount;
+        wideNode.child[i] = -1;
+
+        if (!child.IsLeaf())
+        {
+            // m_nodes can grow while building the child, so don't hold on to the reference
+            const int childIndex = BuildNode(child);
+            m_nodes[index].child[i] = childIndex;
+        }
+    }
+
+    return index;
+}
+
+static void AddRange(std::vector<int>& array, int objectIndex, int objectCount)
+{
+    const size_t offset = array.size();
+    array.resize(offset + objectCount);
+    std::iota(array.begin() + offset, array.end(), objectIndex);
+}
+
+// Either a node with the planes it still intersects, the children are inside all the others, or a range that is
+// already known to be visible (node -1). Ranges go on the stack too, so they come out in object order.
+struct StackEntry
+{
+    int node;
+    int planeMask;
+    int objectIndex;
+    int objectCount;
+};
+
+// Which box corner is the positive vertex of every plane
+struct PlaneSigns
+{
+    bool positiveX[6], positiveY[6], positiveZ[6];
+};
+
+static PlaneSigns GetPlaneSigns(const FrustumPlanes& frustum)
+{
+    PlaneSigns signs;
+    for (int p = 0; p < 6; ++p)
+    {
+        signs.positiveX[p] = frustum.planes[p].a >= 0;
+        signs.positiveY[p] = frustum.planes[p].b >= 0;
+        signs.positiveZ[p] = frustum.planes[p].c >= 0;
+    }
+    return signs;
+}
+
+static int CountChildren(const WideBVHNode& node)
+{
+    int count = 0;
+    for (int i = 0; i < bvhWidth; ++i) count += node.objectCount[i] != 0;
+    return count;
+}
+
+static void PushChildren(const WideBVHNode& node, int outsideMask, const int* intersectMasks, std::vector<StackEntry>& stack)
+{
+    // Last child first, so the first one is popped first
+    for (int i = bvhWidth - 1; i >= 0; --i)
+    {
+        if (node.objectCount[i] == 0 || (outsideMask & (1 << i))) continue;
+
+        // Fully inside children and intersecting leaves report their whole object range
+        if (intersectMasks[i] == 0 || node.child[i] == -1)
+        {
+            stack.push_back({-1, 0, node.objectIndex[i], node.objectCount[i]});
+        }
+        else
+        {
+            stack.push_back({node.child[i], intersectMasks[i], 0, 0});
+        }
+    }
+}
+
+static void FrustumIntersectSSE(const std::vector<WideBVHNode>& nodes,
+                                std::vector<int>& array,
+                                const FrustumPlanes& frustum,
+                                FrustumCullStats& cullStats)
+{
+    // Broadcast the plane equations once
+    __m128 planeA[6], planeB[6], planeC[6], planeD[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeA[p] = _mm_set1_ps(frustum.planes[p].a);
+        planeB[p] = _mm_set1_ps(frustum.planes[p].b);
+        planeC[p] = _mm_set1_ps(frustum.planes[p].c);
+        planeD[p] = _mm_set1_ps(frustum.planes[p].d);
+    }
+    const PlaneSigns signs = GetPlaneSigns(frustum);
+
+    std::vector<StackEntry> stack;
+    stack.reserve(256);
+    stack.push_back({0, 0x3f, 0, 0});
+
+    const __m128 zero = _mm_setzero_ps();
+
+    while (!stack.empty())
+    {
+        const StackEntry entry = stack.back();
+        stack.pop_back();
+
+        if (entry.node == -1)
+        {
+            AddRange(array, entry.objectIndex, entry.objectCount);
+            continue;
+        }
+
+        const WideBVHNode& node = nodes[entry.node];
+
+        const __m128 minX = _mm_load_ps(node.minX);
+        const __m128 minY = _mm_load_ps(node.minY);
+        const __m128 minZ = _mm_load_ps(node.minZ);
+        const __m128 maxX = _mm_load_ps(node.maxX);
+        const __m128 maxY = _mm_load_ps(node.maxY);
+        const __m128 maxZ = _mm_load_ps(node.maxZ);
+
+        __m128 outside = zero;
+        int intersectMasks[bvhWidth] = {};
+
+        cullStats.nodesVisited++;
+        const int numChildren = CountChildren(node);
+
+        for (int p = 0; p < 6; ++p)
+        {
+            if (!(entry.planeMask & (1 << p))) continue;
+
+            cullStats.planeTests += numChildren;
+
+            const __m128 px = signs.positiveX[p] ? maxX : minX;
+            const __m128 py = signs.positiveY[p] ? maxY : minY;
+            const __m128 pz = signs.positiveZ[p] ? maxZ : minZ;
+            const __m128 nx = signs.positiveX[p] ? minX : maxX;
+            const __m128 ny = signs.positiveY[p] ? minY : maxY;
+            const __m128 nz = signs.positiveZ[p] ? minZ : maxZ;
+
+            const __m128 s1 = _mm_add_ps(
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, planeA[p]), _mm_mul_ps(py, planeB[p])), _mm_mul_ps(pz, planeC[p])),
+                planeD[p]);
+            const __m128 s2 = _mm_add_ps(
+                _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, planeA[p]), _mm_mul_ps(ny, planeB[p])), _mm_mul_ps(nz, planeC[p])),
+                planeD[p]);
+
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(s1, zero));
+
+            const int intersect = _mm_movemask_ps(_mm_cmplt_ps(s2, zero));
+            for (int i = 0; i < bvhWidth; ++i)
+            {
+                if (intersect & (1 << i)) intersectMasks[i] |= 1 << p;
+            }
+
+            if (_mm_movemask_ps(outside) == 0xf) break;
+        }
+
+        PushChildren(node, _mm_movemask_ps(outside), intersectMasks, stack);
+    }
+}
+
+// Both corners of the four children in one register, positive vertices in the low lanes and negative vertices in
+// the high lanes, so every plane is a single 8-wide pass. Same sums in the same order as the SSE version.
+TARGET_AVX2 static __m256 Combine(__m128 low, __m128 high)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1);
+}
+
+TARGET_AVX2 static void FrustumIntersectAVX2(const std::vector<WideBVHNode>& nodes,
+                                             std::vector<int>& array,
+                                             const FrustumPlanes& frustum,
+                                             FrustumCullStats& cullStats)
+{
+    __m256 planeA[6], planeB[6], planeC[6], planeD[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeA[p] = _mm256_set1_ps(frustum.planes[p].a);
+        planeB[p] = _mm256_set1_ps(frustum.planes[p].b);
+        planeC[p] = _mm256_set1_ps(frustum.planes[p].c);
+        planeD[p] = _mm256_set1_ps(frustum.planes[p].d);
+    }
+    const PlaneSigns signs = GetPlaneSigns(frustum);
+
+    std::vector<StackEntry> stack;
+    stack.reserve(256);
+    stack.push_back({0, 0x3f, 0, 0});
+
+    const __m256 zero = _mm256_setzero_ps();
+
+    while (!stack.empty())
+    {
+        const StackEntry entry = stack.back();
+        stack.pop_back();
+
+        if (entry.node == -1)
+        {
+            AddRange(array, entry.objectIndex, entry.objectCount);
+            continue;
+        }
+
+        const WideBVHNode& node = nodes[entry.node];
+
+        const __m128 minX = _mm_load_ps(node.minX);
+        const __m128 minY = _mm_load_ps(node.minY);
+        const __m128 minZ = _mm_load_ps(node.minZ);
+        const __m128 maxX = _mm_load_ps(node.maxX);
+        const __m128 maxY = _mm_load_ps(node.maxY);
+        const __m128 maxZ = _mm_load_ps(node.maxZ);
+
+        // max then min for a plane with a positive coefficient, min then max for a negative one
+        const __m256 maxMinX = Combine(maxX, minX), minMaxX = Combine(minX, maxX);
+        const __m256 maxMinY = Combine(maxY, minY), minMaxY = Combine(minY, maxY);
+        const __m256 maxMinZ = Combine(maxZ, minZ), minMaxZ = Combine(minZ, maxZ);
+
+        int outsideMask = 0;
+        int intersectMasks[bvhWidth] = {};
+
+        cullStats.nodesVisited++;
+        const int numChildren = CountChildren(node);
+
+        for (int p = 0; p < 6; ++p)
+        {
+            if (!(entry.planeMask & (1 << p))) continue;
+
+            cullStats.planeTests += numChildren;
+
+            const __m256 x = signs.positiveX[p] ? maxMinX : minMaxX;
+            const __m256 y = signs.positiveY[p] ? maxMinY : minMaxY;
+            const __m256 z = signs.positiveZ[p] ? maxMinZ : minMaxZ;
+
+            const __m256 ax = _mm256_mul_ps(x, planeA[p]);
+            const __m256 by = _mm256_mul_ps(y, planeB[p]);
+            const __m256 cz = _mm256_mul_ps(z, planeC[p]);
+            const __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(ax, by), cz), planeD[p]);
+
+            const int below = _mm256_movemask_ps(_mm256_cmp_ps(distance, zero, _CMP_LT_OQ));
+            outsideMask |= below & 0xf;
+
+            const int intersect = below >> 4;
+            for (int i = 0; i < bvhWidth; ++i)
+            {
+                if (intersect & (1 << i)) intersectMasks[i] |= 1 << p;
+            }
+
+            if (outsideMask == 0xf) break;
+        }
+
+        PushChildren(node, outsideMask, intersectMasks, stack);
+    }
+}
+
+void WideBVH::FrustumIntersect(std::vector<int>& array,
+                               const FrustumPlanes& frustum,
+                               FrustumCullStats* stats,
+                               SimdLevel maxLevel) const
+{
+    if (m_nodes.empty()) return;
+
+    FrustumCullStats localStats;
+    FrustumCullStats& cullStats = stats ? *stats : localStats;
+
+    if (std::min(maxLevel, GetSupportedSimdLevel()) >= SimdLevel::AVX2)
+    {
+        FrustumIntersectAVX2(m_nodes, array, frustum, cullStats);
+    }
+    else
+    {
+        FrustumIntersectSSE(m_nodes, array, frustum, cullStats);
+    }
+}
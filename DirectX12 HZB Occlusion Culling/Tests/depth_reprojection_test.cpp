@@ -0,0 +1,159 @@
+#include "test_helpers.hpp"
+
+#include "depth_reprojection.hpp"
+
+#include <algorithm>
+#include <vector>
+
+static const int width = 192;
+static const int height = 108;
+
+static XMMATRIX MakeViewProjection(float cameraX, float cameraZ)
+{
+    const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(cameraX, 2.f, cameraZ, 1.f),
+                                           XMVectorSet(cameraX, 2.f, cameraZ + 10.f, 1.f),
+                                           XMVectorSet(0.f, 1.f, 0.f, 0.f));
+    const XMMATRIX projection = XMMatrixPerspectiveFovLH(1.2f, 16.f / 9.f, 0.5f, 200.f);
+    return XMMatrixMultiply(view, projection);
+}
+
+// NDC depth of a ground plane at y = 0 and a wall in front of it, ray cast through every pixel center. 1 for the
+// pixels above the horizon.
+static std::vector<float> RenderScene(const XMMATRIX& vpMatrix)
+{
+    const XMMATRIX inverse = XMMatrixInverse(nullptr, vpMatrix);
+    std::vector<float> depth(static_cast<size_t>(width) * height, 1.f);
+
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const float ndcX = (x + 0.5f) / width * 2.f - 1.f;
+            const float ndcY = 1.f - (y + 0.5f) / height * 2.f;
+
+            XMFLOAT3 nearPoint, farPoint;
+            XMStoreFloat3(&nearPoint, XMVector3TransformCoord(XMVectorSet(ndcX, ndcY, 0.f, 1.f), inverse));
+            XMStoreFloat3(&farPoint, XMVector3TransformCoord(XMVectorSet(ndcX, ndcY, 1.f, 1.f), inverse));
+            const XMFLOAT3 direction = {farPoint.x - nearPoint.x, farPoint.y - nearPoint.y, farPoint.z - nearPoint.z};
+
+            // Fractions of the way from the near to the far plane
+            float hit = 2.f;
+            if (direction.y < 0.f) hit = -nearPoint.y / direction.y;
+
+            const float wallHit = (12.f - nearPoint.z) / direction.z;
+            const float wallX = nearPoint.x + direction.x * wallHit;
+            const float wallY = nearPoint.y + direction.y * wallHit;
+            if (wallHit > 0.f && wallX > -3.f && wallX < 3.f && wallY > 0.f && wallY < 5.f) hit = std::min(hit, wallHit);
+
+            if (hit > 1.f) continue;
+
+            const XMVECTOR point = XMVectorSet(nearPoint.x + direction.x * hit,
+                                               nearPoint.y + direction.y * hit,
+                                               nearPoint.z + direction.z * hit,
+                                               1.f);
+            XMFLOAT4 clip;
+            XMStoreFloat4(&clip, XMVector4Transform(point, vpMatrix));
+            depth[static_cast<size_t>(y) * width + x] = clip.z / clip.w;
+        }
+    }
+    return depth;
+}
+
+// Pixels where the reprojected depth is in front of the real one, each of them could cull a visible object
+static int CountTooClose(const DepthReprojector& reprojector, const std::vector<float>& expected)
+{
+    int count = 0;
+    for (size_t i = 0; i < expected.size(); ++i)
+    {
+        if (reprojector.GetDepth()[i] < expected[i] - 1e-5f) count++;
+    }
+    return count;
+}
+
+// Without camera movement every pixel lands on itself, and the 3x3 max leaves a smooth depth almost unchanged
+static void TestStaticCamera()
+{
+    const XMMATRIX vpMatrix = MakeViewProjection(0.f, 0.f);
+    const std::vector<float> depth = RenderScene(vpMatrix);
+
+    DepthReprojector reprojector;
+    const DepthReprojectionStats stats = reprojector.Reproject(depth.data(), width, height, 0, vpMatrix, vpMatrix);
+    CHECK(stats.numSourcePixels == width * height);
+    CHECK(stats.numHoles == 0);
+    CHECK(CountTooClose(reprojector, depth) == 0);
+
+    // Far stays far, so the sky can't hide anything
+    for (size_t i = 0; i < depth.size(); ++i)
+    {
+        if (depth[i] == 1.f) CHECK(reprojector.GetDepth()[i] == 1.f);
+    }
+}
+
+// Moving sideways uncovers the ground behind the wall. It has to come out as far, never as the wall.
+static void TestDisocclusion()
+{
+    const XMMATRIX previousVP = MakeViewProjection(0.f, 0.f);
+    const XMMATRIX currentVP = MakeViewProjection(3.f, 0.f);
+    const std::vector<float> previous = RenderScene(previousVP);
+    const std::vector<float> current = RenderScene(currentVP);
+
+    DepthReprojector reprojector;
+    const DepthReprojectionStats stats = reprojector.Reproject(previous.data(), width, height, 0, previousVP, currentVP);
+    CHECK(stats.numHoles > 0);
+    CHECK(stats.numReprojected < stats.numSourcePixels);
+    CHECK(CountTooClose(reprojector, current) == 0);
+
+    HzbPyramid hzb;
+    reprojector.BuildHzb(hzb);
+    CHECK(hzb.GetMipWidth(0) == width && hzb.GetMipHeight(0) == height);
+    CHECK(std::equal(reprojector.GetDepth(), reprojector.GetDepth() + width, hzb.GetRow(0, 0)));
+}
+
+// Moving closer spreads the splats apart, the cracks between them are filled and the result stays conservative
+static void TestMovingCloser()
+{
+    const XMMATRIX previousVP = MakeViewProjection(0.f, 0.f);
+    const XMMATRIX currentVP = MakeViewProjection(0.f, 3.f);
+    const std::vector<float> previous = RenderScene(previousVP);
+    const std::vector<float> current = RenderScene(currentVP);
+
+    DepthReprojector reprojector;
+    reprojector.Reproject(previous.data(), width, height, 0, previousVP, currentVP);
+    CHECK(CountTooClose(reprojector, current) == 0);
+
+    // Most of the wall is still found, not filled in as far
+    const size_t center = static_cast<size_t>(height / 2) * width + width / 2;
+    CHECK(current[center] < 1.f && reprojector.GetDepth()[center] < 1.f);
+}
+
+// A padded source with garbage in the padding gives the same result as a tightly packed one
+static void TestRowPitch()
+{
+    const XMMATRIX previousVP = MakeViewProjection(0.f, 0.f);
+    const XMMATRIX currentVP = MakeViewProjection(0.7f, 1.f);
+    const std::vector<float> depth = RenderScene(previousVP);
+
+    const int rowPitch = width + 13;
+    std::vector<float> padded(static_cast<size_t>(rowPitch) * height, 0.001f);
+    for (int y = 0; y < height; ++y)
+    {
+        std::copy(depth.begin() + static_cast<size_t>(y) * width,
+                  depth.begin() + static_cast<size_t>(y + 1) * width,
+                  padded.begin() + static_cast<size_t>(y) * rowPitch);
+    }
+
+    DepthReprojector packed, pitched;
+    packed.Reproject(depth.data(), width, height, 0, previousVP, currentVP);
+    pitched.Reproject(padded.data(), width, height, rowPitch, previousVP, currentVP);
+    CHECK(std::equal(packed.GetDepth(), packed.GetDepth() + depth.size(), pitched.GetDepth()));
+}
+
+int main()
+{
+    TestStaticCamera();
+    TestDisocclusion();
+    TestMovingCloser();
+    TestRowPitch();
+
+    return FinishTest("depth_reprojection_test");
+}
@@ -0,0 +1,101 @@
+#include "test_helpers.hpp"
+
+#include "frame_scheduler.hpp"
+
+// Slots go around the ring, and the CPU only waits once it is numFramesInFlight frames ahead of the GPU
+static void TestFramesInFlight()
+{
+    CpuFenceEmulator direct;
+    FrameScheduler scheduler(2);
+
+    CHECK(scheduler.BeginFrame(direct) == 0);
+    scheduler.EndFrame(direct);
+    CHECK(scheduler.BeginFrame(direct) == 1);
+    CHECK(scheduler.GetPreviousFrameIndex() == 0);
+    scheduler.EndFrame(direct);
+
+    // Two frames queued and none done, so slot 0 has to wait for the first one
+    CHECK(direct.GetNumPendingSignals() == 2);
+    CHECK(scheduler.BeginFrame(direct) == 0);
+    CHECK(scheduler.GetStats().numCpuWaits == 1);
+    CHECK(direct.GetCompletedValue() == 1);
+    CHECK(direct.GetNumPendingSignals() == 1);
+    scheduler.EndFrame(direct);
+
+    // A GPU that keeps up never blocks the CPU
+    direct.Step(2);
+    CHECK(scheduler.BeginFrame(direct) == 1);
+    CHECK(scheduler.GetStats().numCpuWaits == 1);
+    scheduler.EndFrame(direct);
+
+    CHECK(scheduler.GetStats().numFrames == 4);
+
+    scheduler.WaitForIdle(direct);
+    CHECK(direct.GetNumPendingSignals() == 0);
+    CHECK(direct.GetCompletedValue() == direct.GetLastSignaledValue());
+}
+
+// Work after a Wait only completes once the other queue reached the value it had at the Wait
+static void TestQueueWaits()
+{
+    CpuFenceEmulator direct;
+    CpuFenceEmulator compute;
+
+    const uint64_t directValue = direct.Signal();
+    compute.Wait(direct);
+    const uint64_t computeValue = compute.Signal();
+
+    CHECK(compute.Step() == 0);
+    CHECK(!compute.IsFenceComplete(computeValue));
+
+    CHECK(direct.Step() == 1);
+    CHECK(direct.IsFenceComplete(directValue));
+    CHECK(compute.Step() == 1);
+    CHECK(compute.IsFenceComplete(computeValue));
+
+    // A CPU wait runs the queues waited on as well
+    direct.Signal();
+    compute.Wait(direct);
+    const uint64_t lastValue = compute.Signal();
+    compute.WaitForFenceValue(lastValue);
+    CHECK(compute.IsFenceComplete(lastValue));
+    CHECK(direct.GetNumPendingSignals() == 0);
+    CHECK(compute.GetNumCpuWaits() == 1);
+}
+
+// A GPU path frame reads the draws of the frame before it on the direct queue. When a CPU visibility frame comes
+// next and reuses that slot, its bucketing on the compute queue must not start before the read is done.
+static void TestCpuVisibilityAfterGpuFrame()
+{
+    CpuFenceEmulator copy;
+    CpuFenceEmulator direct;
+    CpuFenceEmulator compute;
+
+    // Frame N+1, GPU path: depth pass of slot N's draws, then its own culling and draw
+    const uint64_t occluderRead = direct.Signal();
+
+    // Frame N+2, CPU visibility into slot N: upload, then bucketing after both the copy and the direct queue
+    const uint64_t upload = copy.Signal();
+    compute.Wait(copy);
+    compute.Wait(direct);
+    const uint64_t bucketing = compute.Signal();
+
+    CHECK(copy.Step() == 1);
+    CHECK(copy.IsFenceComplete(upload));
+    CHECK(compute.Step() == 0);
+    CHECK(!compute.IsFenceComplete(bucketing));
+
+    CHECK(direct.Step() == 1);
+    CHECK(direct.IsFenceComplete(occluderRead));
+    CHECK(compute.Step() == 1);
+    CHECK(compute.IsFenceComplete(bucketing));
+}
+
+int main()
+{
+    TestFramesInFlight();
+    TestQueueWaits();
+    TestCpuVisibilityAfterGpuFrame();
+
+    return FinishTest("frame_scheduler_test");
+}
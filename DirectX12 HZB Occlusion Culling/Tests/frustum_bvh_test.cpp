@@ -0,0 +1,122 @@
+#include "test_helpers.hpp"
+
+#include "frustum.hpp"
+#include "parallel_for.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+static std::vector<IndexedAABB> MakeObjects(size_t count, uint32_t seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> position(-200.f, 200.f);
+
+    std::vector<IndexedAABB> objects;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const XMFLOAT3 min = {position(random), position(random) * 0.1f, position(random)};
+        objects.emplace_back(AABB{min, {min.x + 2.f, min.y + 2.f, min.z + 2.f}}, static_cast<int>(i));
+    }
+    return objects;
+}
+
+static FrustumPlanes MakeFrustum(float yaw)
+{
+    const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(0.f, 0.f, 0.f, 1.f),
+                                           XMVectorSet(std::sin(yaw), 0.f, std::cos(yaw), 1.f),
+                                           XMVectorSet(0.f, 1.f, 0.f, 0.f));
+    const XMMATRIX projection = XMMatrixPerspectiveFovLH(1.0f, 16.f / 9.f, 0.5f, 150.f);
+
+    FrustumPlanes frustum;
+    ExtractPlanes(frustum.planes, XMMatrixMultiply(view, projection), true);
+    return frustum;
+}
+
+// Every object that is visible on its own is found, in object order. Leaves report all their objects, so a few
+// culled ones come along.
+static void TestAgainstBruteForce(std::vector<IndexedAABB>& objects, std::shared_ptr<BVHNode>& root)
+{
+    for (float yaw : {0.f, 1.f, 2.5f, 4.f})
+    {
+        FrustumPlanes frustum = MakeFrustum(yaw);
+
+        std::vector<int> expected;
+        for (size_t i = 0; i < objects.size(); ++i)
+        {
+            if (FrustumAABBIntersect(objects[i].aabb, frustum.planes) != OUTSIDE) expected.push_back(static_cast<int>(i));
+        }
+
+        std::vector<int> serial;
+        FrustumBVHIntersect(serial, root, frustum);
+        CHECK(std::is_sorted(serial.begin(), serial.end()));
+        CHECK(std::includes(serial.begin(), serial.end(), expected.begin(), expected.end()));
+        CHECK(!expected.empty() && serial.size() < objects.size());
+
+        std::vector<int> parallel;
+        FrustumBVHIntersectParallel(parallel, root, frustum, nullptr, 4);
+        CHECK(parallel == serial);
+    }
+}
+
+// The second traversal with the same camera starts every culled node with the plane that culled it
+static void TestRejectingPlaneHint(std::shared_ptr<BVHNode>& root)
+{
+    FrustumPlanes frustum = MakeFrustum(0.7f);
+
+    // A traversal with another camera leaves different hints behind first
+    FrustumPlanes other = MakeFrustum(3.8f);
+    std::vector<int> visible;
+    FrustumBVHIntersect(visible, root, other);
+
+    FrustumCullStats first, second;
+    std::vector<int> firstVisible, secondVisible;
+    FrustumBVHIntersect(firstVisible, root, frustum, &first);
+    FrustumBVHIntersect(secondVisible, root, frustum, &second);
+
+    CHECK(firstVisible == secondVisible);
+    CHECK(first.nodesVisited == second.nodesVisited);
+    CHECK(second.planeTests < first.planeTests);
+
+    // And the hints don't change anything from then on
+    FrustumCullStats third;
+    std::vector<int> thirdVisible;
+    FrustumBVHIntersect(thirdVisible, root, frustum, &third);
+    CHECK(third.planeTests == second.planeTests);
+}
+
+// Traversals with different cameras on one tree at the same time only fight over the hints
+static void TestConcurrentTraversals(std::shared_ptr<BVHNode>& root)
+{
+    const int numViews = 16;
+
+    std::vector<std::vector<int>> expected(numViews);
+    for (int view = 0; view < numViews; ++view)
+    {
+        FrustumPlanes frustum = MakeFrustum(view * 0.4f);
+        FrustumBVHIntersect(expected[view], root, frustum);
+    }
+
+    std::vector<std::vector<int>> results(numViews);
+    ParallelForChunks(numViews,
+                      [&](size_t view)
+                      {
+                          FrustumPlanes frustum = MakeFrustum(view * 0.4f);
+                          FrustumBVHIntersect(results[view], root, frustum);
+                      });
+
+    CHECK(results == expected);
+}
+
+int main()
+{
+    std::vector<IndexedAABB> objects = MakeObjects(20000, 1);
+    std::shared_ptr<BVHNode> root = BuildBVH(objects, 0, static_cast<int>(objects.size()));
+
+    TestAgainstBruteForce(objects, root);
+    TestRejectingPlaneHint(root);
+    TestConcurrentTraversals(root);
+
+    return FinishTest("frustum_bvh_test");
+}
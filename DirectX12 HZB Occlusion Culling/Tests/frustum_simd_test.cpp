@@ -0,0 +1,167 @@
+#include "test_helpers.hpp"
+
+#include "frustum.hpp"
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+// Not multiples of 4, 8 or 16, so every kernel leaves a tail for the scalar loop
+static const size_t counts[] = {0, 1, 3, 5, 7, 13, 17, 31, 33, 1001};
+
+static void CheckAgainstScalar(std::vector<AABB> boxes, FrustumPlanes frustum)
+{
+    AABBSoA soa;
+    soa.Resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); ++i) soa.Set(i, boxes[i]);
+
+    const size_t numWords = (boxes.size() + 31) / 32;
+    std::vector<uint32_t> expected(numWords, 0u);
+    for (size_t i = 0; i < boxes.size(); ++i)
+    {
+        if (FrustumAABBIntersect(boxes[i], frustum.planes) != OUTSIDE) expected[i / 32] |= 1u << (i % 32);
+    }
+
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2, SimdLevel::AVX512})
+    {
+        if (level > GetSupportedSimdLevel()) continue;
+
+        // Stale bits have to be cleared, and the word after the mask is left alone
+        std::vector<uint32_t> mask(numWords + 1, ~0u);
+        FrustumAABBIntersectBatch(soa, frustum, mask.data(), level);
+
+        CHECK(std::vector<uint32_t>(mask.begin(), mask.end() - 1) == expected);
+        CHECK(mask.back() == ~0u);
+    }
+}
+
+// The cube [-10, 10], planes facing inwards
+static FrustumPlanes MakeBoxFrustum()
+{
+    FrustumPlanes frustum;
+    frustum.planes[0] = {1.f, 0.f, 0.f, 10.f};
+    frustum.planes[1] = {-1.f, 0.f, 0.f, 10.f};
+    frustum.planes[2] = {0.f, 1.f, 0.f, 10.f};
+    frustum.planes[3] = {0.f, -1.f, 0.f, 10.f};
+    frustum.planes[4] = {0.f, 0.f, 1.f, 10.f};
+    frustum.planes[5] = {0.f, 0.f, -1.f, 10.f};
+    return frustum;
+}
+
+// Boxes with a face exactly on a plane are visible, one ulp further out they aren't
+static void TestTouchingBoxes()
+{
+    FrustumPlanes frustum = MakeBoxFrustum();
+    const float justOutside = std::nextafter(10.f, 20.f);
+
+    std::vector<AABB> boxes;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        for (float side : {-1.f, 1.f})
+        {
+            AABB touching = {{-1.f, -1.f, -1.f}, {1.f, 1.f, 1.f}};
+            AABB outside = touching;
+            float* touchingMin = &touching.min.x;
+            float* touchingMax = &touching.max.x;
+            float* outsideMin = &outside.min.x;
+            float* outsideMax = &outside.max.x;
+            if (side > 0)
+            {
+                touchingMin[axis] = 10.f;
+                touchingMax[axis] = 12.f;
+                outsideMin[axis] = justOutside;
+                outsideMax[axis] = 12.f;
+            }
+            else
+            {
+                touchingMin[axis] = -12.f;
+                touchingMax[axis] = -10.f;
+                outsideMin[axis] = -12.f;
+                outsideMax[axis] = -justOutside;
+            }
+            boxes.push_back(touching);
+            boxes.push_back(outside);
+        }
+    }
+
+    // A box touching the frustum in one corner only
+    boxes.push_back({{10.f, 10.f, 10.f}, {11.f, 11.f, 11.f}});
+
+    for (size_t i = 0; i < boxes.size(); ++i)
+    {
+        const IntersectionType expected = i + 1 == boxes.size() || i % 2 == 0 ? INTERSECT : OUTSIDE;
+        CHECK(FrustumAABBIntersect(boxes[i], frustum.planes) == expected);
+    }
+
+    // Repeated to every count, so the touching boxes land in the vector lanes and in the tails
+    for (size_t count : counts)
+    {
+        std::vector<AABB> repeated(count);
+        for (size_t i = 0; i < count; ++i) repeated[i] = boxes[i % boxes.size()];
+        CheckAgainstScalar(repeated, frustum);
+    }
+}
+
+// Integer planes and boxes keep every distance exact, so a lot of them come out as exactly 0
+static void TestIntegerGrid(size_t count, uint32_t seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> coordinate(-14, 14);
+    std::uniform_int_distribution<int> coefficient(-2, 2);
+
+    FrustumPlanes frustum = MakeBoxFrustum();
+    for (Plane& plane : frustum.planes)
+    {
+        plane.a += static_cast<float>(coefficient(random));
+        plane.b += static_cast<float>(coefficient(random));
+    }
+
+    std::vector<AABB> boxes(count);
+    for (AABB& box : boxes)
+    {
+        const float x = static_cast<float>(coordinate(random));
+        const float y = static_cast<float>(coordinate(random));
+        const float z = static_cast<float>(coordinate(random));
+        box = {{x, y, z}, {x + static_cast<float>(random() % 3), y + static_cast<float>(random() % 3), z + 1.f}};
+    }
+
+    CheckAgainstScalar(boxes, frustum);
+}
+
+static void TestPerspective(size_t count, uint32_t seed)
+{
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<float> position(-60.f, 60.f);
+    std::uniform_real_distribution<float> size(0.1f, 8.f);
+
+    const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(position(random), position(random), position(random), 1.f),
+                                           XMVectorSet(0.f, 0.f, 0.f, 1.f),
+                                           XMVectorSet(0.f, 1.f, 0.f, 0.f));
+    const XMMATRIX projection = XMMatrixPerspectiveFovLH(1.2f, 16.f / 9.f, 0.5f, 100.f);
+
+    FrustumPlanes frustum;
+    ExtractPlanes(frustum.planes, XMMatrixMultiply(view, projection), count % 2 == 0);
+
+    std::vector<AABB> boxes(count);
+    for (AABB& box : boxes)
+    {
+        const XMFLOAT3 min = {position(random), position(random), position(random)};
+        box = {min, {min.x + size(random), min.y + size(random), min.z + size(random)}};
+    }
+
+    CheckAgainstScalar(boxes, frustum);
+}
+
+int main()
+{
+    TestTouchingBoxes();
+
+    uint32_t seed = 0;
+    for (size_t count : counts)
+    {
+        TestIntegerGrid(count, seed++);
+        TestPerspective(count, seed++);
+    }
+
+    return FinishTest("frustum_simd_test");
+}
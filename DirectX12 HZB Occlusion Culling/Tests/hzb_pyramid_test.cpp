@@ -0,0 +1,82 @@
+#include "test_helpers.hpp"
+
+#include "hzb_pyramid.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Max over the source texels a texel covers, following the D3D12 mip sizes like HzbPyramid
+static std::vector<float> ReduceReference(const std::vector<float>& src, int srcWidth, int srcHeight)
+{
+    const int width = std::max(1, srcWidth >> 1);
+    const int height = std::max(1, srcHeight >> 1);
+
+    std::vector<float> dst(static_cast<size_t>(width) * height, -FLT_MAX);
+    for (int y = 0; y < srcHeight; ++y)
+    {
+        for (int x = 0; x < srcWidth; ++x)
+        {
+            const int dstX = std::min(x / 2, width - 1);
+            const int dstY = std::min(y / 2, height - 1);
+            float& texel = dst[static_cast<size_t>(dstY) * width + dstX];
+            texel = std::max(texel, src[static_cast<size_t>(y) * srcWidth + x]);
+        }
+    }
+    return dst;
+}
+
+static void CheckPyramid(int width, int height, SimdLevel level)
+{
+    std::vector<float> depth(static_cast<size_t>(width) * height);
+    for (size_t i = 0; i < depth.size(); ++i) depth[i] = static_cast<float>((i * 7919) % 1000) / 1000.f;
+
+    HzbPyramid hzb;
+    hzb.Build(depth.data(), width, height, 0, 0, level);
+
+    std::vector<float> expected = depth;
+    int expectedWidth = width;
+    int expectedHeight = height;
+
+    for (int mip = 0; mip < hzb.GetNumMips(); ++mip)
+    {
+        CHECK(hzb.GetMipWidth(mip) == expectedWidth && hzb.GetMipHeight(mip) == expectedHeight);
+
+        int numWrong = 0;
+        for (int y = 0; y < expectedHeight; ++y)
+        {
+            for (int x = 0; x < expectedWidth; ++x)
+            {
+                numWrong += hzb.GetTexel(mip, x, y) != expected[static_cast<size_t>(y) * expectedWidth + x];
+            }
+
+            // The padding stays zero
+            const float* row = hzb.GetRow(mip, y);
+            numWrong += std::any_of(row + expectedWidth, row + hzb.GetRowPitch(mip), [](float v) { return v != 0.f; });
+        }
+        CHECK(numWrong == 0);
+
+        expected = ReduceReference(expected, expectedWidth, expectedHeight);
+        expectedWidth = std::max(1, expectedWidth >> 1);
+        expectedHeight = std::max(1, expectedHeight >> 1);
+    }
+}
+
+int main()
+{
+    // 1, 16 and 48 wide sources make the pair max read past the source row pitch, see ReduceRows
+    const int widths[] = {1, 2, 3, 15, 16, 17, 33, 48, 64, 97, 320};
+    const int heights[] = {1, 3, 16, 48, 180};
+    const SimdLevel levels[] = {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2};
+
+    for (SimdLevel level : levels)
+    {
+        if (level > GetSupportedSimdLevel()) continue;
+
+        for (int width : widths)
+        {
+            for (int height : heights) CheckPyramid(width, height, level);
+        }
+    }
+
+    return FinishTest("hzb_pyramid_test");
+}
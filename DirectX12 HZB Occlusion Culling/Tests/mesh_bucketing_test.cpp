@@ -0,0 +1,140 @@
+#include "test_helpers.hpp"
+
+#include "mesh_bucketing.hpp"
+#include "occlusion_helpers_dx12.hpp"
+#include "screen_size_lod.hpp"
+#include "visibility_bits.hpp"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// The obvious serial version, one pass over the instances per mesh
+static MeshBuckets BucketSerial(const std::vector<uint32_t>& visibilityBits,
+                                const std::vector<unsigned int>& meshIds,
+                                const std::vector<MeshDrawInfo>& meshes,
+                                const std::vector<uint32_t>& lodBits,
+                                unsigned int numLods)
+{
+    const size_t numMeshIds = meshes.size() / numLods;
+
+    MeshBuckets buckets;
+    buckets.lodCommandOffsets.assign(numLods + 1, 0);
+    for (size_t mesh = 0; mesh < meshes.size(); ++mesh)
+    {
+        if (mesh % numMeshIds == 0)
+        {
+            buckets.lodCommandOffsets[mesh / numMeshIds] = static_cast<unsigned int>(buckets.commands.size());
+        }
+
+        const unsigned int meshStart = static_cast<unsigned int>(buckets.instanceIndices.size());
+        for (size_t i = 0; i < meshIds.size(); ++i)
+        {
+            const size_t instanceMesh = (numLods > 1 ? GetLod(lodBits.data(), i) * numMeshIds : 0) + meshIds[i];
+            if (IsVisible(visibilityBits.data(), i) && instanceMesh == mesh)
+            {
+                buckets.instanceIndices.push_back(static_cast<unsigned int>(i));
+            }
+        }
+
+        const unsigned int count = static_cast<unsigned int>(buckets.instanceIndices.size()) - meshStart;
+        if (count == 0) continue;
+
+        buckets.commands.push_back(
+            {meshStart, meshes[mesh].indexCount, count, meshes[mesh].startIndexLocation, meshes[mesh].baseVertexLocation, 0});
+    }
+    buckets.lodCommandOffsets[numLods] = static_cast<unsigned int>(buckets.commands.size());
+    return buckets;
+}
+
+// More instances than one bucketing chunk, a few meshes left without visible instances
+static void TestAgainstSerial(size_t numInstances, unsigned int numMeshIds, unsigned int numLods, uint32_t seed)
+{
+    std::mt19937 random(seed);
+
+    std::vector<MeshDrawInfo> meshes(numMeshIds * numLods);
+    for (size_t mesh = 0; mesh < meshes.size(); ++mesh)
+    {
+        const unsigned int index = static_cast<unsigned int>(mesh);
+        meshes[mesh] = {36 + index, index * 100, static_cast<int>(index) * 8};
+    }
+
+    // The last mesh id is never used
+    std::vector<unsigned int> meshIds(numInstances);
+    for (unsigned int& meshId : meshIds) meshId = random() % std::max(1u, numMeshIds - 1);
+
+    std::vector<unsigned int> visibility(numInstances);
+    for (unsigned int& visible : visibility) visible = random() % 3 != 0 ? OC_VISIBLE : OC_HIDDEN;
+    std::vector<uint32_t> visibilityBits(GetNumVisibilityWords(numInstances));
+    PackVisibility(visibility.data(), numInstances, visibilityBits.data());
+
+    std::vector<uint32_t> lodBits(GetNumLodWords(numInstances), 0);
+    for (size_t i = 0; i < numInstances; ++i) lodBits[i / 16] |= (random() % numLods) << (i % 16 * 2);
+
+    MeshBuckets cpu;
+    BucketInstancesByMesh(visibilityBits.data(), meshIds.data(), numInstances, meshes, cpu, lodBits.data(), numLods);
+
+    const MeshBuckets expected = BucketSerial(visibilityBits, meshIds, meshes, lodBits, numLods);
+    CHECK(cpu.instanceIndices == expected.instanceIndices);
+    CHECK(cpu.lodCommandOffsets == expected.lodCommandOffsets);
+    CHECK(SameMeshBuckets(cpu, expected));
+
+    // The GPU appends with atomics, so the instances of a draw can come back in any order
+    MeshBuckets gpu = cpu;
+    for (const IndirectCommand& command : gpu.commands)
+    {
+        auto begin = gpu.instanceIndices.begin() + command.InstanceOffset;
+        std::shuffle(begin, begin + command.InstanceCount, random);
+    }
+    CHECK(SameMeshBuckets(gpu, expected));
+
+    if (gpu.commands.empty()) return;
+
+    // An instance in the wrong draw
+    if (gpu.commands.size() > 1)
+    {
+        MeshBuckets wrongDraw = gpu;
+        std::swap(wrongDraw.instanceIndices.front(), wrongDraw.instanceIndices.back());
+        CHECK(!SameMeshBuckets(wrongDraw, expected));
+    }
+
+    // A lost instance
+    MeshBuckets lostInstance = gpu;
+    lostInstance.instanceIndices.pop_back();
+    lostInstance.commands.back().InstanceCount--;
+    CHECK(!SameMeshBuckets(lostInstance, expected));
+
+    // A draw with the wrong mesh
+    MeshBuckets wrongMesh = gpu;
+    wrongMesh.commands.front().StartIndexLocation++;
+    CHECK(!SameMeshBuckets(wrongMesh, expected));
+}
+
+// No visibility bits draws every instance, as for the all instances draw list
+static void TestAllVisible()
+{
+    const std::vector<MeshDrawInfo> meshes = {{36, 0, 0}, {24, 36, 8}};
+    const std::vector<unsigned int> meshIds = {1, 0, 1, 1, 0};
+
+    MeshBuckets buckets;
+    BucketInstancesByMesh(nullptr, meshIds.data(), meshIds.size(), meshes, buckets);
+
+    CHECK(buckets.commands.size() == 2);
+    CHECK(buckets.commands[0].InstanceOffset == 0 && buckets.commands[0].InstanceCount == 2);
+    CHECK(buckets.commands[1].InstanceOffset == 2 && buckets.commands[1].InstanceCount == 3);
+    CHECK(buckets.instanceIndices == std::vector<unsigned int>({1, 4, 0, 2, 3}));
+    CHECK(buckets.lodCommandOffsets == std::vector<unsigned int>({0, 2}));
+}
+
+int main()
+{
+    TestAllVisible();
+
+    TestAgainstSerial(0, 4, 1, 0);
+    TestAgainstSerial(1, 1, 1, 1);
+    TestAgainstSerial(1000, 8, 1, 2);
+    TestAgainstSerial(200000, 16, 1, 3);
+    TestAgainstSerial(200000, 6, 4, 4);
+
+    return FinishTest("mesh_bucketing_test");
+}
@@ -0,0 +1,97 @@
+#include "test_helpers.hpp"
+
+#include "parallel_scan.hpp"
+
+#include <numeric>
+#include <random>
+#include <vector>
+
+static const int partitionSize = 256;
+
+static std::vector<unsigned int> MakeInput(size_t count, uint32_t seed)
+{
+    // Small values, the look-back totals have to fit in the 30 value bits
+    std::mt19937 random(seed);
+    std::vector<unsigned int> input(count);
+    for (unsigned int& value : input) value = random() % 16;
+    return input;
+}
+
+static void CheckLookbackScan(size_t count, int maxResidentGroups, uint32_t seed)
+{
+    const std::vector<unsigned int> input = MakeInput(count, seed);
+
+    std::vector<unsigned int> expected(count);
+    std::exclusive_scan(input.begin(), input.end(), expected.begin(), 0u);
+    const unsigned int expectedTotal = std::accumulate(input.begin(), input.end(), 0u);
+
+    DecoupledLookbackScan scan(partitionSize, maxResidentGroups);
+    std::vector<unsigned int> output(count, ~0u);
+    const unsigned int total = scan.Run(input.data(), output.data(), count, seed);
+
+    CHECK(total == expectedTotal);
+    CHECK(output == expected);
+
+    // Every partition ends up with its inclusive prefix
+    const std::vector<unsigned int>& states = scan.GetPartitionStates();
+    CHECK(static_cast<int>(states.size()) == scan.GetStats().numPartitions);
+    for (size_t partition = 0; partition < states.size(); ++partition)
+    {
+        const size_t end = std::min(count, (partition + 1) * partitionSize);
+        const unsigned int prefix = end == count ? expectedTotal : expected[end];
+        CHECK(GetPartitionFlag(states[partition]) == PARTITION_PREFIX);
+        CHECK(GetPartitionValue(states[partition]) == prefix);
+    }
+}
+
+static void CheckExclusiveScan(size_t count, SimdLevel level)
+{
+    const std::vector<unsigned int> input = MakeInput(count, static_cast<uint32_t>(count));
+
+    std::vector<unsigned int> expected(count);
+    std::exclusive_scan(input.begin(), input.end(), expected.begin(), 0u);
+
+    std::vector<unsigned int> output(count, ~0u);
+    const unsigned int total = ExclusiveScan(input.data(), output.data(), count, level);
+
+    CHECK(total == std::accumulate(input.begin(), input.end(), 0u));
+    CHECK(output == expected);
+}
+
+int main()
+{
+    const size_t sizes[] = {0, 1, partitionSize - 1, partitionSize, partitionSize + 1, partitionSize * 200 + 17};
+
+    // Every seed steps the workgroups in another random order, so partitions publish out of order and look-backs
+    // stall on predecessors that haven't published yet
+    for (size_t count : sizes)
+    {
+        for (int maxResidentGroups : {1, 3, 8, 64})
+        {
+            for (uint32_t seed = 0; seed < 8; ++seed) CheckLookbackScan(count, maxResidentGroups, seed);
+        }
+    }
+
+    // The shuffled orders do make it wait and look further back than one partition
+    {
+        const std::vector<unsigned int> input = MakeInput(partitionSize * 200, 1);
+        std::vector<unsigned int> output(input.size());
+
+        DecoupledLookbackScan scan(partitionSize, 64);
+        scan.Run(input.data(), output.data(), input.size(), 1);
+        CHECK(scan.GetStats().numStalls > 0);
+        CHECK(scan.GetStats().maxLookbackDistance > 1);
+    }
+
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE, SimdLevel::AVX2})
+    {
+        if (level > GetSupportedSimdLevel()) continue;
+
+        for (size_t count : {size_t(0), size_t(1), size_t(7), size_t(16383), size_t(16384), size_t(16385), size_t(100000)})
+        {
+            CheckExclusiveScan(count, level);
+        }
+    }
+
+    return FinishTest("parallel_scan_test");
+}
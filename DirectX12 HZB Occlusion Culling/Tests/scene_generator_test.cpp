@@ -0,0 +1,111 @@
+#include "test_helpers.hpp"
+
+#include "parallel_for.hpp"
+#include "scene_generator.hpp"
+
+#include <cstring>
+#include <vector>
+
+struct Scene
+{
+    std::vector<InstanceData> instances;
+    std::vector<AABB> bounds;
+};
+
+static const AABB meshBounds = {{-1.f, -1.f, -1.f}, {1.f, 1.f, 1.f}};
+
+static Scene Generate(const SceneSettings& settings)
+{
+    Scene scene;
+    GenerateScene(settings, meshBounds, scene.instances, scene.bounds);
+    return scene;
+}
+
+// A parallel call from inside another one runs on the calling thread only, so this is one thread doing every chunk
+static Scene GenerateSingleThreaded(const SceneSettings& settings)
+{
+    Scene scene;
+    ParallelForChunks(2,
+                      [&](size_t chunk)
+                      {
+                          if (chunk == 0) scene = Generate(settings);
+                      });
+    return scene;
+}
+
+// Bit for bit, floats compared with == would let -0 and 0 pass
+static bool SameScene(const Scene& a, const Scene& b, size_t count)
+{
+    return a.instances.size() >= count && b.instances.size() >= count && a.bounds.size() >= count &&
+           b.bounds.size() >= count && std::memcmp(a.instances.data(), b.instances.data(), count * sizeof(InstanceData)) == 0 &&
+           std::memcmp(a.bounds.data(), b.bounds.data(), count * sizeof(AABB)) == 0;
+}
+
+static void TestThreadCountIndependence(int numInstances, uint32_t seed)
+{
+    SceneSettings settings;
+    settings.seed = seed;
+    settings.numInstances = numInstances;
+    settings.scale = 0.5f;
+
+    const Scene multiThreaded = Generate(settings);
+    const Scene singleThreaded = GenerateSingleThreaded(settings);
+
+    CHECK(multiThreaded.instances.size() == static_cast<size_t>(numInstances));
+    CHECK(multiThreaded.bounds.size() == static_cast<size_t>(numInstances));
+    CHECK(SameScene(multiThreaded, singleThreaded, numInstances));
+
+    // And the same again on the next run
+    CHECK(SameScene(multiThreaded, Generate(settings), numInstances));
+}
+
+// Every instance comes from the stream of its chunk, so more instances leave the ones before them alone
+static void TestPrefix()
+{
+    SceneSettings settings;
+    settings.numInstances = 40000;
+    const Scene smaller = Generate(settings);
+
+    settings.numInstances = 70001;
+    const Scene larger = Generate(settings);
+    CHECK(SameScene(smaller, larger, 40000));
+
+    settings.seed++;
+    const Scene otherSeed = Generate(settings);
+    CHECK(!SameScene(larger, otherSeed, 1));
+}
+
+// The bounds are the mesh bounds moved by the world matrix
+static void TestBounds()
+{
+    SceneSettings settings;
+    settings.numInstances = 1000;
+    settings.scale = 2.f;
+    const Scene scene = Generate(settings);
+
+    for (size_t i = 0; i < scene.instances.size(); ++i)
+    {
+        XMFLOAT3 translation;
+        XMStoreFloat3(&translation, scene.instances[i].WorldMatrix.r[3]);
+
+        const AABB& aabb = scene.bounds[i];
+        CHECK(aabb.min.x == translation.x - 2.f && aabb.max.x == translation.x + 2.f);
+        CHECK(aabb.min.y == translation.y - 2.f && aabb.max.y == translation.y + 2.f);
+        CHECK(aabb.min.z == translation.z - 2.f && aabb.max.z == translation.z + 2.f);
+        CHECK(translation.x >= 0.f && translation.x < settings.positionRange * settings.scale);
+    }
+}
+
+int main()
+{
+    // A partial last chunk, one chunk, and nothing at all
+    TestThreadCountIndependence(100000, 1431);
+    TestThreadCountIndependence(16384, 7);
+    TestThreadCountIndependence(5, 3);
+    TestThreadCountIndependence(0, 1);
+
+    TestPrefix();
+    TestBounds();
+
+    return FinishTest("scene_generator_test");
+}
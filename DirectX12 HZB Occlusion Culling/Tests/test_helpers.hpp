@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdio>
+
+// Every test is a small executable of its own, linked with the sources it covers. It returns the number of failed
+// checks, so 0 is a pass.
+static int numFailedChecks = 0;
+
+#define CHECK(condition)                                                              \
+    do                                                                                \
+    {                                                                                 \
+        if (!(condition))                                                             \
+        {                                                                             \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            numFailedChecks++;                                                        \
+        }                                                                             \
+    } while (0)
+
+inline int FinishTest(const char* name)
+{
+    std::printf("%s: %s\n", name, numFailedChecks == 0 ? "passed" : "FAILED");
+    return numFailedChecks;
+}
@@ -0,0 +1,240 @@
+#include "test_helpers.hpp"
+
+#include "transient_resource_pool.hpp"
+
+#include <map>
+
+// What the mock allocator did, shared with the test since the pool owns the allocator
+struct AllocatorLog
+{
+    int texturesCreated = 0;
+    int texturesDestroyed = 0;
+    int viewsCreated = 0;
+    int viewsDestroyed = 0;
+
+    std::map<D3D12_COMMAND_LIST_TYPE, uint64_t> completedFences;
+};
+
+// Counts its own destruction
+struct Token
+{
+    explicit Token(int& destroyed) : destroyed(destroyed) {}
+    ~Token() { destroyed++; }
+
+    int& destroyed;
+};
+
+// The pool never looks inside what the allocator returns, so the mock hands out handles that alias a counting token
+template <typename T>
+static std::shared_ptr<T> MakeHandle(int& destroyed)
+{
+    auto token = std::make_shared<Token>(destroyed);
+    return std::shared_ptr<T>(token, reinterpret_cast<T*>(token.get()));
+}
+
+class MockAllocator : public TransientAllocator
+{
+public:
+    explicit MockAllocator(std::shared_ptr<AllocatorLog> log) : m_log(std::move(log)) {}
+
+    std::shared_ptr<bee::DX12Texture> CreateTexture(const D3D12_RESOURCE_DESC&) override
+    {
+        m_log->texturesCreated++;
+        return MakeHandle<bee::DX12Texture>(m_log->texturesDestroyed);
+    }
+
+    std::shared_ptr<bee::ShaderResourceView> CreateShaderResourceView(const std::shared_ptr<bee::DX12Texture>&,
+                                                                      const D3D12_SHADER_RESOURCE_VIEW_DESC&) override
+    {
+        m_log->viewsCreated++;
+        return MakeHandle<bee::ShaderResourceView>(m_log->viewsDestroyed);
+    }
+
+    std::shared_ptr<bee::UnorderedAccessView> CreateUnorderedAccessView(const std::shared_ptr<bee::DX12Texture>&,
+                                                                        const D3D12_UNORDERED_ACCESS_VIEW_DESC&) override
+    {
+        m_log->viewsCreated++;
+        return MakeHandle<bee::UnorderedAccessView>(m_log->viewsDestroyed);
+    }
+
+    bool IsFenceComplete(D3D12_COMMAND_LIST_TYPE queue, uint64_t fenceValue) override
+    {
+        return fenceValue <= m_log->completedFences[queue];
+    }
+
+private:
+    std::shared_ptr<AllocatorLog> m_log;
+};
+
+static D3D12_RESOURCE_DESC MakeDesc(uint64_t width, unsigned int height, DXGI_FORMAT format = DXGI_FORMAT_R32_FLOAT)
+{
+    D3D12_RESOURCE_DESC desc = {};
+    desc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+    desc.Width = width;
+    desc.Height = height;
+    desc.DepthOrArraySize = 1;
+    desc.MipLevels = 1;
+    desc.Format = format;
+    desc.SampleDesc.Count = 1;
+    desc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+    return desc;
+}
+
+struct TestPool
+{
+    std::shared_ptr<AllocatorLog> log = std::make_shared<AllocatorLog>();
+    TransientResourcePool pool{std::make_unique<MockAllocator>(log)};
+};
+
+// A released texture comes back for the same desc, and only for the same desc
+static void TestReuseByDesc()
+{
+    TestPool test;
+    const D3D12_RESOURCE_DESC desc = MakeDesc(512, 256);
+
+    auto first = test.pool.AcquireTexture(desc);
+    test.pool.ReleaseTexture(first, D3D12_COMMAND_LIST_TYPE_DIRECT, 1);
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_DIRECT] = 1;
+
+    auto reused = test.pool.AcquireTexture(MakeDesc(512, 256));
+    CHECK(reused == first);
+    CHECK(test.log->texturesCreated == 1);
+    CHECK(test.pool.GetStats().numReused == 1);
+
+    // Another size or format, and a second texture while the first is still in use
+    auto otherSize = test.pool.AcquireTexture(MakeDesc(256, 256));
+    auto otherFormat = test.pool.AcquireTexture(MakeDesc(512, 256, DXGI_FORMAT_R32_TYPELESS));
+    auto second = test.pool.AcquireTexture(desc);
+    CHECK(otherSize != first && otherFormat != first && second != first);
+    CHECK(test.log->texturesCreated == 4);
+    CHECK(test.pool.GetStats().numPooled == 4);
+    CHECK(test.pool.GetStats().numInUse == 4);
+}
+
+// The fence is checked on the queue the texture was released on, other queues being further along doesn't count
+static void TestReleaseFence()
+{
+    TestPool test;
+    const D3D12_RESOURCE_DESC desc = MakeDesc(128, 128);
+
+    auto texture = test.pool.AcquireTexture(desc);
+    test.pool.ReleaseTexture(texture, D3D12_COMMAND_LIST_TYPE_COMPUTE, 5);
+
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_DIRECT] = 10;
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_COMPUTE] = 4;
+    auto whileBusy = test.pool.AcquireTexture(desc);
+    CHECK(whileBusy != texture);
+    CHECK(test.log->texturesCreated == 2);
+
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_COMPUTE] = 5;
+    auto afterFence = test.pool.AcquireTexture(desc);
+    CHECK(afterFence == texture);
+    CHECK(test.log->texturesCreated == 2);
+}
+
+// Unused textures are freed after the max age, but never while the GPU may still use them
+static void TestEviction()
+{
+    const uint64_t maxAge = 2;
+
+    TestPool test;
+    test.pool.SetMaxAge(maxAge);
+
+    auto texture = test.pool.AcquireTexture(MakeDesc(64, 64));
+    test.pool.ReleaseTexture(texture, D3D12_COMMAND_LIST_TYPE_DIRECT, 3);
+    texture = nullptr;
+
+    // Old enough, but the fence isn't there yet
+    for (uint64_t frame = 0; frame <= maxAge + 2; ++frame) test.pool.EndFrame();
+    test.pool.Trim();
+    CHECK(test.pool.GetStats().numPooled == 1);
+    CHECK(test.log->texturesDestroyed == 0);
+
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_DIRECT] = 3;
+    test.pool.EndFrame();
+    CHECK(test.pool.GetStats().numEvicted == 1);
+    CHECK(test.pool.GetStats().numPooled == 0);
+    CHECK(test.log->texturesDestroyed == 1);
+
+    // Done on the GPU, but used too recently
+    texture = test.pool.AcquireTexture(MakeDesc(64, 64));
+    test.pool.ReleaseTexture(texture, D3D12_COMMAND_LIST_TYPE_DIRECT, 3);
+    texture = nullptr;
+    for (uint64_t frame = 0; frame < maxAge; ++frame) test.pool.EndFrame();
+    CHECK(test.pool.GetStats().numPooled == 1);
+
+    test.pool.EndFrame();
+    CHECK(test.pool.GetStats().numPooled == 0);
+    CHECK(test.log->texturesDestroyed == 2);
+
+    // Textures in use stay, however old they are
+    texture = test.pool.AcquireTexture(MakeDesc(64, 64));
+    for (uint64_t frame = 0; frame <= maxAge + 2; ++frame) test.pool.EndFrame();
+    test.pool.Trim();
+    CHECK(test.pool.GetStats().numPooled == 1);
+}
+
+// Views are created once per texture and desc, and freed with their texture
+static void TestViewCache()
+{
+    TestPool test;
+    const D3D12_RESOURCE_DESC desc = MakeDesc(256, 128);
+
+    D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+    srvDesc.Format = DXGI_FORMAT_R32_FLOAT;
+    srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+
+    D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+    uavDesc.Format = DXGI_FORMAT_R32_FLOAT;
+    uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+
+    D3D12_UNORDERED_ACCESS_VIEW_DESC otherUavDesc = uavDesc;
+    otherUavDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+
+    auto texture = test.pool.AcquireTexture(desc);
+    {
+        auto srv = test.pool.GetShaderResourceView(texture, srvDesc);
+        auto uav = test.pool.GetUnorderedAccessView(texture, uavDesc);
+        CHECK(test.pool.GetShaderResourceView(texture, srvDesc) == srv);
+        CHECK(test.pool.GetUnorderedAccessView(texture, uavDesc) == uav);
+        CHECK(test.pool.GetUnorderedAccessView(texture, otherUavDesc) != uav);
+        CHECK(test.log->viewsCreated == 3);
+        CHECK(test.pool.GetStats().numViewsReused == 2);
+    }
+
+    // Still cached after a release and reuse
+    test.pool.ReleaseTexture(texture, D3D12_COMMAND_LIST_TYPE_DIRECT, 1);
+    test.log->completedFences[D3D12_COMMAND_LIST_TYPE_DIRECT] = 1;
+    CHECK(test.pool.AcquireTexture(desc) == texture);
+    test.pool.GetShaderResourceView(texture, srvDesc);
+    CHECK(test.log->viewsCreated == 3);
+
+    // Evicting the texture frees its views too
+    test.pool.ReleaseTexture(texture, D3D12_COMMAND_LIST_TYPE_DIRECT, 1);
+    texture = nullptr;
+    test.pool.Trim();
+    CHECK(test.log->texturesDestroyed == 1);
+    CHECK(test.log->viewsDestroyed == 3);
+
+    // A new texture, even at the same address, gets new views
+    texture = test.pool.AcquireTexture(desc);
+    test.pool.GetShaderResourceView(texture, srvDesc);
+    CHECK(test.log->viewsCreated == 4);
+
+    // Textures from outside the pool aren't cached
+    int destroyed = 0;
+    auto external = MakeHandle<bee::DX12Texture>(destroyed);
+    test.pool.GetShaderResourceView(external, srvDesc);
+    test.pool.GetShaderResourceView(external, srvDesc);
+    CHECK(test.log->viewsCreated == 6);
+}
+
+int main()
+{
+    TestReuseByDesc();
+    TestReleaseFence();
+    TestEviction();
+    TestViewCache();
+
+    return FinishTest("transient_resource_pool_test");
+}
@@ -0,0 +1,255 @@
+#include "test_helpers.hpp"
+
+#include "two_phase_culling.hpp"
+#include "visibility_bits.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static const int width = 160;
+static const int height = 90;
+
+// A wall in front of the camera, one box behind it, one box next to it and one behind the camera
+enum SceneObject
+{
+    Wall,
+    HiddenBox,
+    SideBox,
+    BehindCamera,
+    NumSceneObjects
+};
+
+struct Scene
+{
+    std::vector<AABB> aabbs;
+    XMMATRIX vpMatrix;
+    FrustumPlanes frustum;
+    HzbPyramid hzb;
+    std::vector<float> depth;
+};
+
+static Scene MakeScene()
+{
+    Scene scene;
+    scene.aabbs.resize(NumSceneObjects);
+    scene.aabbs[Wall] = {{-4.f, 0.f, 0.f}, {4.f, 6.f, 1.f}};
+    scene.aabbs[HiddenBox] = {{-0.5f, 0.f, 8.f}, {0.5f, 1.f, 9.f}};
+    scene.aabbs[SideBox] = {{12.f, 0.f, 8.f}, {13.f, 1.f, 9.f}};
+    scene.aabbs[BehindCamera] = {{-1.f, 0.f, -20.f}, {1.f, 1.f, -19.f}};
+
+    const XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(0.f, 1.f, -6.f, 1.f),
+                                           XMVectorSet(0.f, 1.f, 10.f, 1.f),
+                                           XMVectorSet(0.f, 1.f, 0.f, 0.f));
+    const XMMATRIX projection = XMMatrixPerspectiveFovLH(1.2f, 16.f / 9.f, 0.5f, 200.f);
+    scene.vpMatrix = XMMatrixMultiply(view, projection);
+    ExtractPlanes(scene.frustum.planes, scene.vpMatrix, false);
+    return scene;
+}
+
+// Fills the screen rectangle of every drawn box at its closest depth, close enough for boxes facing the camera.
+// NDC depth, what HzbCullMode::Fixed expects. All boxes drawn here are in front of the camera.
+static void RenderBoxes(Scene& scene, const uint32_t* drawn)
+{
+    scene.depth.assign(static_cast<size_t>(width) * height, 1.f);
+
+    ForEachVisible(drawn,
+                   scene.aabbs.size(),
+                   [&](size_t i)
+                   {
+                       const AABB& aabb = scene.aabbs[i];
+                       float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX, minZ = FLT_MAX;
+                       for (int corner = 0; corner < 8; ++corner)
+                       {
+                           const XMVECTOR point = XMVectorSet(corner & 1 ? aabb.max.x : aabb.min.x,
+                                                              corner & 2 ? aabb.max.y : aabb.min.y,
+                                                              corner & 4 ? aabb.max.z : aabb.min.z,
+                                                              1.f);
+                           XMFLOAT4 clip;
+                           XMStoreFloat4(&clip, XMVector4Transform(point, scene.vpMatrix));
+
+                           const float x = (clip.x / clip.w * 0.5f + 0.5f) * width;
+                           const float y = (0.5f - clip.y / clip.w * 0.5f) * height;
+                           minX = std::min(minX, x);
+                           maxX = std::max(maxX, x);
+                           minY = std::min(minY, y);
+                           maxY = std::max(maxY, y);
+                           minZ = std::min(minZ, clip.z / clip.w);
+                       }
+
+                       // Pixels with their center inside the rectangle
+                       const int beginX = std::max(0, static_cast<int>(std::ceil(minX - 0.5f)));
+                       const int endX = std::min(width, static_cast<int>(std::floor(maxX - 0.5f)) + 1);
+                       const int beginY = std::max(0, static_cast<int>(std::ceil(minY - 0.5f)));
+                       const int endY = std::min(height, static_cast<int>(std::floor(maxY - 0.5f)) + 1);
+                       for (int y = beginY; y < endY; ++y)
+                       {
+                           for (int x = beginX; x < endX; ++x)
+                           {
+                               float& texel = scene.depth[static_cast<size_t>(y) * width + x];
+                               texel = std::min(texel, minZ);
+                           }
+                       }
+                   });
+}
+
+// Phase 1, its depth into the HZB, then phase 2
+static void RunFrame(TwoPhaseCulling& culling, Scene& scene)
+{
+    HzbCullSettings settings;
+    settings.mode = HzbCullMode::Fixed;
+
+    const std::vector<uint32_t>& phase1 = culling.BeginFrame(scene.aabbs, scene.frustum);
+    RenderBoxes(scene, phase1.data());
+    scene.hzb.Build(scene.depth.data(), width, height);
+    culling.EndFrame(scene.aabbs, scene.hzb, scene.vpMatrix, scene.frustum, settings);
+
+    // Nothing is drawn twice
+    for (size_t word = 0; word < phase1.size(); ++word) CHECK((culling.GetPhase1()[word] & culling.GetPhase2()[word]) == 0);
+}
+
+static bool InPhase1(const TwoPhaseCulling& culling, int object) { return IsVisible(culling.GetPhase1().data(), object); }
+static bool InPhase2(const TwoPhaseCulling& culling, int object) { return IsVisible(culling.GetPhase2().data(), object); }
+static bool InHistory(const TwoPhaseCulling& culling, int object) { return IsVisible(culling.GetHistory().data(), object); }
+
+// Without a history phase 1 draws nothing, so phase 2 tests against an empty HZB and draws the whole frustum
+static void TestFirstFrame()
+{
+    Scene scene = MakeScene();
+    TwoPhaseCulling culling;
+
+    RunFrame(culling, scene);
+    CHECK(culling.GetStats().numPhase1 == 0);
+    CHECK(culling.GetStats().numRetested == NumSceneObjects);
+    CHECK(InPhase2(culling, Wall) && InPhase2(culling, HiddenBox) && InPhase2(culling, SideBox));
+    CHECK(!InPhase2(culling, BehindCamera));
+    CHECK(culling.GetStats().numRecovered == 3);
+
+    // The same after Reset, and for another set of objects
+    culling.Reset();
+    RunFrame(culling, scene);
+    CHECK(culling.GetStats().numPhase1 == 0);
+    CHECK(culling.GetStats().numRecovered == 3);
+
+    scene.aabbs.push_back({{-1.f, 0.f, -30.f}, {1.f, 1.f, -29.f}});
+    RunFrame(culling, scene);
+    CHECK(culling.GetStats().numPhase1 == 0);
+}
+
+// What phase 2 finds is phase 1 of the next frame, minus what turned out hidden behind the phase 1 depth
+static void TestHistoryCarryOver()
+{
+    Scene scene = MakeScene();
+    TwoPhaseCulling culling;
+    culling.SetHistoryRefreshInterval(1);
+
+    RunFrame(culling, scene);
+
+    // The box behind the wall is drawn once more, then found hidden behind it
+    RunFrame(culling, scene);
+    CHECK(InPhase1(culling, Wall) && InPhase1(culling, HiddenBox) && InPhase1(culling, SideBox));
+    CHECK(culling.GetStats().numRecovered == 0);
+    CHECK(culling.GetStats().numDropped == 1);
+    CHECK(!InHistory(culling, HiddenBox));
+
+    // From now on only the visible objects go to phase 1, and phase 2 finds nothing new
+    for (int frame = 0; frame < 3; ++frame)
+    {
+        RunFrame(culling, scene);
+        CHECK(InPhase1(culling, Wall) && !InPhase1(culling, HiddenBox) && InPhase1(culling, SideBox));
+        CHECK(culling.GetStats().numPhase1 == 2);
+        CHECK(culling.GetStats().numRecovered == 0);
+        CHECK(culling.GetStats().numDropped == 0);
+    }
+}
+
+// An object that was hidden last frame and isn't anymore is drawn in phase 2 of the same frame
+static void TestDisocclusion()
+{
+    Scene scene = MakeScene();
+    TwoPhaseCulling culling;
+    culling.SetHistoryRefreshInterval(1);
+
+    RunFrame(culling, scene);
+    RunFrame(culling, scene);
+    CHECK(!InHistory(culling, HiddenBox));
+
+    // The wall moves out of view
+    scene.aabbs[Wall] = {{-30.f, 0.f, 0.f}, {-22.f, 6.f, 1.f}};
+    RunFrame(culling, scene);
+    CHECK(!InPhase1(culling, HiddenBox));
+    CHECK(InPhase2(culling, HiddenBox));
+    CHECK(!InPhase1(culling, Wall) && !InPhase2(culling, Wall));
+    CHECK(culling.GetStats().numRecovered == 1);
+    CHECK(InHistory(culling, HiddenBox) && InHistory(culling, SideBox) && !InHistory(culling, Wall));
+
+    RunFrame(culling, scene);
+    CHECK(InPhase1(culling, HiddenBox));
+    CHECK(culling.GetStats().numRecovered == 0);
+}
+
+// Phase 1 objects are only tested in their word's turn, until then they stay in the history
+static void TestHistoryRefresh()
+{
+    const int interval = 4;
+
+    Scene scene = MakeScene();
+    TwoPhaseCulling culling;
+    culling.SetHistoryRefreshInterval(interval);
+
+    // The first frame tests everything anyway
+    RunFrame(culling, scene);
+    CHECK(InHistory(culling, HiddenBox));
+
+    for (int frame = 1; frame < interval; ++frame)
+    {
+        RunFrame(culling, scene);
+        CHECK(InPhase1(culling, HiddenBox));
+        CHECK(InHistory(culling, HiddenBox));
+        CHECK(culling.GetStats().numRetested == 1);  // Only the object behind the camera
+    }
+
+    RunFrame(culling, scene);
+    CHECK(culling.GetStats().numRetested == NumSceneObjects);
+    CHECK(culling.GetStats().numDropped == 1);
+    CHECK(!InHistory(culling, HiddenBox));
+}
+
+// Rows of boxes behind the wall, over several words, with a partly used last word
+static void TestManyObjects()
+{
+    Scene scene = MakeScene();
+    for (int i = 0; i < 90; ++i)
+    {
+        const float x = -3.f + (i % 10) * 0.6f;
+        const float z = 8.f + (i / 10) * 2.f;
+        scene.aabbs.push_back({{x, 0.f, z}, {x + 0.3f, 0.5f, z + 0.3f}});
+    }
+    const size_t numWords = GetNumVisibilityWords(scene.aabbs.size());
+
+    TwoPhaseCulling culling;
+    culling.SetHistoryRefreshInterval(3);
+
+    RunFrame(culling, scene);
+    CHECK(culling.GetStats().numRecovered == scene.aabbs.size() - 1);
+
+    // Every word gets its turn within the interval, then only the wall and the side box are left
+    for (int frame = 0; frame < 3; ++frame) RunFrame(culling, scene);
+    CHECK(CountVisible(culling.GetHistory().data(), numWords) == 2);
+    CHECK(InHistory(culling, Wall) && InHistory(culling, SideBox));
+
+    // Nothing past the last object
+    const uint32_t lastWord = culling.GetHistory().back() | culling.GetPhase2().back();
+    CHECK((lastWord >> (scene.aabbs.size() % 32)) == 0);
+}
+
+int main()
+{
+    TestFirstFrame();
+    TestHistoryCarryOver();
+    TestDisocclusion();
+    TestHistoryRefresh();
+    TestManyObjects();
+
+    return FinishTest("two_phase_culling_test");
+}